@@ -0,0 +1,512 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44bandit.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "banditanalysis.hpp"
+#include "banditfiles.hpp"
+
+#include <math.h>
+#include <unistd.h>
+
+using namespace p44;
+
+
+#pragma mark - BanditAnalysis
+
+BanditAnalysis::BanditAnalysis() :
+  contentHash(0),
+  transmitBytes(0),
+  compactTransmitBytes(0),
+  arcfitTransmitBytes(0),
+  arcfitLines(0),
+  lines(0),
+  hasExtents(false),
+  toolChanges(0),
+  feedDistance(0),
+  rapidDistance(0),
+  machiningTime(0),
+  hasEnd(false)
+{
+  for (int i=0; i<3; i++) { minPos[i] = 0; maxPos[i] = 0; }
+}
+
+
+static JsonObjectPtr posJson(const double aPos[3])
+{
+  JsonObjectPtr p = JsonObject::newArray();
+  for (int i=0; i<3; i++) p->arrayAppend(JsonObject::newDouble(aPos[i]));
+  return p;
+}
+
+
+JsonObjectPtr BanditAnalysis::json(MLMicroSeconds aByteTime)
+{
+  JsonObjectPtr a = JsonObject::newObj();
+  a->add("hash", JsonObject::newString(string_format("%016llX", (unsigned long long)contentHash)));
+  a->add("transmitBytes", JsonObject::newInt64(transmitBytes));
+  a->add("transmitTime", JsonObject::newDouble((double)transmitTime(aByteTime)/Second));
+  if (compactTransmitBytes>0) {
+    a->add("compactTransmitBytes", JsonObject::newInt64(compactTransmitBytes));
+    a->add("compactBytesSaved", JsonObject::newInt64((int64_t)transmitBytes-(int64_t)compactTransmitBytes));
+    a->add("compactSecondsSaved", JsonObject::newDouble((double)((int64_t)transmitBytes-(int64_t)compactTransmitBytes)*aByteTime/Second));
+  }
+  if (arcfitTransmitBytes>0) {
+    a->add("arcfitTransmitBytes", JsonObject::newInt64(arcfitTransmitBytes));
+    a->add("arcfitBytesSaved", JsonObject::newInt64((int64_t)transmitBytes-(int64_t)arcfitTransmitBytes));
+    a->add("arcfitLinesSaved", JsonObject::newInt64((int64_t)lines-(int64_t)arcfitLines));
+  }
+  a->add("lines", JsonObject::newInt64(lines));
+  if (hasExtents) {
+    a->add("min", posJson(minPos));
+    a->add("max", posJson(maxPos));
+  }
+  a->add("toolChanges", JsonObject::newInt64(toolChanges));
+  JsonObjectPtr f = JsonObject::newArray();
+  for (std::set<double>::iterator pos = feedRates.begin(); pos!=feedRates.end(); ++pos) {
+    f->arrayAppend(JsonObject::newDouble(*pos));
+  }
+  a->add("feedRates", f);
+  a->add("feedDistance", JsonObject::newDouble(feedDistance));
+  a->add("rapidDistance", JsonObject::newDouble(rapidDistance));
+  a->add("machiningTime", JsonObject::newDouble((double)machiningTime/Second));
+  a->add("hasEnd", JsonObject::newBool(hasEnd));
+  return a;
+}
+
+
+#pragma mark - BanditAnalyzer
+
+BanditAnalyzer::BanditAnalyzer() :
+  analysis(new BanditAnalysis),
+  feed(0),
+  relative(false),
+  ended(false)
+{
+  for (int i=0; i<3; i++) pos[i] = 0;
+}
+
+
+void BanditAnalyzer::analyze(const char *aData, size_t aNumBytes)
+{
+  analysis->transmitBytes += aNumBytes;
+  while (aNumBytes>0) {
+    char c = *aData++;
+    aNumBytes--;
+    if (c=='\n') {
+      analyzeLine();
+      line.clear();
+    }
+    else if ((uint8_t)c>' ') {
+      line += c; // blanks and control chars (CR, framing) are irrelevant
+    }
+  }
+}
+
+
+BanditAnalysisPtr BanditAnalyzer::finish()
+{
+  if (!line.empty()) {
+    analyzeLine();
+    line.clear();
+  }
+  return analysis;
+}
+
+
+BanditAnalysisPtr BanditAnalyzer::analyzeSource(BanditDataSourcePtr aSource, ErrorPtr &aError)
+{
+  BanditAnalyzerPtr analyzer = BanditAnalyzerPtr(new BanditAnalyzer);
+  const char *chunk;
+  size_t n;
+  while ((n = aSource->nextChunk(chunk, 4096, aError))>0) {
+    analyzer->analyze(chunk, n);
+  }
+  if (!Error::isOK(aError)) return BanditAnalysisPtr();
+  return analyzer->finish();
+}
+
+
+enum {
+  word_X, word_Y, word_Z, word_I, word_J, word_K, word_F,
+  numValueWords
+};
+
+
+void BanditAnalyzer::analyzeLine()
+{
+  const char *p = line.c_str();
+  // skip line number
+  if (*p=='N') {
+    p++;
+    while (isdigit(*p)) p++;
+    if (*p=='&') p++;
+  }
+  if (*p==0) return; // empty line
+  analysis->lines++;
+  if (ended) return; // ignore everything after end of program
+  bool has[numValueWords];
+  double val[numValueWords];
+  for (int i=0; i<numValueWords; i++) has[i] = false;
+  bool setPos = false;
+  while (*p) {
+    char w = *p++;
+    // parse number
+    const char *n = p;
+    if (*p=='-' || *p=='+') p++;
+    bool decimalPoint = false;
+    while (isdigit(*p) || (*p=='.' && !decimalPoint)) {
+      if (*p=='.') decimalPoint = true;
+      p++;
+    }
+    if (p==n) continue; // letter without number, ignore
+    double v = strtod(n, NULL);
+    int code = (int)v;
+    switch (w) {
+      case 'G':
+        if (code==90) relative = false;
+        else if (code==91) relative = true;
+        else if (code==92) setPos = true;
+        break;
+      case 'M':
+        if (code==6) analysis->toolChanges++;
+        else if (code==2 || code==30) { analysis->hasEnd = true; ended = true; }
+        break;
+      case 'F':
+        // Note: feed rate is taken as-is (postprocessor always outputs it with decimal point)
+        has[word_F] = true; val[word_F] = v; break;
+      case 'X': has[word_X] = true; val[word_X] = decimalPoint ? v : v/1000; break;
+      case 'Y': has[word_Y] = true; val[word_Y] = decimalPoint ? v : v/1000; break;
+      case 'Z': has[word_Z] = true; val[word_Z] = decimalPoint ? v : v/1000; break;
+      case 'I': has[word_I] = true; val[word_I] = decimalPoint ? v : v/1000; break;
+      case 'J': has[word_J] = true; val[word_J] = decimalPoint ? v : v/1000; break;
+      case 'K': has[word_K] = true; val[word_K] = decimalPoint ? v : v/1000; break;
+      default: break;
+    }
+  }
+  if (has[word_F]) {
+    feed = val[word_F];
+    if (feed>0) analysis->feedRates.insert(feed);
+  }
+  if (setPos) {
+    // set position register, no movement
+    if (has[word_X]) pos[0] = val[word_X];
+    if (has[word_Y]) pos[1] = val[word_Y];
+    if (has[word_Z]) pos[2] = val[word_Z];
+    return;
+  }
+  double np[3] = { pos[0], pos[1], pos[2] };
+  bool xy = has[word_X] || has[word_Y];
+  if (xy && (has[word_I] || has[word_J])) {
+    // arc, center is always absolute
+    for (int i=0; i<2; i++) {
+      if (has[word_X+i]) np[i] = relative ? pos[i]+val[word_X+i] : val[word_X+i];
+    }
+    arcTo(np[0], np[1], has[word_I] ? val[word_I] : pos[0], has[word_J] ? val[word_J] : pos[1]);
+    return;
+  }
+  if (has[word_I] || has[word_J] || has[word_K]) {
+    // rapid move
+    for (int i=0; i<3; i++) {
+      if (has[word_I+i]) np[i] = relative ? pos[i]+val[word_I+i] : val[word_I+i];
+    }
+    moveTo(np, true);
+  }
+  if (xy || has[word_Z]) {
+    // linear move at feed rate
+    for (int i=0; i<3; i++) {
+      if (has[word_X+i]) np[i] = relative ? pos[i]+val[word_X+i] : val[word_X+i];
+    }
+    moveTo(np, false);
+  }
+}
+
+
+void BanditAnalyzer::extend(const double aP[3])
+{
+  for (int i=0; i<3; i++) {
+    if (!analysis->hasExtents || aP[i]<analysis->minPos[i]) analysis->minPos[i] = aP[i];
+    if (!analysis->hasExtents || aP[i]>analysis->maxPos[i]) analysis->maxPos[i] = aP[i];
+  }
+  analysis->hasExtents = true;
+}
+
+
+void BanditAnalyzer::moveTo(const double aNewPos[3], bool aRapid)
+{
+  double d = 0;
+  for (int i=0; i<3; i++) d += (aNewPos[i]-pos[i])*(aNewPos[i]-pos[i]);
+  d = sqrt(d);
+  extend(pos);
+  extend(aNewPos);
+  if (aRapid) {
+    analysis->rapidDistance += d;
+    analysis->machiningTime += d/BANDIT_RAPID_FEED*Minute;
+  }
+  else {
+    analysis->feedDistance += d;
+    if (feed>0) analysis->machiningTime += d/feed*Minute;
+  }
+  for (int i=0; i<3; i++) pos[i] = aNewPos[i];
+}
+
+
+void BanditAnalyzer::arcTo(double aX, double aY, double aCX, double aCY)
+{
+  // arcs never cross quadrant borders, so the endpoints are the extremes and the
+  // angle between start and end is the arc angle, regardless of the direction
+  double sx = pos[0]-aCX, sy = pos[1]-aCY;
+  double ex = aX-aCX, ey = aY-aCY;
+  double rs = sqrt(sx*sx+sy*sy);
+  double re = sqrt(ex*ex+ey*ey);
+  double d;
+  if (rs>0 && re>0) {
+    double c = (sx*ex+sy*ey)/(rs*re);
+    if (c>1) c = 1; else if (c<-1) c = -1;
+    d = acos(c)*(rs+re)/2;
+  }
+  else {
+    d = sqrt((aX-pos[0])*(aX-pos[0])+(aY-pos[1])*(aY-pos[1]));
+  }
+  double np[3] = { aX, aY, pos[2] };
+  extend(pos);
+  extend(np);
+  analysis->feedDistance += d;
+  if (feed>0) analysis->machiningTime += d/feed*Minute;
+  pos[0] = aX;
+  pos[1] = aY;
+}
+
+
+#pragma mark - AnalysisCache
+
+#define ANALYSIS_CACHE_SAVE_DELAY (10*Second) // collects the changes of many analyses (e.g. at first start) into one save
+
+
+AnalysisCache::~AnalysisCache()
+{
+  if (saveTicket) {
+    saveTicket.cancel();
+    save();
+  }
+}
+
+
+BanditAnalysisPtr AnalysisCache::get(const string aName, time_t aMtime, off_t aSize, CatalogContentInfo *aContentP)
+{
+  FileAnalysisMap::iterator pos = byName.find(aName);
+  if (pos==byName.end() || pos->second.mtime!=aMtime || pos->second.size!=aSize) return BanditAnalysisPtr();
+  if (aContentP) *aContentP = pos->second.content;
+  return pos->second.analysis;
+}
+
+
+BanditAnalysisPtr AnalysisCache::getByHash(uint64_t aContentHash)
+{
+  HashAnalysisMap::iterator pos = byHash.find(aContentHash);
+  if (pos==byHash.end()) return BanditAnalysisPtr();
+  return pos->second;
+}
+
+
+void AnalysisCache::store(const string aName, time_t aMtime, off_t aSize, const CatalogContentInfo &aContent, BanditAnalysisPtr aAnalysis)
+{
+  forget(aName);
+  FileAnalysis fa;
+  fa.mtime = aMtime;
+  fa.size = aSize;
+  fa.content = aContent;
+  fa.analysis = aAnalysis;
+  byName[aName] = fa;
+  byHash[aAnalysis->contentHash] = aAnalysis;
+  changed();
+}
+
+
+uint64_t AnalysisCache::forget(const string aName)
+{
+  FileAnalysisMap::iterator pos = byName.find(aName);
+  if (pos==byName.end()) return 0;
+  uint64_t hash = pos->second.analysis->contentHash;
+  byName.erase(pos);
+  changed();
+  // drop content entry unless another file still has the same content
+  for (pos = byName.begin(); pos!=byName.end(); ++pos) {
+    if (pos->second.analysis->contentHash==hash) return 0;
+  }
+  byHash.erase(hash);
+  return hash;
+}
+
+
+void AnalysisCache::forgetMissing(FileCatalogPtr aCatalog)
+{
+  FileAnalysisMap::iterator pos = byName.begin();
+  while (pos!=byName.end()) {
+    string name = pos->first;
+    ++pos;
+    if (!aCatalog->entry(name)) forget(name);
+  }
+}
+
+
+// MARK: - persistence
+
+void AnalysisCache::setPersistence(const string aPath, const string aParameters)
+{
+  persistencePath = aPath;
+  parameters = aParameters;
+  load();
+}
+
+
+void AnalysisCache::changed()
+{
+  if (persistencePath.empty() || saveTicket) return; // not persisted, or save already scheduled
+  saveTicket.executeOnce(boost::bind(&AnalysisCache::save, this), ANALYSIS_CACHE_SAVE_DELAY);
+}
+
+
+static JsonObjectPtr analysisJson(BanditAnalysisPtr aAnalysis)
+{
+  // Note: unlike BanditAnalysis::json(), the plain values, without anything derived from the link speed
+  JsonObjectPtr a = JsonObject::newObj();
+  a->add("hash", JsonObject::newString(string_format("%016llX", (unsigned long long)aAnalysis->contentHash)));
+  a->add("transmitBytes", JsonObject::newInt64(aAnalysis->transmitBytes));
+  a->add("compactTransmitBytes", JsonObject::newInt64(aAnalysis->compactTransmitBytes));
+  a->add("arcfitTransmitBytes", JsonObject::newInt64(aAnalysis->arcfitTransmitBytes));
+  a->add("arcfitLines", JsonObject::newInt64(aAnalysis->arcfitLines));
+  a->add("lines", JsonObject::newInt64(aAnalysis->lines));
+  if (aAnalysis->hasExtents) {
+    a->add("min", posJson(aAnalysis->minPos));
+    a->add("max", posJson(aAnalysis->maxPos));
+  }
+  a->add("toolChanges", JsonObject::newInt64(aAnalysis->toolChanges));
+  JsonObjectPtr f = JsonObject::newArray();
+  for (std::set<double>::iterator pos = aAnalysis->feedRates.begin(); pos!=aAnalysis->feedRates.end(); ++pos) {
+    f->arrayAppend(JsonObject::newDouble(*pos));
+  }
+  a->add("feedRates", f);
+  a->add("feedDistance", JsonObject::newDouble(aAnalysis->feedDistance));
+  a->add("rapidDistance", JsonObject::newDouble(aAnalysis->rapidDistance));
+  a->add("machiningTime", JsonObject::newInt64(aAnalysis->machiningTime));
+  a->add("hasEnd", JsonObject::newBool(aAnalysis->hasEnd));
+  return a;
+}
+
+
+static bool posFromJson(JsonObjectPtr aJson, double aPos[3])
+{
+  if (!aJson || aJson->arrayLength()!=3) return false;
+  for (int i=0; i<3; i++) aPos[i] = aJson->arrayGet(i)->doubleValue();
+  return true;
+}
+
+
+static BanditAnalysisPtr analysisFromJson(JsonObjectPtr aJson)
+{
+  JsonObjectPtr o;
+  if (!aJson || !aJson->get("hash", o)) return BanditAnalysisPtr();
+  BanditAnalysisPtr a = BanditAnalysisPtr(new BanditAnalysis);
+  a->contentHash = strtoull(o->c_strValue(), NULL, 16);
+  if (aJson->get("transmitBytes", o)) a->transmitBytes = (size_t)o->int64Value();
+  if (aJson->get("compactTransmitBytes", o)) a->compactTransmitBytes = (size_t)o->int64Value();
+  if (aJson->get("arcfitTransmitBytes", o)) a->arcfitTransmitBytes = (size_t)o->int64Value();
+  if (aJson->get("arcfitLines", o)) a->arcfitLines = (size_t)o->int64Value();
+  if (aJson->get("lines", o)) a->lines = (size_t)o->int64Value();
+  a->hasExtents = posFromJson(aJson->get("min"), a->minPos) && posFromJson(aJson->get("max"), a->maxPos);
+  if (aJson->get("toolChanges", o)) a->toolChanges = o->int32Value();
+  if (aJson->get("feedRates", o)) {
+    for (int i=0; i<o->arrayLength(); i++) a->feedRates.insert(o->arrayGet(i)->doubleValue());
+  }
+  if (aJson->get("feedDistance", o)) a->feedDistance = o->doubleValue();
+  if (aJson->get("rapidDistance", o)) a->rapidDistance = o->doubleValue();
+  if (aJson->get("machiningTime", o)) a->machiningTime = o->int64Value();
+  if (aJson->get("hasEnd", o)) a->hasEnd = o->boolValue();
+  return a;
+}
+
+
+void AnalysisCache::save()
+{
+  saveTicket.cancel();
+  if (persistencePath.empty()) return;
+  JsonObjectPtr c = JsonObject::newObj();
+  c->add("parameters", JsonObject::newString(parameters));
+  JsonObjectPtr files = JsonObject::newArray();
+  for (FileAnalysisMap::iterator pos = byName.begin(); pos!=byName.end(); ++pos) {
+    JsonObjectPtr f = JsonObject::newObj();
+    f->add("name", JsonObject::newString(pos->first));
+    f->add("mtime", JsonObject::newInt64(pos->second.mtime));
+    f->add("size", JsonObject::newInt64(pos->second.size));
+    f->add("logicalSize", JsonObject::newInt64(pos->second.content.logicalSize));
+    f->add("compressed", JsonObject::newBool(pos->second.content.compressed));
+    f->add("contentLines", JsonObject::newInt64(pos->second.content.lines));
+    f->add("analysis", analysisJson(pos->second.analysis));
+    files->arrayAppend(f);
+  }
+  c->add("files", files);
+  string s = c->json_str();
+  AtomicFileWriter w;
+  ErrorPtr err = w.open(tempPathFor(persistencePath));
+  if (Error::isOK(err)) err = w.write(s.c_str(), s.size());
+  if (Error::isOK(err)) err = w.commit(persistencePath);
+  if (!Error::isOK(err)) {
+    LOG(LOG_ERR, "Cannot save analysis cache to '%s': %s", persistencePath.c_str(), err->description().c_str());
+  }
+}
+
+
+void AnalysisCache::load()
+{
+  if (access(persistencePath.c_str(), F_OK)!=0) return; // no cache saved yet
+  ErrorPtr err;
+  JsonObjectPtr c = JsonObject::objFromFile(persistencePath.c_str(), &err);
+  if (!c) {
+    LOG(LOG_ERR, "Cannot load analysis cache from '%s': %s", persistencePath.c_str(), Error::isOK(err) ? "invalid JSON" : err->description().c_str());
+    return;
+  }
+  JsonObjectPtr o;
+  if (!c->get("parameters", o) || o->stringValue()!=parameters) {
+    LOG(LOG_NOTICE, "Analysis settings have changed, files will be analyzed again");
+    return;
+  }
+  byName.clear();
+  byHash.clear();
+  JsonObjectPtr files = c->get("files");
+  for (int i=0; files && i<files->arrayLength(); i++) {
+    JsonObjectPtr f = files->arrayGet(i);
+    BanditAnalysisPtr a = analysisFromJson(f->get("analysis"));
+    if (!a || !f->get("name", o)) continue;
+    FileAnalysis fa;
+    string name = o->stringValue();
+    fa.mtime = f->get("mtime", o) ? (time_t)o->int64Value() : 0;
+    fa.size = f->get("size", o) ? (off_t)o->int64Value() : 0;
+    fa.content.logicalSize = f->get("logicalSize", o) ? (off_t)o->int64Value() : 0;
+    fa.content.compressed = f->get("compressed", o) ? o->boolValue() : false;
+    fa.content.lines = f->get("contentLines", o) ? (size_t)o->int64Value() : 0;
+    // files with the same content share one analysis
+    BanditAnalysisPtr same = getByHash(a->contentHash);
+    fa.analysis = same ? same : a;
+    byName[name] = fa;
+    byHash[a->contentHash] = fa.analysis;
+  }
+  LOG(LOG_NOTICE, "Loaded analysis cache: %zu files", byName.size());
+}
@@ -0,0 +1,188 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44bandit.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef __p44bandit__banditanalysis__
+#define __p44bandit__banditanalysis__
+
+#include "p44utils_common.hpp"
+
+#include "banditdata.hpp"
+#include "filecatalog.hpp"
+#include "jsonobject.hpp"
+
+#include <set>
+
+using namespace std;
+
+namespace p44 {
+
+
+  /// assumed speed of rapid (I/J/K) moves in mm/min
+  #define BANDIT_RAPID_FEED 2000
+
+  class BanditAnalysis;
+  typedef boost::intrusive_ptr<BanditAnalysis> BanditAnalysisPtr;
+
+  /// result of analyzing a BANDIT program
+  class BanditAnalysis : public P44Obj
+  {
+  public:
+
+    BanditAnalysis();
+
+    uint64_t contentHash; ///< FNV64 hash of the program file
+    size_t transmitBytes; ///< number of bytes to transmit (cleaned and framed)
+    size_t compactTransmitBytes; ///< number of bytes to transmit when compacted, 0 if unknown
+    size_t arcfitTransmitBytes; ///< number of bytes to transmit with fitted arcs, 0 if unknown
+    size_t arcfitLines; ///< number of program lines with fitted arcs
+    size_t lines; ///< number of program lines
+    bool hasExtents; ///< set if program contains any moves
+    double minPos[3]; ///< minimum X,Y,Z reached, in mm
+    double maxPos[3]; ///< maximum X,Y,Z reached, in mm
+    int toolChanges; ///< number of M6 tool changes
+    std::set<double> feedRates; ///< feed rates used (mm/min)
+    double feedDistance; ///< distance moved at feed rate, in mm
+    double rapidDistance; ///< distance moved at rapid speed, in mm
+    MLMicroSeconds machiningTime; ///< estimated machining time
+    bool hasEnd; ///< set if program has a M2/M30 end
+
+    /// @param aByteTime time needed to transmit one byte on the link
+    /// @return time needed to transmit the program
+    MLMicroSeconds transmitTime(MLMicroSeconds aByteTime) { return transmitBytes*aByteTime; };
+
+    /// @param aByteTime time needed to transmit one byte on the link
+    /// @return JSON object describing the analysis
+    JsonObjectPtr json(MLMicroSeconds aByteTime);
+  };
+
+
+  class BanditAnalyzer;
+  typedef boost::intrusive_ptr<BanditAnalyzer> BanditAnalyzerPtr;
+
+  /// incremental analyzer for BANDIT dialect G-code, to be fed with the data as it would be transmitted
+  /// (cleaned and framed). Understands:
+  /// - X/Y/Z: linear move at feed rate
+  /// - X/Y with I/J: arc to X/Y around absolute center I/J (never crossing quadrant borders)
+  /// - I/J without X/Y, K: rapid XY and Z moves
+  /// - F: feed rate, M6: tool change, M2/M30: end of program
+  /// - G90/G91: absolute/relative, G92: set position, G99: go to machine zero
+  /// Numbers without decimal point are in 1/1000 mm.
+  class BanditAnalyzer : public P44Obj
+  {
+    BanditAnalysisPtr analysis;
+    string line;
+    double pos[3];
+    double feed;
+    bool relative;
+    bool ended;
+
+  public:
+
+    BanditAnalyzer();
+
+    /// analyze a chunk of data
+    void analyze(const char *aData, size_t aNumBytes);
+
+    /// signal end of data
+    /// @return the analysis
+    BanditAnalysisPtr finish();
+
+    /// analyze all data from a source
+    /// @param aSource the source, delivering cleaned and framed data
+    /// @param aError set to error, if any
+    /// @return the analysis, NULL in case of error
+    static BanditAnalysisPtr analyzeSource(BanditDataSourcePtr aSource, ErrorPtr &aError);
+
+  private:
+
+    void analyzeLine();
+    void moveTo(const double aNewPos[3], bool aRapid);
+    void arcTo(double aX, double aY, double aCX, double aCY);
+    void extend(const double aP[3]);
+
+  };
+
+
+  class AnalysisCache;
+  typedef boost::intrusive_ptr<AnalysisCache> AnalysisCachePtr;
+
+  /// cache of program analyses, by file name (valid as long as mtime and size do not change)
+  /// and by content hash (so copies and renamed files are not analyzed again).
+  /// Can be persisted to a file, so files need not be hashed and analyzed again at every start.
+  class AnalysisCache : public P44Obj
+  {
+    typedef struct {
+      time_t mtime;
+      off_t size;
+      CatalogContentInfo content;
+      BanditAnalysisPtr analysis;
+    } FileAnalysis;
+    typedef std::map<string, FileAnalysis> FileAnalysisMap;
+    FileAnalysisMap byName;
+    typedef std::map<uint64_t, BanditAnalysisPtr> HashAnalysisMap;
+    HashAnalysisMap byHash;
+    string persistencePath;
+    string parameters; ///< describes the settings the analyses depend on
+    MLTicket saveTicket;
+
+  public:
+
+    virtual ~AnalysisCache();
+
+    /// get cached analysis without any file access
+    /// @param aContentP if not NULL, will receive the file's content info stored with the analysis
+    /// @return analysis or NULL if none is cached for this file name/mtime/size
+    BanditAnalysisPtr get(const string aName, time_t aMtime, off_t aSize, CatalogContentInfo *aContentP = NULL);
+
+    /// get cached analysis by content
+    /// @return analysis or NULL if no file with this content was analyzed
+    BanditAnalysisPtr getByHash(uint64_t aContentHash);
+
+    /// store analysis
+    /// @param aContent the file's content info (determined along with the content hash)
+    void store(const string aName, time_t aMtime, off_t aSize, const CatalogContentInfo &aContent, BanditAnalysisPtr aAnalysis);
+
+    /// forget analysis for a file (when it is deleted or changed)
+    /// @return content hash of the file if no other file has the same content any more, 0 otherwise
+    uint64_t forget(const string aName);
+
+    /// forget analyses of files no longer in a catalog (deleted while not running)
+    void forgetMissing(FileCatalogPtr aCatalog);
+
+    /// load the cache from a file, and save it there (shortly after changes) from now on
+    /// @param aPath path of the file
+    /// @param aParameters description of the settings the analyses depend on. Analyses saved
+    ///   with different parameters are not loaded.
+    void setPersistence(const string aPath, const string aParameters);
+
+  private:
+
+    void changed();
+    void save();
+    void load();
+
+  };
+
+
+} // namespace p44
+
+#endif /* defined(__p44bandit__banditanalysis__) */
@@ -20,49 +20,280 @@
 //
 
 #include "banditcomm.hpp"
+#include "metrics.hpp"
 
 #include "consolekey.hpp"
 #include "application.hpp"
 
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/sysmacros.h>
+#endif
+#include <algorithm>
+
 using namespace p44;
 
-#define BANDIT_COMMPARAMS "1200,7,E,2"
+#define DEFAULT_HS_POLL_INTERVAL (100*MilliSecond) // handshake input poll interval when no edge detection is available
+#define HS_WAIT_SIGNAL (SIGRTMIN+2) // interrupts TIOCMIWAIT in the wait thread when stopping it
+#define HS_WAIT_STOP_RETRY (5*MilliSecond) // interval for re-sending HS_WAIT_SIGNAL until the wait thread has ended
+#define MODEM_LINE_PREFIX "modem." // pin spec prefix for handshake input on a modem line of the serial port itself
+#define EMU_LINK_PREFIX "emu:" // pin spec prefix for handshake lines of p44banditemu, followed by the socket path
+#define EMU_LINK_RETRY_INTERVAL (5*Second)
+
+
+#pragma mark - BanditLinkProfile
+
+typedef struct {
+  const char *name;
+  int baudRate;
+  int dataBits;
+  char parity;
+  int stopBits;
+  bool hwHandshake;
+} LinkProfileDesc;
+
+/// predefined link profiles, default first
+static const LinkProfileDesc linkProfiles[] = {
+  { "bandit", 1200, 7, 'E', 2, true }, // factory setting of BANDIT 8300
+  { "bandit2400", 2400, 7, 'E', 2, true },
+  { "bandit4800", 4800, 7, 'E', 2, true },
+  { "bandit9600", 9600, 7, 'E', 2, true },
+  { "bandit19200", 19200, 7, 'E', 2, true },
+  { NULL, 0, 0, 0, 0, false }
+};
+
+
+BanditLinkProfile::BanditLinkProfile()
+{
+  lookup(linkProfiles[0].name, *this);
+}
+
+
+string BanditLinkProfile::commParams() const
+{
+  return string_format("%d,%d,%c,%d", baudRate, dataBits, parity, stopBits);
+}
+
+
+MLMicroSeconds BanditLinkProfile::byteTime() const
+{
+  int bits = 1+dataBits+(parity=='N' ? 0 : 1)+stopBits; // start bit, data, parity, stop bits
+  return Second*bits/baudRate;
+}
+
+
+JsonObjectPtr BanditLinkProfile::json() const
+{
+  JsonObjectPtr p = JsonObject::newObj();
+  p->add("name", JsonObject::newString(name));
+  p->add("commParams", JsonObject::newString(commParams()));
+  p->add("handshake", JsonObject::newBool(hwHandshake));
+  p->add("bytesPerSecond", JsonObject::newDouble((double)Second/byteTime()));
+  return p;
+}
+
+
+bool BanditLinkProfile::lookup(const string aNameOrSpec, BanditLinkProfile &aProfile)
+{
+  for (const LinkProfileDesc *d = linkProfiles; d->name; d++) {
+    if (aNameOrSpec==d->name) {
+      aProfile.name = d->name;
+      aProfile.baudRate = d->baudRate;
+      aProfile.dataBits = d->dataBits;
+      aProfile.parity = d->parity;
+      aProfile.stopBits = d->stopBits;
+      aProfile.hwHandshake = d->hwHandshake;
+      return true;
+    }
+  }
+  // custom specification: baud[,bits[,parity[,stopbits[,hs|nohs]]]]
+  BanditLinkProfile p;
+  const char *cp = aNameOrSpec.c_str();
+  string part;
+  if (!nextPart(cp, part, ',') || (p.baudRate = atoi(part.c_str()))<=0) return false;
+  if (nextPart(cp, part, ',')) p.dataBits = atoi(part.c_str());
+  if (nextPart(cp, part, ',') && !part.empty()) p.parity = toupper(part[0]);
+  if (nextPart(cp, part, ',')) p.stopBits = atoi(part.c_str());
+  if (nextPart(cp, part, ',')) p.hwHandshake = part!="nohs";
+  if (p.dataBits<5 || p.dataBits>8 || p.stopBits<1 || p.stopBits>2 || (p.parity!='N' && p.parity!='E' && p.parity!='O')) return false;
+  p.name = aNameOrSpec;
+  aProfile = p;
+  return true;
+}
+
+
+JsonObjectPtr BanditLinkProfile::predefinedProfiles()
+{
+  JsonObjectPtr a = JsonObject::newArray();
+  BanditLinkProfile p;
+  for (const LinkProfileDesc *d = linkProfiles; d->name; d++) {
+    if (lookup(d->name, p)) a->arrayAppend(p.json());
+  }
+  return a;
+}
+
+
+static bool fasterProfile(const BanditLinkProfile &a, const BanditLinkProfile &b)
+{
+  return a.byteTime()<b.byteTime();
+}
+
+
+std::vector<BanditLinkProfile> BanditLinkProfile::probeProfiles()
+{
+  std::vector<BanditLinkProfile> v;
+  BanditLinkProfile p;
+  for (const LinkProfileDesc *d = linkProfiles; d->name; d++) {
+    if (lookup(d->name, p)) v.push_back(p);
+  }
+  std::sort(v.begin(), v.end(), fasterProfile);
+  return v;
+}
 
 
 #pragma mark - BanditComm
 
 BanditComm::BanditComm(MainLoop &aMainLoop) :
 	inherited(aMainLoop),
+  hsModemLine(0),
+  hsInverted(false),
+  hsState(false),
+  hsDebounceTime(0),
+  hsPollInterval(DEFAULT_HS_POLL_INTERVAL),
+  hsBounceStart(Never),
+  hsLastEdge(Never),
+  hsBounceEdges(0),
+  hsLinkIn(false),
+  hsLinkOut(false),
+  txQueueFromOS(true),
+  defaultPort(0),
   banditState(banditstate_idle),
-  endOnHandshake(false)
+  rxRawBytes(0),
+  rxHandshakeTime(Never),
+  rxLastDataTime(Never),
+  endOnHandshake(false),
+  endDetection(true),
+  rxEnd(rxend_none),
+  rxHasData(false),
+  txPos(0),
+  txLowWater(DEFAULT_TX_LOW_WATER),
+  txHighWater(DEFAULT_TX_HIGH_WATER),
+  dncMode(false),
+  flowControl(false),
+  txPaused(false),
+  txQueueEstimate(0),
+  txQueueEstimateTime(Never),
+  txWrittenBytes(0),
+  txTotalBytes(0),
+  txSentLines(0),
+  txStartTime(Never),
+  txPausedTime(0),
+  txPauseStart(Never),
+  txDrainStart(Never),
+  probeIndex(0),
+  probeEnd(Never)
 {
+  #if defined(__linux__)
+  hsWaitRunning = false;
+  hsWaitStop = false;
+  hsWaitPipe[0] = -1;
+  hsWaitPipe[1] = -1;
+  #endif
 }
 
 
 BanditComm::~BanditComm()
 {
   stop();
+  stopHandshakeMonitor();
+}
+
+
+void BanditComm::setHandshakeInputTiming(MLMicroSeconds aDebounceTime, MLMicroSeconds aPollInterval)
+{
+  hsDebounceTime = aDebounceTime;
+  if (aPollInterval>0) hsPollInterval = aPollInterval;
 }
 
 
-void BanditComm::setConnectionSpecification(const char *aConnectionSpec, uint16_t aDefaultPort, const char *aRtsDtrOutput, const char *aCtsDsrDcdInput)
+ErrorPtr BanditComm::setConnectionSpecification(const char *aConnectionSpec, uint16_t aDefaultPort, const char *aRtsDtrOutput, const char *aCtsDsrDcdInput)
 {
   LOG(LOG_DEBUG, "BanditComm::setConnectionSpecification: %s", aConnectionSpec);
+  connectionSpec = aConnectionSpec;
+  defaultPort = aDefaultPort;
   // setup serial
-  inherited::setConnectionSpecification(aConnectionSpec, aDefaultPort, BANDIT_COMMPARAMS);
+  inherited::setConnectionSpecification(aConnectionSpec, aDefaultPort, linkProfile.commParams().c_str());
   // setup handshake lines
-  rtsDtrOutput = DigitalIoPtr(new DigitalIo(aRtsDtrOutput, true, false));
-  ctsDsrDcdInput = DigitalIoPtr(new DigitalIo(aCtsDsrDcdInput, false, false));
+  string hsout = aRtsDtrOutput;
+  string hsin = aCtsDsrDcdInput;
+  hsLinkRetryTicket.cancel();
+  hsLink.reset();
+  if (hsout.compare(0, strlen(EMU_LINK_PREFIX), EMU_LINK_PREFIX)==0 || hsin.compare(0, strlen(EMU_LINK_PREFIX), EMU_LINK_PREFIX)==0) {
+    // handshake lines of the emulator, via socket
+    hsLinkPath = (hsin.compare(0, strlen(EMU_LINK_PREFIX), EMU_LINK_PREFIX)==0 ? hsin : hsout).substr(strlen(EMU_LINK_PREFIX));
+    hsLink = SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
+    hsLinkConnect();
+  }
+  else {
+    rtsDtrOutput = DigitalIoPtr(new DigitalIo(aRtsDtrOutput, true, false));
+  }
+  hsInverted = !hsin.empty() && hsin[0]=='/';
+  if (hsInverted) hsin.erase(0,1);
+  hsModemLine = 0;
+  if (hsLink) {
+    // handled above
+  }
+  else if (hsin.compare(0, strlen(MODEM_LINE_PREFIX), MODEM_LINE_PREFIX)==0) {
+    // one of our own serial port's input lines
+    string line = lowerCase(hsin.substr(strlen(MODEM_LINE_PREFIX)));
+    if (line=="cts") hsModemLine = TIOCM_CTS;
+    else if (line=="dsr") hsModemLine = TIOCM_DSR;
+    else if (line=="dcd") hsModemLine = TIOCM_CAR;
+    else if (line=="ri") hsModemLine = TIOCM_RNG;
+    else LOG(LOG_ERR, "Unknown modem line '%s', must be cts, dsr, dcd or ri", line.c_str());
+  }
+  else {
+    ctsDsrDcdInput = DigitalIoPtr(new DigitalIo(aCtsDsrDcdInput, false, false));
+  }
   // open serial device
   ErrorPtr err = establishConnection();
+  connectionError = err;
   if (!Error::isOK(err)) {
     LOG(LOG_ERR, "Cannot establish BANDIT connection: %s", err->description().c_str());
-    return;
+    return err;
   }
   // connection ok, set handler
   setReceiveHandler(boost::bind(&BanditComm::receiveHandler, this, _1));
+  checkTxQueueReporting();
   // set handshake line monitor
-  ctsDsrDcdInput->setInputChangedHandler(boost::bind(&BanditComm::handshakeChanged, this, _1), 0, 100*MilliSecond);
+  startHandshakeMonitor();
+  return ErrorPtr();
+}
+
+
+ErrorPtr BanditComm::setLinkProfile(const BanditLinkProfile &aProfile)
+{
+  if (isBusy()) {
+    return TextError::err("Cannot change link profile now, BANDIT connection is busy");
+  }
+  linkProfile = aProfile;
+  if (connectionSpec.empty()) return ErrorPtr(); // not connected yet, will be used when connecting
+  LOG(LOG_NOTICE, "Switching to link profile '%s' (%s)", linkProfile.name.c_str(), linkProfile.commParams().c_str());
+  if (hsModemLine) stopHandshakeMonitor(); // monitors the connection's fd
+  closeConnection();
+  inherited::setConnectionSpecification(connectionSpec.c_str(), defaultPort, linkProfile.commParams().c_str());
+  ErrorPtr err = establishConnection();
+  connectionError = err;
+  if (Error::isOK(err)) {
+    setReceiveHandler(boost::bind(&BanditComm::receiveHandler, this, _1));
+    checkTxQueueReporting();
+    if (hsModemLine) startHandshakeMonitor();
+  }
+  return err;
 }
 
 
@@ -77,9 +308,49 @@ void BanditComm::init()
 void BanditComm::stop()
 {
   responseCB = NULL;
+  rxDataCB = NULL;
+  sendCB = NULL;
+  probeCB = NULL;
+  probeData.clear();
   banditState = banditstate_idle;
   timeoutTicket.cancel();
-  if (rtsDtrOutput) rtsDtrOutput->off();
+  txTicket.cancel();
+  setTransmitHandler(NULL);
+  txSource.reset();
+  txData.clear();
+  txPos = 0;
+  dncMode = false;
+  setHandshakeOutput(false);
+}
+
+
+void BanditComm::abortSend(ErrorPtr aError)
+{
+  if (banditState!=banditstate_sending && banditState!=banditstate_draining) return;
+  // machine should not get any more data
+  if (getFd()>=0) tcflush(getFd(), TCOFLUSH);
+  sendEnd(aError);
+}
+
+
+ErrorPtr BanditComm::setTxWatermarks(size_t aLowWater, size_t aHighWater)
+{
+  if (aLowWater==0 || aHighWater<=aLowWater) {
+    return TextError::err("transmit watermarks must be 0 < low (%zu) < high (%zu)", aLowWater, aHighWater);
+  }
+  txLowWater = aLowWater;
+  txHighWater = aHighWater;
+  return ErrorPtr();
+}
+
+
+bool BanditComm::isBusy()
+{
+  return
+    banditState==banditstate_receiving ||
+    banditState==banditstate_sending ||
+    banditState==banditstate_draining ||
+    banditState==banditstate_probing;
 }
 
 
@@ -94,37 +365,407 @@ void BanditComm::end(ErrorPtr aError, string aData)
 
 
 
+// MARK: - handshake input monitoring
+
+void BanditComm::startHandshakeMonitor()
+{
+  stopHandshakeMonitor();
+  hsState = handshakeInput();
+  hsBounceStart = Never;
+  if (hsLink) {
+    LOG(LOG_INFO, "Handshake lines: emulator link at '%s'", hsLinkPath.c_str());
+    return; // changes are reported through the link
+  }
+  if (hsModemLine) {
+    #if defined(__linux__) && defined(TIOCMIWAIT)
+    // block in TIOCMIWAIT in a thread, which wakes the mainloop through a pipe
+    if (installWaitSignalHandler() && pipe(hsWaitPipe)==0) {
+      hsWaitStop = false;
+      if (pthread_create(&hsWaitThread, NULL, modemWaitThread, this)==0) {
+        hsWaitRunning = true;
+        MainLoop::currentMainLoop().registerPollHandler(hsWaitPipe[0], POLLIN, boost::bind(&BanditComm::modemWaitEvent, this, _1, _2));
+        LOG(LOG_INFO, "Handshake input: modem line change interrupts");
+        return;
+      }
+      closeWaitPipe();
+    }
+    #endif
+    LOG(LOG_INFO, "Handshake input: polling modem line every %lld mS", hsPollInterval/MilliSecond);
+    hsPollTicket.executeOnce(boost::bind(&BanditComm::pollModemLines, this), hsPollInterval);
+    return;
+  }
+  if (!ctsDsrDcdInput || ctsDsrDcdInput->getName()=="missing") return; // nothing to monitor
+  // prefer edge detection (Infinite = do not poll), debouncing is done here to allow measuring bounce
+  if (ctsDsrDcdInput->setInputChangedHandler(boost::bind(&BanditComm::handshakeEdge, this), 0, Infinite)) {
+    LOG(LOG_INFO, "Handshake input: edge detection on '%s'", ctsDsrDcdInput->getName().c_str());
+    return;
+  }
+  LOG(LOG_INFO, "Handshake input: polling '%s' every %lld mS", ctsDsrDcdInput->getName().c_str(), hsPollInterval/MilliSecond);
+  ctsDsrDcdInput->setInputChangedHandler(boost::bind(&BanditComm::handshakeEdge, this), 0, hsPollInterval);
+}
+
+
+void BanditComm::stopHandshakeMonitor()
+{
+  hsPollTicket.cancel();
+  hsDebounceTicket.cancel();
+  if (ctsDsrDcdInput) ctsDsrDcdInput->setInputChangedHandler(NULL, 0, 0);
+  #if defined(__linux__)
+  if (hsWaitRunning) {
+    hsWaitStop = true;
+    // the signal is lost when it arrives after the thread checked hsWaitStop, but before it entered
+    // TIOCMIWAIT, so repeat it until the thread has actually ended
+    while (true) {
+      pthread_kill(hsWaitThread, HS_WAIT_SIGNAL);
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += HS_WAIT_STOP_RETRY*1000;
+      if (deadline.tv_nsec>=1000000000) { deadline.tv_sec++; deadline.tv_nsec -= 1000000000; }
+      if (pthread_timedjoin_np(hsWaitThread, NULL, &deadline)==0) break;
+    }
+    hsWaitRunning = false;
+    MainLoop::currentMainLoop().unregisterPollHandler(hsWaitPipe[0]);
+    closeWaitPipe();
+  }
+  #endif
+}
+
+
+bool BanditComm::handshakeInput()
+{
+  if (hsLink) return hsLinkIn;
+  if (hsModemLine) {
+    int lines = 0;
+    if (getFd()<0 || ioctl(getFd(), TIOCMGET, &lines)<0) return false;
+    return ((lines & hsModemLine)!=0) != hsInverted;
+  }
+  return ctsDsrDcdInput && ctsDsrDcdInput->isSet();
+}
+
+
+#if defined(__linux__)
+
+static void waitSignalHandler(int aSignal)
+{
+  // nothing to do, just makes TIOCMIWAIT return EINTR
+}
+
+
+/// install the (no-op) handler for HS_WAIT_SIGNAL, unless someone else already uses that signal
+/// @return true if the signal can be used to interrupt the wait thread
+bool BanditComm::installWaitSignalHandler()
+{
+  struct sigaction sa;
+  if (sigaction(HS_WAIT_SIGNAL, NULL, &sa)<0) return false;
+  if (sa.sa_handler==waitSignalHandler) return true; // already installed
+  if (sa.sa_handler!=SIG_DFL || (sa.sa_flags & SA_SIGINFO)) {
+    LOG(LOG_WARNING, "Handshake input: signal %d already in use, cannot wait for modem line changes", HS_WAIT_SIGNAL);
+    return false;
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = waitSignalHandler; // no SA_RESTART, so TIOCMIWAIT is interrupted
+  return sigaction(HS_WAIT_SIGNAL, &sa, NULL)==0;
+}
+
+
+void BanditComm::closeWaitPipe()
+{
+  close(hsWaitPipe[0]); close(hsWaitPipe[1]);
+  hsWaitPipe[0] = -1; hsWaitPipe[1] = -1;
+}
+
+
+void *BanditComm::modemWaitThread(void *aArg)
+{
+  BanditComm *comm = static_cast<BanditComm *>(aArg);
+  int fd = comm->getFd();
+  char c = 'C';
+  while (!comm->hsWaitStop) {
+    #if defined(TIOCMIWAIT)
+    if (ioctl(fd, TIOCMIWAIT, comm->hsModemLine)<0) {
+      if (errno==EINTR) continue; // stop flag will tell
+      c = 'E'; // not supported by driver
+    }
+    #endif
+    if (write(comm->hsWaitPipe[1], &c, 1)<0 || c=='E') break;
+  }
+  return NULL;
+}
+
+
+bool BanditComm::modemWaitEvent(int aFD, int aPollFlags)
+{
+  char buf[32];
+  ssize_t n = read(aFD, buf, sizeof(buf));
+  if (n>0 && buf[n-1]=='E') {
+    // driver cannot wait for modem line changes, fall back to polling
+    LOG(LOG_WARNING, "Handshake input: TIOCMIWAIT not supported by serial driver, polling every %lld mS", hsPollInterval/MilliSecond);
+    MainLoop::currentMainLoop().unregisterPollHandler(hsWaitPipe[0]);
+    pthread_join(hsWaitThread, NULL);
+    hsWaitRunning = false;
+    closeWaitPipe();
+    hsPollTicket.executeOnce(boost::bind(&BanditComm::pollModemLines, this), hsPollInterval);
+    return true;
+  }
+  handshakeEdge();
+  return true;
+}
+
+#endif // __linux__
+
+
+void BanditComm::setHandshakeOutput(bool aActive)
+{
+  if (hsLink) {
+    if (aActive!=hsLinkOut) {
+      hsLinkOut = aActive;
+      if (hsLink->connected()) hsLink->transmitString(hsLinkOut ? "1" : "0");
+    }
+    return;
+  }
+  if (rtsDtrOutput) rtsDtrOutput->set(aActive);
+}
+
+
+void BanditComm::hsLinkConnect()
+{
+  hsLink->setConnectionParams(NULL, hsLinkPath.c_str(), SOCK_STREAM, PF_LOCAL);
+  hsLink->setConnectionStatusHandler(boost::bind(&BanditComm::hsLinkStatus, this, _2));
+  hsLink->setReceiveHandler(boost::bind(&BanditComm::hsLinkReceive, this, _1));
+  ErrorPtr err = hsLink->initiateConnection();
+  if (!Error::isOK(err)) hsLinkStatus(err);
+}
+
+
+void BanditComm::hsLinkStatus(ErrorPtr aError)
+{
+  if (Error::isOK(aError)) {
+    LOG(LOG_NOTICE, "Connected to emulator handshake link '%s'", hsLinkPath.c_str());
+    hsLink->transmitString(hsLinkOut ? "1" : "0"); // tell current state
+    return;
+  }
+  LOG(LOG_WARNING, "Emulator handshake link '%s' not connected: %s", hsLinkPath.c_str(), aError->description().c_str());
+  hsLink->closeConnection();
+  if (hsLinkIn) {
+    hsLinkIn = false;
+    handshakeEdge();
+  }
+  hsLinkRetryTicket.executeOnce(boost::bind(&BanditComm::hsLinkConnect, this), EMU_LINK_RETRY_INTERVAL);
+}
+
+
+void BanditComm::hsLinkReceive(ErrorPtr aError)
+{
+  string d;
+  if (!Error::isOK(hsLink->receiveString(d)) || d.empty()) return;
+  bool state = d[d.size()-1]=='1'; // only the latest state matters
+  if (state!=hsLinkIn) {
+    hsLinkIn = state;
+    handshakeEdge();
+  }
+}
+
+
+void BanditComm::checkTxQueueReporting()
+{
+  txQueueFromOS = true;
+  #if defined(__linux__)
+  // pseudo terminals (e.g. p44banditemu) accept TIOCOUTQ, but always report an empty queue
+  struct stat st;
+  if (getFd()>=0 && fstat(getFd(), &st)==0 && S_ISCHR(st.st_mode) && major(st.st_rdev)>=136 && major(st.st_rdev)<=143) {
+    LOG(LOG_INFO, "Serial device is a pseudo terminal, estimating transmit queue from link speed");
+    txQueueFromOS = false;
+  }
+  #endif
+}
+
+
+void BanditComm::pollModemLines()
+{
+  if (handshakeInput()!=hsState || hsBounceStart!=Never) handshakeEdge();
+  hsPollTicket.executeOnce(boost::bind(&BanditComm::pollModemLines, this), hsPollInterval);
+}
+
+
+void BanditComm::handshakeEdge()
+{
+  MLMicroSeconds now = MainLoop::now();
+  if (hsBounceStart==Never) {
+    hsBounceStart = now;
+    hsBounceEdges = 0;
+  }
+  hsLastEdge = now;
+  hsBounceEdges++;
+  if (hsDebounceTime<=0) {
+    handshakeSettled();
+    return;
+  }
+  // accept when input has been stable for the debounce time
+  hsDebounceTicket.executeOnce(boost::bind(&BanditComm::handshakeSettled, this), hsDebounceTime);
+}
+
+
+void BanditComm::handshakeSettled()
+{
+  static MetricHistogram &bounce = Metrics::shared().histogram(
+    "bandit_handshake_bounce_seconds", "duration of handshake input edge bursts (0 for clean edges)",
+    { 0, 0.0001, 0.0005, 0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1 }
+  );
+  static MetricCounter &edges = Metrics::shared().counter("bandit_handshake_edges_total", "raw handshake input edges, including bounces");
+  bool state = handshakeInput();
+  MLMicroSeconds burst = hsLastEdge-hsBounceStart;
+  bounce.observe((double)burst/Second);
+  edges.inc(hsBounceEdges);
+  if (hsBounceEdges>1) {
+    LOG(LOG_INFO, "Handshake input bounced: %d edges within %.1f mS (debounce time is %.1f mS)", hsBounceEdges, (double)burst/MilliSecond, (double)hsDebounceTime/MilliSecond);
+  }
+  hsBounceStart = Never;
+  if (state!=hsState) {
+    hsState = state;
+    handshakeChanged(state);
+  }
+}
+
+
 void BanditComm::handshakeChanged(bool aNewState)
 {
   LOG(LOG_INFO, "Handshake line changed to %d", aNewState);
+  if (handshakeMonitorCB) handshakeMonitorCB(aNewState);
   if (banditState==banditstate_receivewait) {
     // set handshake line now
-    if (aNewState) {
+    if (aNewState && linkProfile.hwHandshake) {
       LOG(LOG_INFO, "Input handshake got active -> starting receive");
+      rxHandshakeTime = MainLoop::now();
       startReceive();
     }
   }
   else if (banditState==banditstate_receiving) {
-    if (endOnHandshake && aNewState==false) {
+    if (endOnHandshake && linkProfile.hwHandshake && aNewState==false) {
       LOG(LOG_INFO, "Input handshake got inactive -> assume all data received");
-      end(ErrorPtr(), data);
+      receiveEnd();
+    }
+  }
+  else if (banditState==banditstate_sending) {
+    if (flowControl && aNewState && txPaused) {
+      LOG(LOG_INFO, "Input handshake got active again -> resuming transmission");
+      transmitNext();
     }
   }
 }
 
 
-#define RECEIVE_TIMEOUT (5*Second)
+#define RECEIVE_IDLE_BYTES 550 // idle time in byte times after which a transmission is considered complete (5 sec at 1200 baud)
+#define MIN_RECEIVE_TIMEOUT (1*Second) // but never less than this
+#define PROGRAMEND_IDLE_BYTES 60 // idle time in byte times after a M2/M30 line (DC3 and padding usually follow right away)
+#define DC3_IDLE_BYTES 10 // idle time in byte times after DC3 and its NUL padding
+#define MIN_END_TIMEOUT (20*MilliSecond) // but never less than this (OS and USB adapter latency)
+#define MAX_RX_LINE 80 // longer lines are not examined for program end
+
+MLMicroSeconds BanditComm::receiveTimeout()
+{
+  MLMicroSeconds t;
+  switch (rxEnd) {
+    case rxend_dc3:
+      t = DC3_IDLE_BYTES*byteTime();
+      return t<MIN_END_TIMEOUT ? MIN_END_TIMEOUT : t;
+    case rxend_programend:
+      t = PROGRAMEND_IDLE_BYTES*byteTime();
+      return t<MIN_END_TIMEOUT ? MIN_END_TIMEOUT : t;
+    default:
+      t = RECEIVE_IDLE_BYTES*byteTime();
+      return t<MIN_RECEIVE_TIMEOUT ? MIN_RECEIVE_TIMEOUT : t;
+  }
+}
+
+
+/// @return true if aLine (without line end) is a program end (M2 or M30), possibly with line number
+static bool isProgramEnd(const string &aLine)
+{
+  const char *p = aLine.c_str();
+  while (*p==' ' || *p=='\t') p++;
+  // skip line number
+  if (toupper(*p)=='N') {
+    p++;
+    while (isdigit(*p)) p++;
+    while (*p==' ' || *p=='\t' || *p=='&') p++;
+  }
+  // must be a single M word, not an M2/M30 somewhere in a comment or among other words
+  if (toupper(*p++)!='M' || !isdigit(*p)) return false;
+  int m = 0;
+  while (isdigit(*p)) m = m*10 + (*p++ - '0');
+  while (*p==' ' || *p=='\t' || *p=='\r') p++;
+  return *p==0 && (m==2 || m==30);
+}
+
+
+void BanditComm::rxScanEnd(const string &aData)
+{
+  for (size_t i=0; i<aData.size(); i++) {
+    char c = aData[i] & 0x7F;
+    if (c==0) continue; // padding
+    if (c==0x13) {
+      // DC3: end of transmission, when following actual data
+      if (rxHasData && rxEnd!=rxend_dc3) {
+        LOG(LOG_INFO, "DC3 received -> end of program, waiting for padding to end");
+        rxEnd = rxend_dc3;
+      }
+      continue;
+    }
+    if (c==0x11) continue; // DC1 leader
+    if (c=='\r' || c=='\n') {
+      if (!rxLine.empty() && rxEnd==rxend_none && isProgramEnd(rxLine)) {
+        LOG(LOG_INFO, "Program end '%s' received, DC3 should follow", rxLine.c_str());
+        rxEnd = rxend_programend;
+      }
+      rxLine.clear();
+      continue;
+    }
+    // actual data
+    if (rxEnd!=rxend_none) {
+      // stray DC3 or M2 within the program
+      LOG(LOG_INFO, "More data after program end -> continuing to receive");
+      rxEnd = rxend_none;
+    }
+    rxHasData = true;
+    if (rxLine.size()<MAX_RX_LINE) rxLine += c;
+  }
+}
+
 
 void BanditComm::receiveHandler(ErrorPtr aError)
 {
   string d;
   ErrorPtr err = receiveAndAppendToString(d);
   if (Error::isOK(err)) {
+    if (banditState==banditstate_probing) {
+      probeData.append(d);
+      probeEvaluate(false);
+      return;
+    }
+    if (banditState==banditstate_receivewait && !linkProfile.hwHandshake) {
+      LOG(LOG_INFO, "Data arrives (no hardware handshake) -> starting receive");
+      startReceive();
+    }
     if (banditState==banditstate_receiving) {
       // accumulate
-      timeoutTicket.reschedule(RECEIVE_TIMEOUT);
+      if (endDetection) rxScanEnd(d);
+      timeoutTicket.reschedule(receiveTimeout());
       LOG(LOG_DEBUG, "Received Data: %s", d.c_str());
-      data.append(d);
+      rxMetrics(d.size());
+      rxRawBytes += d.size();
+      if (rxDataCB) {
+        // pass on right away
+        string chunk;
+        if (rxCleaner) rxCleaner->clean(d.c_str(), d.size(), chunk);
+        else chunk.swap(d);
+        if (!chunk.empty()) rxDataCB(chunk.c_str(), chunk.size());
+      }
+      else if (rxCleaner) {
+        rxCleaner->clean(d.c_str(), d.size(), data);
+      }
+      else {
+        data.append(d);
+      }
     }
     else {
       LOG(LOG_NOTICE, "Received stray Data: %s", d.c_str());
@@ -134,28 +775,58 @@ void BanditComm::receiveHandler(ErrorPtr aError)
   else {
     if (banditState!=banditstate_idle) {
       // report error and stop
-      end(aError);
+      end(err);
     }
   }
 }
 
 
+void BanditComm::rxMetrics(size_t aBytes)
+{
+  static MetricCounter &rxBytes = Metrics::shared().counter("bandit_rx_bytes_total", "bytes received from the machine");
+  static MetricCounter &rxChunks = Metrics::shared().counter("bandit_rx_chunks_total", "data chunks received from the machine");
+  static MetricHistogram &firstByteLatency = Metrics::shared().histogram(
+    "bandit_rx_first_byte_seconds", "time from input handshake edge to first received byte",
+    { 0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30 }
+  );
+  static MetricHistogram &idleGaps = Metrics::shared().histogram(
+    "bandit_rx_gap_seconds", "idle time between received data chunks",
+    { 0.001, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 5 }
+  );
+  MLMicroSeconds now = MainLoop::now();
+  rxBytes.inc(aBytes);
+  rxChunks.inc();
+  if (rxRawBytes==0) {
+    if (rxHandshakeTime!=Never) firstByteLatency.observe((double)(now-rxHandshakeTime)/Second);
+  }
+  else {
+    idleGaps.observe((double)(now-rxLastDataTime)/Second);
+  }
+  rxLastDataTime = now;
+}
+
+
 void BanditComm::startReceive()
 {
   banditState = banditstate_receiving;
   // set handshake line right away
-  rtsDtrOutput->on();
+  setHandshakeOutput(true);
   // set timeout
-  MainLoop::currentMainLoop().executeTicketOnce(timeoutTicket, boost::bind(&BanditComm::timeout, this), RECEIVE_TIMEOUT);
+  MainLoop::currentMainLoop().executeTicketOnce(timeoutTicket, boost::bind(&BanditComm::timeout, this), receiveTimeout());
 }
 
 
 
 void BanditComm::timeout()
 {
+  if (rxEnd!=rxend_none) {
+    LOG(LOG_NOTICE, "End of program received -> complete");
+    receiveEnd();
+    return;
+  }
   LOG(LOG_NOTICE, "Timeout -> stopping");
-  if (data.size()>0) {
-    end(ErrorPtr(), data);
+  if (rxRawBytes>0) {
+    receiveEnd();
   }
   else {
     end(TextError::err("Timeout while waiting for data"));
@@ -163,16 +834,41 @@ void BanditComm::timeout()
 }
 
 
-void BanditComm::receive(BanditResponseCB aResponseCB, bool aHandShakeOnStart, bool aWaitForHandshake, bool aEndOnHandshake)
+void BanditComm::receiveEnd()
+{
+  if (rxCleaner) {
+    if (rxDataCB) {
+      string chunk;
+      rxCleaner->finish(chunk);
+      if (!chunk.empty()) rxDataCB(chunk.c_str(), chunk.size());
+    }
+    else {
+      rxCleaner->finish(data);
+    }
+  }
+  end(ErrorPtr(), data);
+}
+
+
+void BanditComm::receive(BanditResponseCB aResponseCB, bool aHandShakeOnStart, bool aWaitForHandshake, bool aEndOnHandshake, BanditCleanerPtr aCleaner, BanditDataCB aDataCB)
 {
   stop();
-  endOnHandshake = aEndOnHandshake;
+  endOnHandshake = aEndOnHandshake && linkProfile.hwHandshake;
   responseCB = aResponseCB;
   data.clear();
+  rxRawBytes = 0;
+  rxHandshakeTime = Never;
+  rxEnd = rxend_none;
+  rxLine.clear();
+  rxHasData = false;
+  rxCleaner = aCleaner;
+  if (rxCleaner) rxCleaner->reset();
+  rxDataCB = aDataCB;
   if (aHandShakeOnStart) {
-    rtsDtrOutput->on();
+    setHandshakeOutput(true);
   }
   if (aWaitForHandshake) {
+    // Note: without hardware handshake, first data received starts receiving
     banditState = banditstate_receivewait;
   }
   else {
@@ -181,24 +877,366 @@ void BanditComm::receive(BanditResponseCB aResponseCB, bool aHandShakeOnStart, b
 }
 
 
-#define BYTE_TIME (Second/1200*11)
-#define SEND_FINISH_DELAY (BYTE_TIME*4)
+#define UART_FIFO_SIZE 16 // bytes that might still be in the UART hardware when the OS queue is already empty
+#define SEND_FINISH_BYTES (UART_FIFO_SIZE+4) // byte times to wait after OS queue is empty
+#define TX_QUEUE_TIME (300*MilliSecond) // max data to have queued in the OS at any time, in transmission time
+#define MIN_TX_QUEUE_LIMIT 32 // but allow at least this many bytes
+
+size_t BanditComm::txQueueLimit()
+{
+  size_t l = (size_t)(TX_QUEUE_TIME/byteTime());
+  return l<MIN_TX_QUEUE_LIMIT ? MIN_TX_QUEUE_LIMIT : l;
+}
+
 
 void BanditComm::send(StatusCB aStatusCB, string aData, bool aEnableHandshake)
 {
-  // FIXME: send line per line, maybe check handshake line, callback only when finished
-  //printf("BEGIN:\n%sEND\n", aData.c_str());
+  send(aStatusCB, BanditDataSourcePtr(new StringDataSource(aData)), aEnableHandshake);
+}
+
+
+void BanditComm::send(StatusCB aStatusCB, BanditDataSourcePtr aSource, bool aEnableHandshake, bool aDNC)
+{
+  if (isBusy()) {
+    if (aStatusCB) aStatusCB(TextError::err("Cannot send now, BANDIT connection is busy"));
+    return;
+  }
+  if (aDNC && !(flowControl && linkProfile.hwHandshake)) {
+    if (aStatusCB) aStatusCB(TextError::err("DNC mode requires flow control by handshake input"));
+    return;
+  }
+  stop(); // abandon waiting for data, if any
+  sendCB = aStatusCB;
+  txSource = aSource;
+  dncMode = aDNC;
+  txData.clear();
+  txPos = 0;
+  txPaused = false;
+  txQueueEstimate = 0;
+  txQueueEstimateTime = MainLoop::now();
+  txWrittenBytes = 0;
+  txTotalBytes = aSource->sizeHint();
+  txLineEnds.clear();
+  txSentLines = 0;
+  txStartTime = MainLoop::now();
+  txPausedTime = 0;
+  txPauseStart = Never;
+  txDrainStart = Never;
+  banditState = banditstate_sending;
   if (aEnableHandshake) {
-    if (rtsDtrOutput) rtsDtrOutput->on();
+    setHandshakeOutput(true);
   }
-  MainLoop::currentMainLoop().executeTicketOnce(timeoutTicket, boost::bind(&BanditComm::dataSent, this, aStatusCB), BYTE_TIME*aData.size()+SEND_FINISH_DELAY);
-  sendString(aData);
+  transmitNext();
 }
 
 
-void BanditComm::dataSent(StatusCB aStatusCB)
+void BanditComm::transmitHandler(ErrorPtr aError)
 {
-  if (rtsDtrOutput) rtsDtrOutput->off();
-  if (aStatusCB) aStatusCB(ErrorPtr());
+  if (!Error::isOK(aError)) {
+    sendEnd(aError);
+    return;
+  }
+  transmitNext();
 }
 
+
+void BanditComm::transmitNext()
+{
+  txTicket.cancel();
+  if (banditState!=banditstate_sending) return;
+  if (flowControl && linkProfile.hwHandshake && !handshakeInput()) {
+    // controller not ready, handshakeChanged() will resume
+    if (!txPaused) {
+      LOG(LOG_INFO, "Input handshake inactive -> pausing transmission");
+      txPaused = true;
+      txPauseStart = MainLoop::now();
+    }
+    setTransmitHandler(NULL);
+    return;
+  }
+  if (txPaused) {
+    txPaused = false;
+    txPausedTime += MainLoop::now()-txPauseStart;
+  }
+  // make sure there is data to send
+  ErrorPtr err = refillTxData();
+  if (!Error::isOK(err)) {
+    sendEnd(err);
+    return;
+  }
+  if (txPos>=txData.size()) {
+    // all data is handed to the OS, now wait for it to actually leave
+    setTransmitHandler(NULL);
+    txData.clear();
+    banditState = banditstate_draining;
+    checkDrained();
+    return;
+  }
+  size_t queued = txQueueBytes();
+  countSentLines(queued); // keeps txLineEnds short even when nobody asks for progress
+  size_t limit = txQueueLimit();
+  if (queued>=limit) {
+    // enough data on its way, check again when about half of it has left
+    setTransmitHandler(NULL);
+    txTicket.executeOnce(boost::bind(&BanditComm::transmitNext, this), (queued-limit/2)*byteTime());
+    return;
+  }
+  // feed next line (or as much of it as fits into the queue limit)
+  size_t n = limit-queued;
+  size_t eol = txData.find('\n', txPos);
+  if (eol!=string::npos && eol+1-txPos<n) n = eol+1-txPos;
+  if (txPos+n>txData.size()) n = txData.size()-txPos;
+  size_t written = transmitBytes(n, (const uint8_t *)txData.c_str()+txPos, err);
+  if (!Error::isOK(err)) {
+    sendEnd(err);
+    return;
+  }
+  static MetricCounter &txBytes = Metrics::shared().counter("bandit_tx_bytes_total", "bytes sent to the machine");
+  txBytes.inc(written);
+  // remember where lines end, for progress
+  for (size_t i=0; i<written; i++) {
+    if (txData[txPos+i]=='\n') txLineEnds.push_back(txWrittenBytes+i+1);
+  }
+  txWrittenBytes += written;
+  txPos += written;
+  txQueueEstimate += written;
+  // more to send (or detect end of data) as soon as the connection can accept data
+  setTransmitHandler(boost::bind(&BanditComm::transmitHandler, this, _1));
+}
+
+
+ErrorPtr BanditComm::refillTxData()
+{
+  if (!txSource || txData.size()-txPos>=txLowWater) return ErrorPtr(); // nothing to read or still enough data
+  // drop already transmitted data
+  txData.erase(0, txPos);
+  txPos = 0;
+  // read from source up to high watermark
+  ErrorPtr err;
+  while (txData.size()<txHighWater) {
+    const char *chunk;
+    size_t n = txSource->nextChunk(chunk, txHighWater-txData.size(), err);
+    if (n==0) {
+      // end of data (or error), now we know the exact total
+      txSource.reset();
+      txTotalBytes = txWrittenBytes+txData.size()-txPos;
+      break;
+    }
+    txData.append(chunk, n);
+  }
+  if (dncMode) {
+    LOG(LOG_DEBUG, "DNC: refilled transmit buffer to %zd bytes%s", txData.size(), txSource ? "" : " (end of program)");
+  }
+  return err;
+}
+
+
+size_t BanditComm::txQueueBytes()
+{
+  // update estimate: queue drains at one byte per byte time
+  MLMicroSeconds now = MainLoop::now();
+  MLMicroSeconds bt = byteTime();
+  size_t drained = (size_t)((now-txQueueEstimateTime)/bt);
+  if (drained>0) {
+    txQueueEstimate = drained>txQueueEstimate ? 0 : txQueueEstimate-drained;
+    txQueueEstimateTime += drained*bt;
+  }
+  if (txQueueEstimate==0) txQueueEstimateTime = now;
+  #ifdef TIOCOUTQ
+  // ask the OS for the real number of bytes not yet sent (works for serial devices and TCP sockets)
+  int queued;
+  if (txQueueFromOS && getFd()>=0 && ioctl(getFd(), TIOCOUTQ, &queued)>=0) {
+    return queued>0 ? queued : 0;
+  }
+  #endif
+  return txQueueEstimate;
+}
+
+
+void BanditComm::checkDrained()
+{
+  size_t queued = txQueueBytes();
+  countSentLines(queued);
+  if (queued>0) {
+    // check again when the queued bytes should be gone
+    txTicket.executeOnce(boost::bind(&BanditComm::checkDrained, this), queued*byteTime());
+    return;
+  }
+  MLMicroSeconds now = MainLoop::now();
+  if (txDrainStart==Never) txDrainStart = now;
+  #if defined(TIOCSERGETLSR) && defined(TIOCSER_TEMT)
+  // ask the UART if the last bits have left the wire, so we can end as early as possible
+  int lsr;
+  if (getFd()>=0 && ioctl(getFd(), TIOCSERGETLSR, &lsr)>=0) {
+    if ((lsr & TIOCSER_TEMT) || now-txDrainStart>SEND_FINISH_BYTES*byteTime()) {
+      sendEnd(ErrorPtr());
+    }
+    else {
+      txTicket.executeOnce(boost::bind(&BanditComm::checkDrained, this), 2*byteTime());
+    }
+    return;
+  }
+  #endif
+  // OS queue is empty, give last bytes time to leave the UART
+  txTicket.executeOnce(boost::bind(&BanditComm::sendEnd, this, ErrorPtr()), SEND_FINISH_BYTES*byteTime());
+}
+
+
+void BanditComm::sendEnd(ErrorPtr aError)
+{
+  static MetricCounter &sendsOk = Metrics::shared().counter("bandit_sends_total", "completed sends by result", "result=\"ok\"");
+  static MetricCounter &sendsFailed = Metrics::shared().counter("bandit_sends_total", "completed sends by result", "result=\"error\"");
+  static MetricHistogram &durationRatio = Metrics::shared().histogram(
+    "bandit_send_duration_ratio", "actual send duration relative to theoretical duration at link speed",
+    { 1, 1.02, 1.05, 1.1, 1.25, 1.5, 2, 3, 5, 10 }
+  );
+  if (Error::isOK(aError)) {
+    sendsOk.inc();
+    if (txWrittenBytes>0) {
+      durationRatio.observe((double)(MainLoop::now()-txStartTime)/(txWrittenBytes*byteTime()));
+    }
+  }
+  else {
+    sendsFailed.inc();
+  }
+  StatusCB c = sendCB;
+  stop();
+  if (c) c(aError);
+}
+
+
+
+uint64_t BanditComm::txSentBytes()
+{
+  return countSentLines(txQueueBytes());
+}
+
+
+uint64_t BanditComm::countSentLines(size_t aQueued)
+{
+  uint64_t sent = aQueued>txWrittenBytes ? 0 : txWrittenBytes-aQueued;
+  while (!txLineEnds.empty() && txLineEnds.front()<=sent) {
+    txLineEnds.pop_front();
+    txSentLines++;
+  }
+  return sent;
+}
+
+
+JsonObjectPtr BanditComm::transferStatus()
+{
+  static const char *stateNames[] = { "idle", "receivewait", "receiving", "sending", "draining", "probing" };
+  JsonObjectPtr st = JsonObject::newObj();
+  st->add("state", JsonObject::newString(stateNames[banditState]));
+  st->add("linkProfile", JsonObject::newString(linkProfile.name));
+  if (banditState==banditstate_receiving) {
+    st->add("bytesReceived", JsonObject::newInt64(rxRawBytes));
+  }
+  else if (banditState==banditstate_sending || banditState==banditstate_draining) {
+    MLMicroSeconds now = MainLoop::now();
+    uint64_t sent = txSentBytes();
+    uint64_t total = txTotalBytes<txWrittenBytes ? txWrittenBytes : txTotalBytes;
+    MLMicroSeconds active = now-txStartTime-txPausedTime-(txPaused ? now-txPauseStart : 0);
+    // effective rate as measured, or nominal rate at the very beginning
+    double rate = (double)Second/byteTime();
+    if (active>2*Second && sent>0) rate = (double)sent*Second/active;
+    st->add("bytesTotal", JsonObject::newInt64(total));
+    st->add("totalIsExact", JsonObject::newBool(!txSource));
+    st->add("bytesSent", JsonObject::newInt64(sent));
+    st->add("bytesQueued", JsonObject::newInt64(txWrittenBytes-sent));
+    st->add("line", JsonObject::newInt64(txSentLines+1));
+    st->add("progress", JsonObject::newDouble(total>0 ? (double)sent/total : 0));
+    st->add("elapsed", JsonObject::newDouble((double)(now-txStartTime)/Second));
+    st->add("bytesPerSecond", JsonObject::newDouble(rate));
+    st->add("eta", JsonObject::newDouble(total>sent ? (double)(total-sent)/rate : 0));
+    st->add("paused", JsonObject::newBool(txPaused));
+    st->add("dnc", JsonObject::newBool(dncMode));
+  }
+  return st;
+}
+
+
+// MARK: - link probing
+
+#define PROBE_WINDOW_BYTES 200 // byte times to listen with each profile
+#define MIN_PROBE_WINDOW (2*Second) // but at least this long
+#define PROBE_MIN_BYTES 32 // number of (non-padding) bytes needed to judge a profile
+#define PROBE_MIN_VALID_PERCENT 90 // percentage of bytes that must be valid BANDIT program characters
+
+void BanditComm::probe(BanditProbeCB aProbeCB, MLMicroSeconds aTimeout)
+{
+  if (isBusy()) {
+    if (aProbeCB) aProbeCB(linkProfile, TextError::err("Cannot probe now, BANDIT connection is busy"));
+    return;
+  }
+  stop();
+  probeCandidates = BanditLinkProfile::probeProfiles();
+  probeIndex = 0;
+  probeEnd = MainLoop::now()+aTimeout;
+  probeCB = aProbeCB;
+  LOG(LOG_NOTICE, "Probing link profiles - start program output on the controller now");
+  probeNext();
+}
+
+
+void BanditComm::probeNext()
+{
+  if (MainLoop::now()>=probeEnd) {
+    BanditProbeCB cb = probeCB;
+    stop();
+    if (cb) cb(linkProfile, TextError::err("No valid data received with any link profile"));
+    return;
+  }
+  const BanditLinkProfile &p = probeCandidates[probeIndex];
+  probeIndex = (probeIndex+1) % probeCandidates.size(); // cycle until timeout
+  banditState = banditstate_idle; // allow switching
+  ErrorPtr err = setLinkProfile(p);
+  if (!Error::isOK(err)) {
+    BanditProbeCB cb = probeCB;
+    stop();
+    if (cb) cb(linkProfile, err);
+    return;
+  }
+  banditState = banditstate_probing;
+  probeData.clear();
+  setHandshakeOutput(true); // ready to receive
+  MLMicroSeconds w = PROBE_WINDOW_BYTES*byteTime();
+  timeoutTicket.executeOnce(boost::bind(&BanditComm::probeEvaluate, this, true), w<MIN_PROBE_WINDOW ? MIN_PROBE_WINDOW : w);
+}
+
+
+static bool validProgramChar(uint8_t aChar)
+{
+  return
+    isalnum(aChar) ||
+    aChar==' ' || aChar=='\r' || aChar=='\n' ||
+    aChar=='.' || aChar=='-' || aChar=='+' || aChar=='&' || aChar=='#' || aChar=='%';
+}
+
+
+void BanditComm::probeEvaluate(bool aWindowEnded)
+{
+  size_t total = 0;
+  size_t valid = 0;
+  for (size_t i=0; i<probeData.size(); i++) {
+    uint8_t c = probeData[i] & 0x7F;
+    if (c==0 || c==0x11 || c==0x13) continue; // padding and framing, received as such with many wrong settings, too
+    total++;
+    if (validProgramChar(c)) valid++;
+  }
+  if (total>=PROBE_MIN_BYTES) {
+    if (valid*100>=total*PROBE_MIN_VALID_PERCENT) {
+      LOG(LOG_NOTICE, "Probing: valid data received with link profile '%s'", linkProfile.name.c_str());
+      BanditProbeCB cb = probeCB;
+      stop();
+      if (cb) cb(linkProfile, ErrorPtr());
+      return;
+    }
+    LOG(LOG_INFO, "Probing: link profile '%s' delivers invalid data (%zd of %zd bytes valid)", linkProfile.name.c_str(), valid, total);
+    timeoutTicket.cancel();
+    probeNext();
+  }
+  else if (aWindowEnded) {
+    probeNext();
+  }
+}
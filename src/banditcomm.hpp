@@ -25,17 +25,71 @@
 #include "p44utils_common.hpp"
 
 #include "serialcomm.hpp"
+#include "socketcomm.hpp"
 #include "digitalio.hpp"
+#include "jsonobject.hpp"
+
+#include "banditdata.hpp"
+
+#include <deque>
+#if defined(__linux__)
+#include <pthread.h>
+#include <atomic>
+#endif
 
 using namespace std;
 
 namespace p44 {
 
 
+  #define DEFAULT_TX_LOW_WATER 512 // refill transmit buffer when less than this is left to send
+  #define DEFAULT_TX_HIGH_WATER 4096 // refill transmit buffer up to this size
+
+
+  /// serial link parameters of a BANDIT controller
+  class BanditLinkProfile
+  {
+  public:
+    string name; ///< profile name
+    int baudRate; ///< baud rate
+    int dataBits; ///< number of data bits (5..8)
+    char parity; ///< 'N', 'E' or 'O'
+    int stopBits; ///< number of stop bits (1 or 2)
+    bool hwHandshake; ///< if set, handshake lines signal controller readiness and start/end of transmissions
+
+    BanditLinkProfile();
+
+    /// @return communication parameters in SerialComm notation, e.g. "1200,7,E,2"
+    string commParams() const;
+
+    /// @return time needed to transmit one byte (including start, parity and stop bits)
+    MLMicroSeconds byteTime() const;
+
+    /// @return JSON description of the profile
+    JsonObjectPtr json() const;
+
+    /// get a profile
+    /// @param aNameOrSpec name of a predefined profile, or a specification in the form
+    ///   baud[,bits[,parity[,stopbits[,hs|nohs]]]], e.g. "9600,7,E,2,hs"
+    /// @param aProfile will be set to the profile
+    /// @return false if aNameOrSpec is neither a profile name nor a valid specification
+    static bool lookup(const string aNameOrSpec, BanditLinkProfile &aProfile);
+
+    /// @return JSON array of all predefined profiles
+    static JsonObjectPtr predefinedProfiles();
+
+    /// @return predefined profiles, fastest first, for probing
+    static std::vector<BanditLinkProfile> probeProfiles();
+  };
+
+
   class BanditComm;
 
 
   typedef boost::function<void (const string &aResponse, ErrorPtr aError)> BanditResponseCB;
+  typedef boost::function<void (const char *aData, size_t aNumBytes)> BanditDataCB;
+  typedef boost::function<void (const BanditLinkProfile &aProfile, ErrorPtr aError)> BanditProbeCB;
+  typedef boost::function<void (bool aActive)> BanditHandshakeCB;
 
 
   typedef boost::intrusive_ptr<BanditComm> BanditCommPtr;
@@ -46,18 +100,93 @@ namespace p44 {
     DigitalIoPtr rtsDtrOutput;
     DigitalIoPtr ctsDsrDcdInput;
 
+    // handshake input monitoring
+    int hsModemLine; ///< TIOCM_xxx bit if handshake input is a modem line of the serial port, 0 otherwise
+    bool hsInverted; ///< modem line handshake input is inverted
+    bool hsState; ///< debounced handshake input state
+    MLMicroSeconds hsDebounceTime; ///< input must be stable this long before a change is accepted
+    MLMicroSeconds hsPollInterval; ///< poll interval when edge detection is not available
+    MLMicroSeconds hsBounceStart; ///< first edge of the current burst, Never if stable
+    MLMicroSeconds hsLastEdge; ///< last edge of the current burst
+    int hsBounceEdges; ///< number of edges in the current burst
+    MLTicket hsDebounceTicket;
+    MLTicket hsPollTicket;
+    #if defined(__linux__)
+    pthread_t hsWaitThread; ///< thread blocking in TIOCMIWAIT
+    bool hsWaitRunning;
+    std::atomic<bool> hsWaitStop;
+    int hsWaitPipe[2]; ///< wait thread signals modem line changes through this
+    #endif
+    SocketCommPtr hsLink; ///< handshake lines link to p44banditemu
+    string hsLinkPath;
+    bool hsLinkIn; ///< emulator's handshake output state
+    bool hsLinkOut; ///< our handshake output state
+    MLTicket hsLinkRetryTicket; ///< reconnects the link, independent of handshake monitoring
+    bool txQueueFromOS; ///< OS reports transmit queue size reliably
+    string connectionSpec;
+    uint16_t defaultPort;
+    ErrorPtr connectionError; ///< why the connection could not be established last time, NULL if ok
+    BanditLinkProfile linkProfile; ///< currently active link profile
+
     BanditResponseCB responseCB;
+    BanditHandshakeCB handshakeMonitorCB;
 
     enum {
       banditstate_idle,
       banditstate_receivewait,
-      banditstate_receiving
+      banditstate_receiving,
+      banditstate_sending,
+      banditstate_draining,
+      banditstate_probing
     } banditState;
 
     string data;
+    BanditCleanerPtr rxCleaner; ///< if set, received data is cleaned on the fly
+    BanditDataCB rxDataCB; ///< if set, received data is passed on immediately instead of accumulating it
+    size_t rxRawBytes; ///< number of bytes received (before cleaning)
+    MLMicroSeconds rxHandshakeTime; ///< when input handshake started the receive, Never if not started by handshake
+    MLMicroSeconds rxLastDataTime; ///< when the last data chunk was received
     bool endOnHandshake;
+    bool endDetection; ///< if set, end-of-program framing ends receiving without waiting for the idle timeout
+    enum {
+      rxend_none, ///< no end seen yet
+      rxend_programend, ///< M2/M30 line seen, DC3 and padding might follow
+      rxend_dc3 ///< DC3 seen, only NUL padding might follow
+    } rxEnd;
+    string rxLine; ///< current line as received, for recognizing program end
+    bool rxHasData; ///< non-framing data received
     MLTicket timeoutTicket;
 
+    // transmission
+    StatusCB sendCB; ///< called when transmission is complete (last byte has left)
+    BanditDataSourcePtr txSource; ///< source for more data to transmit, NULL when all data is in txData
+    string txData; ///< buffered data being transmitted
+    size_t txPos; ///< next byte in txData to transmit
+    size_t txLowWater; ///< txData is refilled from txSource when less than this number of bytes are left to send
+    size_t txHighWater; ///< txData is refilled up to this number of bytes
+    bool dncMode; ///< set when drip-feeding a program to a running machine
+    bool flowControl; ///< if set, transmission pauses while input handshake is inactive
+    bool txPaused; ///< set while transmission is paused by input handshake
+    size_t txQueueEstimate; ///< estimated number of bytes in output queue (when OS cannot tell)
+    MLMicroSeconds txQueueEstimateTime; ///< time when txQueueEstimate was last updated
+    MLTicket txTicket;
+    // - progress
+    uint64_t txWrittenBytes; ///< number of bytes handed to the OS so far
+    uint64_t txTotalBytes; ///< total bytes to send (estimate while source is not exhausted)
+    std::deque<uint64_t> txLineEnds; ///< offsets of line ends written but possibly not yet sent (at most the lines in the output queue)
+    size_t txSentLines; ///< number of lines completely sent
+    MLMicroSeconds txStartTime; ///< when sending started
+    MLMicroSeconds txPausedTime; ///< total time sending was paused by flow control
+    MLMicroSeconds txPauseStart; ///< when current pause started
+    MLMicroSeconds txDrainStart; ///< when OS output queue became empty
+
+    // probing
+    BanditProbeCB probeCB;
+    std::vector<BanditLinkProfile> probeCandidates;
+    size_t probeIndex;
+    string probeData;
+    MLMicroSeconds probeEnd;
+
   public:
 
     BanditComm(MainLoop &aMainLoop);
@@ -66,7 +195,12 @@ namespace p44 {
     /// set the connection parameters to connect to BANDIT controller
     /// @param aConnectionSpec serial device path (/dev/...) or host name/address[:port] (1.2.3.4 or xxx.yy)
     /// @param aDefaultPort default port number for TCP connection (irrelevant for direct serial device connection)
-    void setConnectionSpecification(const char *aConnectionSpec, uint16_t aDefaultPort, const char *aRtsDtrOutput, const char *aCtsDsrDcdInput);
+    /// @return error if the connection could not be established
+    ErrorPtr setConnectionSpecification(const char *aConnectionSpec, uint16_t aDefaultPort, const char *aRtsDtrOutput, const char *aCtsDsrDcdInput);
+
+    /// @return error from establishing the connection at the last attempt (setConnectionSpecification()
+    ///   or setLinkProfile()), NULL if connected ok
+    ErrorPtr lastConnectionError() { return connectionError; };
 
     /// init to idle
     void init();
@@ -74,19 +208,85 @@ namespace p44 {
     /// stop actions, no callback
     void stop();
 
+    /// abort sending, discarding data still queued for output
+    /// @param aError error to report to the send callback
+    void abortSend(ErrorPtr aError);
+
     /// receive data from bandit
     /// @param aResponseCB will be called after receiving a complete transmission from Bandit, or on error
     /// @param aEnableHandshake if set, handshake line will be set before starting to receive or waiting for handshake input
     /// @param aWaitForHandshake if set, receiving will not start before input handshake goes active
     /// @param aEndOnHandshake if set, receiving ends when input handshake goes inactive
-    void receive(BanditResponseCB aResponseCB, bool aEnableHandshake, bool aWaitForHandshake, bool aEndOnHandshake);
+    /// @param aCleaner if set, received data is cleaned with this cleaner while receiving, and aResponseCB gets the cleaned data
+    /// @param aDataCB if set, (cleaned) data is passed to this callback as it arrives, and aResponseCB gets no data
+    ///   (only signals the end of the transmission). This keeps memory usage independent of the program size.
+    void receive(BanditResponseCB aResponseCB, bool aEnableHandshake, bool aWaitForHandshake, bool aEndOnHandshake, BanditCleanerPtr aCleaner = BanditCleanerPtr(), BanditDataCB aDataCB = NULL);
 
-    /// receive data from bandit
+    /// send data to bandit
     /// @param aData data to send
-    /// @param aStatusCB will be called after transmission to Bandit is complete, or on error
+    /// @param aStatusCB will be called after transmission to Bandit is complete (last byte has left), or on error
     /// @param aEnableHandshake if set, handshake line will be set before sending
+    /// @note data is fed line by line, such that at most a few bytes are queued in the OS at any time
     void send(StatusCB aStatusCB, string aData, bool aEnableHandshake);
 
+    /// send data to bandit from a data source
+    /// @param aSource the source to read data from while sending. Only up to the high watermark
+    ///   (see setTxWatermarks()) of data is buffered at any time.
+    /// @param aStatusCB will be called after transmission to Bandit is complete (last byte has left), or on error
+    /// @param aEnableHandshake if set, handshake line will be set before sending
+    /// @param aDNC if set, data is drip-fed to a running machine (DNC mode): the controller's buffer is kept topped
+    ///   up as long as the input handshake is active. Requires flow control to be enabled.
+    void send(StatusCB aStatusCB, BanditDataSourcePtr aSource, bool aEnableHandshake, bool aDNC = false);
+
+    /// set the transmit buffer watermarks
+    /// @param aLowWater more data is read from the data source when less than this number of bytes are left to send
+    /// @param aHighWater data is read from the data source until this number of bytes is buffered
+    /// @return error if the watermarks are not 0 < aLowWater < aHighWater (watermarks remain unchanged then)
+    ErrorPtr setTxWatermarks(size_t aLowWater, size_t aHighWater);
+
+    /// configure handshake input change detection
+    /// @param aDebounceTime the input must be stable for this time before a change is accepted, 0 = no debouncing
+    /// @param aPollInterval interval for polling the input when no edge detection is available for it
+    /// @note must be called before setConnectionSpecification()
+    void setHandshakeInputTiming(MLMicroSeconds aDebounceTime, MLMicroSeconds aPollInterval);
+
+    /// enable flow control
+    /// @param aFlowControl if set, sending pauses while the input handshake line is inactive
+    void setFlowControl(bool aFlowControl) { flowControl = aFlowControl; };
+
+    /// enable end-of-program detection while receiving
+    /// @param aEndDetection if set, receiving ends shortly after DC3 or a M2/M30 line arrives, otherwise only by idle timeout or handshake
+    void setEndDetection(bool aEndDetection) { endDetection = aEndDetection; };
+
+    /// @return true if currently sending or receiving data
+    bool isBusy();
+
+    /// @param aHandshakeCB will be called on every change of the handshake input line (for monitoring only)
+    void setHandshakeMonitor(BanditHandshakeCB aHandshakeCB) { handshakeMonitorCB = aHandshakeCB; };
+
+    /// @return status of the current transfer, with progress and estimated time to completion when sending
+    /// @note progress is based on the bytes that have actually left the OS output queue
+    JsonObjectPtr transferStatus();
+
+    /// @return time needed to transmit one byte (including start, parity and stop bits)
+    MLMicroSeconds byteTime() { return linkProfile.byteTime(); };
+
+    /// set the serial link profile
+    /// @param aProfile the new profile
+    /// @return error if connection cannot be reopened with the new parameters, or connection is busy
+    ErrorPtr setLinkProfile(const BanditLinkProfile &aProfile);
+
+    /// @return currently active link profile
+    const BanditLinkProfile &getLinkProfile() { return linkProfile; };
+
+    /// find the link profile the controller is using, by listening to a transmission from the
+    /// controller with each of the predefined profiles (fastest first) and checking which one
+    /// delivers valid BANDIT data.
+    /// @param aProbeCB called with the detected profile (which is then active), or an error
+    /// @param aTimeout overall time to wait for the controller to transmit
+    /// @note the operator must start a program output on the controller while probing
+    void probe(BanditProbeCB aProbeCB, MLMicroSeconds aTimeout);
+
 
   protected:
 
@@ -95,10 +295,41 @@ namespace p44 {
 
     void receiveHandler(ErrorPtr aError);
     void end(ErrorPtr aError, string aData="");
+    void receiveEnd();
     void timeout();
     void handshakeChanged(bool aNewState);
+    void startHandshakeMonitor();
+    void stopHandshakeMonitor();
+    bool handshakeInput();
+    void setHandshakeOutput(bool aActive);
+    void hsLinkConnect();
+    void hsLinkStatus(ErrorPtr aError);
+    void hsLinkReceive(ErrorPtr aError);
+    void checkTxQueueReporting();
+    void handshakeEdge();
+    void handshakeSettled();
+    void pollModemLines();
+    #if defined(__linux__)
+    bool modemWaitEvent(int aFD, int aPollFlags);
+    bool installWaitSignalHandler();
+    void closeWaitPipe();
+    static void *modemWaitThread(void *aArg);
+    #endif
     void startReceive();
-    void dataSent(StatusCB aStatusCB);
+    MLMicroSeconds receiveTimeout();
+    void rxScanEnd(const string &aData);
+    size_t txQueueLimit();
+    void probeNext();
+    void probeEvaluate(bool aWindowEnded);
+    void transmitHandler(ErrorPtr aError);
+    void transmitNext();
+    ErrorPtr refillTxData();
+    void checkDrained();
+    size_t txQueueBytes();
+    void rxMetrics(size_t aBytes);
+    uint64_t txSentBytes();
+    uint64_t countSentLines(size_t aQueued);
+    void sendEnd(ErrorPtr aError);
 
   };
 
@@ -0,0 +1,381 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44bandit.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "banditcompress.hpp"
+
+using namespace p44;
+
+
+#define BLZ_MIN_MATCH 4 // shorter matches do not pay off against the token and offset bytes
+#define BLZ_MAX_OFFSET 0xFFFF
+#define BLZ_HASH_BITS 14
+#define BLZ_CHAIN_DEPTH 16 // max number of earlier occurrences checked for the longest match
+
+
+static inline uint32_t get32(const uint8_t *aP)
+{
+  return (uint32_t)aP[0] | ((uint32_t)aP[1]<<8) | ((uint32_t)aP[2]<<16) | ((uint32_t)aP[3]<<24);
+}
+
+
+static inline void append32(string &aOutput, uint32_t aValue)
+{
+  aOutput += (char)(aValue & 0xFF);
+  aOutput += (char)((aValue>>8) & 0xFF);
+  aOutput += (char)((aValue>>16) & 0xFF);
+  aOutput += (char)((aValue>>24) & 0xFF);
+}
+
+
+bool p44::isCompressedProgram(const char *aData, size_t aSize)
+{
+  return aData && aSize>=BLZ_MAGIC_SIZE && memcmp(aData, BLZ_MAGIC, BLZ_MAGIC_SIZE)==0;
+}
+
+
+bool p44::compressedProgramSize(const char *aData, size_t aSize, uint64_t &aLogicalSize)
+{
+  aLogicalSize = 0;
+  if (!isCompressedProgram(aData, aSize)) return false;
+  size_t pos = BLZ_MAGIC_SIZE;
+  while (pos+BLZ_BLOCK_HEADER_SIZE<=aSize) {
+    uint32_t rawLen = get32((const uint8_t *)aData+pos);
+    uint32_t storedLen = get32((const uint8_t *)aData+pos+4);
+    if (rawLen>BLZ_MAX_BLOCK_SIZE || storedLen>rawLen) return false; // corrupt
+    if (pos+BLZ_BLOCK_HEADER_SIZE+storedLen>aSize) return false; // incomplete block
+    aLogicalSize += rawLen;
+    pos += BLZ_BLOCK_HEADER_SIZE+storedLen;
+  }
+  return pos==aSize;
+}
+
+
+#pragma mark - ProgramCompressor
+
+ProgramCompressor::ProgramCompressor(size_t aBlockSize) :
+  blockSize(aBlockSize),
+  started(false),
+  inputBytes(0)
+{
+  if (blockSize>BLZ_MAX_BLOCK_SIZE || blockSize==0) blockSize = BLZ_MAX_BLOCK_SIZE;
+  hashTable = new uint32_t[1<<BLZ_HASH_BITS];
+  chainTable = new uint16_t[BLZ_MAX_BLOCK_SIZE];
+}
+
+
+ProgramCompressor::~ProgramCompressor()
+{
+  delete[] hashTable;
+  delete[] chainTable;
+}
+
+
+void ProgramCompressor::compress(const char *aData, size_t aNumBytes, string &aOutput)
+{
+  if (!started) {
+    aOutput.append(BLZ_MAGIC, BLZ_MAGIC_SIZE);
+    started = true;
+  }
+  inputBytes += aNumBytes;
+  if (!pending.empty()) {
+    // complete pending block first
+    size_t n = blockSize-pending.size();
+    if (n>aNumBytes) n = aNumBytes;
+    pending.append(aData, n);
+    aData += n;
+    aNumBytes -= n;
+    if (pending.size()<blockSize) return;
+    compressBlock((const uint8_t *)pending.c_str(), pending.size(), aOutput);
+    pending.clear();
+  }
+  // compress complete blocks directly from the input
+  while (aNumBytes>=blockSize) {
+    compressBlock((const uint8_t *)aData, blockSize, aOutput);
+    aData += blockSize;
+    aNumBytes -= blockSize;
+  }
+  pending.append(aData, aNumBytes);
+}
+
+
+void ProgramCompressor::finish(string &aOutput)
+{
+  if (!started) {
+    aOutput.append(BLZ_MAGIC, BLZ_MAGIC_SIZE);
+    started = true;
+  }
+  if (!pending.empty()) {
+    compressBlock((const uint8_t *)pending.c_str(), pending.size(), aOutput);
+    pending.clear();
+  }
+}
+
+
+/// append the extension bytes of a length that does not fit into its token nibble
+static inline void appendLength(string &aOutput, size_t aLength)
+{
+  while (aLength>=255) {
+    aOutput += (char)255;
+    aLength -= 255;
+  }
+  aOutput += (char)aLength;
+}
+
+
+/// append a token with its literals and (if aMatchLen>0) back reference
+static void appendSequence(string &aOutput, const uint8_t *aLiterals, size_t aNumLiterals, size_t aOffset, size_t aMatchLen)
+{
+  size_t ml = aMatchLen>0 ? aMatchLen-BLZ_MIN_MATCH : 0;
+  aOutput += (char)(((aNumLiterals<15 ? aNumLiterals : 15)<<4) | (ml<15 ? ml : 15));
+  if (aNumLiterals>=15) appendLength(aOutput, aNumLiterals-15);
+  aOutput.append((const char *)aLiterals, aNumLiterals);
+  if (aMatchLen>0) {
+    aOutput += (char)(aOffset & 0xFF);
+    aOutput += (char)((aOffset>>8) & 0xFF);
+    if (ml>=15) appendLength(aOutput, ml-15);
+  }
+}
+
+
+static inline uint32_t blzHash(uint32_t aValue)
+{
+  return (aValue*2654435761U)>>(32-BLZ_HASH_BITS);
+}
+
+
+void ProgramCompressor::compressBlock(const uint8_t *aData, size_t aSize, string &aOutput)
+{
+  // block header, stored size is filled in when known
+  size_t headerPos = aOutput.size();
+  append32(aOutput, (uint32_t)aSize);
+  append32(aOutput, 0);
+  size_t dataPos = aOutput.size();
+  // greedy LZ with hash chains: the hash table holds the last position+1 (0=none) where each hashed
+  // 4-byte sequence occurred, the chain table the distance from each position to the previous one with
+  // the same hash (0=none)
+  memset(hashTable, 0, sizeof(uint32_t)<<BLZ_HASH_BITS);
+  size_t anchor = 0; // start of literals not yet output
+  size_t i = 0;
+  while (i+BLZ_MIN_MATCH<=aSize) {
+    // find longest match among the most recent candidates
+    size_t bestLen = 0;
+    size_t bestPos = 0;
+    size_t cand = hashTable[blzHash(get32(aData+i))];
+    for (int depth=0; depth<BLZ_CHAIN_DEPTH && cand>0; depth++) {
+      cand--;
+      if (i-cand>BLZ_MAX_OFFSET) break;
+      if (aData[cand+bestLen]==aData[i+bestLen] && get32(aData+cand)==get32(aData+i)) {
+        size_t len = BLZ_MIN_MATCH;
+        while (i+len<aSize && aData[cand+len]==aData[i+len]) len++;
+        if (len>bestLen) {
+          bestLen = len;
+          bestPos = cand;
+          if (i+len>=aSize) break; // cannot get any longer
+        }
+      }
+      size_t d = chainTable[cand];
+      if (d==0) break;
+      cand = cand-d+1;
+    }
+    // insert current position (and, after a match, all positions within the match) into the chains
+    size_t end = bestLen>0 ? i+bestLen : i+1;
+    for (size_t k=i; k<end && k+BLZ_MIN_MATCH<=aSize; k++) {
+      uint32_t h = blzHash(get32(aData+k));
+      size_t prev = hashTable[h];
+      chainTable[k] = prev>0 && k-(prev-1)<=BLZ_MAX_OFFSET ? (uint16_t)(k-(prev-1)) : 0;
+      hashTable[h] = (uint32_t)k+1;
+    }
+    if (bestLen>0) {
+      appendSequence(aOutput, aData+anchor, i-anchor, i-bestPos, bestLen);
+      anchor = end;
+    }
+    i = end;
+  }
+  if (anchor<aSize) {
+    appendSequence(aOutput, aData+anchor, aSize-anchor, 0, 0);
+  }
+  size_t storedLen = aOutput.size()-dataPos;
+  if (storedLen>=aSize) {
+    // incompressible, store as-is
+    aOutput.resize(dataPos);
+    aOutput.append((const char *)aData, aSize);
+    storedLen = aSize;
+  }
+  string sz;
+  append32(sz, (uint32_t)storedLen);
+  aOutput.replace(headerPos+4, 4, sz);
+}
+
+
+#pragma mark - DecompressingDataSource
+
+DecompressingDataSource::DecompressingDataSource(BanditDataSourcePtr aSource, uint64_t aLogicalSize) :
+  source(aSource),
+  logicalSize(aLogicalSize),
+  started(false),
+  blockData(NULL),
+  blockSize(0),
+  blockPos(0)
+{
+}
+
+
+/// expand one LZ compressed block
+/// @return false if the data is corrupt
+static bool expandBlock(const uint8_t *aData, size_t aStoredLen, string &aOutput, size_t aRawLen)
+{
+  aOutput.resize(aRawLen);
+  if (aRawLen==0) return aStoredLen==0;
+  uint8_t *op = (uint8_t *)&aOutput[0];
+  uint8_t *oend = op+aRawLen;
+  const uint8_t *ip = aData;
+  const uint8_t *iend = aData+aStoredLen;
+  while (op<oend) {
+    if (ip>=iend) return false;
+    uint8_t token = *ip++;
+    // literals
+    size_t n = token>>4;
+    if (n==15) {
+      uint8_t b;
+      do {
+        if (ip>=iend) return false;
+        b = *ip++;
+        n += b;
+      } while (b==255);
+    }
+    if (n>(size_t)(iend-ip) || n>(size_t)(oend-op)) return false;
+    memcpy(op, ip, n);
+    op += n;
+    ip += n;
+    if (op>=oend) break; // last token has no back reference
+    // back reference
+    if (iend-ip<2) return false;
+    size_t offset = ip[0] | (ip[1]<<8);
+    ip += 2;
+    n = token & 0x0F;
+    if (n==15) {
+      uint8_t b;
+      do {
+        if (ip>=iend) return false;
+        b = *ip++;
+        n += b;
+      } while (b==255);
+    }
+    n += BLZ_MIN_MATCH;
+    if (offset==0 || offset>(size_t)(op-(uint8_t *)&aOutput[0]) || n>(size_t)(oend-op)) return false;
+    const uint8_t *mp = op-offset;
+    if (offset>=n) {
+      memcpy(op, mp, n);
+      op += n;
+    }
+    else {
+      // overlapping (repeating) match
+      while (n-->0) *op++ = *mp++;
+    }
+  }
+  return ip==iend;
+}
+
+
+ErrorPtr DecompressingDataSource::readInput(size_t aNumBytes, const char *&aDataP, bool &aEof)
+{
+  ErrorPtr err;
+  aEof = false;
+  inBuf.clear();
+  if (aNumBytes==0) {
+    // empty block, nothing to read
+    aDataP = inBuf.c_str();
+    return ErrorPtr();
+  }
+  while (true) {
+    const char *p;
+    size_t n = source->nextChunk(p, aNumBytes-inBuf.size(), err);
+    if (!Error::isOK(err)) return err;
+    if (n==0) {
+      aEof = true;
+      if (inBuf.empty()) return ErrorPtr(); // clean end
+      return TextError::err("compressed program data is truncated");
+    }
+    if (n==aNumBytes && inBuf.empty()) {
+      // source delivered all we need in one piece, use it in place
+      aDataP = p;
+      return ErrorPtr();
+    }
+    inBuf.append(p, n);
+    if (inBuf.size()>=aNumBytes) break;
+  }
+  aDataP = inBuf.c_str();
+  return ErrorPtr();
+}
+
+
+ErrorPtr DecompressingDataSource::nextBlock(bool &aEof)
+{
+  const char *p;
+  ErrorPtr err;
+  blockData = NULL;
+  blockSize = 0;
+  blockPos = 0;
+  if (!started) {
+    err = readInput(BLZ_MAGIC_SIZE, p, aEof);
+    if (!Error::isOK(err)) return err;
+    if (aEof || !isCompressedProgram(p, BLZ_MAGIC_SIZE)) return TextError::err("not compressed program data");
+    started = true;
+  }
+  err = readInput(BLZ_BLOCK_HEADER_SIZE, p, aEof);
+  if (!Error::isOK(err) || aEof) return err;
+  uint32_t rawLen = get32((const uint8_t *)p);
+  uint32_t storedLen = get32((const uint8_t *)p+4);
+  if (rawLen>BLZ_MAX_BLOCK_SIZE || storedLen>rawLen) {
+    return TextError::err("corrupt compressed program data");
+  }
+  err = readInput(storedLen, p, aEof);
+  if (!Error::isOK(err)) return err;
+  if (aEof) return TextError::err("compressed program data is truncated");
+  if (storedLen==rawLen) {
+    // stored uncompressed
+    blockData = p;
+  }
+  else {
+    if (!expandBlock((const uint8_t *)p, storedLen, block, rawLen)) {
+      return TextError::err("corrupt compressed program data");
+    }
+    blockData = block.c_str();
+  }
+  blockSize = rawLen;
+  return ErrorPtr();
+}
+
+
+size_t DecompressingDataSource::nextChunk(const char *&aChunkP, size_t aMaxBytes, ErrorPtr &aError)
+{
+  while (blockPos>=blockSize) {
+    bool eof;
+    aError = nextBlock(eof);
+    if (!Error::isOK(aError) || eof) return 0;
+  }
+  size_t n = blockSize-blockPos;
+  if (n>aMaxBytes) n = aMaxBytes;
+  aChunkP = blockData+blockPos;
+  blockPos += n;
+  return n;
+}
@@ -0,0 +1,140 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44bandit.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef __p44bandit__banditcompress__
+#define __p44bandit__banditcompress__
+
+#include "p44utils_common.hpp"
+
+#include "banditdata.hpp"
+
+using namespace std;
+
+namespace p44 {
+
+
+  /// Compressed program storage format:
+  /// - 4 bytes magic "BLZ1"
+  /// - sequence of independently decodable blocks, each consisting of
+  ///   - 32 bit little endian number of bytes the block expands to (max BLZ_MAX_BLOCK_SIZE)
+  ///   - 32 bit little endian number of bytes stored for the block
+  ///   - the stored bytes, which are the uncompressed data when both sizes are equal,
+  ///     LZ compressed data otherwise
+  /// The LZ data is a sequence of tokens, each with a run of literal bytes followed by a back reference
+  /// (16 bit offset into the already decoded data of the same block, min length 4), similar to LZ4.
+  #define BLZ_MAGIC "BLZ1"
+  #define BLZ_MAGIC_SIZE 4
+  #define BLZ_BLOCK_HEADER_SIZE 8
+  #define BLZ_MAX_BLOCK_SIZE 65536
+
+
+  /// @param aData start of file data
+  /// @param aSize number of bytes available at aData
+  /// @return true if aData is in compressed program format
+  bool isCompressedProgram(const char *aData, size_t aSize);
+
+  /// determine the uncompressed size of compressed program data without decompressing it
+  /// @param aData start of compressed program data (including magic)
+  /// @param aSize size of the compressed data
+  /// @param aLogicalSize will be set to the number of bytes the complete blocks expand to
+  /// @return false if the data is not in compressed program format or ends with an incomplete block
+  bool compressedProgramSize(const char *aData, size_t aSize, uint64_t &aLogicalSize);
+
+
+  class ProgramCompressor;
+  typedef boost::intrusive_ptr<ProgramCompressor> ProgramCompressorPtr;
+
+  /// incremental compressor for program data.
+  /// Data can be fed in arbitrary chunks, output is produced in complete blocks.
+  class ProgramCompressor : public P44Obj
+  {
+    size_t blockSize;
+    string pending; ///< uncompressed data not yet forming a complete block
+    bool started; ///< set when magic has been output
+    uint64_t inputBytes;
+    uint32_t *hashTable; ///< last position of each hashed 4-byte sequence
+    uint16_t *chainTable; ///< distance to previous position with the same hash
+
+  public:
+
+    /// create compressor
+    /// @param aBlockSize size of the blocks (max BLZ_MAX_BLOCK_SIZE). Smaller blocks keep less
+    ///   data in memory before it is output, larger blocks compress better.
+    ProgramCompressor(size_t aBlockSize = BLZ_MAX_BLOCK_SIZE);
+    virtual ~ProgramCompressor();
+
+    /// compress a chunk of data
+    /// @param aData the data
+    /// @param aNumBytes number of bytes in aData
+    /// @param aOutput the compressed data of all blocks completed by this chunk is appended to this string
+    void compress(const char *aData, size_t aNumBytes, string &aOutput);
+
+    /// signal end of data
+    /// @param aOutput the last (possibly short) block is appended to this string
+    void finish(string &aOutput);
+
+    /// @return number of uncompressed bytes fed so far
+    uint64_t logicalSize() { return inputBytes; };
+
+  private:
+
+    void compressBlock(const uint8_t *aData, size_t aSize, string &aOutput);
+
+  };
+
+
+  /// data source expanding compressed program data delivered by another source, one block at a time.
+  /// Blocks stored uncompressed are passed through without copying when the source can deliver them in one piece.
+  class DecompressingDataSource : public BanditDataSource
+  {
+    typedef BanditDataSource inherited;
+
+    BanditDataSourcePtr source;
+    uint64_t logicalSize;
+    bool started; ///< set when magic has been checked
+    string inBuf; ///< collects input pieces when the source delivers them in smaller chunks
+    string block; ///< expanded data of current block
+    const char *blockData; ///< data of current block (in block or in source's chunk)
+    size_t blockSize;
+    size_t blockPos;
+
+  public:
+
+    /// create decompressing source
+    /// @param aSource the source delivering compressed program data (including magic)
+    /// @param aLogicalSize the expanded size, if known (for sizeHint())
+    DecompressingDataSource(BanditDataSourcePtr aSource, uint64_t aLogicalSize = 0);
+
+    virtual size_t nextChunk(const char *&aChunkP, size_t aMaxBytes, ErrorPtr &aError);
+    virtual size_t sizeHint() { return (size_t)logicalSize; };
+
+  private:
+
+    ErrorPtr readInput(size_t aNumBytes, const char *&aDataP, bool &aEof);
+    ErrorPtr nextBlock(bool &aEof);
+
+  };
+
+
+} // namespace p44
+
+#endif /* defined(__p44bandit__banditcompress__) */
@@ -0,0 +1,574 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44bandit.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "banditdata.hpp"
+#include "banditcompress.hpp"
+#include "metrics.hpp"
+
+#include <sys/stat.h> // for fstat
+#include <sys/mman.h>
+
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+  #define BANDIT_SIMD_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  #include <arm_neon.h>
+  #define BANDIT_SIMD_NEON 1
+#endif
+
+using namespace p44;
+
+
+#pragma mark - StringDataSource
+
+StringDataSource::StringDataSource(const string &aData) :
+  data(aData),
+  pos(0)
+{
+}
+
+
+size_t StringDataSource::nextChunk(const char *&aChunkP, size_t aMaxBytes, ErrorPtr &aError)
+{
+  size_t n = data.size()-pos;
+  if (n>aMaxBytes) n = aMaxBytes;
+  aChunkP = data.c_str()+pos;
+  pos += n;
+  return n;
+}
+
+
+#pragma mark - FileDataSource
+
+#define FILE_CHUNK_SIZE 4096
+
+FileDataSource::FileDataSource() :
+  fd(-1),
+  fileSize(0)
+{
+}
+
+
+FileDataSource::~FileDataSource()
+{
+  if (fd>=0) close(fd);
+}
+
+
+ErrorPtr FileDataSource::open(const string aFilePath)
+{
+  if (fd>=0) close(fd);
+  fd = ::open(aFilePath.c_str(), O_RDONLY);
+  if (fd<0) {
+    return SysError::errNo(string_format("cannot open '%s': ", aFilePath.c_str()).c_str());
+  }
+  struct stat fs;
+  fileSize = fstat(fd, &fs)==0 ? fs.st_size : 0;
+  return ErrorPtr();
+}
+
+
+size_t FileDataSource::nextChunk(const char *&aChunkP, size_t aMaxBytes, ErrorPtr &aError)
+{
+  if (fd<0) return 0;
+  if (aMaxBytes>FILE_CHUNK_SIZE) aMaxBytes = FILE_CHUNK_SIZE;
+  buffer.resize(aMaxBytes);
+  ssize_t n = read(fd, &buffer[0], aMaxBytes);
+  if (n<0) {
+    aError = SysError::errNo("error reading file: ");
+    n = 0;
+  }
+  if (n==0) {
+    // end of file (or error)
+    close(fd);
+    fd = -1;
+  }
+  aChunkP = buffer.c_str();
+  return n;
+}
+
+
+#pragma mark - MappedFileDataSource
+
+MappedFileDataSource::MappedFileDataSource() :
+  mapping(NULL),
+  mappedSize(0),
+  pos(0)
+{
+}
+
+
+MappedFileDataSource::~MappedFileDataSource()
+{
+  if (mapping) munmap((void *)mapping, mappedSize);
+}
+
+
+ErrorPtr MappedFileDataSource::open(const string aFilePath)
+{
+  if (mapping) munmap((void *)mapping, mappedSize);
+  mapping = NULL;
+  mappedSize = 0;
+  pos = 0;
+  int fd = ::open(aFilePath.c_str(), O_RDONLY);
+  if (fd<0) {
+    return SysError::errNo(string_format("cannot open '%s': ", aFilePath.c_str()).c_str());
+  }
+  ErrorPtr err;
+  struct stat fs;
+  if (fstat(fd, &fs)!=0) {
+    err = SysError::errNo("cannot stat file: ");
+  }
+  else if (fs.st_size>0) {
+    // Note: the mapping remains valid after closing the file
+    void *m = mmap(NULL, fs.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m==MAP_FAILED) {
+      err = SysError::errNo(string_format("cannot map '%s': ", aFilePath.c_str()).c_str());
+    }
+    else {
+      mapping = (const char *)m;
+      mappedSize = fs.st_size;
+      // data will be read once, front to back: ask for aggressive read-ahead
+      posix_madvise(m, mappedSize, POSIX_MADV_SEQUENTIAL);
+      posix_madvise(m, mappedSize, POSIX_MADV_WILLNEED);
+    }
+  }
+  close(fd);
+  return err;
+}
+
+
+size_t MappedFileDataSource::nextChunk(const char *&aChunkP, size_t aMaxBytes, ErrorPtr &aError)
+{
+  size_t n = mappedSize-pos;
+  if (n>aMaxBytes) n = aMaxBytes;
+  aChunkP = mapping+pos;
+  pos += n;
+  return n;
+}
+
+
+ErrorPtr p44::openProgramFile(const string aFilePath, BanditDataSourcePtr &aSource)
+{
+  MappedFileDataSource *mappedSource = new MappedFileDataSource;
+  BanditDataSourcePtr source = BanditDataSourcePtr(mappedSource);
+  ErrorPtr err = mappedSource->open(aFilePath);
+  if (!Error::isOK(err)) {
+    // cannot map (e.g. special file), read it chunk by chunk instead
+    FileDataSource *fileSource = new FileDataSource;
+    source = BanditDataSourcePtr(fileSource);
+    err = fileSource->open(aFilePath);
+  }
+  else if (isCompressedProgram(mappedSource->data(), mappedSource->sizeHint())) {
+    // stored compressed, expand block by block while reading
+    uint64_t logicalSize;
+    compressedProgramSize(mappedSource->data(), mappedSource->sizeHint(), logicalSize);
+    source = BanditDataSourcePtr(new DecompressingDataSource(source, logicalSize));
+  }
+  if (Error::isOK(err)) aSource = source;
+  return err;
+}
+
+
+#pragma mark - FramedDataSource
+
+FramedDataSource::FramedDataSource(BanditDataSourcePtr aSource) :
+  source(aSource),
+  framingState(framing_preamble),
+  framePos(0),
+  lastChar(0)
+{
+  frame = "\x11"; // always DC1/XON at beginning
+  frame.append(BANDIT_PREAMBLE_PADDING, 0); // null chars padding
+  frame += "\r"; // single CR in front of first line
+}
+
+
+size_t FramedDataSource::sizeHint()
+{
+  // Note: possibly missing final CR+LF not included
+  return 1+BANDIT_PREAMBLE_PADDING+1 + (source ? source->sizeHint() : 0) + 1+BANDIT_TRAILER_PADDING;
+}
+
+
+size_t FramedDataSource::nextChunk(const char *&aChunkP, size_t aMaxBytes, ErrorPtr &aError)
+{
+  while (true) {
+    switch (framingState) {
+      case framing_data: {
+        size_t n = source ? source->nextChunk(aChunkP, aMaxBytes, aError) : 0;
+        if (n>0) {
+          lastChar = aChunkP[n-1];
+          return n;
+        }
+        if (!Error::isOK(aError)) return 0;
+        // data exhausted, prepare trailer
+        framingState = framing_trailer;
+        frame.clear();
+        if (lastChar!='\n') {
+          frame += "\r\n"; // make sure data ends with CR LF
+        }
+        frame += "\x13"; // always DC3/XOFF character at the end of file
+        frame.append(BANDIT_TRAILER_PADDING, 0); // null chars padding
+        framePos = 0;
+        break;
+      }
+      case framing_preamble:
+      case framing_trailer: {
+        size_t n = frame.size()-framePos;
+        if (n>0) {
+          if (n>aMaxBytes) n = aMaxBytes;
+          aChunkP = frame.c_str()+framePos;
+          framePos += n;
+          return n;
+        }
+        if (framingState==framing_preamble) {
+          lastChar = frame[frame.size()-1];
+          framingState = framing_data;
+        }
+        else {
+          framingState = framing_done;
+        }
+        break;
+      }
+      case framing_done:
+      default:
+        return 0;
+    }
+  }
+}
+
+
+#pragma mark - BanditCleaner
+
+BanditCleaner::BanditCleaner(bool aForSend, bool aRawMode) :
+  forSend(aForSend),
+  rawMode(aRawMode)
+{
+  reset();
+}
+
+
+void BanditCleaner::reset()
+{
+  cleanState = clean_leading;
+  bol = true;
+  lastChar = 0;
+  lineNo = 0;
+}
+
+
+void BanditCleaner::appendLineNo(string &aOutput)
+{
+  string_format_append(aOutput, "N%d%c", lineNo, lineNo==1 ? '&' : ' ');
+}
+
+
+// MARK: - byte classification kernel
+
+enum {
+  cc_printable = 0x01, ///< 0x20..0x7E, passes the control char filter
+  cc_digit = 0x02, ///< 0..9
+  cc_blank = 0x04, ///< space or tab
+  cc_lineend = 0x08, ///< CR or LF
+  cc_lower = 0x20 ///< a..z, same value as the bit to clear for uppercase
+};
+
+static constexpr uint8_t charClassOf(int c)
+{
+  return (uint8_t)(
+    (c>=0x20 && c<=0x7E ? cc_printable : 0) |
+    (c>='0' && c<='9' ? cc_digit : 0) |
+    (c==' ' || c=='\t' ? cc_blank : 0) |
+    (c=='\n' || c=='\r' ? cc_lineend : 0) |
+    (c>='a' && c<='z' ? cc_lower : 0)
+  );
+}
+
+#define CC4(c) charClassOf(c), charClassOf(c+1), charClassOf(c+2), charClassOf(c+3)
+#define CC16(c) CC4(c), CC4(c+4), CC4(c+8), CC4(c+12)
+#define CC64(c) CC16(c), CC16(c+16), CC16(c+32), CC16(c+48)
+static constexpr uint8_t charClass[256] = { CC64(0x00), CC64(0x40), CC64(0x80), CC64(0xC0) };
+
+static inline bool ccIs(char aC, uint8_t aClass) { return (charClass[(uint8_t)aC] & aClass)!=0; }
+static inline char ccUpper(char aC) { return aC & ~(charClass[(uint8_t)aC] & cc_lower); }
+
+
+/// @return number of printable (0x20..0x7E) chars at the beginning of aData
+static size_t printableRun(const char *aData, size_t aNumBytes)
+{
+  size_t i = 0;
+  #if BANDIT_SIMD_SSE2
+  const __m128i lo = _mm_set1_epi8(0x1F);
+  const __m128i hi = _mm_set1_epi8(0x7F);
+  while (i+16<=aNumBytes) {
+    // Note: signed compare, bytes >=0x80 are negative and fail the lower bound
+    __m128i v = _mm_loadu_si128((const __m128i *)(aData+i));
+    __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+    unsigned mask = (unsigned)_mm_movemask_epi8(ok);
+    if (mask!=0xFFFF) return i+__builtin_ctz(~mask);
+    i += 16;
+  }
+  #elif BANDIT_SIMD_NEON
+  const uint8x16_t lo = vdupq_n_u8(0x20);
+  const uint8x16_t hi = vdupq_n_u8(0x7E);
+  while (i+16<=aNumBytes) {
+    uint8x16_t v = vld1q_u8((const uint8_t *)(aData+i));
+    uint8x16_t ok = vandq_u8(vcgeq_u8(v, lo), vcleq_u8(v, hi));
+    uint8x8_t m = vmin_u8(vget_low_u8(ok), vget_high_u8(ok));
+    m = vpmin_u8(m, m); m = vpmin_u8(m, m); m = vpmin_u8(m, m);
+    if (vget_lane_u8(m, 0)==0) break; // not all printable, scalar loop finds exact position
+    i += 16;
+  }
+  #endif
+  while (i<aNumBytes && ccIs(aData[i], cc_printable)) i++;
+  return i;
+}
+
+
+/// convert chars to uppercase in place
+static void upcaseInPlace(char *aData, size_t aNumBytes)
+{
+  size_t i = 0;
+  #if BANDIT_SIMD_SSE2
+  const __m128i a = _mm_set1_epi8('a'-1);
+  const __m128i z = _mm_set1_epi8('z'+1);
+  const __m128i caseBit = _mm_set1_epi8(0x20);
+  while (i+16<=aNumBytes) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(aData+i));
+    __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(v, a), _mm_cmplt_epi8(v, z));
+    _mm_storeu_si128((__m128i *)(aData+i), _mm_sub_epi8(v, _mm_and_si128(lower, caseBit)));
+    i += 16;
+  }
+  #elif BANDIT_SIMD_NEON
+  const uint8x16_t a = vdupq_n_u8('a');
+  const uint8x16_t z = vdupq_n_u8('z');
+  const uint8x16_t caseBit = vdupq_n_u8(0x20);
+  while (i+16<=aNumBytes) {
+    uint8x16_t v = vld1q_u8((const uint8_t *)(aData+i));
+    uint8x16_t lower = vandq_u8(vcgeq_u8(v, a), vcleq_u8(v, z));
+    vst1q_u8((uint8_t *)(aData+i), vsubq_u8(v, vandq_u8(lower, caseBit)));
+    i += 16;
+  }
+  #endif
+  for (; i<aNumBytes; i++) aData[i] = ccUpper(aData[i]);
+}
+
+
+/// @return number of chars before the first CR or LF in aData (aNumBytes if none)
+static size_t lineEndSearch(const char *aData, size_t aNumBytes)
+{
+  size_t i = 0;
+  #if BANDIT_SIMD_SSE2
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n');
+  while (i+16<=aNumBytes) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(aData+i));
+    unsigned mask = (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+    if (mask) return i+__builtin_ctz(mask);
+    i += 16;
+  }
+  #elif BANDIT_SIMD_NEON
+  const uint8x16_t cr = vdupq_n_u8('\r');
+  const uint8x16_t lf = vdupq_n_u8('\n');
+  while (i+16<=aNumBytes) {
+    uint8x16_t v = vld1q_u8((const uint8_t *)(aData+i));
+    uint8x16_t eol = vorrq_u8(vceqq_u8(v, cr), vceqq_u8(v, lf));
+    uint8x8_t m = vmax_u8(vget_low_u8(eol), vget_high_u8(eol));
+    m = vpmax_u8(m, m); m = vpmax_u8(m, m); m = vpmax_u8(m, m);
+    if (vget_lane_u8(m, 0)!=0) break; // line end in this block, scalar loop finds exact position
+    i += 16;
+  }
+  #endif
+  while (i<aNumBytes && !ccIs(aData[i], cc_lineend)) i++;
+  return i;
+}
+
+
+// MARK: - cleaning
+
+void BanditCleaner::clean(const char *aData, size_t aNumBytes, string &aOutput)
+{
+  static MetricCounter &cleanBytes = Metrics::shared().counter("bandit_clean_bytes_total", "bytes processed by the data cleaner");
+  static MetricCounter &cleanTime = Metrics::shared().counter("bandit_clean_microseconds_total", "time spent in the data cleaner");
+  if (rawMode) {
+    aOutput.append(aData, aNumBytes); // pass through
+    return;
+  }
+  MLMicroSeconds start = MainLoop::now();
+  if (forSend) {
+    cleanChunk<true>(aData, aNumBytes, aOutput);
+  }
+  else {
+    cleanChunk<false>(aData, aNumBytes, aOutput);
+  }
+  cleanTime.inc(MainLoop::now()-start);
+  cleanBytes.inc(aNumBytes);
+}
+
+
+template<bool FOR_SEND> void BanditCleaner::cleanChunk(const char *aData, size_t aNumBytes, string &aOutput)
+{
+  const char *p = aData;
+  const char *e = aData+aNumBytes;
+  while (p<e) {
+    // fast paths
+    if (cleanState==clean_normal && !bol) {
+      // within a line: runs of printable chars are just copied in uppercase
+      size_t n = printableRun(p, e-p);
+      if (n>0) {
+        size_t o = aOutput.size();
+        aOutput.append(p, n);
+        upcaseInPlace(&aOutput[o], n);
+        lastChar = p[n-1];
+        p += n;
+        if (p>=e) break;
+      }
+    }
+    else if (cleanState==clean_comment) {
+      // comment text is skipped up to the line end
+      p += lineEndSearch(p, e-p);
+      if (p>=e) break;
+    }
+    // char by char
+    char c = *p++;
+    switch (cleanState) {
+      case clean_leading:
+        // skip all leading control chars and spaces first
+        if (c<=0x20) continue;
+        cleanState = clean_normal;
+        break;
+      case clean_comment:
+        // skip comment text
+        if (ccIs(c, cc_lineend)) cleanState = clean_commentEol;
+        continue;
+      case clean_commentEol:
+        // skip line end, still BOL afterwards
+        if (ccIs(c, cc_lineend)) continue;
+        cleanState = clean_normal;
+        break;
+      case clean_lineNoDigits:
+        // skip existing line number
+        if (ccIs(c, cc_digit)) continue;
+        cleanState = clean_lineNoSeparator;
+        // fall through
+      case clean_lineNoSeparator:
+        // skip spaces and ampersand
+        if (ccIs(c, cc_blank) || c=='&') continue;
+        // (re-)generate line number, then output the first char after the old number as-is
+        cleanState = clean_normal;
+        appendLineNo(aOutput);
+        aOutput += ccUpper(c);
+        lastChar = c;
+        continue;
+      case clean_normal:
+        break;
+    }
+    // normal processing
+    // - filter comment lines
+    if (bol && c=='#') {
+      cleanState = clean_comment;
+      continue;
+    }
+    if (ccIs(c, cc_lineend)) {
+      // newline
+      if (lastChar=='\n') {
+        continue; // no duplicates
+      }
+      c = '\n';
+      if (FOR_SEND) aOutput += '\r'; // output with CR+LF
+      bol = true;
+    }
+    else if (!ccIs(c, cc_printable)) {
+      continue; // filter all control chars (DC1 0x11 at beginning, many nulls, DC4 0x13 at end)
+    }
+    else if (bol) {
+      bol = false;
+      lineNo++;
+      if (FOR_SEND) {
+        if (c=='N' || ccIs(c, cc_digit)) {
+          // skip existing line number (starting with N or not)
+          cleanState = clean_lineNoDigits;
+          continue;
+        }
+        // (re-)generate line number
+        appendLineNo(aOutput);
+      }
+    }
+    aOutput += ccUpper(c);
+    lastChar = c;
+  }
+}
+
+
+void BanditCleaner::finish(string &aOutput)
+{
+  if (cleanState==clean_lineNoDigits || cleanState==clean_lineNoSeparator) {
+    // data ended within existing line number: generate new one, followed by
+    // a NUL like cleaning all data at once always did (string terminator)
+    appendLineNo(aOutput);
+    aOutput += '\0';
+    lastChar = 0;
+  }
+  cleanState = clean_normal;
+}
+
+
+string p44::cleanBanditData(const string &aData, bool aForSend, bool aRawMode)
+{
+  if (aRawMode) return aData; // pass trough
+  string res;
+  BanditCleaner cleaner(aForSend, aRawMode);
+  cleaner.clean(aData.c_str(), aData.size(), res);
+  cleaner.finish(res);
+  return res;
+}
+
+
+#pragma mark - CleaningDataSource
+
+CleaningDataSource::CleaningDataSource(BanditDataSourcePtr aSource, BanditCleanerPtr aCleaner) :
+  source(aSource),
+  cleaner(aCleaner),
+  finished(false)
+{
+}
+
+
+size_t CleaningDataSource::nextChunk(const char *&aChunkP, size_t aMaxBytes, ErrorPtr &aError)
+{
+  buffer.clear();
+  // Note: cleaned data may be slightly larger than aMaxBytes due to generated line numbers
+  while (buffer.empty() && !finished) {
+    const char *raw;
+    size_t n = source ? source->nextChunk(raw, aMaxBytes, aError) : 0;
+    if (n==0) {
+      if (!Error::isOK(aError)) return 0;
+      cleaner->finish(buffer);
+      finished = true;
+    }
+    else {
+      cleaner->clean(raw, n, buffer);
+    }
+  }
+  aChunkP = buffer.c_str();
+  return buffer.size();
+}
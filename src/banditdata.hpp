@@ -0,0 +1,248 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44bandit.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44bandit__banditdata__
+#define __p44bandit__banditdata__
+
+#include "p44utils_common.hpp"
+
+using namespace std;
+
+namespace p44 {
+
+
+  /// BANDIT transmission framing
+  #define BANDIT_PREAMBLE_PADDING 100 // number of NUL chars after DC1 at beginning of transmission
+  #define BANDIT_TRAILER_PADDING 100 // number of NUL chars after DC3 at end of transmission
+
+
+  class BanditDataSource;
+  typedef boost::intrusive_ptr<BanditDataSource> BanditDataSourcePtr;
+
+  /// abstract source of program data, delivering data in chunks
+  class BanditDataSource : public P44Obj
+  {
+  public:
+
+    /// get next chunk of data
+    /// @param aChunkP will be set to point to the chunk's data, which remains valid until the next call
+    /// @param aMaxBytes max number of bytes to return
+    /// @param aError will be set when reading fails
+    /// @return number of bytes in chunk, 0 when no more data is available (or error)
+    virtual size_t nextChunk(const char *&aChunkP, size_t aMaxBytes, ErrorPtr &aError) = 0;
+
+    /// @return total number of bytes this source will deliver, if known, 0 otherwise
+    virtual size_t sizeHint() { return 0; };
+
+  };
+
+
+  /// data source delivering data from a string
+  class StringDataSource : public BanditDataSource
+  {
+    typedef BanditDataSource inherited;
+
+    string data;
+    size_t pos;
+
+  public:
+
+    StringDataSource(const string &aData);
+
+    virtual size_t nextChunk(const char *&aChunkP, size_t aMaxBytes, ErrorPtr &aError);
+    virtual size_t sizeHint() { return data.size(); };
+
+  };
+
+
+  /// data source reading a file from disk, without keeping more than one chunk in memory
+  class FileDataSource : public BanditDataSource
+  {
+    typedef BanditDataSource inherited;
+
+    int fd;
+    size_t fileSize;
+    string buffer;
+
+  public:
+
+    FileDataSource();
+    virtual ~FileDataSource();
+
+    /// open the file
+    /// @param aFilePath path of the file to read
+    ErrorPtr open(const string aFilePath);
+
+    virtual size_t nextChunk(const char *&aChunkP, size_t aMaxBytes, ErrorPtr &aError);
+    virtual size_t sizeHint() { return fileSize; };
+
+  };
+
+
+  /// data source delivering a file through a read-only memory mapping, without copying it
+  class MappedFileDataSource : public BanditDataSource
+  {
+    typedef BanditDataSource inherited;
+
+    const char *mapping;
+    size_t mappedSize;
+    size_t pos;
+
+  public:
+
+    MappedFileDataSource();
+    virtual ~MappedFileDataSource();
+
+    /// map the file
+    /// @param aFilePath path of the file to map
+    ErrorPtr open(const string aFilePath);
+
+    /// @return pointer to the entire file's data (NULL for empty files)
+    const char *data() { return mapping; };
+
+    virtual size_t nextChunk(const char *&aChunkP, size_t aMaxBytes, ErrorPtr &aError);
+    virtual size_t sizeHint() { return mappedSize; };
+
+  };
+
+
+  /// open a program file as a data source (memory mapped if possible)
+  /// @param aFilePath path of the file
+  /// @param aSource will be set to the data source delivering the file's contents
+  ///   (expanded, if the file is stored in compressed program format)
+  /// @return error if file cannot be opened
+  ErrorPtr openProgramFile(const string aFilePath, BanditDataSourcePtr &aSource);
+
+
+  /// data source wrapping another source with the BANDIT transmission framing:
+  /// DC1/XON + NUL padding + CR before the data, CR+LF after the data if it does not end with one,
+  /// DC3/XOFF + NUL padding at the end
+  class FramedDataSource : public BanditDataSource
+  {
+    typedef BanditDataSource inherited;
+
+    BanditDataSourcePtr source;
+    enum {
+      framing_preamble,
+      framing_data,
+      framing_trailer,
+      framing_done
+    } framingState;
+    string frame;
+    size_t framePos;
+    char lastChar;
+
+  public:
+
+    FramedDataSource(BanditDataSourcePtr aSource);
+
+    virtual size_t nextChunk(const char *&aChunkP, size_t aMaxBytes, ErrorPtr &aError);
+    virtual size_t sizeHint();
+
+  };
+
+
+  class BanditCleaner;
+  typedef boost::intrusive_ptr<BanditCleaner> BanditCleanerPtr;
+
+  /// incremental cleaner for BANDIT program data.
+  /// Strips comment lines, control chars and duplicate line ends, converts to uppercase and
+  /// (for sending) regenerates line numbers (with & on line 1) and uses CR+LF line ends.
+  /// Data can be fed in arbitrary chunks, result is identical to cleaning all data at once.
+  class BanditCleaner : public P44Obj
+  {
+    bool forSend;
+    bool rawMode;
+
+    enum {
+      clean_leading, ///< skipping leading control chars and spaces
+      clean_normal, ///< normal processing
+      clean_comment, ///< skipping comment text
+      clean_commentEol, ///< skipping line end(s) after comment
+      clean_lineNoDigits, ///< skipping digits of existing line number
+      clean_lineNoSeparator ///< skipping blanks and ampersand after existing line number
+    } cleanState;
+    bool bol;
+    char lastChar;
+    int lineNo;
+
+  public:
+
+    /// create cleaner
+    /// @param aForSend if set, line numbers are regenerated and line ends are CR+LF
+    /// @param aRawMode if set, data is passed through unmodified
+    BanditCleaner(bool aForSend, bool aRawMode);
+
+    /// reset to start cleaning new data
+    void reset();
+
+    /// clean a chunk of data
+    /// @param aData the data
+    /// @param aNumBytes number of bytes in aData
+    /// @param aOutput the cleaned data is appended to this string
+    void clean(const char *aData, size_t aNumBytes, string &aOutput);
+
+    /// signal end of data
+    /// @param aOutput possibly pending cleaned data is appended to this string
+    void finish(string &aOutput);
+
+    /// @return number of lines cleaned so far
+    int lines() { return lineNo; };
+
+  private:
+
+    void appendLineNo(string &aOutput);
+    template<bool FOR_SEND> void cleanChunk(const char *aData, size_t aNumBytes, string &aOutput);
+
+  };
+
+
+  /// clean complete BANDIT program data at once
+  /// @param aData data to clean
+  /// @param aForSend if set, line numbers are regenerated and line ends are CR+LF
+  /// @param aRawMode if set, data is returned unmodified
+  /// @return cleaned data
+  string cleanBanditData(const string &aData, bool aForSend, bool aRawMode);
+
+
+  /// data source cleaning the data of another source on the fly
+  class CleaningDataSource : public BanditDataSource
+  {
+    typedef BanditDataSource inherited;
+
+    BanditDataSourcePtr source;
+    BanditCleanerPtr cleaner;
+    string buffer;
+    bool finished;
+
+  public:
+
+    CleaningDataSource(BanditDataSourcePtr aSource, BanditCleanerPtr aCleaner);
+
+    virtual size_t nextChunk(const char *&aChunkP, size_t aMaxBytes, ErrorPtr &aError);
+    virtual size_t sizeHint() { return source ? source->sizeHint() : 0; };
+
+  };
+
+
+} // namespace p44
+
+#endif /* defined(__p44bandit__banditdata__) */
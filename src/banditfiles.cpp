@@ -0,0 +1,401 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44bandit.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "banditfiles.hpp"
+
+#include "banditdata.hpp"
+#include "banditcompress.hpp"
+#include "fnv.hpp"
+
+#include <dirent.h>
+#include <sys/stat.h> // for fstat
+#include <sys/mman.h>
+#if defined(__linux__)
+  #include <sys/sendfile.h>
+  #include <sys/syscall.h>
+#endif
+
+using namespace p44;
+
+
+#define INGEST_FALLBACK_BUF_SIZE 16384 // buffer for copying when neither kernel copy nor mapping is available
+
+string p44::tempPathFor(const string aDestPath)
+{
+  size_t p = aDestPath.rfind('/');
+  if (p==string::npos) return "." + aDestPath + ".part";
+  return aDestPath.substr(0, p+1) + "." + aDestPath.substr(p+1) + ".part";
+}
+
+
+/// write all of aNumBytes to aFd, retrying short writes
+static bool writeAll(int aFd, const char *aData, size_t aNumBytes)
+{
+  while (aNumBytes>0) {
+    ssize_t n = write(aFd, aData, aNumBytes);
+    if (n<0) {
+      if (errno==EINTR) continue;
+      return false;
+    }
+    aData += n;
+    aNumBytes -= n;
+  }
+  return true;
+}
+
+
+/// copy aNumBytes from aSrcFd to aDestFd in the kernel
+/// @return true if completely copied, false if kernel copy is not possible (nothing copied then) or failed (errno set,
+///   EIO if the source ended early)
+static bool kernelCopy(int aSrcFd, int aDestFd, size_t aNumBytes, bool &aTried)
+{
+  aTried = false;
+  #if defined(__linux__)
+  size_t copied = 0;
+  #ifdef SYS_copy_file_range
+  // copy_file_range: in-kernel copy, possibly even reflink/server side on suitable filesystems
+  while (copied<aNumBytes) {
+    ssize_t n = syscall(SYS_copy_file_range, aSrcFd, NULL, aDestFd, NULL, aNumBytes-copied, 0);
+    if (n<0 && errno==EINTR) continue;
+    if (n==0) errno = EIO; // source shorter than expected, errno would be stale
+    if (n<=0) break;
+    copied += n;
+    aTried = true;
+  }
+  if (copied>=aNumBytes) return true;
+  if (aTried) return false; // failed midway
+  #endif
+  // sendfile: in-kernel copy from page cache
+  while (copied<aNumBytes) {
+    ssize_t n = sendfile(aDestFd, aSrcFd, NULL, aNumBytes-copied);
+    if (n<0 && errno==EINTR) continue;
+    if (n==0) errno = EIO; // source shorter than expected, errno would be stale
+    if (n<=0) break;
+    copied += n;
+    aTried = true;
+  }
+  if (copied>=aNumBytes) return true;
+  #endif
+  return false;
+}
+
+
+ErrorPtr p44::fileContentHash(const string aFilePath, uint64_t &aContentHash)
+{
+  MappedFileDataSource *mappedSource = new MappedFileDataSource;
+  BanditDataSourcePtr src = BanditDataSourcePtr(mappedSource);
+  ErrorPtr err = mappedSource->open(aFilePath);
+  if (Error::isOK(err)) {
+    Fnv64 hash;
+    if (isCompressedProgram(mappedSource->data(), mappedSource->sizeHint())) {
+      // hash the expanded content, so the hash does not depend on how the file is stored
+      DecompressingDataSource expanded(src);
+      const char *chunk;
+      size_t n;
+      while ((n = expanded.nextChunk(chunk, BLZ_MAX_BLOCK_SIZE, err))>0) {
+        hash.addBytes(n, (const uint8_t *)chunk);
+      }
+      if (!Error::isOK(err)) return err;
+    }
+    else {
+      hash.addBytes(mappedSource->sizeHint(), (const uint8_t *)mappedSource->data());
+    }
+    aContentHash = hash.getHash();
+  }
+  return err;
+}
+
+
+ErrorPtr p44::compressFile(const string aSourcePath, const string aDestPath, uint64_t *aContentHashP)
+{
+  MappedFileDataSource src;
+  ErrorPtr err = src.open(aSourcePath);
+  if (!Error::isOK(err)) return err;
+  if (isCompressedProgram(src.data(), src.sizeHint())) {
+    // already compressed, just copy
+    return ingestFile(aSourcePath, aDestPath, aContentHashP, false);
+  }
+  string tempPath = tempPathFor(aDestPath);
+  int destfd = open(tempPath.c_str(), O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+  if (destfd<0) {
+    return SysError::errNo(string_format("compressFile: cannot open output file '%s': ", tempPath.c_str()).c_str());
+  }
+  // compress from the mapping, one block at a time
+  Fnv64 hash;
+  ProgramCompressor compressor;
+  string out;
+  const char *chunk;
+  size_t n;
+  bool ok = true;
+  while (ok && (n = src.nextChunk(chunk, BLZ_MAX_BLOCK_SIZE, err))>0) {
+    hash.addBytes(n, (const uint8_t *)chunk);
+    out.clear();
+    compressor.compress(chunk, n, out);
+    ok = writeAll(destfd, out.c_str(), out.size());
+  }
+  if (ok) {
+    out.clear();
+    compressor.finish(out);
+    ok = writeAll(destfd, out.c_str(), out.size());
+  }
+  if (!ok) {
+    err = SysError::errNo("compressFile: error writing data: ");
+  }
+  else if (fsync(destfd)!=0) {
+    err = SysError::errNo("compressFile: error flushing data: ");
+  }
+  if (close(destfd)!=0 && Error::isOK(err)) {
+    err = SysError::errNo("compressFile: error closing output file: ");
+  }
+  if (Error::isOK(err) && rename(tempPath.c_str(), aDestPath.c_str())!=0) {
+    err = SysError::errNo("compressFile: cannot rename temporary file into place: ");
+  }
+  if (!Error::isOK(err)) {
+    unlink(tempPath.c_str());
+  }
+  else if (aContentHashP) {
+    *aContentHashP = hash.getHash();
+  }
+  return err;
+}
+
+
+ErrorPtr p44::ingestFile(const string aSourcePath, const string aDestPath, uint64_t *aContentHashP, bool aMoveAllowed)
+{
+  if (aMoveAllowed && rename(aSourcePath.c_str(), aDestPath.c_str())==0) {
+    // moved into place (same file system), no data copied at all
+    if (aContentHashP) return fileContentHash(aDestPath, *aContentHashP);
+    return ErrorPtr();
+  }
+  // must copy
+  int srcfd = open(aSourcePath.c_str(), O_RDONLY);
+  if (srcfd<0) {
+    return SysError::errNo(string_format("ingestFile: cannot open input file '%s': ", aSourcePath.c_str()).c_str());
+  }
+  struct stat fs;
+  if (fstat(srcfd, &fs)!=0) {
+    close(srcfd);
+    return SysError::errNo("ingestFile: cannot stat input file: ");
+  }
+  size_t size = fs.st_size;
+  string tempPath = tempPathFor(aDestPath);
+  int destfd = open(tempPath.c_str(), O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+  if (destfd<0) {
+    close(srcfd);
+    return SysError::errNo(string_format("ingestFile: cannot open output file '%s': ", tempPath.c_str()).c_str());
+  }
+  // map source for hashing (and copying, if kernel copy is not available)
+  const char *mapping = NULL;
+  if (size>0) {
+    void *m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, srcfd, 0);
+    if (m!=MAP_FAILED) {
+      mapping = (const char *)m;
+      posix_madvise(m, size, POSIX_MADV_SEQUENTIAL);
+    }
+  }
+  Fnv64 hash;
+  bool ok = true;
+  bool tried;
+  if (size==0) {
+    // nothing to copy
+  }
+  else if (kernelCopy(srcfd, destfd, size, tried)) {
+    // copied in kernel, hash from mapping in a second pass (reading the pages the copy just brought into cache)
+    if (mapping) hash.addBytes(size, (const uint8_t *)mapping);
+    else if (aContentHashP) {
+      close(srcfd);
+      close(destfd);
+      unlink(tempPath.c_str());
+      return TextError::err("ingestFile: cannot map input file for hashing");
+    }
+  }
+  else if (tried) {
+    ok = false; // kernel copy failed midway
+  }
+  else if (mapping) {
+    // write directly from mapping, hash in the same pass
+    hash.addBytes(size, (const uint8_t *)mapping);
+    ok = writeAll(destfd, mapping, size);
+  }
+  else {
+    // plain read/write
+    char buffer[INGEST_FALLBACK_BUF_SIZE];
+    ssize_t n;
+    while ((n = read(srcfd, buffer, sizeof(buffer)))>0) {
+      hash.addBytes(n, (const uint8_t *)buffer);
+      if (!writeAll(destfd, buffer, n)) break;
+    }
+    ok = n==0;
+  }
+  // the content hash is defined on the expanded content of compressed files
+  bool compressed = isCompressedProgram(mapping, size);
+  ErrorPtr err;
+  if (!ok) {
+    err = SysError::errNo("ingestFile: error copying data: ");
+  }
+  else if (fsync(destfd)!=0) {
+    err = SysError::errNo("ingestFile: error flushing data: ");
+  }
+  if (mapping) munmap((void *)mapping, size);
+  close(srcfd);
+  if (close(destfd)!=0 && Error::isOK(err)) {
+    err = SysError::errNo("ingestFile: error closing output file: ");
+  }
+  if (Error::isOK(err)) {
+    // atomically replace destination
+    if (rename(tempPath.c_str(), aDestPath.c_str())!=0) {
+      err = SysError::errNo("ingestFile: cannot rename temporary file into place: ");
+    }
+  }
+  if (!Error::isOK(err)) {
+    unlink(tempPath.c_str());
+  }
+  else if (aContentHashP) {
+    if (compressed) return fileContentHash(aDestPath, *aContentHashP);
+    *aContentHashP = hash.getHash();
+  }
+  return err;
+}
+
+
+// MARK: - AtomicFileWriter
+
+#define WRITER_SYNC_BYTES 4096 // flush to storage after this many bytes...
+#define WRITER_SYNC_INTERVAL (5*Second) // ...or after this time, whichever comes first
+
+AtomicFileWriter::AtomicFileWriter() :
+  fd(-1),
+  bytesWritten(0),
+  unsyncedBytes(0),
+  lastSync(Never)
+{
+}
+
+
+AtomicFileWriter::~AtomicFileWriter()
+{
+  discard();
+}
+
+
+ErrorPtr AtomicFileWriter::open(const string aTempPath)
+{
+  discard();
+  tempPath = aTempPath;
+  bytesWritten = 0;
+  unsyncedBytes = 0;
+  lastSync = MainLoop::now();
+  writeError.reset();
+  fd = ::open(tempPath.c_str(), O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+  if (fd<0) {
+    writeError = SysError::errNo(string_format("cannot open '%s' for writing: ", tempPath.c_str()).c_str());
+  }
+  return writeError;
+}
+
+
+ErrorPtr AtomicFileWriter::write(const char *aData, size_t aNumBytes)
+{
+  if (!Error::isOK(writeError)) return writeError;
+  if (fd<0) return TextError::err("file not open for writing");
+  if (!writeAll(fd, aData, aNumBytes)) {
+    // Note: a partially written chunk is cut off, so the file ends exactly with the last complete chunk
+    writeError = SysError::errNo("error writing file: ");
+    if (ftruncate(fd, bytesWritten)!=0) {
+      LOG(LOG_WARNING, "cannot cut off partially written data in '%s'", tempPath.c_str());
+    }
+    return writeError;
+  }
+  bytesWritten += aNumBytes;
+  unsyncedBytes += aNumBytes;
+  MLMicroSeconds now = MainLoop::now();
+  if (unsyncedBytes>=WRITER_SYNC_BYTES || now>=lastSync+WRITER_SYNC_INTERVAL) {
+    #if defined(__APPLE__)
+    fsync(fd);
+    #else
+    fdatasync(fd);
+    #endif
+    unsyncedBytes = 0;
+    lastSync = now;
+  }
+  return ErrorPtr();
+}
+
+
+ErrorPtr AtomicFileWriter::commit(const string aFinalPath)
+{
+  if (fd<0) return TextError::err("file not open for writing");
+  ErrorPtr err;
+  if (fsync(fd)!=0) {
+    err = SysError::errNo("error flushing file: ");
+  }
+  if (close(fd)!=0 && Error::isOK(err)) {
+    err = SysError::errNo("error closing file: ");
+  }
+  fd = -1;
+  if (Error::isOK(err) && rename(tempPath.c_str(), aFinalPath.c_str())!=0) {
+    err = SysError::errNo(string_format("cannot rename file to '%s': ", aFinalPath.c_str()).c_str());
+  }
+  if (!Error::isOK(err)) {
+    unlink(tempPath.c_str());
+  }
+  tempPath.clear();
+  return err;
+}
+
+
+void AtomicFileWriter::discard()
+{
+  if (fd>=0) {
+    close(fd);
+    fd = -1;
+    unlink(tempPath.c_str());
+  }
+  tempPath.clear();
+}
+
+
+// MARK: - listing
+
+JsonObjectPtr p44::listFiles(const string aDirPath, const string aSelectedFile, bool &aFoundSelected, ErrorPtr &aError)
+{
+  aFoundSelected = false;
+  DIR *dirP = opendir(aDirPath.c_str());
+  struct dirent *direntP;
+  if (dirP==NULL) {
+    aError = SysError::errNo("Cannot read data directory: ");
+    return JsonObjectPtr();
+  }
+  JsonObjectPtr files = JsonObject::newArray();
+  while ((direntP = readdir(dirP))!=NULL) {
+    string fn = direntP->d_name;
+    if (fn.empty() || fn[0]=='.') continue; // ., .. and hidden (temporary) files
+    JsonObjectPtr file = JsonObject::newObj();
+    file->add("name", JsonObject::newString(fn));
+    file->add("ino", JsonObject::newInt64(direntP->d_ino));
+    file->add("type", JsonObject::newInt64(direntP->d_type));
+    if (fn==aSelectedFile) aFoundSelected = true;
+    file->add("selected", JsonObject::newBool(fn==aSelectedFile));
+    files->arrayAppend(file);
+  }
+  closedir (dirP);
+  return files;
+}
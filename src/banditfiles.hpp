@@ -0,0 +1,123 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44bandit.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44bandit__banditfiles__
+#define __p44bandit__banditfiles__
+
+#include "p44utils_common.hpp"
+
+#include "jsonobject.hpp"
+
+using namespace std;
+
+namespace p44 {
+
+
+  /// ingest a file into a directory, atomically and without copying data through user space where possible.
+  /// The data is first written to a temporary file (a hidden .part file next to the destination), which is
+  /// then renamed to the destination path, so the destination either does not exist or is complete.
+  /// @param aSourcePath file to ingest
+  /// @param aDestPath path of the ingested file (will be replaced if it exists)
+  /// @param aContentHashP if not NULL, will be set to the FNV64 hash of the file's contents. When the data is copied
+  ///   through user space, hashing happens in the same pass, after an in-kernel copy or a move it takes a separate
+  ///   pass over the (then usually cached) data.
+  /// @param aMoveAllowed if set, the source file is moved (renamed) into place if possible, rather than copied
+  /// @return error, if any
+  ErrorPtr ingestFile(const string aSourcePath, const string aDestPath, uint64_t *aContentHashP, bool aMoveAllowed);
+
+  /// store a file in compressed program format, atomically like ingestFile().
+  /// Files already in compressed program format are copied as-is.
+  /// @param aSourcePath file to compress
+  /// @param aDestPath path of the compressed file (will be replaced if it exists)
+  /// @param aContentHashP if not NULL, will be set to the FNV64 hash of the uncompressed contents
+  /// @return error, if any
+  ErrorPtr compressFile(const string aSourcePath, const string aDestPath, uint64_t *aContentHashP);
+
+  /// calculate the content hash of a file
+  /// @param aFilePath the file
+  /// @param aContentHash will be set to the FNV64 hash of the file's contents
+  ///   (of the expanded contents for files stored in compressed program format)
+  /// @return error, if any
+  ErrorPtr fileContentHash(const string aFilePath, uint64_t &aContentHash);
+
+  /// @return path of the temporary file used while writing aDestPath
+  string tempPathFor(const string aDestPath);
+
+  class AtomicFileWriter;
+  typedef boost::intrusive_ptr<AtomicFileWriter> AtomicFileWriterPtr;
+
+  /// writes a file incrementally into a temporary file, which is renamed to its final name when complete.
+  /// Data is flushed to storage in batches, so after a crash or power loss, the temporary file contains
+  /// most of the data written so far.
+  class AtomicFileWriter : public P44Obj
+  {
+    int fd;
+    string tempPath;
+    size_t bytesWritten;
+    size_t unsyncedBytes;
+    MLMicroSeconds lastSync;
+    ErrorPtr writeError; ///< first error opening or writing, further writes are skipped once set
+
+  public:
+
+    AtomicFileWriter();
+    virtual ~AtomicFileWriter();
+
+    /// start writing
+    /// @param aTempPath path of the temporary file to write to
+    ErrorPtr open(const string aTempPath);
+
+    /// write data
+    /// @param aData data to write
+    /// @param aNumBytes number of bytes
+    /// @return error, if any. Once an error has occurred, nothing more is written and the same error is returned,
+    ///   so the file contains exactly the data written before the error.
+    ErrorPtr write(const char *aData, size_t aNumBytes);
+
+    /// @return the error that stopped writing, if any
+    ErrorPtr error() { return writeError; };
+
+    /// finish writing, and rename the file to its final name
+    /// @param aFinalPath final path of the file
+    /// @note also commits after a write error (with the data written before the error), check error() to know
+    ErrorPtr commit(const string aFinalPath);
+
+    /// stop writing and delete the temporary file
+    void discard();
+
+    /// @return number of bytes written so far
+    size_t size() { return bytesWritten; };
+
+  };
+
+
+  /// list the files in a directory
+  /// @param aDirPath directory to list
+  /// @param aSelectedFile name of the selected file, to be marked in the list
+  /// @param aFoundSelected will be set if aSelectedFile was found in the directory
+  /// @param aError will be set if listing the directory fails
+  /// @return JSON array of file objects (name, ino, type, selected)
+  JsonObjectPtr listFiles(const string aDirPath, const string aSelectedFile, bool &aFoundSelected, ErrorPtr &aError);
+
+
+} // namespace p44
+
+#endif /* defined(__p44bandit__banditfiles__) */
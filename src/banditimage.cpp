@@ -0,0 +1,193 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44bandit.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "banditimage.hpp"
+
+using namespace p44;
+
+
+#pragma mark - ImageDataSource
+
+ImageDataSource::ImageDataSource(TransmissionImagePtr aImage) :
+  image(aImage),
+  pos(0)
+{
+}
+
+
+size_t ImageDataSource::nextChunk(const char *&aChunkP, size_t aMaxBytes, ErrorPtr &aError)
+{
+  size_t n = image->data.size()-pos;
+  if (n>aMaxBytes) n = aMaxBytes;
+  aChunkP = image->data.c_str()+pos;
+  pos += n;
+  return n;
+}
+
+
+#pragma mark - TransmissionImageBuilder
+
+#define BUILD_SLICE_SIZE (64*1024) // bytes to build per mainloop cycle
+
+TransmissionImageBuilder::TransmissionImageBuilder(BanditDataSourcePtr aSource, uint64_t aContentHash) :
+  source(aSource),
+  image(new TransmissionImage),
+  maxBytes(0),
+  cancelled(false)
+{
+  image->contentHash = aContentHash;
+}
+
+
+TransmissionImageBuilder::~TransmissionImageBuilder()
+{
+  buildTicket.cancel();
+}
+
+
+void TransmissionImageBuilder::build(ImageBuiltCB aBuiltCB, WorkerPoolPtr aWorkers, size_t aMaxBytes)
+{
+  builtCB = aBuiltCB;
+  maxBytes = aMaxBytes;
+  size_t sz = source->sizeHint();
+  if (maxBytes>0 && sz>maxBytes) {
+    // known to be too large, don't even start
+    buildTicket.executeOnce(boost::bind(&TransmissionImageBuilder::buildDone, TransmissionImageBuilderPtr(this), TextError::err("image too large")));
+    return;
+  }
+  image->data.reserve(sz);
+  if (aWorkers) {
+    // completion keeps us alive while the worker uses source and image
+    aWorkers->submit(
+      boost::bind(&TransmissionImageBuilder::buildAll, this),
+      boost::bind(&TransmissionImageBuilder::buildDone, TransmissionImageBuilderPtr(this), _1)
+    );
+    return;
+  }
+  buildTicket.executeOnce(boost::bind(&TransmissionImageBuilder::buildSlice, this));
+}
+
+
+ErrorPtr TransmissionImageBuilder::buildAll()
+{
+  // in worker thread
+  ErrorPtr err;
+  const char *chunk;
+  size_t n;
+  while (!cancelled && (n = source->nextChunk(chunk, BUILD_SLICE_SIZE, err))>0) {
+    image->data.append(chunk, n);
+    if (maxBytes>0 && image->data.size()>maxBytes) {
+      err = TextError::err("image too large");
+      break;
+    }
+  }
+  source.reset();
+  return err;
+}
+
+
+void TransmissionImageBuilder::cancel()
+{
+  cancelled = true;
+  buildTicket.cancel();
+  builtCB = NULL;
+}
+
+
+void TransmissionImageBuilder::buildDone(ErrorPtr aError)
+{
+  ImageBuiltCB cb = builtCB;
+  builtCB = NULL;
+  if (cb && !cancelled) cb(Error::isOK(aError) ? image : TransmissionImagePtr(), aError);
+}
+
+
+void TransmissionImageBuilder::buildSlice()
+{
+  ErrorPtr err;
+  const char *chunk;
+  size_t built = 0;
+  while (built<BUILD_SLICE_SIZE) {
+    size_t n = source->nextChunk(chunk, BUILD_SLICE_SIZE-built, err);
+    if (n>0 && maxBytes>0 && image->data.size()+n>maxBytes) {
+      err = TextError::err("image too large");
+      n = 0;
+    }
+    if (n==0) {
+      // done or error
+      TransmissionImageBuilderPtr keepAlive(this); // callback might release us
+      source.reset();
+      ImageBuiltCB cb = builtCB;
+      builtCB = NULL;
+      if (cb) cb(Error::isOK(err) ? image : TransmissionImagePtr(), err);
+      return;
+    }
+    image->data.append(chunk, n);
+    built += n;
+  }
+  // more to do, let others run first
+  buildTicket.executeOnce(boost::bind(&TransmissionImageBuilder::buildSlice, this));
+}
+
+
+#pragma mark - TransmissionImageCache
+
+TransmissionImageCache::TransmissionImageCache(size_t aMaxBytes) :
+  maxBytes(aMaxBytes),
+  cachedBytes(0)
+{
+}
+
+
+TransmissionImagePtr TransmissionImageCache::get(uint64_t aContentHash)
+{
+  ImageMap::iterator pos = imageMap.find(aContentHash);
+  if (pos==imageMap.end()) return TransmissionImagePtr();
+  // mark most recently used
+  images.splice(images.begin(), images, pos->second);
+  return *(pos->second);
+}
+
+
+bool TransmissionImageCache::insert(TransmissionImagePtr aImage)
+{
+  remove(aImage->contentHash);
+  size_t sz = aImage->data.size();
+  if (sz>maxBytes) return false;
+  while (cachedBytes+sz>maxBytes && !images.empty()) {
+    remove(images.back()->contentHash);
+  }
+  images.push_front(aImage);
+  imageMap[aImage->contentHash] = images.begin();
+  cachedBytes += sz;
+  return true;
+}
+
+
+void TransmissionImageCache::remove(uint64_t aContentHash)
+{
+  ImageMap::iterator pos = imageMap.find(aContentHash);
+  if (pos==imageMap.end()) return;
+  cachedBytes -= (*(pos->second))->data.size();
+  images.erase(pos->second);
+  imageMap.erase(pos);
+}
@@ -0,0 +1,156 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44bandit.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef __p44bandit__banditimage__
+#define __p44bandit__banditimage__
+
+#include "p44utils_common.hpp"
+
+#include "banditdata.hpp"
+#include "workerpool.hpp"
+
+#include <list>
+#include <atomic>
+
+using namespace std;
+
+namespace p44 {
+
+
+  class TransmissionImage;
+  typedef boost::intrusive_ptr<TransmissionImage> TransmissionImagePtr;
+
+  /// complete, ready-to-send (cleaned and framed) transmission data of a program
+  class TransmissionImage : public P44Obj
+  {
+  public:
+    uint64_t contentHash; ///< FNV64 hash of the program file the image was built from
+    string data; ///< the bytes to transmit
+  };
+
+
+  /// data source delivering a transmission image, without copying it
+  class ImageDataSource : public BanditDataSource
+  {
+    typedef BanditDataSource inherited;
+
+    TransmissionImagePtr image;
+    size_t pos;
+
+  public:
+
+    ImageDataSource(TransmissionImagePtr aImage);
+
+    virtual size_t nextChunk(const char *&aChunkP, size_t aMaxBytes, ErrorPtr &aError);
+    virtual size_t sizeHint() { return image->data.size(); };
+
+  };
+
+
+  /// callback for completed transmission image
+  /// @param aImage the image, NULL in case of error
+  /// @param aError error, if any
+  typedef boost::function<void (TransmissionImagePtr aImage, ErrorPtr aError)> ImageBuiltCB;
+
+  class TransmissionImageBuilder;
+  typedef boost::intrusive_ptr<TransmissionImageBuilder> TransmissionImageBuilderPtr;
+
+  /// builds a transmission image in the background, in a worker thread or one slice per mainloop cycle
+  class TransmissionImageBuilder : public P44Obj
+  {
+    BanditDataSourcePtr source;
+    TransmissionImagePtr image;
+    ImageBuiltCB builtCB;
+    MLTicket buildTicket;
+    size_t maxBytes;
+    std::atomic<bool> cancelled;
+
+  public:
+
+    /// @param aSource the source delivering the cleaned and framed data
+    /// @param aContentHash hash of the program file's contents
+    TransmissionImageBuilder(BanditDataSourcePtr aSource, uint64_t aContentHash);
+    virtual ~TransmissionImageBuilder();
+
+    /// start building
+    /// @param aBuiltCB called when image is complete
+    /// @param aWorkers if set, the image is built in a worker thread of this pool, otherwise in slices on the mainloop
+    /// @param aMaxBytes if not 0, building stops with an error as soon as the image gets larger than this
+    void build(ImageBuiltCB aBuiltCB, WorkerPoolPtr aWorkers = WorkerPoolPtr(), size_t aMaxBytes = 0);
+
+    /// stop building as soon as possible, the callback will not be called any more
+    void cancel();
+
+    /// @return hash of the program file's contents the image is being built for
+    uint64_t contentHash() { return image->contentHash; };
+
+  private:
+
+    void buildSlice();
+    ErrorPtr buildAll();
+    void buildDone(ErrorPtr aError);
+
+  };
+
+
+  class TransmissionImageCache;
+  typedef boost::intrusive_ptr<TransmissionImageCache> TransmissionImageCachePtr;
+
+  /// cache of transmission images, keyed by content hash, limited in total size.
+  /// Least recently used images are evicted first.
+  class TransmissionImageCache : public P44Obj
+  {
+    typedef std::list<TransmissionImagePtr> ImageList;
+    ImageList images; ///< most recently used first
+    typedef std::map<uint64_t, ImageList::iterator> ImageMap;
+    ImageMap imageMap;
+    size_t maxBytes;
+    size_t cachedBytes;
+
+  public:
+
+    /// @param aMaxBytes max total size of cached images
+    TransmissionImageCache(size_t aMaxBytes);
+
+    /// @param aContentHash program content hash
+    /// @return image, NULL if not cached
+    TransmissionImagePtr get(uint64_t aContentHash);
+
+    /// add image to cache, evicting least recently used images if needed
+    /// @return false if image is too large to be cached at all
+    bool insert(TransmissionImagePtr aImage);
+
+    /// @return max size of a single image that can be cached (check before building one)
+    size_t maxImageSize() { return maxBytes; };
+
+    /// remove image (because the program it was built from no longer exists)
+    void remove(uint64_t aContentHash);
+
+    /// @return total size of images in cache
+    size_t size() { return cachedBytes; };
+
+  };
+
+
+} // namespace p44
+
+#endif /* defined(__p44bandit__banditimage__) */
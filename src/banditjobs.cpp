@@ -0,0 +1,367 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44bandit.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+
+#include "banditjobs.hpp"
+#include "banditfiles.hpp"
+
+#include <unistd.h>
+
+using namespace p44;
+
+
+#define MAX_JOB_HISTORY 20 // number of ended jobs to keep for reporting
+
+
+#pragma mark - SendOptions
+
+SendOptions::SendOptions() :
+  dnc(false),
+  compact(false),
+  arcfitTolerance(0)
+{
+}
+
+
+void SendOptions::setFromJson(JsonObjectPtr aData)
+{
+  JsonObjectPtr o;
+  if (aData->get("dnc", o)) dnc = o->boolValue();
+  if (aData->get("compact", o)) compact = o->boolValue();
+  if (aData->get("arcfit", o)) arcfitTolerance = o->doubleValue(); // tolerance in mm, 0 to disable
+  if (aData->get("profile", o)) linkProfile = o->stringValue();
+}
+
+
+JsonObjectPtr SendOptions::json() const
+{
+  JsonObjectPtr o = JsonObject::newObj();
+  o->add("dnc", JsonObject::newBool(dnc));
+  o->add("compact", JsonObject::newBool(compact));
+  o->add("arcfit", JsonObject::newDouble(arcfitTolerance));
+  if (!linkProfile.empty()) o->add("profile", JsonObject::newString(linkProfile));
+  return o;
+}
+
+
+#pragma mark - SendJob
+
+SendJob::SendJob() :
+  id(0),
+  priority(0),
+  status(job_pending),
+  queuedAt(0),
+  startedAt(0),
+  endedAt(0),
+  aborting(false)
+{
+}
+
+
+const char *SendJob::statusText()
+{
+  switch (status) {
+    case job_pending: return "pending";
+    case job_running: return "running";
+    case job_done: return "done";
+    case job_failed: return "failed";
+    case job_aborted: return "aborted";
+    case job_cancelled: return "cancelled";
+  }
+  return "unknown";
+}
+
+
+JsonObjectPtr SendJob::json()
+{
+  JsonObjectPtr j = JsonObject::newObj();
+  j->add("id", JsonObject::newInt64(id));
+  j->add("file", JsonObject::newString(fileName));
+  j->add("priority", JsonObject::newInt64(priority));
+  j->add("options", options.json());
+  j->add("status", JsonObject::newString(statusText()));
+  if (!error.empty()) j->add("error", JsonObject::newString(error));
+  j->add("queuedAt", JsonObject::newInt64(queuedAt));
+  if (startedAt) j->add("startedAt", JsonObject::newInt64(startedAt));
+  if (endedAt) j->add("endedAt", JsonObject::newInt64(endedAt));
+  return j;
+}
+
+
+#pragma mark - SendJobQueue
+
+SendJobQueue::SendJobQueue() :
+  nextId(1),
+  hold(false)
+{
+}
+
+
+void SendJobQueue::setHandlers(JobReadyCB aReadyCB, JobRunCB aRunCB, JobAbortCB aAbortCB)
+{
+  readyCB = aReadyCB;
+  runCB = aRunCB;
+  abortCB = aAbortCB;
+}
+
+
+void SendJobQueue::setPersistence(const string aPath)
+{
+  persistencePath = aPath;
+  load();
+}
+
+
+void SendJobQueue::insertByPriority(SendJobPtr aJob)
+{
+  // after all jobs with same or higher priority
+  JobList::iterator pos = jobs.begin();
+  while (pos!=jobs.end() && (*pos)->priority>=aJob->priority) ++pos;
+  jobs.insert(pos, aJob);
+}
+
+
+SendJobPtr SendJobQueue::add(const string aFileName, int aPriority, const SendOptions &aOptions)
+{
+  SendJobPtr job = SendJobPtr(new SendJob);
+  job->id = nextId++;
+  job->fileName = aFileName;
+  job->priority = aPriority;
+  job->options = aOptions;
+  job->queuedAt = time(NULL);
+  insertByPriority(job);
+  LOG(LOG_NOTICE, "Queued job #%u: '%s' (priority %d, %zu pending)", job->id, aFileName.c_str(), aPriority, jobs.size());
+  save();
+  runNext();
+  return job;
+}
+
+
+bool SendJobQueue::cancel(uint32_t aJobId)
+{
+  for (JobList::iterator pos = jobs.begin(); pos!=jobs.end(); ++pos) {
+    if ((*pos)->id==aJobId) {
+      SendJobPtr job = *pos;
+      jobs.erase(pos);
+      job->status = SendJob::job_cancelled;
+      endJob(job);
+      LOG(LOG_NOTICE, "Cancelled job #%u: '%s'", job->id, job->fileName.c_str());
+      save();
+      return true;
+    }
+  }
+  return false;
+}
+
+
+bool SendJobQueue::move(uint32_t aJobId, size_t aIndex)
+{
+  for (JobList::iterator pos = jobs.begin(); pos!=jobs.end(); ++pos) {
+    if ((*pos)->id==aJobId) {
+      SendJobPtr job = *pos;
+      jobs.erase(pos);
+      JobList::iterator ins = jobs.begin();
+      for (size_t i=0; i<aIndex && ins!=jobs.end(); i++) ++ins;
+      // adjust priority to fit in between neighbours
+      if (ins!=jobs.end() && (*ins)->priority>job->priority) job->priority = (*ins)->priority;
+      if (ins!=jobs.begin()) {
+        JobList::iterator prev = ins; --prev;
+        if ((*prev)->priority<job->priority) job->priority = (*prev)->priority;
+      }
+      jobs.insert(ins, job);
+      save();
+      return true;
+    }
+  }
+  return false;
+}
+
+
+bool SendJobQueue::abortCurrent(bool aHold)
+{
+  if (!current) return false;
+  if (aHold) hold = true;
+  if (!current->aborting) {
+    LOG(LOG_NOTICE, "Aborting job #%u: '%s'", current->id, current->fileName.c_str());
+    current->aborting = true;
+    if (abortCB) abortCB(current);
+  }
+  save();
+  return true;
+}
+
+
+void SendJobQueue::setHold(bool aHold)
+{
+  if (aHold==hold) return;
+  hold = aHold;
+  LOG(LOG_NOTICE, "Job queue %s", hold ? "on hold" : "resumed");
+  save();
+  if (!hold) runNext();
+}
+
+
+void SendJobQueue::jobDone(ErrorPtr aError)
+{
+  if (!current) return;
+  SendJobPtr job = current;
+  current.reset();
+  if (Error::isOK(aError)) {
+    job->status = SendJob::job_done;
+  }
+  else {
+    job->status = job->aborting ? SendJob::job_aborted : SendJob::job_failed;
+    job->error = aError->description();
+  }
+  LOG(LOG_NOTICE, "Job #%u: '%s' %s", job->id, job->fileName.c_str(), job->statusText());
+  endJob(job);
+  save();
+  // immediately start next one, machine is waiting
+  runNext();
+}
+
+
+void SendJobQueue::runNext()
+{
+  while (!current && !hold && !jobs.empty() && runCB) {
+    if (readyCB && !readyCB()) return; // will be called again when machine connection is ready
+    SendJobPtr job = jobs.front();
+    jobs.pop_front();
+    job->status = SendJob::job_running;
+    job->startedAt = time(NULL);
+    current = job;
+    LOG(LOG_NOTICE, "Starting job #%u: '%s' (%zu more pending)", job->id, job->fileName.c_str(), jobs.size());
+    ErrorPtr err = runCB(job);
+    if (Error::isOK(err)) {
+      save();
+      return;
+    }
+    // could not start, drop it and try next one
+    LOG(LOG_ERR, "Cannot start job #%u: %s", job->id, err->description().c_str());
+    current.reset();
+    job->status = SendJob::job_failed;
+    job->error = err->description();
+    endJob(job);
+    save();
+  }
+}
+
+
+void SendJobQueue::endJob(SendJobPtr aJob)
+{
+  aJob->endedAt = time(NULL);
+  history.push_front(aJob);
+  if (history.size()>MAX_JOB_HISTORY) history.pop_back();
+}
+
+
+JsonObjectPtr SendJobQueue::json()
+{
+  JsonObjectPtr q = JsonObject::newObj();
+  q->add("hold", JsonObject::newBool(hold));
+  if (current) q->add("current", current->json());
+  JsonObjectPtr a = JsonObject::newArray();
+  for (JobList::iterator pos = jobs.begin(); pos!=jobs.end(); ++pos) {
+    a->arrayAppend((*pos)->json());
+  }
+  q->add("pending", a);
+  a = JsonObject::newArray();
+  for (JobList::iterator pos = history.begin(); pos!=history.end(); ++pos) {
+    a->arrayAppend((*pos)->json());
+  }
+  q->add("history", a);
+  return q;
+}
+
+
+// MARK: - persistence
+
+void SendJobQueue::save()
+{
+  if (persistencePath.empty()) return;
+  JsonObjectPtr q = JsonObject::newObj();
+  q->add("nextId", JsonObject::newInt64(nextId));
+  q->add("hold", JsonObject::newBool(hold));
+  if (current) q->add("interrupted", current->json());
+  JsonObjectPtr a = JsonObject::newArray();
+  for (JobList::iterator pos = jobs.begin(); pos!=jobs.end(); ++pos) {
+    a->arrayAppend((*pos)->json());
+  }
+  q->add("jobs", a);
+  string s = q->json_str();
+  AtomicFileWriter w;
+  ErrorPtr err = w.open(tempPathFor(persistencePath));
+  if (Error::isOK(err)) err = w.write(s.c_str(), s.size());
+  if (Error::isOK(err)) err = w.commit(persistencePath);
+  if (!Error::isOK(err)) {
+    LOG(LOG_ERR, "Cannot save job queue to '%s': %s", persistencePath.c_str(), err->description().c_str());
+  }
+}
+
+
+static SendJobPtr jobFromJson(JsonObjectPtr aJson)
+{
+  JsonObjectPtr o;
+  if (!aJson->get("id", o)) return SendJobPtr();
+  SendJobPtr job = SendJobPtr(new SendJob);
+  job->id = (uint32_t)o->int64Value();
+  if (aJson->get("file", o)) job->fileName = o->stringValue();
+  if (aJson->get("priority", o)) job->priority = o->int32Value();
+  if (aJson->get("options", o)) job->options.setFromJson(o);
+  if (aJson->get("queuedAt", o)) job->queuedAt = (time_t)o->int64Value();
+  return job;
+}
+
+
+void SendJobQueue::load()
+{
+  if (access(persistencePath.c_str(), F_OK)!=0) return; // no queue saved yet
+  ErrorPtr err;
+  JsonObjectPtr q = JsonObject::objFromFile(persistencePath.c_str(), &err);
+  if (!q) {
+    LOG(LOG_ERR, "Cannot load job queue from '%s': %s", persistencePath.c_str(), Error::isOK(err) ? "invalid JSON" : err->description().c_str());
+    return;
+  }
+  JsonObjectPtr o;
+  jobs.clear();
+  if (q->get("hold", o)) hold = o->boolValue();
+  if (q->get("jobs", o)) {
+    for (int i=0; i<o->arrayLength(); i++) {
+      SendJobPtr job = jobFromJson(o->arrayGet(i));
+      if (job) jobs.push_back(job);
+    }
+  }
+  if (q->get("interrupted", o)) {
+    SendJobPtr job = jobFromJson(o);
+    if (job) {
+      // do not blindly resend, machine state is unknown
+      LOG(LOG_WARNING, "Job #%u: '%s' was interrupted, queued again but queue is on hold", job->id, job->fileName.c_str());
+      jobs.push_front(job);
+      hold = true;
+    }
+  }
+  if (q->get("nextId", o)) nextId = (uint32_t)o->int64Value();
+  for (JobList::iterator pos = jobs.begin(); pos!=jobs.end(); ++pos) {
+    if ((*pos)->id>=nextId) nextId = (*pos)->id+1;
+  }
+  LOG(LOG_NOTICE, "Loaded job queue: %zu pending jobs%s", jobs.size(), hold ? ", on hold" : "");
+}
@@ -0,0 +1,199 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44bandit.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+
+#ifndef __p44bandit__banditjobs__
+#define __p44bandit__banditjobs__
+
+#include "p44utils_common.hpp"
+#include "jsonobject.hpp"
+
+#include <list>
+
+using namespace std;
+
+namespace p44 {
+
+
+  /// options for sending a program
+  class SendOptions
+  {
+  public:
+    bool dnc; ///< drip-feed to a running machine
+    bool compact; ///< send in compacted form
+    double arcfitTolerance; ///< fit arcs with this tolerance, 0 = do not fit arcs
+    string linkProfile; ///< link profile name or specification for this job, empty for default
+
+    SendOptions();
+
+    /// override options present in JSON object
+    /// @param aData JSON object with "dnc", "compact", "arcfit" and/or "profile" fields
+    void setFromJson(JsonObjectPtr aData);
+
+    /// @return options as JSON object (in the format accepted by setFromJson())
+    JsonObjectPtr json() const;
+  };
+
+
+  class SendJob;
+  typedef boost::intrusive_ptr<SendJob> SendJobPtr;
+
+  /// a program waiting to be sent, being sent or sent
+  class SendJob : public P44Obj
+  {
+  public:
+    typedef enum {
+      job_pending,
+      job_running,
+      job_done,
+      job_failed,
+      job_aborted,
+      job_cancelled
+    } JobStatus;
+
+    uint32_t id; ///< unique job id
+    string fileName; ///< name of the program file in the data directory
+    int priority; ///< higher priority jobs run first, same priority in order of queueing
+    SendOptions options; ///< how to send the program
+    JobStatus status;
+    string error; ///< error message for failed jobs
+    time_t queuedAt; ///< when job was queued
+    time_t startedAt; ///< when job started running, 0 if not yet
+    time_t endedAt; ///< when job ended, 0 if not yet
+    bool aborting; ///< set while abort of the running job is in progress
+
+    SendJob();
+
+    /// @return job as JSON object
+    JsonObjectPtr json();
+
+    /// @return job status as text
+    const char *statusText();
+  };
+
+
+  /// checks if a job could be started now
+  /// @return true if the connection to the machine is ready for sending
+  typedef boost::function<bool ()> JobReadyCB;
+
+  /// starts a job
+  /// @param aJob the job to start
+  /// @return error if the job could not be started. Otherwise, SendJobQueue::jobDone() must be called
+  ///   when the job has ended.
+  typedef boost::function<ErrorPtr (SendJobPtr aJob)> JobRunCB;
+
+  /// aborts the running job, must eventually cause SendJobQueue::jobDone() to be called
+  typedef boost::function<void (SendJobPtr aJob)> JobAbortCB;
+
+
+  class SendJobQueue;
+  typedef boost::intrusive_ptr<SendJobQueue> SendJobQueuePtr;
+
+  /// queue of programs to send to the machine back-to-back.
+  /// The next job is started right from the completion of the previous one, so the machine
+  /// only waits for the link turnaround. The queue is saved to a file on every change, so
+  /// it survives restarts.
+  class SendJobQueue : public P44Obj
+  {
+    typedef std::list<SendJobPtr> JobList;
+    JobList jobs; ///< pending jobs, in order of execution
+    JobList history; ///< ended jobs, most recent first
+    SendJobPtr current; ///< running job, NULL if none
+    uint32_t nextId;
+    bool hold; ///< if set, no new jobs are started
+    string persistencePath;
+    JobReadyCB readyCB;
+    JobRunCB runCB;
+    JobAbortCB abortCB;
+
+  public:
+
+    SendJobQueue();
+
+    /// set the handlers that actually run jobs
+    void setHandlers(JobReadyCB aReadyCB, JobRunCB aRunCB, JobAbortCB aAbortCB);
+
+    /// load queue from file and save it there on every change from now on
+    /// @param aPath path of the file
+    /// @note a job that was running when the queue was last saved is put back at the front, and the
+    ///   queue is put on hold, so the operator can decide whether to resend it.
+    void setPersistence(const string aPath);
+
+    /// add a job
+    /// @param aFileName program file name
+    /// @param aPriority jobs with higher priority run first
+    /// @param aOptions send options
+    /// @return the new job
+    SendJobPtr add(const string aFileName, int aPriority, const SendOptions &aOptions);
+
+    /// remove a pending job
+    /// @return false if no such job is pending
+    bool cancel(uint32_t aJobId);
+
+    /// move a pending job to another position in the queue
+    /// @param aJobId the job
+    /// @param aIndex new position, 0 = next to run
+    /// @return false if no such job is pending
+    /// @note the job takes the priority of its new neighbours, so later additions are sorted consistently
+    bool move(uint32_t aJobId, size_t aIndex);
+
+    /// abort the running job
+    /// @param aHold if set, the queue is put on hold, so the next job is not started right away
+    /// @return false if no job is running
+    bool abortCurrent(bool aHold);
+
+    /// stop or resume starting jobs
+    void setHold(bool aHold);
+
+    /// @return true if queue is on hold
+    bool isHeld() { return hold; };
+
+    /// must be called when a job started via the run handler has ended
+    /// @param aError result of the job
+    void jobDone(ErrorPtr aError);
+
+    /// start the next job if there is one and the machine is ready
+    /// @note to be called when the machine connection becomes ready after other activity
+    void runNext();
+
+    /// @return the running job, NULL if none
+    SendJobPtr currentJob() { return current; };
+
+    /// @return number of pending jobs
+    size_t size() { return jobs.size(); };
+
+    /// @return queue state, running, pending and recently ended jobs as JSON
+    JsonObjectPtr json();
+
+  private:
+
+    void insertByPriority(SendJobPtr aJob);
+    void endJob(SendJobPtr aJob);
+    void save();
+    void load();
+
+  };
+
+
+} // namespace p44
+
+#endif /* defined(__p44bandit__banditjobs__) */
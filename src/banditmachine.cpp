@@ -0,0 +1,1108 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44bandit.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "banditmachine.hpp"
+#include "banditoptimizer.hpp"
+#include "metrics.hpp"
+
+#include "application.hpp"
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+using namespace p44;
+
+
+#define PROBE_TIMEOUT (2*Minute) // time for the operator to start program output on the controller when probing
+#define JOBQUEUE_FILE ".sendqueue.json" // in data dir, dotfiles are not listed
+#define ANALYSIS_CACHE_FILE ".analysis.json" // in data dir
+#define ANALYSIS_CACHE_VERSION 1 // increment when analyses of the same file would differ
+#define SEND_PROGRESS_INTERVAL (1*Second) // interval for send progress events
+#define DEFAULT_TCP_PORT 2101 // for host:port connection specifications without port
+#define DOWNLOAD_SUFFIX "_bandit_download.txt"
+#define INCOMPLETE_DOWNLOAD_SUFFIX "_bandit_download_incomplete.txt"
+#define RECEIVE_COMPRESSION_BLOCK_SIZE 16384 // smaller than default, to not keep too much received data in memory only
+
+
+static void actionStatus(RequestDoneCB aRequestDoneCB, ErrorPtr aError = ErrorPtr())
+{
+  aRequestDoneCB(JsonObjectPtr(), aError);
+}
+
+
+namespace p44 {
+
+  /// a file being analyzed in a worker thread
+  class AnalysisJob : public P44Obj
+  {
+  public:
+    string name;
+    time_t mtime; ///< of the file when analysis was started
+    off_t size; ///< of the file when analysis was started
+    string path;
+    uint64_t hash;
+    CatalogContentInfo content; ///< for the catalog, determined along with the hash
+    BanditAnalysisPtr analysis;
+    ErrorPtr optimizedError; ///< error of the compacted or arc fitted analysis pass, if any (analysis is still valid)
+    AnalysisCB analysisCB;
+  };
+
+
+  /// an uploaded file being ingested in a worker thread
+  class UploadJob : public P44Obj
+  {
+  public:
+    string name;
+    string uploadedFile;
+    string path;
+    bool compress; ///< store compressed
+    uint64_t hash;
+    StatusCB doneCB;
+  };
+
+} // namespace p44
+
+
+static ErrorPtr hashRoutine(AnalysisJob *aJob)
+{
+  ErrorPtr err = fileContentHash(aJob->path, aJob->hash);
+  if (!Error::isOK(err)) return err;
+  // Note: second pass over the (then cached) file, as counting lines needs the expanded data
+  return FileCatalog::countContent(aJob->path, aJob->content);
+}
+
+
+static ErrorPtr ingestRoutine(UploadJob *aJob)
+{
+  if (aJob->compress) return compressFile(aJob->uploadedFile, aJob->path, &aJob->hash);
+  return ingestFile(aJob->uploadedFile, aJob->path, &aJob->hash, true);
+}
+
+
+#pragma mark - BanditMachineSettings
+
+BanditMachineSettings::BanditMachineSettings() :
+  rawmode(false),
+  compactmode(false),
+  arcfitTolerance(0),
+  compressStorage(false)
+{
+}
+
+
+#pragma mark - BanditMachine
+
+BanditMachine::BanditMachine(const string aId, const string aSubDir, const BanditMachineSettings &aSettings, EventHubPtr aEventHub, TransmissionImageCachePtr aImageCache, WorkerPoolPtr aWorkers) :
+  id(aId),
+  subDir(aSubDir),
+  settings(aSettings),
+  eventHub(aEventHub),
+  imageCache(aImageCache),
+  workers(aWorkers),
+  jobQueue(new SendJobQueue),
+  analysisCache(new AnalysisCache),
+  analyzing(false),
+  lastSendEnd(Never)
+{
+}
+
+
+ErrorPtr BanditMachine::configure(JsonObjectPtr aConfig)
+{
+  JsonObjectPtr o;
+  if (!subDir.empty()) {
+    string dir = dataPath();
+    if (mkdir(dir.c_str(), 0775)<0 && errno!=EEXIST) {
+      return SysError::errNo(string_format("Cannot create data directory for machine '%s': ", id.c_str()).c_str());
+    }
+  }
+  // - create button input
+  button = ButtonInputPtr(new ButtonInput(aConfig->get("button", o) ? o->c_strValue() : "missing"));
+  button->setButtonHandler(boost::bind(&BanditMachine::buttonHandler, this, _1, _2, _3), true, Second);
+  // - create LEDs
+  greenLed = IndicatorOutputPtr(new IndicatorOutput(aConfig->get("greenled", o) ? o->c_strValue() : "missing"));
+  redLed = IndicatorOutputPtr(new IndicatorOutput(aConfig->get("redled", o) ? o->c_strValue() : "missing"));
+  // - create bandit comm
+  banditComm = BanditCommPtr(new BanditComm(MainLoop::currentMainLoop()));
+  if (aConfig->get("linkprofile", o) && !BanditLinkProfile::lookup(o->stringValue(), defaultLinkProfile)) {
+    return TextError::err("Invalid link profile '%s' for machine '%s'", o->c_strValue(), id.c_str());
+  }
+  banditComm->setLinkProfile(defaultLinkProfile);
+  if (aConfig->get("serialport", o)) {
+    string serialport = o->stringValue();
+    string hsoutpin = aConfig->get("hsoutpin", o) ? o->stringValue() : "missing";
+    string hsinpin = aConfig->get("hsinpin", o) ? o->stringValue() : "missing";
+    int hsDebounceMs = aConfig->get("hsdebounce", o) ? o->int32Value() : 0;
+    int hsPollMs = aConfig->get("hspoll", o) ? o->int32Value() : 100;
+    banditComm->setHandshakeInputTiming(hsDebounceMs*MilliSecond, hsPollMs*MilliSecond);
+    // Note: a machine whose port cannot be opened (e.g. unplugged USB adapter) must not prevent the
+    //   others from running, so it is only marked failed in status()
+    ErrorPtr err = banditComm->setConnectionSpecification(serialport.c_str(), DEFAULT_TCP_PORT, hsoutpin.c_str(), hsinpin.c_str());
+    if (!Error::isOK(err)) {
+      LOG(LOG_ERR, "Machine '%s': cannot connect to controller at '%s': %s", id.c_str(), serialport.c_str(), err->description().c_str());
+    }
+    // flow control makes sense only with a real handshake input
+    banditComm->setFlowControl(aConfig->get("hsinpin", o) && !(aConfig->get("flowcontrol", o) && !o->boolValue()));
+    banditComm->setEndDetection(!(aConfig->get("enddetect", o) && !o->boolValue()));
+  }
+  int lowWater = aConfig->get("txlowwater", o) ? o->int32Value() : DEFAULT_TX_LOW_WATER;
+  int highWater = aConfig->get("txhighwater", o) ? o->int32Value() : DEFAULT_TX_HIGH_WATER;
+  if (lowWater<=0 || highWater<=0) {
+    return TextError::err("Invalid transmit watermarks for machine '%s': must be positive", id.c_str());
+  }
+  ErrorPtr err = banditComm->setTxWatermarks(lowWater, highWater);
+  if (!Error::isOK(err)) {
+    return TextError::err("Invalid transmit watermarks for machine '%s': %s", id.c_str(), err->description().c_str());
+  }
+  return ErrorPtr();
+}
+
+
+void BanditMachine::start()
+{
+  LOG(LOG_NOTICE, "Machine '%s': data in '%s'", id.c_str(), dataPath().c_str());
+  // analyses of files unchanged since the last run are loaded, so catalogChanged() finds them cached
+  analysisCache->setPersistence(
+    dataPath(ANALYSIS_CACHE_FILE),
+    string_format("v%d raw=%d compact=%d arcfit=%g", ANALYSIS_CACHE_VERSION, settings.rawmode, settings.compactmode, settings.arcfitTolerance)
+  );
+  recoverDownloads();
+  catalog(); // build catalog now, not at first API request
+  if (Error::isOK(catalog()->error())) analysisCache->forgetMissing(catalog());
+  jobQueue->setHandlers(
+    boost::bind(&BanditMachine::jobReady, this),
+    boost::bind(&BanditMachine::runJob, this, _1),
+    boost::bind(&BanditMachine::abortJob, this, _1)
+  );
+  jobQueue->setPersistence(dataPath(JOBQUEUE_FILE));
+  banditComm->setHandshakeMonitor(boost::bind(&BanditMachine::handshakeEvent, this, _1));
+  LOG(LOG_NOTICE, "Machine '%s': start receiving automatically when handshake line indicates data", id.c_str());
+  autoReceive();
+  jobQueue->runNext();
+}
+
+
+string BanditMachine::dataPath(const string aFile)
+{
+  if (subDir.empty()) return Application::sharedApplication()->dataPath(aFile);
+  return Application::sharedApplication()->dataPath(aFile.empty() ? subDir : subDir+"/"+aFile);
+}
+
+
+JsonObjectPtr BanditMachine::status()
+{
+  JsonObjectPtr m = JsonObject::newObj();
+  m->add("id", JsonObject::newString(id));
+  m->add("dir", JsonObject::newString(subDir));
+  ErrorPtr connErr = banditComm->lastConnectionError();
+  m->add("failed", JsonObject::newBool(!Error::isOK(connErr)));
+  if (!Error::isOK(connErr)) m->add("error", JsonObject::newString(connErr->description()));
+  m->add("linkprofile", banditComm->getLinkProfile().json());
+  m->add("busy", JsonObject::newBool(banditComm->isBusy()));
+  m->add("transfer", banditComm->transferStatus());
+  if (!sendingFile.empty()) m->add("sending", JsonObject::newString(sendingFile));
+  if (!selectedfile.empty()) m->add("selected", JsonObject::newString(selectedfile));
+  m->add("jobsPending", JsonObject::newInt64(jobQueue->size()));
+  m->add("hold", JsonObject::newBool(jobQueue->isHeld()));
+  return m;
+}
+
+
+void BanditMachine::sampleMetrics()
+{
+  string labels = string_format("machine=\"%s\"", id.c_str());
+  Metrics::shared().gauge("bandit_jobs_pending", "jobs waiting in the send queue", labels).set(jobQueue->size());
+  Metrics::shared().gauge("bandit_busy", "1 while sending or receiving", labels).set(banditComm->isBusy() ? 1 : 0);
+}
+
+
+// MARK: ==== Events
+
+void BanditMachine::postEvent(const char *aType, JsonObjectPtr aData)
+{
+  aData->add("machine", JsonObject::newString(id));
+  eventHub->post(aType, aData);
+}
+
+
+JsonObjectPtr BanditMachine::phaseEvent(const char *aPhase)
+{
+  JsonObjectPtr ev = JsonObject::newObj();
+  ev->add("phase", JsonObject::newString(aPhase));
+  return ev;
+}
+
+
+void BanditMachine::errorEvent(const char *aContext, ErrorPtr aError)
+{
+  JsonObjectPtr ev = JsonObject::newObj();
+  ev->add("context", JsonObject::newString(aContext));
+  ev->add("message", JsonObject::newString(aError->description()));
+  postEvent("error", ev);
+}
+
+
+void BanditMachine::ledEvent(const char *aLed, const char *aState)
+{
+  JsonObjectPtr ev = JsonObject::newObj();
+  ev->add("led", JsonObject::newString(aLed));
+  ev->add("state", JsonObject::newString(aState));
+  postEvent("led", ev);
+}
+
+
+void BanditMachine::handshakeEvent(bool aActive)
+{
+  JsonObjectPtr ev = JsonObject::newObj();
+  ev->add("active", JsonObject::newBool(aActive));
+  postEvent("handshake", ev);
+}
+
+
+// MARK: ==== Receiving
+
+void BanditMachine::autoReceive()
+{
+  if (banditComm->isBusy()) return; // sending, will restart receiving when done
+  LOG(LOG_INFO, "Machine '%s': start waiting for new data...", id.c_str());
+  receiveWriter.reset();
+  receiveCompressor.reset();
+  banditComm->receive(
+    boost::bind(&BanditMachine::autoReceived, this, _1, _2),
+    true, // hsonstart
+    true, // startonhs
+    true, // stoponhs
+    BanditCleanerPtr(new BanditCleaner(false, settings.rawmode)),
+    boost::bind(&BanditMachine::autoReceivedData, this, _1, _2)
+  );
+}
+
+
+void BanditMachine::autoReceivedData(const char *aData, size_t aNumBytes)
+{
+  ErrorPtr err;
+  if (!receiveWriter) {
+    postEvent("receive", phaseEvent("start"));
+    // first data, start writing temp file
+    string ts = string_ftime("%Y-%m-%d_%H.%M.%S", NULL);
+    receiveWriter = AtomicFileWriterPtr(new AtomicFileWriter);
+    err = receiveWriter->open(tempPathFor(dataPath(ts+DOWNLOAD_SUFFIX)));
+    if (settings.compressStorage) {
+      receiveCompressor = ProgramCompressorPtr(new ProgramCompressor(RECEIVE_COMPRESSION_BLOCK_SIZE));
+    }
+  }
+  else if (!Error::isOK(receiveWriter->error())) {
+    return; // already failed and reported, file will be saved as incomplete with the data written before the error
+  }
+  if (Error::isOK(err)) {
+    if (receiveCompressor) {
+      string compressed;
+      receiveCompressor->compress(aData, aNumBytes, compressed);
+      if (!compressed.empty()) err = receiveWriter->write(compressed.c_str(), compressed.size());
+    }
+    else {
+      err = receiveWriter->write(aData, aNumBytes);
+    }
+  }
+  if (!Error::isOK(err)) {
+    LOG(LOG_ERR, "Machine '%s': cannot save received data: %s", id.c_str(), err->description().c_str());
+    // Note: writer stays in error state, so we don't write (and log) any further chunks
+  }
+}
+
+
+void BanditMachine::autoReceived(const string &aResponse, ErrorPtr aError)
+{
+  size_t receivedBytes = receiveCompressor ? (size_t)receiveCompressor->logicalSize() : (receiveWriter ? receiveWriter->size() : 0);
+  JsonObjectPtr ev = phaseEvent("end");
+  ev->add("bytes", JsonObject::newInt64(receivedBytes));
+  if (Error::isOK(aError)) {
+    LOG(LOG_INFO, "Machine '%s': successfully received %zd bytes of data", id.c_str(), receivedBytes);
+    redLed->onFor(2*Second);
+    ledEvent("red", "flash");
+  }
+  else {
+    LOG(LOG_ERR, "Machine '%s': error auto-receiving data: %s", id.c_str(), aError->description().c_str());
+    errorEvent("receive", aError);
+    ev->add("error", JsonObject::newString(aError->description()));
+  }
+  if (receivedBytes>0) {
+    if (receiveCompressor && Error::isOK(receiveWriter->error())) {
+      string compressed;
+      receiveCompressor->finish(compressed);
+      receiveWriter->write(compressed.c_str(), compressed.size()); // error, if any, remains in writer
+    }
+    // save what we've got, mark as incomplete in case of receive or write error
+    bool complete = Error::isOK(aError) && Error::isOK(receiveWriter->error());
+    string ts = string_ftime("%Y-%m-%d_%H.%M.%S", NULL);
+    string fp = dataPath(ts + (complete ? DOWNLOAD_SUFFIX : INCOMPLETE_DOWNLOAD_SUFFIX));
+    if (!Error::isOK(receiveWriter->error())) {
+      LOG(LOG_ERR, "Machine '%s': received data could not be saved completely: %s", id.c_str(), receiveWriter->error()->description().c_str());
+      errorEvent("save", receiveWriter->error());
+    }
+    LOG(LOG_NOTICE, "Machine '%s': saving received data (%zd bytes, %zd bytes stored) to '%s'", id.c_str(), receivedBytes, receiveWriter->size(), fp.c_str());
+    ErrorPtr err = receiveWriter->commit(fp);
+    if (!Error::isOK(err)) {
+      LOG(LOG_ERR, "Cannot save received file %s - %s", fp.c_str(), err->description().c_str());
+      errorEvent("save", err);
+    }
+    else {
+      ev->add("file", JsonObject::newString(fp.substr(fp.rfind('/')+1)));
+    }
+    if (fileCatalog) fileCatalog->update(fp.substr(fp.rfind('/')+1));
+  }
+  if (receivedBytes>0 || !Error::isOK(aError)) postEvent("receive", ev);
+  receiveWriter.reset(); // discards empty temp file, if any
+  receiveCompressor.reset();
+  // machine is ready for jobs again
+  jobQueue->runNext();
+  // restart receiving (with a small safety delay)
+  autoReceiveTicket.executeOnce(boost::bind(&BanditMachine::autoReceive, this), 1*Second);
+}
+
+
+/// make downloads that were interrupted by a crash or power loss visible as incomplete files
+void BanditMachine::recoverDownloads()
+{
+  string dir = dataPath();
+  DIR *dirP = opendir(dir.c_str());
+  if (!dirP) return;
+  struct dirent *direntP;
+  const string tempSuffix = string(DOWNLOAD_SUFFIX) + ".part";
+  while ((direntP = readdir(dirP))!=NULL) {
+    string fn = direntP->d_name;
+    if (fn.size()<=tempSuffix.size()+1 || fn[0]!='.' || fn.substr(fn.size()-tempSuffix.size())!=tempSuffix) continue;
+    // .<timestamp>_bandit_download.txt.part -> <timestamp>_bandit_download_incomplete.txt
+    string recovered = fn.substr(1, fn.size()-tempSuffix.size()-1) + INCOMPLETE_DOWNLOAD_SUFFIX;
+    LOG(LOG_WARNING, "Machine '%s': recovering interrupted download as '%s'", id.c_str(), recovered.c_str());
+    rename(dataPath(fn).c_str(), dataPath(recovered).c_str());
+  }
+  closedir(dirP);
+}
+
+
+void BanditMachine::apiProbeResult(RequestDoneCB aRequestDoneCB, const BanditLinkProfile &aProfile, ErrorPtr aError)
+{
+  if (Error::isOK(aError)) {
+    defaultLinkProfile = aProfile; // use from now on
+    aRequestDoneCB(aProfile.json(), ErrorPtr());
+  }
+  else {
+    restoreLinkProfile();
+    actionStatus(aRequestDoneCB, aError);
+  }
+  jobQueue->runNext();
+  autoReceive(); // probing has stopped waiting for data
+}
+
+
+// MARK: ==== Sending
+
+ErrorPtr BanditMachine::programSource(const string aFilePath, BanditDataSourcePtr &aSource, bool aCompact, double aArcFitTolerance)
+{
+  BanditDataSourcePtr source;
+  ErrorPtr err = openProgramFile(aFilePath, source);
+  if (Error::isOK(err)) {
+    if ((aCompact || aArcFitTolerance>0) && !settings.rawmode) {
+      // optimizers work on cleaned lines, line numbers are regenerated afterwards
+      source = BanditDataSourcePtr(new CleaningDataSource(source, BanditCleanerPtr(new BanditCleaner(false, false))));
+      if (aArcFitTolerance>0) {
+        source = BanditDataSourcePtr(new ArcFittingDataSource(source, aArcFitTolerance));
+      }
+      if (aCompact) {
+        source = BanditDataSourcePtr(new LineFilterDataSource(source, BanditLineFilterPtr(new BanditCompactor)));
+      }
+    }
+    // clean while sending, data itself with CR+LF line ends and regenerated line numbers
+    source = BanditDataSourcePtr(new CleaningDataSource(source, BanditCleanerPtr(new BanditCleaner(true, settings.rawmode))));
+    aSource = BanditDataSourcePtr(new FramedDataSource(source));
+  }
+  return err;
+}
+
+
+/// @return send options as configured on the command line
+SendOptions BanditMachine::defaultSendOptions()
+{
+  SendOptions o;
+  o.dnc = false;
+  o.compact = settings.compactmode;
+  o.arcfitTolerance = settings.arcfitTolerance;
+  return o;
+}
+
+
+ErrorPtr BanditMachine::sendFile(const string aFilePath, const SendOptions &aOptions)
+{
+  ErrorPtr err;
+  BanditDataSourcePtr source;
+  TransmissionImagePtr image;
+  if (banditComm->isBusy()) {
+    return TextError::err("Cannot send now, BANDIT connection is busy");
+  }
+  if (!aOptions.linkProfile.empty()) {
+    // job specific link profile
+    BanditLinkProfile profile;
+    if (!BanditLinkProfile::lookup(aOptions.linkProfile, profile)) {
+      return WebError::webErr(400, "Unknown link profile '%s'", aOptions.linkProfile.c_str());
+    }
+    err = banditComm->setLinkProfile(profile);
+    if (!Error::isOK(err)) return err;
+  }
+  if (aOptions.compact==settings.compactmode && aOptions.arcfitTolerance==settings.arcfitTolerance) {
+    // images are always built in default mode
+    image = cachedImage(aFilePath.substr(aFilePath.rfind('/')+1));
+  }
+  if (image) {
+    source = BanditDataSourcePtr(new ImageDataSource(image));
+    LOG(LOG_NOTICE, "Machine '%s': %s data (%zd bytes, prebuilt) from '%s'", id.c_str(), aOptions.dnc ? "drip-feeding (DNC)" : "sending", source->sizeHint(), aFilePath.c_str());
+  }
+  else {
+    err = programSource(aFilePath, source, aOptions.compact, aOptions.arcfitTolerance);
+    if (!Error::isOK(err)) {
+      restoreLinkProfile();
+      return err;
+    }
+    LOG(LOG_NOTICE, "Machine '%s': %s data (~%zd bytes padded, cleaned on the fly) from '%s'", id.c_str(), aOptions.dnc ? "drip-feeding (DNC)" : "sending", source->sizeHint(), aFilePath.c_str());
+  }
+  // send it
+  sendingFile = aFilePath.substr(aFilePath.rfind('/')+1);
+  JsonObjectPtr ev = phaseEvent("start");
+  ev->add("file", JsonObject::newString(sendingFile));
+  ev->add("bytes", JsonObject::newInt64(source->sizeHint()));
+  ev->add("options", aOptions.json());
+  postEvent("send", ev);
+  progressTicket.executeOnce(boost::bind(&BanditMachine::sendProgress, this), SEND_PROGRESS_INTERVAL);
+  redLed->steadyOn();
+  ledEvent("red", "on");
+  banditComm->send(
+    boost::bind(&BanditMachine::sendFileComplete, this, _1),
+    source,
+    true, // hsonstart
+    aOptions.dnc
+  );
+  return err;
+}
+
+
+/// switch back to default link profile after a job with a specific one
+void BanditMachine::restoreLinkProfile()
+{
+  if (banditComm->getLinkProfile().name!=defaultLinkProfile.name) {
+    ErrorPtr err = banditComm->setLinkProfile(defaultLinkProfile);
+    if (!Error::isOK(err)) {
+      LOG(LOG_ERR, "Machine '%s': cannot restore default link profile: %s", id.c_str(), err->description().c_str());
+    }
+  }
+}
+
+
+void BanditMachine::sendFileComplete(ErrorPtr aError)
+{
+  redLed->steadyOff();
+  ledEvent("red", "off");
+  progressTicket.cancel();
+  JsonObjectPtr ev = phaseEvent("end");
+  ev->add("file", JsonObject::newString(sendingFile));
+  if (!Error::isOK(aError)) {
+    ev->add("error", JsonObject::newString(aError->description()));
+    errorEvent("send", aError);
+  }
+  postEvent("send", ev);
+  restoreLinkProfile();
+  lastSentFile = sendingFile;
+  sendingFile.clear();
+  lastSendError = aError;
+  lastSendEnd = MainLoop::now();
+  if (Error::isOK(aError)) {
+    LOG(LOG_NOTICE, "Machine '%s': successfully sent data", id.c_str());
+  }
+  else {
+    LOG(LOG_ERR, "Machine '%s': error sending data: %s", id.c_str(), aError->description().c_str());
+  }
+  // start next job right away, if any
+  jobQueue->jobDone(aError);
+  // sending has abandoned waiting for data, restart receiving (with a small safety delay)
+  if (!banditComm->isBusy()) autoReceiveTicket.executeOnce(boost::bind(&BanditMachine::autoReceive, this), 1*Second);
+}
+
+
+void BanditMachine::sendProgress()
+{
+  if (eventHub->hasSubscribers()) {
+    JsonObjectPtr ev = banditComm->transferStatus();
+    ev->add("phase", JsonObject::newString("progress"));
+    ev->add("file", JsonObject::newString(sendingFile));
+    postEvent("send", ev);
+  }
+  progressTicket.executeOnce(boost::bind(&BanditMachine::sendProgress, this), SEND_PROGRESS_INTERVAL);
+}
+
+
+// MARK: ==== Jobs
+
+bool BanditMachine::jobReady()
+{
+  return !banditComm->isBusy();
+}
+
+
+ErrorPtr BanditMachine::runJob(SendJobPtr aJob)
+{
+  ErrorPtr err = sendFile(dataPath(aJob->fileName), aJob->options);
+  if (!Error::isOK(err)) errorEvent("job", err);
+  return err;
+}
+
+
+void BanditMachine::abortJob(SendJobPtr aJob)
+{
+  banditComm->abortSend(TextError::err("Job aborted"));
+}
+
+
+// MARK: ==== Button
+
+void BanditMachine::buttonHandler(bool aState, bool aHasChanged, MLMicroSeconds aTimeSincePreviousChange)
+{
+  LOG(LOG_INFO, "Machine '%s': button state now %d%s", id.c_str(), aState, aHasChanged ? " (changed)" : " (same)");
+  if (aHasChanged && !aState && selectedfile.size()>0) {
+    // send the selected file
+    jobQueue->add(selectedfile, 0, defaultSendOptions());
+  }
+}
+
+
+// MARK: ==== Files
+
+void BanditMachine::processUpload(JsonObjectPtr aData, const string aUploadedFile, StatusCB aDoneCB)
+{
+  string cmd;
+  JsonObjectPtr o;
+  if (!aData->get("cmd", o)) {
+    aDoneCB(ErrorPtr());
+    return;
+  }
+  cmd = o->stringValue();
+  if (cmd!="banditfileupload") {
+    aDoneCB(WebError::webErr(500, "Unknown upload cmd '%s'", cmd.c_str()));
+    return;
+  }
+  // create destination file name
+  // - original name
+  UploadJobPtr job = UploadJobPtr(new UploadJob);
+  job->uploadedFile = aUploadedFile;
+  job->name = aUploadedFile;
+  size_t p = aUploadedFile.rfind('/');
+  if (p!=string::npos) {
+    job->name = aUploadedFile.substr(p+1);
+  }
+  job->path = dataPath(job->name);
+  job->compress = settings.compressStorage;
+  job->hash = 0;
+  job->doneCB = aDoneCB;
+  LOG(LOG_NOTICE, "Machine '%s': saving uploaded file '%s' as '%s'", id.c_str(), aUploadedFile.c_str(), job->path.c_str());
+  // copying and hashing large files must not block the mainloop
+  workers->submit(boost::bind(&ingestRoutine, job.get()), boost::bind(&BanditMachine::uploadDone, this, job, _1));
+}
+
+
+void BanditMachine::uploadDone(UploadJobPtr aJob, ErrorPtr aError)
+{
+  if (Error::isOK(aError)) {
+    LOG(LOG_INFO, "Uploaded file '%s' has content hash %016llX", aJob->name.c_str(), (unsigned long long)aJob->hash);
+    catalog()->update(aJob->name);
+    // auto-select the file
+    selectedfile = aJob->name;
+  }
+  aJob->doneCB(aError);
+}
+
+
+/// @return the catalog of the files in the data directory
+FileCatalogPtr BanditMachine::catalog()
+{
+  if (!fileCatalog) {
+    fileCatalog = FileCatalogPtr(new FileCatalog);
+    fileCatalog->setChangedHandler(boost::bind(&BanditMachine::catalogChanged, this, _1, _2));
+    ErrorPtr err = fileCatalog->open(dataPath());
+    if (!Error::isOK(err)) {
+      LOG(LOG_ERR, "Machine '%s': cannot catalog data directory: %s", id.c_str(), err->description().c_str());
+    }
+  }
+  return fileCatalog;
+}
+
+
+void BanditMachine::catalogChanged(const string &aName, CatalogEntryPtr aEntry)
+{
+  // previous contents are no longer valid, unless unchanged since analyzed (e.g. persisted analysis at startup)
+  if (!aEntry || !analysisCache->get(aName, aEntry->mtime, aEntry->size)) {
+    uint64_t oldHash = analysisCache->forget(aName);
+    if (oldHash) imageCache->remove(oldHash);
+  }
+  fileEvent(aName, aEntry);
+  if (!aEntry) {
+    if (aName==selectedfile) {
+      selectedfile.clear(); // selected file is gone
+    }
+  }
+  else if (aEntry->type==DT_REG) {
+    // analyze in the background
+    pendingAnalyses.push_back(aName);
+    analyzeNext();
+  }
+}
+
+
+void BanditMachine::fileEvent(const string &aName, CatalogEntryPtr aEntry)
+{
+  JsonObjectPtr ev = JsonObject::newObj();
+  ev->add("name", JsonObject::newString(aName));
+  if (aEntry) ev->add("entry", aEntry->json());
+  else ev->add("deleted", JsonObject::newBool(true));
+  postEvent("file", ev);
+}
+
+
+/// analyze pending files one by one in a worker thread, so API and comm stay responsive
+void BanditMachine::analyzeNext()
+{
+  while (!analyzing && !pendingAnalyses.empty()) {
+    string name = pendingAnalyses.front();
+    pendingAnalyses.pop_front();
+    CatalogEntryPtr e = catalog()->entry(name);
+    if (e) {
+      analyzing = true;
+      analyze(e, boost::bind(&BanditMachine::backgroundAnalysisDone, this, name, _1, _2));
+    }
+  }
+}
+
+
+void BanditMachine::backgroundAnalysisDone(const string aName, BanditAnalysisPtr aAnalysis, ErrorPtr aError)
+{
+  analyzing = false;
+  if (!Error::isOK(aError)) {
+    LOG(LOG_WARNING, "Machine '%s': cannot analyze '%s': %s", id.c_str(), aName.c_str(), aError->description().c_str());
+  }
+  else if (aName==selectedfile) {
+    prepareImage(aName);
+  }
+  // Note: cached analyses call back right away, so with many of them (persisted cache at startup),
+  //   calling analyzeNext() directly would recurse once per file
+  analyzeNextTicket.executeOnce(boost::bind(&BanditMachine::analyzeNext, this));
+}
+
+
+/// get analysis of a file, from cache or by analyzing it in a worker thread
+/// @param aEntry the catalog entry of the file
+/// @param aAnalysisCB called with the analysis (right away if cached)
+void BanditMachine::analyze(CatalogEntryPtr aEntry, AnalysisCB aAnalysisCB)
+{
+  CatalogContentInfo content;
+  BanditAnalysisPtr a = analysisCache->get(aEntry->name, aEntry->mtime, aEntry->size, &content);
+  if (a) {
+    // content info was stored along with the analysis, no need to read the file
+    CatalogEntryPtr e = catalog()->setContent(aEntry->name, aEntry->mtime, aEntry->size, content);
+    if (e) fileEvent(aEntry->name, e);
+    aAnalysisCB(a, ErrorPtr());
+    return;
+  }
+  AnalysisJobPtr job = AnalysisJobPtr(new AnalysisJob);
+  job->name = aEntry->name;
+  job->mtime = aEntry->mtime;
+  job->size = aEntry->size;
+  job->path = dataPath(aEntry->name);
+  job->hash = 0;
+  job->analysisCB = aAnalysisCB;
+  // first only hash, same content might already be analyzed
+  workers->submit(boost::bind(&hashRoutine, job.get()), boost::bind(&BanditMachine::analysisHashed, this, job, _1));
+}
+
+
+void BanditMachine::analysisHashed(AnalysisJobPtr aJob, ErrorPtr aError)
+{
+  if (!Error::isOK(aError)) {
+    aJob->analysisCB(BanditAnalysisPtr(), aError);
+    return;
+  }
+  // catalog gets expanded size and line count only now, as determining these needs reading the file
+  CatalogEntryPtr e = catalog()->setContent(aJob->name, aJob->mtime, aJob->size, aJob->content);
+  if (e) fileEvent(aJob->name, e);
+  BanditAnalysisPtr a = analysisCache->getByHash(aJob->hash);
+  if (a) {
+    analysisCache->store(aJob->name, aJob->mtime, aJob->size, aJob->content, a);
+    aJob->analysisCB(a, ErrorPtr());
+    return;
+  }
+  // same content never seen before, must analyze
+  workers->submit(boost::bind(&BanditMachine::analysisRoutine, this, aJob.get()), boost::bind(&BanditMachine::analysisDone, this, aJob, _1));
+}
+
+
+ErrorPtr BanditMachine::analysisRoutine(AnalysisJob *aJob)
+{
+  // in worker thread, must only use the job and the (constant) settings
+  ErrorPtr err;
+  BanditDataSourcePtr source;
+  err = programSource(aJob->path, source, false, 0);
+  if (!Error::isOK(err)) return err;
+  BanditAnalysisPtr a = BanditAnalyzer::analyzeSource(source, err);
+  if (!a) return err;
+  a->contentHash = aJob->hash;
+  // size when compacted
+  ErrorPtr compactErr = programSource(aJob->path, source, true, 0);
+  if (Error::isOK(compactErr)) {
+    BanditAnalysisPtr ca = BanditAnalyzer::analyzeSource(source, compactErr);
+    if (ca) a->compactTransmitBytes = ca->transmitBytes;
+  }
+  if (!Error::isOK(compactErr)) aJob->optimizedError = compactErr;
+  // size and lines with fitted arcs, only when arc fitting is configured
+  if (settings.arcfitTolerance>0) {
+    ErrorPtr arcfitErr = programSource(aJob->path, source, settings.compactmode, settings.arcfitTolerance);
+    if (Error::isOK(arcfitErr)) {
+      BanditAnalysisPtr fa = BanditAnalyzer::analyzeSource(source, arcfitErr);
+      if (fa) {
+        a->arcfitTransmitBytes = fa->transmitBytes;
+        a->arcfitLines = fa->lines;
+      }
+    }
+    if (!Error::isOK(arcfitErr)) aJob->optimizedError = arcfitErr;
+  }
+  aJob->analysis = a;
+  return err;
+}
+
+
+void BanditMachine::analysisDone(AnalysisJobPtr aJob, ErrorPtr aError)
+{
+  BanditAnalysisPtr a = aJob->analysis;
+  aJob->analysis.reset();
+  if (!Error::isOK(aJob->optimizedError)) {
+    // plain analysis is fine, just the sizes for optimized sending are missing
+    LOG(LOG_WARNING, "Machine '%s': cannot analyze optimized form of '%s': %s", id.c_str(), aJob->name.c_str(), aJob->optimizedError->description().c_str());
+  }
+  if (a) {
+    LOG(LOG_INFO, "Analyzed '%s': %zd lines, %d tool changes", aJob->name.c_str(), a->lines, a->toolChanges);
+    analysisCache->store(aJob->name, aJob->mtime, aJob->size, aJob->content, a);
+  }
+  aJob->analysisCB(a, aError);
+}
+
+
+void BanditMachine::apiAnalysisDone(RequestDoneCB aRequestDoneCB, BanditAnalysisPtr aAnalysis, ErrorPtr aError)
+{
+  if (!aAnalysis) {
+    actionStatus(aRequestDoneCB, aError);
+    return;
+  }
+  aRequestDoneCB(aAnalysis->json(banditComm->byteTime()), ErrorPtr());
+}
+
+
+/// @param aName file name
+/// @return prebuilt transmission image for the file's current contents, NULL if none
+TransmissionImagePtr BanditMachine::cachedImage(const string aName)
+{
+  CatalogEntryPtr e = catalog()->entry(aName);
+  if (!e) return TransmissionImagePtr();
+  BanditAnalysisPtr a = analysisCache->get(e->name, e->mtime, e->size);
+  if (!a) return TransmissionImagePtr();
+  return imageCache->get(a->contentHash);
+}
+
+
+/// build the transmission image for a file in the background, so sending can start immediately
+/// @param aName file name
+/// @note needs the file's analysis (for the content hash), does nothing if it is not yet available
+void BanditMachine::prepareImage(const string aName)
+{
+  CatalogEntryPtr e = catalog()->entry(aName);
+  if (!e) return;
+  BanditAnalysisPtr a = analysisCache->get(e->name, e->mtime, e->size);
+  if (!a) return; // will be called again when analysis is done
+  if (imageCache->get(a->contentHash)) return; // already there
+  if (imageBuilder && imageBuilder->contentHash()==a->contentHash) return; // already building
+  BanditDataSourcePtr source;
+  ErrorPtr err = programSource(dataPath(aName), source, settings.compactmode, settings.arcfitTolerance);
+  if (!Error::isOK(err)) return;
+  if (source->sizeHint()>imageCache->maxImageSize()) {
+    LOG(LOG_INFO, "Machine '%s': '%s' is too large for the image cache, will be sent from file", id.c_str(), aName.c_str());
+    return;
+  }
+  if (imageBuilder) {
+    // only the most recently selected file is worth preparing
+    imageBuilder->cancel();
+  }
+  LOG(LOG_INFO, "Machine '%s': building transmission image for '%s'", id.c_str(), aName.c_str());
+  imageBuilder = TransmissionImageBuilderPtr(new TransmissionImageBuilder(source, a->contentHash));
+  imageBuilder->build(boost::bind(&BanditMachine::imageBuilt, this, imageBuilder.get(), aName, _1, _2), workers, imageCache->maxImageSize());
+}
+
+
+void BanditMachine::imageBuilt(TransmissionImageBuilder *aBuilder, const string aName, TransmissionImagePtr aImage, ErrorPtr aError)
+{
+  if (aBuilder!=imageBuilder.get()) return; // superseded by a newer build
+  imageBuilder.reset();
+  if (!aImage) {
+    LOG(LOG_WARNING, "Cannot build transmission image for '%s': %s", aName.c_str(), aError->description().c_str());
+    return;
+  }
+  if (imageCache->insert(aImage)) {
+    LOG(LOG_INFO, "Transmission image for '%s' ready (%zd bytes, cache now %zd bytes)", aName.c_str(), aImage->data.size(), imageCache->size());
+  }
+  else {
+    LOG(LOG_INFO, "Transmission image for '%s' is too large for cache, will be sent from file", aName.c_str());
+  }
+}
+
+
+/// list files from the catalog
+/// @param aParams optional query parameters:
+///   sort=name|size|mtime, order=asc|desc, filter=<name prefix>, offset=<n>, limit=<n>
+/// @return array of files, or object with total, offset and files array when offset or limit is specified
+JsonObjectPtr BanditMachine::listFiles(JsonObjectPtr aParams)
+{
+  FileCatalog::SortKey sortKey = FileCatalog::sort_name;
+  bool descending = false;
+  string prefix;
+  size_t offset = 0;
+  size_t limit = 0;
+  bool paginated = false;
+  JsonObjectPtr o;
+  if (aParams) {
+    if (aParams->get("sort", o)) {
+      string s = o->stringValue();
+      if (s=="size") sortKey = FileCatalog::sort_size;
+      else if (s=="mtime") sortKey = FileCatalog::sort_mtime;
+    }
+    if (aParams->get("order", o)) descending = o->stringValue()=="desc";
+    if (aParams->get("filter", o)) prefix = o->stringValue();
+    if (aParams->get("offset", o)) { offset = o->int32Value(); paginated = true; }
+    if (aParams->get("limit", o)) { limit = o->int32Value(); paginated = true; }
+  }
+  CatalogEntriesVector found;
+  size_t total = catalog()->query(sortKey, descending, prefix, offset, limit, found);
+  JsonObjectPtr files = JsonObject::newArray();
+  for (CatalogEntriesVector::iterator pos = found.begin(); pos!=found.end(); ++pos) {
+    JsonObjectPtr file = (*pos)->json();
+    file->add("selected", JsonObject::newBool((*pos)->name==selectedfile));
+    // only already cached analyses, listing must not parse files
+    BanditAnalysisPtr a = analysisCache->get((*pos)->name, (*pos)->mtime, (*pos)->size);
+    if (a) file->add("analysis", a->json(banditComm->byteTime()));
+    files->arrayAppend(file);
+  }
+  if (!paginated) return files;
+  JsonObjectPtr result = JsonObject::newObj();
+  result->add("total", JsonObject::newInt64(total));
+  result->add("offset", JsonObject::newInt64(offset));
+  result->add("files", files);
+  return result;
+}
+
+
+// MARK: ==== API
+
+
+bool BanditMachine::processRequest(string aUri, JsonObjectPtr aData, bool aIsAction, RequestDoneCB aRequestDoneCB)
+{
+  ErrorPtr err;
+  JsonObjectPtr o;
+  if (aUri=="files") {
+    // return a list of files
+    string action;
+    if (!aData || !aData->get("action", o)) {
+      aIsAction = false;
+    }
+    else {
+      action = o->stringValue();
+    }
+    if (!aIsAction) {
+      JsonObjectPtr files = listFiles(aData);
+      err = catalog()->error();
+      if (!Error::isOK(err)) {
+        // an empty list would look like an empty directory
+        aRequestDoneCB(JsonObjectPtr(), WebError::webErr(500, "Cannot list files: %s", err->description().c_str()));
+        return true;
+      }
+      aRequestDoneCB(files, ErrorPtr());
+      return true;
+    }
+    else {
+      // a file action
+      if (!aData->get("name", o)) {
+        err = WebError::webErr(400, "Missing 'name'");
+      }
+      else {
+        // addressing a particular file
+        // - try to open to see if it exists
+        string filename = o->c_strValue();
+        string filepath = dataPath(filename);
+        FILE *fileP = fopen(filepath.c_str(),"r");
+        if (fileP==NULL) {
+          err = WebError::webErr(404, "File '%s' not found", filename.c_str());
+        }
+        else {
+          // exists
+          fclose(fileP);
+          if (action=="rename") {
+            // rename file
+            if (!aData->get("newname", o)) {
+              err = WebError::webErr(400, "Missing 'newname'");
+            }
+            else {
+              string newname = o->stringValue();
+              if (newname.size()<3) {
+                err = WebError::webErr(415, "'newname' is too short (min 3 characters)");
+              }
+              else {
+                string newpath = dataPath(newname);
+                if (rename(filepath.c_str(), newpath.c_str())!=0) {
+                  err = SysError::errNo("Cannot rename file: ");
+                }
+                catalog()->update(filename);
+                catalog()->update(newname);
+              }
+            }
+          }
+          else if (action=="delete") {
+            if (unlink(filepath.c_str())!=0) {
+              err = SysError::errNo("Cannot delete file: ");
+            }
+            catalog()->update(filename);
+          }
+          else if (action=="select") {
+            if (selectedfile==filename) {
+              selectedfile.clear(); // unselect
+            }
+            else {
+              selectedfile = filename; // select
+              prepareImage(filename);
+            }
+          }
+          else if (action=="analyze") {
+            CatalogEntryPtr e = catalog()->entry(filename);
+            if (!e) {
+              err = WebError::webErr(404, "File '%s' not found", filename.c_str());
+            }
+            else {
+              analyze(e, boost::bind(&BanditMachine::apiAnalysisDone, this, aRequestDoneCB, _1, _2));
+              return true;
+            }
+          }
+          else if (action=="send") {
+            // queue for sending
+            SendOptions options = defaultSendOptions();
+            options.setFromJson(aData);
+            int priority = aData->get("priority", o) ? o->int32Value() : 0;
+            SendJobPtr job = jobQueue->add(filename, priority, options);
+            aRequestDoneCB(job->json(), ErrorPtr());
+            return true;
+          }
+          else {
+            err = WebError::webErr(400, "Unknown files action");
+          }
+        }
+      }
+    }
+    actionStatus(aRequestDoneCB, err);
+    return true;
+  }
+  else if (aUri=="jobs") {
+    if (!aIsAction || !aData->get("action", o)) {
+      aRequestDoneCB(jobQueue->json(), ErrorPtr());
+      return true;
+    }
+    string action = o->stringValue();
+    uint32_t jobId = aData->get("id", o) ? (uint32_t)o->int64Value() : 0;
+    if (action=="cancel") {
+      if (!jobQueue->cancel(jobId)) err = WebError::webErr(404, "No pending job #%u", jobId);
+    }
+    else if (action=="move") {
+      size_t index = aData->get("index", o) ? o->int32Value() : 0;
+      if (!jobQueue->move(jobId, index)) err = WebError::webErr(404, "No pending job #%u", jobId);
+    }
+    else if (action=="abort") {
+      // by default, do not start next job before operator has checked the machine
+      bool hold = aData->get("hold", o) ? o->boolValue() : true;
+      if (!jobQueue->abortCurrent(hold)) err = WebError::webErr(404, "No job running");
+    }
+    else if (action=="hold") {
+      jobQueue->setHold(aData->get("hold", o) ? o->boolValue() : true);
+    }
+    else {
+      err = WebError::webErr(400, "Unknown jobs action");
+    }
+    actionStatus(aRequestDoneCB, err);
+    return true;
+  }
+  else if (aUri=="linkprofile") {
+    if (!aIsAction || !aData->get("action", o)) {
+      // return active and available profiles
+      JsonObjectPtr res = JsonObject::newObj();
+      res->add("active", banditComm->getLinkProfile().json());
+      res->add("default", defaultLinkProfile.json());
+      res->add("profiles", BanditLinkProfile::predefinedProfiles());
+      aRequestDoneCB(res, ErrorPtr());
+      return true;
+    }
+    string action = o->stringValue();
+    if (action=="set") {
+      // change default profile
+      BanditLinkProfile profile;
+      if (!aData->get("profile", o) || !BanditLinkProfile::lookup(o->stringValue(), profile)) {
+        err = WebError::webErr(400, "Missing or invalid 'profile'");
+      }
+      else {
+        err = banditComm->setLinkProfile(profile);
+        if (Error::isOK(err)) defaultLinkProfile = profile;
+      }
+    }
+    else if (action=="probe") {
+      // find controller's profile, operator must start program output on the controller
+      banditComm->probe(boost::bind(&BanditMachine::apiProbeResult, this, aRequestDoneCB, _1, _2), PROBE_TIMEOUT);
+      return true;
+    }
+    else {
+      err = WebError::webErr(400, "Unknown linkprofile action");
+    }
+    actionStatus(aRequestDoneCB, err);
+    return true;
+  }
+  else if (aUri=="transfer") {
+    // current transfer state and progress
+    JsonObjectPtr res = banditComm->transferStatus();
+    if (!sendingFile.empty()) res->add("file", JsonObject::newString(sendingFile));
+    if (!lastSentFile.empty()) {
+      JsonObjectPtr last = JsonObject::newObj();
+      last->add("file", JsonObject::newString(lastSentFile));
+      last->add("ok", JsonObject::newBool(Error::isOK(lastSendError)));
+      if (!Error::isOK(lastSendError)) last->add("error", JsonObject::newString(lastSendError->description()));
+      last->add("age", JsonObject::newDouble((double)(MainLoop::now()-lastSendEnd)/Second));
+      res->add("last", last);
+    }
+    aRequestDoneCB(res, ErrorPtr());
+    return true;
+  }
+  return false;
+}
@@ -0,0 +1,220 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44bandit.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef __p44bandit__banditmachine__
+#define __p44bandit__banditmachine__
+
+#include "p44utils_common.hpp"
+#include "jsonobject.hpp"
+#include "digitalio.hpp"
+
+#include "banditcomm.hpp"
+#include "banditfiles.hpp"
+#include "banditcompress.hpp"
+#include "filecatalog.hpp"
+#include "banditanalysis.hpp"
+#include "banditimage.hpp"
+#include "banditjobs.hpp"
+#include "jsonapi.hpp"
+#include "eventhub.hpp"
+#include "workerpool.hpp"
+
+#include <list>
+
+using namespace std;
+
+namespace p44 {
+
+
+  /// settings common to all machines
+  class BanditMachineSettings
+  {
+  public:
+    bool rawmode; ///< send/receive raw data
+    bool compactmode; ///< send programs compacted by default
+    double arcfitTolerance; ///< tolerance for fitting arcs, 0 = do not fit arcs by default
+    bool compressStorage; ///< store received and uploaded programs in compressed program format
+
+    BanditMachineSettings();
+  };
+
+
+  /// callback for file analysis
+  /// @param aAnalysis the analysis, NULL in case of error
+  /// @param aError error, if any
+  typedef boost::function<void (BanditAnalysisPtr aAnalysis, ErrorPtr aError)> AnalysisCB;
+
+  class AnalysisJob;
+  typedef boost::intrusive_ptr<AnalysisJob> AnalysisJobPtr;
+  class UploadJob;
+  typedef boost::intrusive_ptr<UploadJob> UploadJobPtr;
+
+  class BanditMachine;
+  typedef boost::intrusive_ptr<BanditMachine> BanditMachinePtr;
+
+  /// one BANDIT controller with its serial or TCP link, handshake lines, LEDs and button,
+  /// send job queue and its own data (sub-)directory.
+  /// All machines of a daemon share the mainloop, the event hub and the transmission image cache.
+  class BanditMachine : public P44Obj
+  {
+    string id; ///< machine id, as used in API requests and events
+    string subDir; ///< sub-directory of the application's data directory, empty to use the data directory itself
+    BanditMachineSettings settings;
+    EventHubPtr eventHub;
+    TransmissionImageCachePtr imageCache;
+    WorkerPoolPtr workers; ///< for file preparation off the mainloop
+
+    // BANDIT communication
+    BanditCommPtr banditComm;
+    BanditLinkProfile defaultLinkProfile; ///< link profile to use unless a job specifies another one
+    SendJobQueuePtr jobQueue; ///< programs to send back-to-back
+
+    // LED+Button
+    ButtonInputPtr button;
+    IndicatorOutputPtr greenLed;
+    IndicatorOutputPtr redLed;
+
+    MLTicket autoReceiveTicket;
+    AtomicFileWriterPtr receiveWriter; ///< receives the data while auto-receiving
+    ProgramCompressorPtr receiveCompressor; ///< compresses the data while auto-receiving, if compressed storage is enabled
+
+    // data dir
+    string selectedfile;
+    FileCatalogPtr fileCatalog;
+    AnalysisCachePtr analysisCache;
+    std::list<string> pendingAnalyses; ///< files waiting to be analyzed in the background
+    bool analyzing; ///< background analysis in progress
+    MLTicket analyzeNextTicket; ///< continues with the next file from the main loop, not nested in the previous one's callback
+    TransmissionImageBuilderPtr imageBuilder;
+
+    // transfer status
+    string sendingFile; ///< name of the file currently being sent
+    string lastSentFile; ///< name of the file sent last
+    ErrorPtr lastSendError; ///< result of the last send
+    MLMicroSeconds lastSendEnd; ///< when the last send completed
+    MLTicket progressTicket;
+
+  public:
+
+    /// create machine
+    /// @param aId machine id
+    /// @param aSubDir sub-directory of the data directory for this machine's files, empty to use the data directory itself
+    /// @param aSettings settings common to all machines
+    /// @param aEventHub the hub to post this machine's events to
+    /// @param aImageCache the transmission image cache (shared, images are identified by content)
+    /// @param aWorkers worker pool for analyzing files, building images and ingesting uploads
+    BanditMachine(const string aId, const string aSubDir, const BanditMachineSettings &aSettings, EventHubPtr aEventHub, TransmissionImageCachePtr aImageCache, WorkerPoolPtr aWorkers);
+
+    /// configure link, handshake lines, LEDs and button
+    /// @param aConfig JSON object with "serialport" (device or host:port), "hsoutpin", "hsinpin", "hsdebounce",
+    ///   "hspoll", "flowcontrol", "enddetect", "linkprofile", "txlowwater", "txhighwater", "button", "greenled", "redled"
+    /// @return error if configuration is invalid
+    ErrorPtr configure(JsonObjectPtr aConfig);
+
+    /// start normal operation: recover interrupted downloads, catalog files, run jobs and receive automatically
+    void start();
+
+    /// @return the machine id
+    const string &getId() { return id; };
+
+    /// @return the communication with the controller
+    BanditCommPtr comm() { return banditComm; };
+
+    /// @param aFile file name
+    /// @return path of the file in this machine's data directory (the directory itself with no file name)
+    string dataPath(const string aFile = "");
+
+    /// get a data source delivering a program file cleaned and framed for sending
+    /// @param aFilePath the program file
+    /// @param aSource will be set to the data source
+    /// @param aCompact if set, the program is rewritten into its shortest equivalent form
+    /// @param aArcFitTolerance if >0, runs of short moves are replaced by lines and arcs within this tolerance
+    ErrorPtr programSource(const string aFilePath, BanditDataSourcePtr &aSource, bool aCompact, double aArcFitTolerance);
+
+    /// process a machine specific API request
+    /// @param aUri the request URI (files, jobs, linkprofile, transfer)
+    /// @param aData the request data, may be NULL for GET requests without parameters
+    /// @param aIsAction set if request is an action (PUT/POST, or GET with parameters)
+    /// @param aRequestDoneCB must be called with the response
+    /// @return false if there is no handler for this URI
+    bool processRequest(string aUri, JsonObjectPtr aData, bool aIsAction, RequestDoneCB aRequestDoneCB);
+
+    /// process an upload into this machine's data directory
+    /// @param aData the request data containing the "cmd"
+    /// @param aUploadedFile path of the uploaded temp file
+    /// @param aDoneCB called when the file is stored (copying and hashing runs in a worker thread)
+    void processUpload(JsonObjectPtr aData, const string aUploadedFile, StatusCB aDoneCB);
+
+    /// @return machine overview for listing machines
+    JsonObjectPtr status();
+
+    /// update the machine's gauges for reporting metrics
+    void sampleMetrics();
+
+  private:
+
+    void postEvent(const char *aType, JsonObjectPtr aData);
+    void errorEvent(const char *aContext, ErrorPtr aError);
+    void ledEvent(const char *aLed, const char *aState);
+    void handshakeEvent(bool aActive);
+    JsonObjectPtr phaseEvent(const char *aPhase);
+
+    void autoReceive();
+    void autoReceivedData(const char *aData, size_t aNumBytes);
+    void autoReceived(const string &aResponse, ErrorPtr aError);
+    void recoverDownloads();
+    void apiProbeResult(RequestDoneCB aRequestDoneCB, const BanditLinkProfile &aProfile, ErrorPtr aError);
+
+    SendOptions defaultSendOptions();
+    ErrorPtr sendFile(const string aFilePath, const SendOptions &aOptions);
+    void restoreLinkProfile();
+    void sendFileComplete(ErrorPtr aError);
+    void sendProgress();
+
+    bool jobReady();
+    ErrorPtr runJob(SendJobPtr aJob);
+    void abortJob(SendJobPtr aJob);
+
+    void buttonHandler(bool aState, bool aHasChanged, MLMicroSeconds aTimeSincePreviousChange);
+
+    FileCatalogPtr catalog();
+    void fileEvent(const string &aName, CatalogEntryPtr aEntry);
+    void catalogChanged(const string &aName, CatalogEntryPtr aEntry);
+    void analyzeNext();
+    void backgroundAnalysisDone(const string aName, BanditAnalysisPtr aAnalysis, ErrorPtr aError);
+    void analyze(CatalogEntryPtr aEntry, AnalysisCB aAnalysisCB);
+    ErrorPtr analysisRoutine(AnalysisJob *aJob);
+    void analysisHashed(AnalysisJobPtr aJob, ErrorPtr aError);
+    void analysisDone(AnalysisJobPtr aJob, ErrorPtr aError);
+    void uploadDone(UploadJobPtr aJob, ErrorPtr aError);
+    void apiAnalysisDone(RequestDoneCB aRequestDoneCB, BanditAnalysisPtr aAnalysis, ErrorPtr aError);
+    TransmissionImagePtr cachedImage(const string aName);
+    void prepareImage(const string aName);
+    void imageBuilt(TransmissionImageBuilder *aBuilder, const string aName, TransmissionImagePtr aImage, ErrorPtr aError);
+    JsonObjectPtr listFiles(JsonObjectPtr aParams);
+
+  };
+
+
+} // namespace p44
+
+#endif /* defined(__p44bandit__banditmachine__) */
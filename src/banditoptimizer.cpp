@@ -0,0 +1,528 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44bandit.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "banditoptimizer.hpp"
+
+#include <math.h>
+
+using namespace p44;
+
+
+#pragma mark - BanditLineFilter
+
+BanditLineFilter::BanditLineFilter() :
+  inBytes(0),
+  outBytes(0),
+  inLines(0),
+  outLines(0)
+{
+}
+
+
+void BanditLineFilter::process(const char *aData, size_t aNumBytes, string &aOutput)
+{
+  inBytes += aNumBytes;
+  const char *e = aData+aNumBytes;
+  while (aData<e) {
+    const char *lf = (const char *)memchr(aData, '\n', e-aData);
+    if (!lf) {
+      line.append(aData, e-aData);
+      break;
+    }
+    line.append(aData, lf-aData);
+    aData = lf+1;
+    inLines++;
+    processLine(line, aOutput);
+    line.clear();
+  }
+}
+
+
+void BanditLineFilter::finish(string &aOutput)
+{
+  if (!line.empty()) {
+    inLines++;
+    processLine(line, aOutput);
+    line.clear();
+  }
+}
+
+
+void BanditLineFilter::outputLine(const string &aLine, string &aOutput)
+{
+  aOutput += aLine;
+  aOutput += '\n';
+  outBytes += aLine.size()+1;
+  outLines++;
+}
+
+
+#pragma mark - LineFilterDataSource
+
+LineFilterDataSource::LineFilterDataSource(BanditDataSourcePtr aSource, BanditLineFilterPtr aFilter) :
+  source(aSource),
+  filter(aFilter),
+  finished(false)
+{
+}
+
+
+size_t LineFilterDataSource::nextChunk(const char *&aChunkP, size_t aMaxBytes, ErrorPtr &aError)
+{
+  buffer.clear();
+  // Note: filtered data may be larger than aMaxBytes
+  while (buffer.empty() && !finished) {
+    const char *data;
+    size_t n = source ? source->nextChunk(data, aMaxBytes, aError) : 0;
+    if (n==0) {
+      if (!Error::isOK(aError)) return 0;
+      filter->finish(buffer);
+      finished = true;
+    }
+    else {
+      filter->process(data, n, buffer);
+    }
+  }
+  aChunkP = buffer.c_str();
+  return buffer.size();
+}
+
+
+#pragma mark - parsing utilities
+
+bool p44::parseBanditLine(const string &aLine, BanditWordsVector &aWords)
+{
+  aWords.clear();
+  const char *p = aLine.c_str();
+  while (*p==' ' || *p=='\t') p++;
+  // skip line number
+  if (*p=='N') {
+    p++;
+    while (isdigit(*p)) p++;
+    while (*p==' ' || *p=='\t' || *p=='&') p++;
+  }
+  while (*p) {
+    if (*p==' ' || *p=='\t') { p++; continue; }
+    if (!isupper(*p)) return false;
+    BanditWord w;
+    w.letter = *p++;
+    const char *n = p;
+    if (*p=='-' || *p=='+') p++;
+    bool digits = false;
+    while (isdigit(*p)) { p++; digits = true; }
+    if (*p=='.') {
+      p++;
+      while (isdigit(*p)) { p++; digits = true; }
+    }
+    if (!digits) return false;
+    w.number.assign(n, p-n);
+    aWords.push_back(w);
+  }
+  return true;
+}
+
+
+string p44::normalizedCoordinate(const string &aNumber)
+{
+  const char *p = aNumber.c_str();
+  bool neg = false;
+  if (*p=='-' || *p=='+') neg = *p++=='-';
+  string ip, fp;
+  while (isdigit(*p)) ip += *p++;
+  if (*p=='.') {
+    p++;
+    while (isdigit(*p)) fp += *p++;
+  }
+  else {
+    // no decimal point: 1/1000 mm
+    if (ip.size()<4) ip.insert(0, 4-ip.size(), '0');
+    fp = ip.substr(ip.size()-3);
+    ip.erase(ip.size()-3);
+  }
+  size_t i = ip.find_first_not_of('0');
+  ip = i==string::npos ? "0" : ip.substr(i);
+  i = fp.find_last_not_of('0');
+  fp = i==string::npos ? "" : fp.substr(0, i+1);
+  if (ip=="0" && fp.empty()) neg = false; // no negative zero
+  return (neg ? "-" : "") + ip + "." + fp;
+}
+
+
+#pragma mark - BanditCompactor
+
+BanditCompactor::BanditCompactor() :
+  mode(mode_unknown),
+  ended(false)
+{
+}
+
+
+void BanditCompactor::forgetPosition()
+{
+  for (int i=0; i<3; i++) pos[i].clear();
+}
+
+
+static int axisIndex(char aLetter)
+{
+  switch (aLetter) {
+    case 'X': case 'I': return 0;
+    case 'Y': case 'J': return 1;
+    case 'Z': case 'K': return 2;
+    default: return -1;
+  }
+}
+
+
+void BanditCompactor::processLine(const string &aLine, string &aOutput)
+{
+  BanditWordsVector words;
+  if (ended || !parseBanditLine(aLine, words)) {
+    // after end of program or not understood: pass unchanged, but no longer trust position
+    forgetPosition();
+    if (aLine.find_first_not_of(" \t")!=string::npos) outputLine(aLine, aOutput);
+    return;
+  }
+  // analyze the line
+  bool setPos = false;
+  bool hasXY = false, hasIJ = false;
+  for (BanditWordsVector::iterator w = words.begin(); w!=words.end(); ++w) {
+    int ax = axisIndex(w->letter);
+    if (ax>=0) w->number = normalizedCoordinate(w->number);
+    if (w->letter=='X' || w->letter=='Y') hasXY = true;
+    else if (w->letter=='I' || w->letter=='J') hasIJ = true;
+    else if (w->letter=='G') {
+      int g = atoi(w->number.c_str());
+      if (g==92) setPos = true;
+    }
+  }
+  bool relative = mode==mode_relative;
+  string np[3] = { pos[0], pos[1], pos[2] }; // new position
+  BanditWordsVector kept;
+  for (BanditWordsVector::iterator w = words.begin(); w!=words.end(); ++w) {
+    int ax = axisIndex(w->letter);
+    bool keep = true;
+    if (w->letter=='G') {
+      int g = atoi(w->number.c_str());
+      if (g==90 || g==91) {
+        keep = mode!=(g==90 ? mode_absolute : mode_relative);
+        mode = g==90 ? mode_absolute : mode_relative;
+        relative = mode==mode_relative;
+        if (relative) forgetPosition();
+      }
+      else if (g==99) {
+        // goes to machine zero
+        forgetPosition();
+        for (int i=0; i<3; i++) np[i].clear();
+      }
+      w->number = string_format("%d", g);
+    }
+    else if (w->letter=='M') {
+      int m = atoi(w->number.c_str());
+      if (m==6) feed.clear(); // re-state feed after tool change
+      else if (m==2 || m==30) ended = true;
+    }
+    else if (w->letter=='F') {
+      if (w->number.find('.')!=string::npos) w->number = normalizedCoordinate(w->number); // same rules, but only when it has a decimal point
+      keep = w->number!=feed;
+      feed = w->number;
+    }
+    else if (ax>=0) {
+      if (setPos) {
+        np[ax] = w->number; // position register set, no move
+      }
+      else if (hasXY && (w->letter=='I' || w->letter=='J')) {
+        // arc center is absolute and always needed
+      }
+      else if (mode==mode_unknown) {
+        // no G90/G91 seen yet: can't tell whether the word changes anything, keep it
+        np[ax].clear();
+      }
+      else if (relative) {
+        keep = w->number!="0."; // zero distance
+      }
+      else if (w->letter=='I' || w->letter=='J') {
+        // rapid XY: keep both words unless the move goes nowhere (checked below)
+        np[ax] = w->number;
+      }
+      else {
+        keep = w->number!=pos[ax];
+        np[ax] = w->number;
+      }
+    }
+    if (keep) kept.push_back(*w);
+  }
+  // moves that go nowhere
+  bool dropIJ = false;
+  if (hasXY && hasIJ) {
+    // arc: center is meaningless when end point is the start point (and would turn the line into a rapid move)
+    dropIJ = true;
+    for (BanditWordsVector::iterator w = kept.begin(); w!=kept.end(); ++w) {
+      if (w->letter=='X' || w->letter=='Y') { dropIJ = false; break; }
+    }
+  }
+  else if (hasIJ && mode==mode_absolute && !setPos) {
+    // rapid XY to where we already are
+    dropIJ = !pos[0].empty() && !pos[1].empty() && np[0]==pos[0] && np[1]==pos[1];
+  }
+  string out;
+  for (BanditWordsVector::iterator w = kept.begin(); w!=kept.end(); ++w) {
+    if (dropIJ && (w->letter=='I' || w->letter=='J')) continue;
+    out += w->letter;
+    out += w->number;
+  }
+  for (int i=0; i<3; i++) pos[i] = relative ? "" : np[i];
+  if (!out.empty()) outputLine(out, aOutput);
+}
+
+
+#pragma mark - BanditArcFitter
+
+#define MAX_FIT_POINTS 256 // max number of original points to replace by a single line or arc
+#define MAX_RUN_POINTS (4*MAX_FIT_POINTS) // longer runs are fitted up to where the remaining points cannot influence the result
+#define MIN_ARC_SEGMENTS 3 // min number of original segments to replace by an arc
+#define MAX_ARC_RADIUS 10000.0 // larger circles are treated as lines
+#define MAX_ARC_MISSES 16 // number of consecutive non-fitting end points before giving up extending an arc
+
+BanditArcFitter::BanditArcFitter(double aTolerance) :
+  tolerance(aTolerance)
+{
+  st.mode = BanditPosState::mode_unknown;
+  st.ended = false;
+  for (int i=0; i<3; i++) { st.known[i] = false; st.pos[i] = 0; }
+}
+
+
+static string fittedCoordinate(double aValue)
+{
+  return normalizedCoordinate(string_format("%.3f", aValue));
+}
+
+
+void BanditArcFitter::updateState(const BanditWordsVector &aWords)
+{
+  bool setPos = false;
+  bool hasXY = false;
+  for (BanditWordsVector::const_iterator w = aWords.begin(); w!=aWords.end(); ++w) {
+    if (w->letter=='G') {
+      int g = atoi(w->number.c_str());
+      if (g==90) st.mode = BanditPosState::mode_absolute;
+      else if (g==91) st.mode = BanditPosState::mode_relative;
+      else if (g==92) setPos = true;
+      else if (g==99) for (int i=0; i<3; i++) st.known[i] = false;
+    }
+    else if (w->letter=='M') {
+      int m = atoi(w->number.c_str());
+      if (m==2 || m==30) st.ended = true;
+    }
+    else if (w->letter=='X' || w->letter=='Y') {
+      hasXY = true;
+    }
+  }
+  if (st.mode!=BanditPosState::mode_absolute) {
+    // relative, or not yet known whether words are positions or distances
+    for (int i=0; i<3; i++) st.known[i] = false;
+    if (!setPos) return;
+  }
+  for (BanditWordsVector::const_iterator w = aWords.begin(); w!=aWords.end(); ++w) {
+    int ax = axisIndex(w->letter);
+    if (ax<0) continue;
+    if (hasXY && !setPos && (w->letter=='I' || w->letter=='J')) continue; // arc center, not a position
+    st.posStr[ax] = normalizedCoordinate(w->number);
+    st.pos[ax] = strtod(st.posStr[ax].c_str(), NULL);
+    st.known[ax] = true;
+  }
+}
+
+
+void BanditArcFitter::processLine(const string &aLine, string &aOutput)
+{
+  BanditWordsVector words;
+  if (st.ended || !parseBanditLine(aLine, words)) {
+    flushRun(aOutput);
+    for (int i=0; i<3; i++) st.known[i] = false;
+    if (aLine.find_first_not_of(" \t")!=string::npos) outputLine(aLine, aOutput);
+    return;
+  }
+  // check for plain linear XY move in absolute mode from a known position
+  bool plainXY = !words.empty() && st.mode==BanditPosState::mode_absolute && st.known[0] && st.known[1];
+  for (BanditWordsVector::iterator w = words.begin(); plainXY && w!=words.end(); ++w) {
+    if (w->letter!='X' && w->letter!='Y') plainXY = false;
+  }
+  if (plainXY) {
+    if (run.empty()) {
+      FitPoint p = { st.pos[0], st.pos[1], st.posStr[0], st.posStr[1] };
+      run.push_back(p);
+    }
+    updateState(words);
+    FitPoint p = { st.pos[0], st.pos[1], st.posStr[0], st.posStr[1] };
+    run.push_back(p);
+    if (run.size()>MAX_RUN_POINTS) flushRun(aOutput, false); // keep memory bounded
+    return;
+  }
+  flushRun(aOutput);
+  updateState(words);
+  string out;
+  for (BanditWordsVector::iterator w = words.begin(); w!=words.end(); ++w) {
+    out += w->letter;
+    out += w->number;
+  }
+  if (!out.empty()) outputLine(out, aOutput);
+}
+
+
+void BanditArcFitter::finish(string &aOutput)
+{
+  inherited::finish(aOutput);
+  flushRun(aOutput);
+}
+
+
+/// @return index of the last point of the run that can be reached from aStart by a single line
+size_t BanditArcFitter::lineFit(size_t aStart)
+{
+  size_t best = aStart+1;
+  size_t lim = std::min(run.size()-1, aStart+MAX_FIT_POINTS);
+  const FitPoint &s = run[aStart];
+  for (size_t e=aStart+2; e<=lim; e++) {
+    double dx = run[e].x-s.x, dy = run[e].y-s.y;
+    double len = sqrt(dx*dx+dy*dy);
+    if (len<=tolerance) break;
+    // all points in between must be near the line, and in order
+    bool ok = true;
+    double lastT = 0;
+    for (size_t i=aStart+1; i<e && ok; i++) {
+      double px = run[i].x-s.x, py = run[i].y-s.y;
+      double t = (px*dx+py*dy)/len; // position along line
+      double d = fabs(px*dy-py*dx)/len; // distance from line
+      if (d>tolerance || t<lastT || t>len) ok = false;
+      lastT = t;
+    }
+    if (!ok) break;
+    best = e;
+  }
+  return best;
+}
+
+
+bool BanditArcFitter::arcFits(size_t aStart, size_t aEnd, double &aCX, double &aCY)
+{
+  // circle through start, middle and end point
+  const FitPoint &a = run[aStart];
+  const FitPoint &b = run[(aStart+aEnd)/2];
+  const FitPoint &c = run[aEnd];
+  double d = 2*(a.x*(b.y-c.y)+b.x*(c.y-a.y)+c.x*(a.y-b.y));
+  if (fabs(d)<1e-9) return false; // collinear
+  double a2 = a.x*a.x+a.y*a.y, b2 = b.x*b.x+b.y*b.y, c2 = c.x*c.x+c.y*c.y;
+  double cx = (a2*(b.y-c.y)+b2*(c.y-a.y)+c2*(a.y-b.y))/d;
+  double cy = (a2*(c.x-b.x)+b2*(a.x-c.x)+c2*(b.x-a.x))/d;
+  double r = sqrt((a.x-cx)*(a.x-cx)+(a.y-cy)*(a.y-cy));
+  if (r>MAX_ARC_RADIUS) return false;
+  // center as it will be transmitted
+  cx = strtod(fittedCoordinate(cx).c_str(), NULL);
+  cy = strtod(fittedCoordinate(cy).c_str(), NULL);
+  // BANDIT derives the direction of the arc from the quadrant its end points are in, so these must be on the
+  // same side of both axes through the transmitted center (exactly, points near the axes are checked below with tolerance)
+  double sx = a.x-cx, sy = a.y-cy, ex = c.x-cx, ey = c.y-cy;
+  if ((sx<0 && ex>0) || (sx>0 && ex<0) || (sy<0 && ey>0) || (sy>0 && ey<0)) return false;
+  // all points must be near the circle, within the same quadrant, turning in the same direction,
+  // and the original segments must not deviate more than the tolerance from the arc
+  double dir = 0;
+  bool xNeg = false, xPos = false, yNeg = false, yPos = false;
+  for (size_t i=aStart; i<=aEnd; i++) {
+    double px = run[i].x-cx, py = run[i].y-cy;
+    double pr = sqrt(px*px+py*py);
+    if (fabs(pr-r)>tolerance) return false;
+    if (px<-tolerance) xNeg = true; else if (px>tolerance) xPos = true;
+    if (py<-tolerance) yNeg = true; else if (py>tolerance) yPos = true;
+    if ((xNeg && xPos) || (yNeg && yPos)) return false; // crosses quadrant border
+    if (i>aStart) {
+      double qx = run[i-1].x-cx, qy = run[i-1].y-cy;
+      double cross = qx*py-qy*px;
+      if (dir==0) dir = cross;
+      else if ((dir>0)!=(cross>0)) return false; // changes direction
+      double segLen = sqrt((px-qx)*(px-qx)+(py-qy)*(py-qy));
+      double sagitta = r-sqrt(std::max(0.0, r*r-segLen*segLen/4));
+      if (sagitta>tolerance) return false;
+    }
+  }
+  aCX = cx;
+  aCY = cy;
+  return true;
+}
+
+
+/// @return index of the last point of the run that can be reached from aStart by a single arc, aStart if none
+size_t BanditArcFitter::arcFit(size_t aStart, double &aCX, double &aCY)
+{
+  size_t best = aStart;
+  size_t lim = std::min(run.size()-1, aStart+MAX_FIT_POINTS);
+  int misses = 0;
+  for (size_t e=aStart+MIN_ARC_SEGMENTS; e<=lim; e++) {
+    double cx, cy;
+    if (!arcFits(aStart, e, cx, cy)) {
+      // short arcs through rounded coordinates may miss, while longer ones fit again
+      if (++misses>MAX_ARC_MISSES) break;
+      continue;
+    }
+    misses = 0;
+    best = e;
+    aCX = cx;
+    aCY = cy;
+  }
+  return best;
+}
+
+
+void BanditArcFitter::flushRun(string &aOutput, bool aComplete)
+{
+  if (run.empty()) return;
+  size_t s = 0;
+  while (s+1<run.size()) {
+    if (!aComplete && s+MAX_FIT_POINTS>run.size()-1) break; // needs points not yet seen
+    size_t le = lineFit(s);
+    double cx = 0, cy = 0;
+    size_t ae = arcFit(s, cx, cy);
+    string out;
+    if (ae>le) {
+      const FitPoint &p = run[ae];
+      out = "X" + p.xs + "Y" + p.ys + "I" + fittedCoordinate(cx) + "J" + fittedCoordinate(cy);
+      s = ae;
+    }
+    else {
+      const FitPoint &p = run[le];
+      out = "X" + p.xs + "Y" + p.ys;
+      s = le;
+    }
+    outputLine(out, aOutput);
+  }
+  if (aComplete) run.clear();
+  else run.erase(run.begin(), run.begin()+s); // end point of last output becomes start point of the rest
+}
+
+
+#pragma mark - ArcFittingDataSource
+
+ArcFittingDataSource::ArcFittingDataSource(BanditDataSourcePtr aSource, double aTolerance) :
+  inherited(aSource, BanditLineFilterPtr(new BanditArcFitter(aTolerance)))
+{
+}
@@ -0,0 +1,216 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44bandit.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef __p44bandit__banditoptimizer__
+#define __p44bandit__banditoptimizer__
+
+#include "p44utils_common.hpp"
+
+#include "banditdata.hpp"
+
+using namespace std;
+
+namespace p44 {
+
+
+  class BanditLineFilter;
+  typedef boost::intrusive_ptr<BanditLineFilter> BanditLineFilterPtr;
+
+  /// base class for filters rewriting cleaned (uppercase, LF line ends, no comments) program data line by line
+  class BanditLineFilter : public P44Obj
+  {
+    string line;
+
+  public:
+
+    size_t inBytes; ///< number of bytes processed
+    size_t outBytes; ///< number of bytes output
+    size_t inLines; ///< number of lines processed
+    size_t outLines; ///< number of lines output
+
+    BanditLineFilter();
+
+    /// process a chunk of data
+    /// @param aData the data
+    /// @param aNumBytes number of bytes in aData
+    /// @param aOutput the filtered data is appended to this string
+    void process(const char *aData, size_t aNumBytes, string &aOutput);
+
+    /// signal end of data
+    /// @param aOutput possibly pending filtered data is appended to this string
+    virtual void finish(string &aOutput);
+
+  protected:
+
+    /// process a single line
+    /// @param aLine the line, without line end
+    /// @param aOutput append filtered line(s) including LF line end(s) here
+    virtual void processLine(const string &aLine, string &aOutput) = 0;
+
+    /// append a line to the output and count it
+    void outputLine(const string &aLine, string &aOutput);
+
+  };
+
+
+  /// data source filtering the data of another source on the fly
+  class LineFilterDataSource : public BanditDataSource
+  {
+    typedef BanditDataSource inherited;
+
+    BanditDataSourcePtr source;
+    BanditLineFilterPtr filter;
+    string buffer;
+    bool finished;
+
+  public:
+
+    LineFilterDataSource(BanditDataSourcePtr aSource, BanditLineFilterPtr aFilter);
+
+    virtual size_t nextChunk(const char *&aChunkP, size_t aMaxBytes, ErrorPtr &aError);
+    virtual size_t sizeHint() { return source ? source->sizeHint() : 0; };
+
+  };
+
+
+  /// a single word (letter and number) of a program line
+  typedef struct {
+    char letter;
+    string number;
+  } BanditWord;
+  typedef std::vector<BanditWord> BanditWordsVector;
+
+  /// split a program line into words
+  /// @param aLine the line (line number, if any, is skipped)
+  /// @param aWords will receive the words
+  /// @return false if line contains anything that is not a word
+  bool parseBanditLine(const string &aLine, BanditWordsVector &aWords);
+
+  /// bring a coordinate into its shortest form that still has a decimal point (without decimal point,
+  /// BANDIT reads numbers as 1/1000 mm), e.g. "010.500" -> "10.5", "1500" -> "1.5", "0.000" -> "0."
+  /// @param aNumber number as found in program
+  /// @return normalized number, equal values always have identical normalized strings
+  string normalizedCoordinate(const string &aNumber);
+
+
+  class BanditCompactor;
+  typedef boost::intrusive_ptr<BanditCompactor> BanditCompactorPtr;
+
+  /// rewrites a program into the smallest equivalent form, by
+  /// - removing line numbers (regenerated when cleaning for sending anyway) and blanks
+  /// - normalizing numbers (keeping the decimal point)
+  /// - omitting axis words not changing the position, repeated feed rates and G90/G91
+  /// - dropping moves that go nowhere
+  class BanditCompactor : public BanditLineFilter
+  {
+    typedef BanditLineFilter inherited;
+
+    enum { mode_unknown, mode_absolute, mode_relative } mode;
+    string pos[3]; ///< current X,Y,Z (normalized), empty if unknown
+    string feed; ///< current feed, empty if unknown
+    bool ended;
+
+  public:
+
+    BanditCompactor();
+
+  protected:
+
+    virtual void processLine(const string &aLine, string &aOutput);
+
+  private:
+
+    void forgetPosition();
+
+  };
+
+
+  /// state of the machine position, as needed to continue processing a program in the middle
+  typedef struct {
+    enum { mode_unknown, mode_absolute, mode_relative } mode;
+    bool known[3]; ///< set if X,Y,Z position is known
+    double pos[3]; ///< current X,Y,Z
+    string posStr[3]; ///< current X,Y,Z as normalized coordinate strings
+    bool ended; ///< program has ended (M2/M30)
+  } BanditPosState;
+
+
+  class BanditArcFitter;
+  typedef boost::intrusive_ptr<BanditArcFitter> BanditArcFitterPtr;
+
+  /// replaces runs of short linear XY moves by fewer lines and quadrant-bounded arcs
+  /// (X/Y end point with absolute I/J center), deviating no more than a given tolerance from the original path
+  class BanditArcFitter : public BanditLineFilter
+  {
+    typedef BanditLineFilter inherited;
+
+    typedef struct {
+      double x, y;
+      string xs, ys;
+    } FitPoint;
+    typedef std::vector<FitPoint> FitPointsVector;
+
+    double tolerance;
+    BanditPosState st;
+    FitPointsVector run; ///< current run of linear XY moves, starting with the start point
+
+  public:
+
+    /// @param aTolerance max deviation from the original path in mm
+    BanditArcFitter(double aTolerance);
+
+    virtual void finish(string &aOutput);
+
+  protected:
+
+    virtual void processLine(const string &aLine, string &aOutput);
+
+  private:
+
+    void updateState(const BanditWordsVector &aWords);
+    /// output the current run as lines and arcs
+    /// @param aComplete if not set, only the part of the run no fit can reach beyond is output (with the same
+    ///   result as if the run was complete), and the rest is kept for fitting with points still to come
+    void flushRun(string &aOutput, bool aComplete = true);
+    size_t lineFit(size_t aStart);
+    size_t arcFit(size_t aStart, double &aCX, double &aCY);
+    bool arcFits(size_t aStart, size_t aEnd, double &aCX, double &aCY);
+
+  };
+
+
+  /// data source fitting arcs to the data from another source on the fly. Memory use is bounded, as the fitter
+  /// only holds back as many points as a single fit can span.
+  class ArcFittingDataSource : public LineFilterDataSource
+  {
+    typedef LineFilterDataSource inherited;
+
+  public:
+
+    ArcFittingDataSource(BanditDataSourcePtr aSource, double aTolerance);
+
+  };
+
+
+} // namespace p44
+
+#endif /* defined(__p44bandit__banditoptimizer__) */
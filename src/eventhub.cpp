@@ -0,0 +1,158 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44bandit.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+
+#include "eventhub.hpp"
+#include "socketcomm.hpp"
+
+using namespace p44;
+
+
+#pragma mark - EventSubscriber
+
+EventSubscriber::EventSubscriber(FdCommPtr aConnection, uint64_t aCursor) :
+  conn(aConnection),
+  cursor(aCursor),
+  offset(0),
+  waiting(false)
+{
+}
+
+
+#pragma mark - EventHub
+
+EventHub::EventHub(size_t aMaxEvents) :
+  firstSeq(1),
+  maxEvents(aMaxEvents)
+{
+}
+
+
+EventHub::~EventHub()
+{
+  while (!subscribers.empty()) {
+    drop(subscribers.front(), "shutting down");
+  }
+}
+
+
+void EventHub::post(const char *aType, JsonObjectPtr aData)
+{
+  if (!aData) aData = JsonObject::newObj();
+  aData->add("type", JsonObject::newString(aType));
+  aData->add("seq", JsonObject::newInt64(nextSeq()));
+  aData->add("time", JsonObject::newDouble((double)MainLoop::mainLoopTimeToUnixTime(MainLoop::now())/Second));
+  events.push_back(aData->json_str()+"\n");
+  if (events.size()>maxEvents) {
+    events.pop_front();
+    firstSeq++;
+  }
+  SubscriberList::iterator pos = subscribers.begin();
+  while (pos!=subscribers.end()) {
+    EventSubscriberPtr s = *pos++; // advance first, s might get dropped
+    if (!s->waiting) {
+      sendPending(s);
+    }
+    else if (s->cursor<firstSeq) {
+      // still blocked, and now behind the buffer
+      drop(s, "too slow, missed events");
+    }
+    // otherwise, will continue when connection becomes writable
+  }
+}
+
+
+uint64_t EventHub::subscribe(FdCommPtr aConnection, uint64_t aSince)
+{
+  uint64_t cursor = nextSeq();
+  if (aSince>0 && aSince<cursor) cursor = aSince<firstSeq ? firstSeq : aSince;
+  EventSubscriberPtr s = EventSubscriberPtr(new EventSubscriber(aConnection, cursor));
+  subscribers.push_back(s);
+  // we don't expect requests any more, but must notice the client going away
+  aConnection->setReceiveHandler(boost::bind(&EventHub::writable, this, s, _1));
+  LOG(LOG_INFO, "Event subscriber added, starting at #%llu (%zu subscribers)", (unsigned long long)cursor, subscribers.size());
+  sendPending(s);
+  return cursor;
+}
+
+
+void EventHub::sendPending(EventSubscriberPtr aSubscriber)
+{
+  while (aSubscriber->cursor<nextSeq()) {
+    if (aSubscriber->cursor<firstSeq) {
+      drop(aSubscriber, "too slow, missed events");
+      return;
+    }
+    const string &ev = events[aSubscriber->cursor-firstSeq];
+    ErrorPtr err;
+    size_t n = aSubscriber->conn->transmitBytes(ev.size()-aSubscriber->offset, (const uint8_t *)ev.c_str()+aSubscriber->offset, err);
+    if (!Error::isOK(err)) {
+      drop(aSubscriber, "write error");
+      return;
+    }
+    aSubscriber->offset += n;
+    if (aSubscriber->offset<ev.size()) {
+      // socket buffer full, continue when writable
+      aSubscriber->waiting = true;
+      aSubscriber->conn->setTransmitHandler(boost::bind(&EventHub::writable, this, aSubscriber, _1));
+      return;
+    }
+    aSubscriber->offset = 0;
+    aSubscriber->cursor++;
+  }
+  if (aSubscriber->waiting) {
+    aSubscriber->waiting = false;
+    aSubscriber->conn->setTransmitHandler(NULL);
+  }
+}
+
+
+void EventHub::writable(EventSubscriberPtr aSubscriber, ErrorPtr aError)
+{
+  if (!Error::isOK(aError)) {
+    drop(aSubscriber, "connection closed");
+    return;
+  }
+  if (aSubscriber->conn->numBytesReady()>0) {
+    // discard anything the client sends
+    string dummy;
+    aSubscriber->conn->receiveString(dummy);
+  }
+  sendPending(aSubscriber);
+}
+
+
+void EventHub::drop(EventSubscriberPtr aSubscriber, const char *aReason)
+{
+  for (SubscriberList::iterator pos = subscribers.begin(); pos!=subscribers.end(); ++pos) {
+    if (*pos==aSubscriber) {
+      subscribers.erase(pos);
+      LOG(LOG_INFO, "Event subscriber dropped: %s (%zu subscribers left)", aReason, subscribers.size());
+      aSubscriber->conn->setTransmitHandler(NULL);
+      aSubscriber->conn->setReceiveHandler(NULL);
+      SocketCommPtr sc = boost::dynamic_pointer_cast<SocketComm>(aSubscriber->conn);
+      if (sc) sc->closeConnection();
+      else aSubscriber->conn->stopMonitoringAndClose();
+      return;
+    }
+  }
+}
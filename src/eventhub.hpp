@@ -0,0 +1,109 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44bandit.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+
+#ifndef __p44bandit__eventhub__
+#define __p44bandit__eventhub__
+
+#include "p44utils_common.hpp"
+#include "jsonobject.hpp"
+#include "fdcomm.hpp"
+
+#include <deque>
+#include <list>
+
+using namespace std;
+
+namespace p44 {
+
+
+  class EventSubscriber;
+  typedef boost::intrusive_ptr<EventSubscriber> EventSubscriberPtr;
+
+  class EventHub;
+  typedef boost::intrusive_ptr<EventHub> EventHubPtr;
+
+  /// a connection receiving events
+  class EventSubscriber : public P44Obj
+  {
+    friend class EventHub;
+
+    FdCommPtr conn;
+    uint64_t cursor; ///< sequence number of the next event to send
+    size_t offset; ///< bytes of the event at cursor already sent
+    bool waiting; ///< set while waiting for the connection to become writable
+
+    EventSubscriber(FdCommPtr aConnection, uint64_t aCursor);
+  };
+
+
+  /// broadcasts events as newline-delimited JSON objects to any number of subscribers.
+  /// Events are kept once in a bounded buffer; each subscriber only has a cursor into it.
+  /// Subscribers that fall behind so far that their next event has been dropped from the
+  /// buffer are disconnected, so a slow client never stalls the mainloop or grows memory.
+  class EventHub : public P44Obj
+  {
+    typedef std::list<EventSubscriberPtr> SubscriberList;
+
+    std::deque<string> events; ///< serialized events, oldest first
+    uint64_t firstSeq; ///< sequence number of events.front()
+    size_t maxEvents;
+    SubscriberList subscribers;
+
+  public:
+
+    /// @param aMaxEvents number of events to buffer
+    EventHub(size_t aMaxEvents);
+    virtual ~EventHub();
+
+    /// post an event to all subscribers
+    /// @param aType event type
+    /// @param aData event fields, can be NULL. "type", "seq" and "time" are added.
+    void post(const char *aType, JsonObjectPtr aData = JsonObjectPtr());
+
+    /// add a subscriber
+    /// @param aConnection connection to send events to
+    /// @param aSince if >0, replay buffered events with sequence numbers >= aSince, if still available
+    /// @return sequence number of the first event the subscriber will get
+    uint64_t subscribe(FdCommPtr aConnection, uint64_t aSince = 0);
+
+    /// @return true if anyone is listening (allows skipping expensive events)
+    bool hasSubscribers() { return !subscribers.empty(); };
+
+    /// @return number of subscribers
+    size_t numSubscribers() { return subscribers.size(); };
+
+    /// @return sequence number the next event will get
+    uint64_t nextSeq() { return firstSeq+events.size(); };
+
+  private:
+
+    void sendPending(EventSubscriberPtr aSubscriber);
+    void writable(EventSubscriberPtr aSubscriber, ErrorPtr aError);
+    void drop(EventSubscriberPtr aSubscriber, const char *aReason);
+
+  };
+
+
+} // namespace p44
+
+#endif /* defined(__p44bandit__eventhub__) */
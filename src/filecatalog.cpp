@@ -0,0 +1,393 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44bandit.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "filecatalog.hpp"
+
+#include "banditdata.hpp"
+#include "banditcompress.hpp"
+
+#include <dirent.h>
+#include <algorithm>
+#include <set>
+#if defined(__linux__)
+  #include <sys/inotify.h>
+#endif
+
+using namespace p44;
+
+
+#pragma mark - CatalogEntry
+
+JsonObjectPtr CatalogEntry::json()
+{
+  JsonObjectPtr file = JsonObject::newObj();
+  file->add("name", JsonObject::newString(name));
+  file->add("ino", JsonObject::newInt64(ino));
+  file->add("type", JsonObject::newInt64(type));
+  file->add("size", JsonObject::newInt64(size));
+  file->add("mtime", JsonObject::newInt64(mtime));
+  if (contentKnown) {
+    file->add("logicalSize", JsonObject::newInt64(content.logicalSize));
+    file->add("compressed", JsonObject::newBool(content.compressed));
+    file->add("lines", JsonObject::newInt64(content.lines));
+  }
+  return file;
+}
+
+
+#pragma mark - FileCatalog
+
+FileCatalog::FileCatalog() :
+  watchFd(-1),
+  dirMtime(0)
+{
+  invalidateSorting();
+}
+
+
+FileCatalog::~FileCatalog()
+{
+  if (watchFd>=0) {
+    MainLoop::currentMainLoop().unregisterPollHandler(watchFd);
+    close(watchFd);
+  }
+}
+
+
+ErrorPtr FileCatalog::open(const string aDirPath)
+{
+  dirPath = aDirPath;
+  #if defined(__linux__)
+  if (watchFd<0) {
+    watchFd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if (watchFd>=0) {
+      if (inotify_add_watch(watchFd, dirPath.c_str(), IN_CLOSE_WRITE|IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_ATTRIB|IN_DELETE_SELF)<0) {
+        LOG(LOG_WARNING, "Cannot watch '%s' for changes, falling back to checking directory mtime", dirPath.c_str());
+        close(watchFd);
+        watchFd = -1;
+      }
+      else {
+        MainLoop::currentMainLoop().registerPollHandler(watchFd, POLLIN, boost::bind(&FileCatalog::watchHandler, this, _1, _2));
+      }
+    }
+  }
+  #endif
+  return rescan();
+}
+
+
+ErrorPtr FileCatalog::rescan()
+{
+  DIR *dirP = opendir(dirPath.c_str());
+  if (dirP==NULL) {
+    scanError = SysError::errNo("Cannot read data directory: ");
+    return scanError;
+  }
+  scanError.reset();
+  struct stat ds;
+  if (stat(dirPath.c_str(), &ds)==0) dirMtime = ds.st_mtime;
+  // collect names
+  std::set<string> present;
+  struct dirent *direntP;
+  while ((direntP = readdir(dirP))!=NULL) {
+    string fn = direntP->d_name;
+    if (fn.empty() || fn[0]=='.') continue; // ., .. and hidden (temporary) files
+    present.insert(fn);
+  }
+  closedir(dirP);
+  // remove vanished entries
+  EntryMap::iterator pos = entries.begin();
+  while (pos!=entries.end()) {
+    string name = pos->first;
+    ++pos;
+    if (present.find(name)==present.end()) removeEntry(name);
+  }
+  // add new and update changed entries
+  for (std::set<string>::iterator npos = present.begin(); npos!=present.end(); ++npos) {
+    update(*npos);
+  }
+  return ErrorPtr();
+}
+
+
+void FileCatalog::update(const string aName)
+{
+  if (aName.empty() || aName[0]=='.') return; // hidden (temporary) file
+  string path = dirPath + "/" + aName;
+  struct stat fs;
+  if (stat(path.c_str(), &fs)!=0) {
+    removeEntry(aName);
+    return;
+  }
+  CatalogEntryPtr e = entry(aName);
+  if (e && e->ino==fs.st_ino && e->size==fs.st_size && e->mtime==fs.st_mtime) {
+    return; // unchanged
+  }
+  if (e) removeSorted(e);
+  e = CatalogEntryPtr(new CatalogEntry);
+  e->name = aName;
+  e->ino = fs.st_ino;
+  e->type = S_ISDIR(fs.st_mode) ? DT_DIR : (S_ISREG(fs.st_mode) ? DT_REG : DT_UNKNOWN);
+  e->size = fs.st_size;
+  e->mtime = fs.st_mtime;
+  e->contentKnown = false;
+  entries[aName] = e;
+  addSorted(e);
+  LOG(LOG_DEBUG, "Catalog: updated '%s' (%lld bytes)", aName.c_str(), (long long)e->size);
+  if (changedCB) changedCB(aName, e);
+}
+
+
+ErrorPtr FileCatalog::countContent(const string aPath, CatalogContentInfo &aContent)
+{
+  aContent.logicalSize = 0;
+  aContent.compressed = false;
+  aContent.lines = 0;
+  MappedFileDataSource *mappedSource = new MappedFileDataSource;
+  BanditDataSourcePtr src = BanditDataSourcePtr(mappedSource);
+  ErrorPtr err = mappedSource->open(aPath);
+  if (!Error::isOK(err)) return err;
+  aContent.logicalSize = mappedSource->sizeHint();
+  if (isCompressedProgram(mappedSource->data(), mappedSource->sizeHint())) {
+    // count in the expanded data, block by block
+    aContent.compressed = true;
+    uint64_t logicalSize;
+    compressedProgramSize(mappedSource->data(), mappedSource->sizeHint(), logicalSize);
+    aContent.logicalSize = logicalSize;
+    src = BanditDataSourcePtr(new DecompressingDataSource(src, logicalSize));
+  }
+  const char *chunk;
+  size_t n;
+  char last = '\n';
+  while ((n = src->nextChunk(chunk, BLZ_MAX_BLOCK_SIZE, err))>0) {
+    const char *p = chunk;
+    const char *end = chunk+n;
+    while ((p = (const char *)memchr(p, '\n', end-p))!=NULL) {
+      aContent.lines++;
+      p++;
+    }
+    last = *(end-1);
+  }
+  if (last!='\n') aContent.lines++; // last line without line end
+  return err;
+}
+
+
+CatalogEntryPtr FileCatalog::setContent(const string aName, time_t aMtime, off_t aSize, const CatalogContentInfo &aContent)
+{
+  CatalogEntryPtr e = entry(aName);
+  if (!e || e->contentKnown || e->mtime!=aMtime || e->size!=aSize) return CatalogEntryPtr(); // already known, or changed meanwhile
+  e->content = aContent;
+  e->contentKnown = true;
+  LOG(LOG_DEBUG, "Catalog: '%s' has %lld bytes expanded, %zd lines", aName.c_str(), (long long)aContent.logicalSize, aContent.lines);
+  return e;
+}
+
+
+void FileCatalog::removeEntry(const string aName)
+{
+  EntryMap::iterator pos = entries.find(aName);
+  if (pos==entries.end()) return;
+  removeSorted(pos->second);
+  entries.erase(pos);
+  LOG(LOG_DEBUG, "Catalog: removed '%s'", aName.c_str());
+  if (changedCB) changedCB(aName, CatalogEntryPtr());
+}
+
+
+CatalogEntryPtr FileCatalog::entry(const string aName)
+{
+  checkForChanges();
+  EntryMap::iterator pos = entries.find(aName);
+  if (pos==entries.end()) return CatalogEntryPtr();
+  return pos->second;
+}
+
+
+void FileCatalog::checkForChanges()
+{
+  if (!Error::isOK(scanError)) {
+    rescan(); // directory could not be read before, try again
+    return;
+  }
+  if (watchFd>=0) return; // watched, always up-to-date
+  // no change notification, check directory's mtime
+  struct stat ds;
+  if (stat(dirPath.c_str(), &ds)==0 && ds.st_mtime!=dirMtime) {
+    rescan();
+  }
+}
+
+
+bool FileCatalog::watchHandler(int aFd, int aPollFlags)
+{
+  #if defined(__linux__)
+  if (aPollFlags & POLLIN) {
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    bool needsRescan = false;
+    while ((n = read(aFd, buf, sizeof(buf)))>0) {
+      for (char *p = buf; p<buf+n; p += sizeof(struct inotify_event)+((struct inotify_event *)p)->len) {
+        struct inotify_event *ev = (struct inotify_event *)p;
+        if (ev->mask & (IN_Q_OVERFLOW|IN_DELETE_SELF|IN_IGNORED)) {
+          needsRescan = true;
+          continue;
+        }
+        if (ev->len==0) continue;
+        string name = ev->name;
+        if (ev->mask & (IN_DELETE|IN_MOVED_FROM)) {
+          removeEntry(name);
+        }
+        else {
+          update(name);
+        }
+      }
+    }
+    if (needsRescan) {
+      LOG(LOG_INFO, "Catalog: change events lost, rescanning '%s'", dirPath.c_str());
+      rescan();
+    }
+  }
+  #endif
+  return true;
+}
+
+
+// MARK: - queries
+
+void FileCatalog::invalidateSorting()
+{
+  for (int k=0; k<numSortKeys; k++) {
+    sortedValid[k] = false;
+    sorted[k].clear();
+  }
+}
+
+
+static bool lessByName(const CatalogEntryPtr &a, const CatalogEntryPtr &b)
+{
+  return a->name<b->name;
+}
+
+
+static bool lessBySize(const CatalogEntryPtr &a, const CatalogEntryPtr &b)
+{
+  if (a->size!=b->size) return a->size<b->size;
+  return a->name<b->name;
+}
+
+
+static bool lessByMtime(const CatalogEntryPtr &a, const CatalogEntryPtr &b)
+{
+  if (a->mtime!=b->mtime) return a->mtime<b->mtime;
+  return a->name<b->name;
+}
+
+
+static bool entryNameLess(const CatalogEntryPtr &a, const string &aName)
+{
+  return a->name<aName;
+}
+
+
+typedef bool (*EntryLessFunc)(const CatalogEntryPtr &a, const CatalogEntryPtr &b);
+static const EntryLessFunc entryLess[FileCatalog::numSortKeys] = { lessByName, lessBySize, lessByMtime };
+
+
+void FileCatalog::addSorted(CatalogEntryPtr aEntry)
+{
+  for (int k=0; k<numSortKeys; k++) {
+    if (!sortedValid[k]) continue; // will be sorted when first needed
+    CatalogEntriesVector &v = sorted[k];
+    v.insert(std::upper_bound(v.begin(), v.end(), aEntry, entryLess[k]), aEntry);
+  }
+}
+
+
+void FileCatalog::removeSorted(CatalogEntryPtr aEntry)
+{
+  for (int k=0; k<numSortKeys; k++) {
+    if (!sortedValid[k]) continue;
+    CatalogEntriesVector &v = sorted[k];
+    // keys are unique (name is the last criterion), so the entry is where it would be inserted
+    CatalogEntriesVector::iterator pos = std::lower_bound(v.begin(), v.end(), aEntry, entryLess[k]);
+    if (pos!=v.end() && *pos==aEntry) v.erase(pos);
+    else invalidateSorting(); // should not happen, but re-sort rather than serve wrong results
+  }
+}
+
+
+const CatalogEntriesVector &FileCatalog::sortedBy(SortKey aSortKey)
+{
+  if (!sortedValid[aSortKey]) {
+    CatalogEntriesVector &v = sorted[aSortKey];
+    v.clear();
+    v.reserve(entries.size());
+    for (EntryMap::iterator pos = entries.begin(); pos!=entries.end(); ++pos) {
+      v.push_back(pos->second); // map is sorted by name already
+    }
+    if (aSortKey!=sort_name) std::sort(v.begin(), v.end(), entryLess[aSortKey]);
+    sortedValid[aSortKey] = true;
+  }
+  return sorted[aSortKey];
+}
+
+
+size_t FileCatalog::query(SortKey aSortKey, bool aDescending, const string aNamePrefix, size_t aOffset, size_t aLimit, CatalogEntriesVector &aResult)
+{
+  checkForChanges();
+  aResult.clear();
+  const CatalogEntriesVector &v = sortedBy(aSortKey);
+  size_t first = 0;
+  size_t count = v.size();
+  const CatalogEntriesVector *src = &v;
+  CatalogEntriesVector filtered;
+  if (!aNamePrefix.empty()) {
+    if (aSortKey==sort_name) {
+      // binary search for the range of names with the prefix
+      CatalogEntriesVector::const_iterator b = std::lower_bound(v.begin(), v.end(), aNamePrefix, entryNameLess);
+      CatalogEntriesVector::const_iterator e = b;
+      string upper = aNamePrefix;
+      upper[upper.size()-1]++;
+      if (upper[upper.size()-1]!=0) e = std::lower_bound(b, v.end(), upper, entryNameLess);
+      else while (e!=v.end() && (*e)->name.compare(0, aNamePrefix.size(), aNamePrefix)==0) ++e;
+      first = b-v.begin();
+      count = e-b;
+    }
+    else {
+      for (CatalogEntriesVector::const_iterator pos = v.begin(); pos!=v.end(); ++pos) {
+        if ((*pos)->name.compare(0, aNamePrefix.size(), aNamePrefix)==0) filtered.push_back(*pos);
+      }
+      src = &filtered;
+      count = filtered.size();
+    }
+  }
+  // paginate
+  if (aOffset>=count) return count;
+  size_t n = count-aOffset;
+  if (aLimit>0 && n>aLimit) n = aLimit;
+  aResult.reserve(n);
+  for (size_t i=0; i<n; i++) {
+    size_t idx = aDescending ? first+count-1-aOffset-i : first+aOffset+i;
+    aResult.push_back((*src)[idx]);
+  }
+  return count;
+}
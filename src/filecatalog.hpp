@@ -0,0 +1,176 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44bandit.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44bandit__filecatalog__
+#define __p44bandit__filecatalog__
+
+#include "p44utils_common.hpp"
+
+#include "jsonobject.hpp"
+
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace p44 {
+
+
+  /// information about a file that can only be obtained by reading all of it
+  typedef struct {
+    off_t logicalSize; ///< size of the program data in bytes (expanded, for compressed files)
+    bool compressed; ///< set if the file is stored in compressed program format
+    size_t lines; ///< number of lines
+  } CatalogContentInfo;
+
+
+  class CatalogEntry;
+  typedef boost::intrusive_ptr<CatalogEntry> CatalogEntryPtr;
+
+  /// information about a file in the catalog
+  class CatalogEntry : public P44Obj
+  {
+  public:
+    string name; ///< file name
+    ino_t ino; ///< inode number
+    uint8_t type; ///< file type (DT_xxx)
+    off_t size; ///< file size in bytes (as stored)
+    time_t mtime; ///< last modification time
+    bool contentKnown; ///< set when content has been set by FileCatalog::setContent()
+    CatalogContentInfo content; ///< only valid when contentKnown is set
+
+    /// @return JSON object describing the entry
+    JsonObjectPtr json();
+  };
+  typedef std::vector<CatalogEntryPtr> CatalogEntriesVector;
+
+
+  /// callback for catalog changes
+  /// @param aName name of the file that was added, changed or removed
+  /// @param aEntry the new entry, NULL if the file was removed
+  typedef boost::function<void (const string &aName, CatalogEntryPtr aEntry)> CatalogChangedCB;
+
+
+  class FileCatalog;
+  typedef boost::intrusive_ptr<FileCatalog> FileCatalogPtr;
+
+  /// in-memory catalog of the files in a directory. It is built once and then kept up-to-date by
+  /// watching the directory for changes (inotify on Linux, checking the directory's mtime elsewhere).
+  /// The entries are kept sorted by each key once that key has been queried. A changed file is moved
+  /// to its new place (binary search plus a vector insert/erase), rather than re-sorting everything.
+  class FileCatalog : public P44Obj
+  {
+  public:
+
+    enum SortKey {
+      sort_name,
+      sort_size,
+      sort_mtime,
+      numSortKeys
+    };
+
+  private:
+
+    string dirPath;
+    typedef std::map<string, CatalogEntryPtr> EntryMap;
+    EntryMap entries;
+    CatalogEntriesVector sorted[numSortKeys]; ///< entries sorted by the different keys, built on demand
+    bool sortedValid[numSortKeys];
+    CatalogChangedCB changedCB;
+    int watchFd; ///< inotify file descriptor, -1 if none
+    time_t dirMtime; ///< mtime of the directory at last scan (when not using inotify)
+    ErrorPtr scanError; ///< error of the last directory scan, if any
+
+  public:
+
+    FileCatalog();
+    virtual ~FileCatalog();
+
+    /// start cataloging a directory
+    /// @param aDirPath the directory
+    /// @return error if directory cannot be read
+    ErrorPtr open(const string aDirPath);
+
+    /// re-read the entire directory
+    ErrorPtr rescan();
+
+    /// @return error if the directory could not be read at the last scan (catalog is not valid then)
+    ErrorPtr error() { return scanError; };
+
+    /// set handler to be called when files are added, changed or removed
+    void setChangedHandler(CatalogChangedCB aChangedCB) { changedCB = aChangedCB; };
+
+    /// @param aName file name
+    /// @return entry, NULL if no such file
+    CatalogEntryPtr entry(const string aName);
+
+    /// query the catalog
+    /// @param aSortKey sort order
+    /// @param aDescending if set, sort descending
+    /// @param aNamePrefix if not empty, only files with names starting with this prefix are returned
+    /// @param aOffset number of matching entries to skip
+    /// @param aLimit max number of entries to return (0 = no limit)
+    /// @param aResult will receive the entries
+    /// @return total number of matching entries
+    /// @note without name prefix, or with name prefix in name order, the query is O(log n) plus the number
+    ///   of returned entries, with name prefix in other orders it is O(n). The first query by a key sorts
+    ///   the entries once (O(n log n)), updates keep them sorted at O(log n) plus an O(n) vector move.
+    size_t query(SortKey aSortKey, bool aDescending, const string aNamePrefix, size_t aOffset, size_t aLimit, CatalogEntriesVector &aResult);
+
+    /// @return number of files in the catalog
+    size_t size() { return entries.size(); };
+
+    /// update a single entry from the file system
+    /// @param aName file name
+    /// @note only the directory entry is looked at, see countContent() and setContent() for information
+    ///   that needs reading the file
+    void update(const string aName);
+
+    /// determine expanded size and number of lines of a file
+    /// @param aPath path of the file
+    /// @param aContent will receive the information
+    /// @return error, if any
+    /// @note reads the entire file, so this should be called in a worker thread. Does not access any catalog.
+    static ErrorPtr countContent(const string aPath, CatalogContentInfo &aContent);
+
+    /// set content information determined by countContent()
+    /// @param aName file name
+    /// @param aMtime modification time of the file when countContent() was called
+    /// @param aSize size of the file when countContent() was called
+    /// @param aContent the content information
+    /// @return the entry, if the content information was not known before and still applies
+    CatalogEntryPtr setContent(const string aName, time_t aMtime, off_t aSize, const CatalogContentInfo &aContent);
+
+  private:
+
+    void checkForChanges();
+    void removeEntry(const string aName);
+    void invalidateSorting();
+    void addSorted(CatalogEntryPtr aEntry);
+    void removeSorted(CatalogEntryPtr aEntry);
+    const CatalogEntriesVector &sortedBy(SortKey aSortKey);
+    bool watchHandler(int aFd, int aPollFlags);
+
+  };
+
+
+} // namespace p44
+
+#endif /* defined(__p44bandit__filecatalog__) */
@@ -0,0 +1,202 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44bandit.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+
+#include "jsonapi.hpp"
+
+using namespace p44;
+
+
+#define MAX_PIPELINED_REQUESTS 32 // max outstanding requests per connection
+
+
+JsonApiConnection::JsonApiConnection(ApiRequestCB aRequestCB, bool aDefaultKeepAlive, MLMicroSeconds aIdleTimeout) :
+  requestCB(aRequestCB),
+  defaultKeepAlive(aDefaultKeepAlive),
+  idleTimeout(aIdleTimeout),
+  firstSeq(0),
+  closing(false),
+  closeWhenSent(false),
+  transmitWaiting(false)
+{
+  conn = JsonCommPtr(new JsonComm(MainLoop::currentMainLoop()));
+  // Note: handlers retain this object, close must break that retain cycle so we won't cause a mem leak
+  conn->setMessageHandler(boost::bind(&JsonApiConnection::messageHandler, JsonApiConnectionPtr(this), _1, _2));
+  conn->setConnectionStatusHandler(boost::bind(&JsonApiConnection::connectionStatus, JsonApiConnectionPtr(this), _2));
+  conn->setClearHandlersAtClose();
+}
+
+
+JsonApiConnection::~JsonApiConnection()
+{
+  idleTicket.cancel();
+}
+
+
+void JsonApiConnection::messageHandler(ErrorPtr aError, JsonObjectPtr aMessage)
+{
+  if (closing || closeWhenSent || handOverCB) return; // not accepting requests any more
+  idleTicket.cancel();
+  PendingResponse r;
+  r.done = false;
+  r.keepAlive = defaultKeepAlive;
+  uint32_t seq = firstSeq+(uint32_t)pending.size();
+  if (!Error::isOK(aError)) {
+    // cannot parse any further requests on this connection
+    r.keepAlive = false;
+    pending.push_back(r);
+    requestDone(seq, JsonObjectPtr(), aError);
+    return;
+  }
+  JsonObjectPtr o;
+  if (aMessage->get("keepalive", o)) r.keepAlive = o->boolValue();
+  pending.push_back(r);
+  if (pending.size()>MAX_PIPELINED_REQUESTS) {
+    requestDone(seq, JsonObjectPtr(), WebError::webErr(503, "Too many outstanding requests"));
+    return;
+  }
+  requestCB(JsonApiConnectionPtr(this), aMessage, boost::bind(&JsonApiConnection::requestDone, JsonApiConnectionPtr(this), seq, _1, _2));
+}
+
+
+void JsonApiConnection::handOver(ConnectionHandOverCB aHandOverCB)
+{
+  handOverCB = aHandOverCB;
+  sendResponses();
+}
+
+
+void JsonApiConnection::requestDone(uint32_t aSeq, JsonObjectPtr aResponse, ErrorPtr aError)
+{
+  if (closing || aSeq<firstSeq || aSeq-firstSeq>=pending.size()) return; // connection gone or already answered
+  if (!aResponse) {
+    aResponse = JsonObject::newObj(); // empty response
+  }
+  if (!Error::isOK(aError)) {
+    aResponse->add("Error", JsonObject::newString(aError->description()));
+  }
+  PendingResponse &r = pending[aSeq-firstSeq];
+  r.response = aResponse;
+  r.done = true;
+  sendResponses();
+}
+
+
+void JsonApiConnection::sendResponses()
+{
+  if (closing) return;
+  // send completed responses in request order
+  while (!closeWhenSent && !pending.empty() && pending.front().done) {
+    PendingResponse r = pending.front();
+    pending.pop_front();
+    firstSeq++;
+    LOG(LOG_INFO,"API answer: %s", r.response->c_strValue());
+    sendBuffer += r.response->json_str();
+    sendBuffer += '\n';
+    if (!r.keepAlive) {
+      // responses to requests that are still pipelined behind this one are discarded
+      closeWhenSent = true;
+      pending.clear();
+    }
+  }
+  // Note: responses are buffered here rather than in JsonComm, so we know when they are out and
+  //   the connection can be closed or handed over without anything else writing in between
+  if (!transmitBuffered()) return; // writable() continues when the socket accepts more data
+  if (closeWhenSent) {
+    closing = true;
+    conn->closeConnection();
+    return;
+  }
+  if (pending.empty() && handOverCB) {
+    // all answered, connection now belongs to someone else
+    closing = true;
+    idleTicket.cancel();
+    ConnectionHandOverCB cb = handOverCB;
+    handOverCB = NULL;
+    cb(conn);
+    return;
+  }
+  if (pending.empty() && idleTimeout>0) {
+    idleTicket.executeOnce(boost::bind(&JsonApiConnection::idleTimeoutReached, this), idleTimeout);
+  }
+}
+
+
+/// @return true if all buffered responses have been written to the socket
+bool JsonApiConnection::transmitBuffered()
+{
+  if (!sendBuffer.empty()) {
+    ErrorPtr err;
+    size_t n = conn->transmitBytes(sendBuffer.size(), (const uint8_t *)sendBuffer.c_str(), err);
+    if (!Error::isOK(err)) {
+      LOG(LOG_WARNING, "API connection write error: %s", err->description().c_str());
+      closing = true;
+      pending.clear();
+      sendBuffer.clear();
+      conn->closeConnection();
+      return false;
+    }
+    sendBuffer.erase(0, n);
+  }
+  if (sendBuffer.empty()) {
+    if (transmitWaiting) {
+      transmitWaiting = false;
+      conn->setTransmitHandler(NULL);
+    }
+    return true;
+  }
+  if (!transmitWaiting) {
+    transmitWaiting = true;
+    conn->setTransmitHandler(boost::bind(&JsonApiConnection::writable, JsonApiConnectionPtr(this), _1));
+  }
+  return false;
+}
+
+
+void JsonApiConnection::writable(ErrorPtr aError)
+{
+  if (!Error::isOK(aError)) {
+    connectionStatus(aError);
+    return;
+  }
+  sendResponses();
+}
+
+
+void JsonApiConnection::idleTimeoutReached()
+{
+  if (!pending.empty()) return;
+  LOG(LOG_INFO, "API connection idle for too long, closing");
+  closing = true;
+  conn->closeConnection();
+}
+
+
+void JsonApiConnection::connectionStatus(ErrorPtr aError)
+{
+  if (!Error::isOK(aError)) {
+    // connection closed by peer or failed
+    closing = true;
+    pending.clear();
+    idleTicket.cancel();
+  }
+}
@@ -0,0 +1,109 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44bandit.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+
+#ifndef __p44bandit__jsonapi__
+#define __p44bandit__jsonapi__
+
+#include "p44utils_common.hpp"
+#include "jsoncomm.hpp"
+
+#include <deque>
+
+using namespace std;
+
+namespace p44 {
+
+
+  /// callback to deliver the response to an API request
+  typedef boost::function<void (JsonObjectPtr aResponse, ErrorPtr aError)> RequestDoneCB;
+
+  class JsonApiConnection;
+  typedef boost::intrusive_ptr<JsonApiConnection> JsonApiConnectionPtr;
+
+  /// handler for API requests
+  /// @param aConnection the connection the request came from
+  /// @param aRequest the request
+  /// @param aRequestDoneCB must be called exactly once with the response (possibly later)
+  typedef boost::function<void (JsonApiConnectionPtr aConnection, JsonObjectPtr aRequest, RequestDoneCB aRequestDoneCB)> ApiRequestCB;
+
+  /// receives a connection that is no longer used for API requests
+  typedef boost::function<void (SocketCommPtr aConnection)> ConnectionHandOverCB;
+
+  /// a connection to the JSON API, which can carry many requests.
+  /// Requests can be pipelined; they are processed as they arrive, but responses are always sent
+  /// in the order of the requests, even when processing completes out of order.
+  /// A request containing "keepalive":true keeps the connection open after its response has been
+  /// sent, "keepalive":false closes it. Requests without "keepalive" use the connection's default.
+  class JsonApiConnection : public P44Obj
+  {
+    typedef struct {
+      bool done;
+      bool keepAlive;
+      JsonObjectPtr response;
+    } PendingResponse;
+
+    JsonCommPtr conn;
+    ApiRequestCB requestCB;
+    bool defaultKeepAlive;
+    MLMicroSeconds idleTimeout;
+    std::deque<PendingResponse> pending; ///< responses not yet sent, in request order
+    uint32_t firstSeq; ///< sequence number of the first entry in pending
+    bool closing; ///< set when no more responses must be sent
+    bool closeWhenSent; ///< set when the connection must be closed once sendBuffer is empty
+    string sendBuffer; ///< serialized responses not yet accepted by the socket
+    bool transmitWaiting; ///< set while waiting for the socket to become writable
+    MLTicket idleTicket;
+    ConnectionHandOverCB handOverCB;
+
+  public:
+
+    /// @param aRequestCB handler for requests
+    /// @param aDefaultKeepAlive keep connection open after responses for requests not specifying "keepalive"
+    /// @param aIdleTimeout close kept-alive connection after this time without requests
+    JsonApiConnection(ApiRequestCB aRequestCB, bool aDefaultKeepAlive, MLMicroSeconds aIdleTimeout);
+    virtual ~JsonApiConnection();
+
+    /// @return the socket connection, to be returned to the server socket's connection handler
+    SocketCommPtr socket() { return conn; };
+
+    /// stop processing API requests and hand over the connection, once responses to all
+    /// requests received so far have been sent and completely accepted by the socket
+    /// @param aHandOverCB will be called with the connection
+    void handOver(ConnectionHandOverCB aHandOverCB);
+
+  private:
+
+    void messageHandler(ErrorPtr aError, JsonObjectPtr aMessage);
+    void requestDone(uint32_t aSeq, JsonObjectPtr aResponse, ErrorPtr aError);
+    void sendResponses();
+    bool transmitBuffered();
+    void writable(ErrorPtr aError);
+    void connectionStatus(ErrorPtr aError);
+    void idleTimeoutReached();
+
+  };
+
+
+} // namespace p44
+
+#endif /* defined(__p44bandit__jsonapi__) */
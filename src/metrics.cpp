@@ -0,0 +1,149 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44bandit.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+
+#include "metrics.hpp"
+
+using namespace p44;
+
+
+#pragma mark - MetricHistogram
+
+void MetricHistogram::observe(double aValue)
+{
+  size_t i = 0;
+  while (i<bounds.size() && aValue>bounds[i]) i++;
+  counts[i]++;
+  sum += aValue;
+  count++;
+}
+
+
+#pragma mark - Metrics
+
+Metrics::Metrics()
+{
+  pthread_mutex_init(&registryMutex, NULL);
+}
+
+
+Metrics &Metrics::shared()
+{
+  static Metrics metrics;
+  return metrics;
+}
+
+
+Metrics::MetricFamily &Metrics::family(const char *aName, const char *aHelp, MetricType aType)
+{
+  FamilyMap::iterator pos = families.find(aName);
+  if (pos!=families.end()) return pos->second;
+  MetricFamily &f = families[aName];
+  f.type = aType;
+  f.help = aHelp;
+  return f;
+}
+
+
+MetricCounter &Metrics::counter(const char *aName, const char *aHelp, const string aLabels)
+{
+  pthread_mutex_lock(&registryMutex);
+  MetricCounter &c = family(aName, aHelp, metric_counter).counters[aLabels];
+  pthread_mutex_unlock(&registryMutex);
+  return c;
+}
+
+
+MetricGauge &Metrics::gauge(const char *aName, const char *aHelp, const string aLabels)
+{
+  pthread_mutex_lock(&registryMutex);
+  MetricGauge &g = family(aName, aHelp, metric_gauge).gauges[aLabels];
+  pthread_mutex_unlock(&registryMutex);
+  return g;
+}
+
+
+MetricHistogram &Metrics::histogram(const char *aName, const char *aHelp, const vector<double> &aBounds, const string aLabels)
+{
+  pthread_mutex_lock(&registryMutex);
+  MetricFamily &f = family(aName, aHelp, metric_histogram);
+  std::map<string, MetricHistogram>::iterator pos = f.histograms.find(aLabels);
+  if (pos==f.histograms.end()) {
+    MetricHistogram &h = f.histograms[aLabels];
+    h.bounds = aBounds;
+    h.counts.resize(aBounds.size()+1, 0);
+    pos = f.histograms.find(aLabels);
+  }
+  pthread_mutex_unlock(&registryMutex);
+  return pos->second;
+}
+
+
+static string labelSet(const string &aLabels, const string &aExtra = "")
+{
+  if (aLabels.empty() && aExtra.empty()) return "";
+  if (aLabels.empty()) return "{" + aExtra + "}";
+  if (aExtra.empty()) return "{" + aLabels + "}";
+  return "{" + aLabels + "," + aExtra + "}";
+}
+
+
+string Metrics::prometheusText()
+{
+  string t;
+  pthread_mutex_lock(&registryMutex);
+  for (FamilyMap::iterator fpos = families.begin(); fpos!=families.end(); ++fpos) {
+    const string &name = fpos->first;
+    MetricFamily &f = fpos->second;
+    string_format_append(t, "# HELP %s %s\n", name.c_str(), f.help.c_str());
+    switch (f.type) {
+      case metric_counter:
+        string_format_append(t, "# TYPE %s counter\n", name.c_str());
+        for (std::map<string, MetricCounter>::iterator pos = f.counters.begin(); pos!=f.counters.end(); ++pos) {
+          string_format_append(t, "%s%s %llu\n", name.c_str(), labelSet(pos->first).c_str(), (unsigned long long)pos->second.get());
+        }
+        break;
+      case metric_gauge:
+        string_format_append(t, "# TYPE %s gauge\n", name.c_str());
+        for (std::map<string, MetricGauge>::iterator pos = f.gauges.begin(); pos!=f.gauges.end(); ++pos) {
+          string_format_append(t, "%s%s %.9g\n", name.c_str(), labelSet(pos->first).c_str(), pos->second.get());
+        }
+        break;
+      case metric_histogram:
+        string_format_append(t, "# TYPE %s histogram\n", name.c_str());
+        for (std::map<string, MetricHistogram>::iterator pos = f.histograms.begin(); pos!=f.histograms.end(); ++pos) {
+          MetricHistogram &h = pos->second;
+          uint64_t cumulated = 0;
+          for (size_t i=0; i<h.bounds.size(); i++) {
+            cumulated += h.counts[i];
+            string_format_append(t, "%s_bucket%s %llu\n", name.c_str(), labelSet(pos->first, string_format("le=\"%.9g\"", h.bounds[i])).c_str(), (unsigned long long)cumulated);
+          }
+          string_format_append(t, "%s_bucket%s %llu\n", name.c_str(), labelSet(pos->first, "le=\"+Inf\"").c_str(), (unsigned long long)h.count);
+          string_format_append(t, "%s_sum%s %.9g\n", name.c_str(), labelSet(pos->first).c_str(), h.sum);
+          string_format_append(t, "%s_count%s %llu\n", name.c_str(), labelSet(pos->first).c_str(), (unsigned long long)h.count);
+        }
+        break;
+    }
+  }
+  pthread_mutex_unlock(&registryMutex);
+  return t;
+}
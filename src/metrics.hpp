@@ -0,0 +1,118 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44bandit.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+
+#ifndef __p44bandit__metrics__
+#define __p44bandit__metrics__
+
+#include "p44utils_common.hpp"
+
+#include <map>
+#include <vector>
+#include <atomic>
+#include <pthread.h>
+
+using namespace std;
+
+namespace p44 {
+
+
+  /// monotonically increasing count, can be incremented from worker threads
+  class MetricCounter
+  {
+    std::atomic<uint64_t> value;
+  public:
+    MetricCounter() : value(0) {};
+    void inc(uint64_t aBy = 1) { value.fetch_add(aBy, std::memory_order_relaxed); };
+    uint64_t get() const { return value.load(std::memory_order_relaxed); };
+  };
+
+
+  /// value that can go up and down
+  class MetricGauge
+  {
+    double value;
+  public:
+    MetricGauge() : value(0) {};
+    void set(double aValue) { value = aValue; };
+    double get() const { return value; };
+  };
+
+
+  /// distribution of observed values over fixed buckets
+  class MetricHistogram
+  {
+    friend class Metrics;
+    vector<double> bounds; ///< upper bounds of the buckets, ascending
+    vector<uint64_t> counts; ///< count per bucket (not cumulative), last is overflow
+    double sum;
+    uint64_t count;
+  public:
+    MetricHistogram() : sum(0), count(0) {};
+    void observe(double aValue);
+  };
+
+
+  /// registry of all metrics of the process, exported as Prometheus text format.
+  /// Metrics are created on first access and live forever, so references to them can be kept
+  /// (typically in function-level statics). The registry and counters are thread safe,
+  /// gauges and histograms must only be updated from the mainloop thread.
+  class Metrics
+  {
+    typedef enum { metric_counter, metric_gauge, metric_histogram } MetricType;
+    typedef struct {
+      MetricType type;
+      string help;
+      std::map<string, MetricCounter> counters; ///< by label set
+      std::map<string, MetricGauge> gauges; ///< by label set
+      std::map<string, MetricHistogram> histograms; ///< by label set
+    } MetricFamily;
+    typedef std::map<string, MetricFamily> FamilyMap;
+    FamilyMap families;
+    pthread_mutex_t registryMutex;
+
+    Metrics();
+    MetricFamily &family(const char *aName, const char *aHelp, MetricType aType);
+
+  public:
+
+    /// @return the process wide metrics registry
+    static Metrics &shared();
+
+    /// @param aName metric name (Prometheus conventions: snake_case, unit suffix, _total for counters)
+    /// @param aHelp description
+    /// @param aLabels label set in Prometheus syntax without braces, e.g. `uri="files"`, empty for none
+    MetricCounter &counter(const char *aName, const char *aHelp, const string aLabels = "");
+    MetricGauge &gauge(const char *aName, const char *aHelp, const string aLabels = "");
+
+    /// @param aBounds upper bounds of the buckets (only used when the histogram is created)
+    MetricHistogram &histogram(const char *aName, const char *aHelp, const vector<double> &aBounds, const string aLabels = "");
+
+    /// @return all metrics as Prometheus text exposition format (version 0.0.4)
+    string prometheusText();
+
+  };
+
+
+} // namespace p44
+
+#endif /* defined(__p44bandit__metrics__) */
@@ -0,0 +1,535 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44banditd.
+//
+//  pixelboardd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  pixelboardd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with pixelboardd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "application.hpp"
+
+#include "banditdata.hpp"
+#include "banditfiles.hpp"
+#include "filecatalog.hpp"
+#include "banditoptimizer.hpp"
+
+#include <new>
+#include <atomic>
+#include <algorithm>
+#include <math.h>
+#include <sys/stat.h>
+
+using namespace p44;
+
+#define DEFAULT_LOGLEVEL LOG_NOTICE
+#define DEFAULT_SIZES "1k,64k,1m,16m,100m"
+#define DEFAULT_MIN_RUN_TIME (300*MilliSecond)
+#define DEFAULT_LIST_FILES 1000
+#define DEFAULT_TOLERANCE 10 // percent
+#define ARCFIT_CHUNK_SIZE 4096 // like the default transmit buffer high water mark
+
+
+// MARK: ==== allocation counting
+
+// Note: atomic, so counts stay exact when benchmarked code allocates in other threads
+static std::atomic<size_t> numAllocs(0);
+static std::atomic<size_t> allocatedBytes(0);
+
+void *operator new(size_t aSize)
+{
+  numAllocs.fetch_add(1, std::memory_order_relaxed);
+  allocatedBytes.fetch_add(aSize, std::memory_order_relaxed);
+  void *p = malloc(aSize ? aSize : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+void *operator new[](size_t aSize)
+{
+  return operator new(aSize);
+}
+
+void operator delete(void *aPtr) noexcept
+{
+  free(aPtr);
+}
+
+void operator delete[](void *aPtr) noexcept
+{
+  free(aPtr);
+}
+
+
+// MARK: ==== synthetic BANDIT G-code corpus
+
+/// generates programs looking like the output of the QCAD GCodeBandit.js postprocessor
+/// (plus the things we see in received and hand-edited programs)
+class BanditCorpus
+{
+  uint32_t seed;
+  int lineNo;
+  double x, y, z;
+  string prog;
+
+  uint32_t rnd(uint32_t aRange)
+  {
+    seed = seed*1103515245+12345;
+    return (seed>>8)%aRange;
+  }
+
+  void line(const string aText)
+  {
+    string_format_append(prog, "N%d%c%s\r\n", lineNo, lineNo==1 ? '&' : ' ', aText.c_str());
+    lineNo++;
+  }
+
+  void rapid()
+  {
+    x = rnd(400000)/1000.0; y = rnd(300000)/1000.0;
+    line(string_format("I%.3fJ%.3f", x, y));
+    line("K2.000");
+  }
+
+  void linear()
+  {
+    x += ((int)rnd(20000)-10000)/1000.0; y += ((int)rnd(20000)-10000)/1000.0;
+    line(string_format("X%.3fY%.3f", x, y));
+  }
+
+  void arc()
+  {
+    // quadrant-split arc: endpoints on the circle within one quadrant, absolute center
+    double r = 1+rnd(50000)/1000.0;
+    int q = rnd(4);
+    double a0 = q*M_PI/2, a1 = a0+M_PI/2*(1+rnd(99))/100.0;
+    double cx = x-r*cos(a0), cy = y-r*sin(a0);
+    x = cx+r*cos(a1); y = cy+r*sin(a1);
+    line(string_format("X%.3fY%.3fI%.3fJ%.3f", x, y, cx, cy));
+  }
+
+  void contour()
+  {
+    rapid();
+    z = -(1.0+rnd(5))/2;
+    line(string_format("Z%.3f", z));
+    int n = 5+rnd(60);
+    for (int i=0; i<n; i++) {
+      if (rnd(3)==0) arc(); else linear();
+    }
+    line("K2.000");
+  }
+
+public:
+
+  BanditCorpus(uint32_t aSeed) : seed(aSeed), lineNo(1), x(0), y(0), z(0) {};
+
+  /// generate a program of approximately the given size
+  string generate(size_t aSize)
+  {
+    prog.clear();
+    lineNo = 1;
+    // received programs start with DC1 and NUL padding
+    prog += "\x11";
+    prog.append(20, 0);
+    prog += "# synthetic BANDIT program for benchmarking\n";
+    line("G99");
+    line("Z100.000Y0.000X0.000G92");
+    line("G90");
+    while (prog.size()+200<aSize) {
+      if (rnd(20)==0) {
+        line("M6");
+        line(string_format("F%d.000", 100+rnd(20)*50));
+      }
+      if (rnd(10)==0) {
+        prog += "# contour\n";
+      }
+      if (rnd(50)==0) {
+        prog += "\x13"; // stray DC3
+        prog.append(rnd(10), 0);
+      }
+      contour();
+    }
+    line("M2");
+    prog += "\x13";
+    prog.append(100, 0);
+    return prog;
+  }
+
+};
+
+
+// MARK: ==== Benchmark application
+
+class P44BanditBench : public CmdLineApp
+{
+  typedef CmdLineApp inherited;
+
+  typedef boost::function<size_t ()> BenchRoutine; ///< runs once, returns number of units processed
+
+  struct BenchResult {
+    string name;
+    double throughput; ///< units per second
+    const char *unit;
+    double allocsPerRun;
+    double bytesAllocatedPerRun;
+  };
+  typedef std::vector<BenchResult> BenchResultsVector;
+
+  BenchResultsVector results;
+  MLMicroSeconds minRunTime;
+  string workdir;
+
+public:
+
+  P44BanditBench() :
+    minRunTime(DEFAULT_MIN_RUN_TIME)
+  {
+  }
+
+  virtual int main(int argc, char **argv)
+  {
+    const char *usageText =
+      "Usage: %1$s [options]\n";
+    const CmdLineOptionDescriptor options[] = {
+      { 0  , "sizes",          true,  "sizelist;comma separated corpus sizes (k,m suffixes allowed), default=" DEFAULT_SIZES },
+      { 0  , "seed",           true,  "seed;random seed for corpus generation" },
+      { 0  , "mintime",        true,  "milliseconds;minimal time to repeat each benchmark (default=300)" },
+      { 0  , "listfiles",      true,  "count;number of files for the files listing benchmark (default=1000)" },
+      { 0  , "workdir",        true,  "path;directory for corpus files (default=/tmp)" },
+      { 0  , "keepcorpus",     false, "do not delete generated corpus files" },
+      { 0  , "baseline",       true,  "file;compare results with this baseline, exit with error on regression" },
+      { 0  , "tolerance",      true,  "percent;allowed throughput regression against baseline (default=10)" },
+      { 0  , "savebaseline",   true,  "file;save results as new baseline" },
+      { 'l', "loglevel",       true,  "level;set max level of log message detail to show on stdout" },
+      { 'h', "help",           false, "show this text" },
+      { 0, NULL } // list terminator
+    };
+
+    // parse the command line, exits when syntax errors occur
+    setCommandDescriptors(usageText, options);
+    parseCommandLine(argc, argv);
+
+    if (getOption("help") || numArguments()>0) {
+      // show usage
+      showUsage();
+      terminateApp(EXIT_SUCCESS);
+    }
+
+    if (!isTerminated()) {
+      int loglevel = DEFAULT_LOGLEVEL;
+      getIntOption("loglevel", loglevel);
+      SETLOGLEVEL(loglevel);
+      int ms;
+      if (getIntOption("mintime", ms)) minRunTime = ms*MilliSecond;
+      workdir = "/tmp";
+      getStringOption("workdir", workdir);
+    }
+    // app now ready to run (or cleanup when already terminated)
+    return run();
+  }
+
+
+  virtual void initialize()
+  {
+    int seed = 42;
+    getIntOption("seed", seed);
+    BanditCorpus corpus(seed);
+    string sizes = DEFAULT_SIZES;
+    getStringOption("sizes", sizes);
+    printf("%-24s %12s %14s %14s\n", "benchmark", "throughput", "allocs/run", "kB alloc/run");
+    const char *p = sizes.c_str();
+    string sz;
+    while (nextPart(p, sz, ',')) {
+      size_t size = parseSize(sz);
+      if (size==0) continue;
+      string data = corpus.generate(size);
+      benchData(lowerCase(sz), data);
+    }
+    int numFiles = DEFAULT_LIST_FILES;
+    getIntOption("listfiles", numFiles);
+    benchListing(numFiles);
+    // compare and save
+    int exitCode = EXIT_SUCCESS;
+    string fn;
+    if (getStringOption("baseline", fn)) {
+      int tolerance = DEFAULT_TOLERANCE;
+      getIntOption("tolerance", tolerance);
+      if (!compareBaseline(fn, tolerance)) exitCode = EXIT_FAILURE;
+    }
+    if (getStringOption("savebaseline", fn)) {
+      saveBaseline(fn);
+    }
+    terminateApp(exitCode);
+  }
+
+
+  static size_t parseSize(const string aSize)
+  {
+    char unit = 0;
+    double v = 0;
+    if (sscanf(aSize.c_str(), "%lf%c", &v, &unit)<1) return 0;
+    switch (tolower(unit)) {
+      case 'k': v *= 1024; break;
+      case 'm': v *= 1024*1024; break;
+      case 'g': v *= 1024*1024*1024; break;
+    }
+    return (size_t)v;
+  }
+
+
+  // MARK: ==== measuring
+
+  void measure(const string aName, const char *aUnit, BenchRoutine aRoutine)
+  {
+    size_t allocs0 = numAllocs;
+    size_t bytes0 = allocatedBytes;
+    int runs = 0;
+    size_t units = 0;
+    MLMicroSeconds elapsed = 0;
+    do {
+      MLMicroSeconds start = MainLoop::now();
+      units += aRoutine();
+      elapsed += MainLoop::now()-start;
+      runs++;
+    } while (elapsed<minRunTime);
+    BenchResult r;
+    r.name = aName;
+    r.unit = aUnit;
+    r.throughput = elapsed>0 ? (double)units*Second/elapsed : 0;
+    r.allocsPerRun = (double)(numAllocs-allocs0)/runs;
+    r.bytesAllocatedPerRun = (double)(allocatedBytes-bytes0)/runs;
+    results.push_back(r);
+    printf(
+      "%-24s %8.2f %-3s %14.1f %14.1f\n",
+      aName.c_str(),
+      strcmp(aUnit, "MB/s")==0 ? r.throughput/(1024*1024) : r.throughput, aUnit,
+      r.allocsPerRun, r.bytesAllocatedPerRun/1024
+    );
+    fflush(stdout);
+  }
+
+
+  // MARK: ==== benchmarks
+
+  static size_t runClean(const string *aData, bool aForSend, bool aRawMode)
+  {
+    string res = cleanBanditData(*aData, aForSend, aRawMode);
+    return aData->size();
+  }
+
+
+  static size_t runArcFit(const string *aCleaned)
+  {
+    // same fitter as ArcFittingDataSource uses when sending, fed in transmit buffer sized chunks
+    BanditArcFitterPtr fitter = BanditArcFitterPtr(new BanditArcFitter(0.01));
+    string res;
+    for (size_t pos=0; pos<aCleaned->size(); pos += ARCFIT_CHUNK_SIZE) {
+      res.clear();
+      fitter->process(aCleaned->c_str()+pos, std::min((size_t)ARCFIT_CHUNK_SIZE, aCleaned->size()-pos), res);
+    }
+    fitter->finish(res);
+    return aCleaned->size();
+  }
+
+
+  static size_t runSendPipeline(const string aPath, bool aMapped)
+  {
+    // same pipeline as sendFile() uses
+    BanditDataSourcePtr source;
+    if (aMapped) {
+      if (!Error::isOK(openProgramFile(aPath, source))) return 0;
+    }
+    else {
+      FileDataSource *fileSource = new FileDataSource;
+      source = BanditDataSourcePtr(fileSource);
+      if (!Error::isOK(fileSource->open(aPath))) return 0;
+    }
+    size_t inputSize = source->sizeHint();
+    source = BanditDataSourcePtr(new CleaningDataSource(source, BanditCleanerPtr(new BanditCleaner(true, false))));
+    source = BanditDataSourcePtr(new FramedDataSource(source));
+    ErrorPtr err;
+    const char *chunk;
+    while (source->nextChunk(chunk, 4096, err)>0);
+    return inputSize;
+  }
+
+
+  static size_t runIngest(const string aSrc, const string aDest, size_t aSize)
+  {
+    uint64_t hash;
+    if (!Error::isOK(ingestFile(aSrc, aDest, &hash, false))) return 0;
+    return aSize;
+  }
+
+
+  static size_t runCompress(const string aSrc, const string aDest, size_t aSize)
+  {
+    uint64_t hash;
+    if (!Error::isOK(compressFile(aSrc, aDest, &hash))) return 0;
+    return aSize;
+  }
+
+
+  static size_t runListing(const string aDir)
+  {
+    bool foundSelected;
+    ErrorPtr err;
+    JsonObjectPtr files = listFiles(aDir, "none", foundSelected, err);
+    if (!files) return 0;
+    string json = files->json_str(); // API serializes the list, so include that
+    return files->arrayLength();
+  }
+
+
+  static size_t runCatalogQuery(FileCatalogPtr aCatalog)
+  {
+    // one page of the most recent files, as the web UI requests it
+    CatalogEntriesVector found;
+    aCatalog->query(FileCatalog::sort_mtime, true, "", 0, 50, found);
+    JsonObjectPtr files = JsonObject::newArray();
+    for (CatalogEntriesVector::iterator pos = found.begin(); pos!=found.end(); ++pos) {
+      files->arrayAppend((*pos)->json());
+    }
+    string json = files->json_str();
+    return files->arrayLength();
+  }
+
+
+  void benchData(const string aSizeName, const string &aData)
+  {
+    measure("clean-send/"+aSizeName, "MB/s", boost::bind(&runClean, &aData, true, false));
+    measure("clean-receive/"+aSizeName, "MB/s", boost::bind(&runClean, &aData, false, false));
+    measure("clean-raw/"+aSizeName, "MB/s", boost::bind(&runClean, &aData, false, true));
+    string cleaned = cleanBanditData(aData, false, false);
+    measure("arcfit/"+aSizeName, "MB/s", boost::bind(&runArcFit, &cleaned));
+    // file based
+    string path = workdir + "/banditbench_corpus_" + aSizeName + ".txt";
+    string copyPath = path + ".copy";
+    FILE *f = fopen(path.c_str(), "w");
+    if (!f || fwrite(aData.c_str(), 1, aData.size(), f)<aData.size()) {
+      LOG(LOG_ERR, "Cannot write corpus file '%s'", path.c_str());
+      if (f) fclose(f);
+      return;
+    }
+    fclose(f);
+    measure("send-pipeline-read/"+aSizeName, "MB/s", boost::bind(&runSendPipeline, path, false));
+    measure("send-pipeline-mmap/"+aSizeName, "MB/s", boost::bind(&runSendPipeline, path, true));
+    measure("ingest/"+aSizeName, "MB/s", boost::bind(&runIngest, path, copyPath, aData.size()));
+    string compressedPath = path + ".blz";
+    measure("compress/"+aSizeName, "MB/s", boost::bind(&runCompress, path, compressedPath, aData.size()));
+    measure("send-pipeline-compressed/"+aSizeName, "MB/s", boost::bind(&runSendPipeline, compressedPath, true));
+    struct stat fs;
+    if (stat(compressedPath.c_str(), &fs)==0 && fs.st_size>0) {
+      printf("%-24s %8.2f %-3s\n", ("compress-ratio/"+aSizeName).c_str(), (double)aData.size()/fs.st_size, ":1");
+    }
+    if (!getOption("keepcorpus")) {
+      unlink(path.c_str());
+      unlink(copyPath.c_str());
+      unlink(compressedPath.c_str());
+    }
+  }
+
+
+  void benchListing(int aNumFiles)
+  {
+    if (aNumFiles<=0) return;
+    string dir = string_format("%s/banditbench_files_%d", workdir.c_str(), aNumFiles);
+    mkdir(dir.c_str(), S_IRWXU);
+    BanditCorpus corpus(aNumFiles);
+    for (int i=0; i<aNumFiles; i++) {
+      string fn = string_format("%s/2020-01-01_00.00.%05d_bandit_download.txt", dir.c_str(), i);
+      FILE *f = fopen(fn.c_str(), "w");
+      if (f) {
+        fputs(corpus.generate(256).c_str(), f);
+        fclose(f);
+      }
+    }
+    measure(string_format("files-listing/%d", aNumFiles), "f/s", boost::bind(&runListing, dir));
+    FileCatalogPtr catalog = FileCatalogPtr(new FileCatalog);
+    if (Error::isOK(catalog->open(dir))) {
+      measure(string_format("catalog-query/%d", aNumFiles), "f/s", boost::bind(&runCatalogQuery, catalog));
+    }
+    if (!getOption("keepcorpus")) {
+      for (int i=0; i<aNumFiles; i++) {
+        unlink(string_format("%s/2020-01-01_00.00.%05d_bandit_download.txt", dir.c_str(), i).c_str());
+      }
+      rmdir(dir.c_str());
+    }
+  }
+
+
+  // MARK: ==== baseline
+
+  bool compareBaseline(const string aPath, int aTolerance)
+  {
+    FILE *f = fopen(aPath.c_str(), "r");
+    if (!f) {
+      LOG(LOG_ERR, "Cannot open baseline file '%s'", aPath.c_str());
+      return false;
+    }
+    bool ok = true;
+    string line;
+    while (string_fgetline(f, line)) {
+      char name[100];
+      double base;
+      if (sscanf(line.c_str(), "%99s %lf", name, &base)!=2) continue;
+      for (BenchResultsVector::iterator pos = results.begin(); pos!=results.end(); ++pos) {
+        if (pos->name!=name) continue;
+        double change = base>0 ? (pos->throughput/base-1)*100 : 0;
+        if (change<-aTolerance) {
+          printf("REGRESSION: %s is %.1f%% slower than baseline\n", name, -change);
+          ok = false;
+        }
+        else {
+          LOG(LOG_INFO, "%s: %+.1f%% against baseline", name, change);
+        }
+      }
+    }
+    fclose(f);
+    printf("%s\n", ok ? "No regressions against baseline" : "Benchmark FAILED against baseline");
+    return ok;
+  }
+
+
+  void saveBaseline(const string aPath)
+  {
+    FILE *f = fopen(aPath.c_str(), "w");
+    if (!f) {
+      LOG(LOG_ERR, "Cannot write baseline file '%s'", aPath.c_str());
+      return;
+    }
+    for (BenchResultsVector::iterator pos = results.begin(); pos!=results.end(); ++pos) {
+      fprintf(f, "%s %.1f\n", pos->name.c_str(), pos->throughput);
+    }
+    fclose(f);
+  }
+
+};
+
+
+
+
+
+int main(int argc, char **argv)
+{
+  // prevent debug output before application.main scans command line
+  SETLOGLEVEL(LOG_EMERG);
+  SETERRLEVEL(LOG_EMERG, false); // messages, if any, go to stderr
+  // create app with current mainloop
+  static P44BanditBench application;
+  // pass control
+  return application.main(argc, argv);
+}
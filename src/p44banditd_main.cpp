@@ -19,148 +19,62 @@
 //  along with pixelboardd. If not, see <http://www.gnu.org/licenses/>.
 //
 
+
 #include "application.hpp"
 
 #include "jsoncomm.hpp"
 
-#include "banditcomm.hpp"
-
-#include <dirent.h>
-#include <sys/stat.h> // for fstat
+#include "banditmachine.hpp"
+#include "banditimage.hpp"
+#include "workerpool.hpp"
+#include "jsonapi.hpp"
+#include "eventhub.hpp"
+#include "metrics.hpp"
 
 using namespace p44;
 
 #define MAINLOOP_CYCLE_TIME_uS 10000 // 10mS
+#define PROBE_TIMEOUT (2*Minute) // time for the operator to start program output on the controller when probing
 #define DEFAULT_LOGLEVEL LOG_NOTICE
+#define API_IDLE_TIMEOUT (60*Second) // kept-alive API connections are closed after this time without requests
+#define EVENT_BUFFER_SIZE 256 // events buffered for subscribers, slower subscribers are dropped
+#define LAG_SAMPLE_INTERVAL (100*MilliSecond) // interval for measuring mainloop lag
+#define SINGLE_MACHINE_ID "default" // id of the machine configured by the command line options
 
-
-// MARK: ==== Application
-
-typedef boost::function<void (JsonObjectPtr aResponse, ErrorPtr aError)> RequestDoneCB;
-
-
-#define MAX_COPYFILE_BUF_SIZE 20000
-
-static ErrorPtr copyfile(const string aSourcePath, const string aDestPath)
-{
-  size_t bufSize = MAX_COPYFILE_BUF_SIZE;
-  int srcfd = open(aSourcePath.c_str(), O_RDONLY);
-  if (srcfd<0) {
-    return SysError::errNo(string_format("copyfile: cannot open input file '%s'", aSourcePath.c_str()).c_str());
-  }
-  // opened, check buffer needs
-  struct stat fs;
-  fstat(srcfd, &fs);
-  if (fs.st_size<bufSize) bufSize = fs.st_size; // don't need the entire buffer
-  // open destination file
-  int destfd = open(aDestPath.c_str(), O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
-  if (destfd<0) {
-    close(srcfd);
-    return SysError::errNo(string_format("copyfile: cannot open output file '%s'", aDestPath.c_str()).c_str());
-  }
-  // copy
-  char *buffer = new char[bufSize];
-  ssize_t n;
-  while((n = read(srcfd, buffer, bufSize))>0) {
-    n = write(destfd, buffer, n);
-    if (n<0) break;
-  }
-  close(destfd);
-  close(srcfd);
-  delete[] buffer;
-  if (n<0) {
-    return SysError::errNo("copyfile: error copying data");
-  }
-  return ErrorPtr();
-}
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x) // for using numeric defaults in the option descriptions
 
 
-static string cleanBanditData(const string aData, bool aForSend, bool aRawMode)
-{
-  if (aRawMode) return aData; // pass trough
-  string res;
-  char lastChar = 0;
-  // skip all trailing control chars and spaces first
-  size_t i=0;
-  while (i<aData.size()) {
-    if (aData[i]>0x20) break;
-    i++;
-  }
-  bool bol = true;
-  int lineNo = 0;
-  for (;i<aData.size(); ++i) {
-    char c = aData[i];
-    // filter comment lines
-    if (bol && c=='#') {
-      i++; // skip #
-      while (i<aData.size() && aData[i]!='\n' && aData[i]!='\r') i++; // skip comment text
-      while (i<aData.size() && (aData[i]=='\n' || aData[i]=='\r')) i++; // skip line end
-      i--; // will increment after continue
-      continue; // still BOL
-    }
-    if (c=='\n' || c=='\r') {
-      // newline
-      if (lastChar=='\n') {
-        continue; // no duplicates
-      }
-      c = '\n';
-      if (aForSend) res += '\r'; // output with CR+LF
-      bol = true;
-    }
-    else if (c<0x20 || c>0x7E) {
-      continue; // filter all control chars (DC1 0x11 at beginning, many nulls, DC4 0x13 at end)
-    }
-    else if (bol) {
-      bol = false;
-      lineNo++;
-      if (aForSend) {
-        if (c=='N' || isdigit(c)) {
-          // skip existing line number (starting with N or not)
-          if (c=='N') i++;
-          while (i<aData.size() && isdigit(aData[i])) i++;
-          // skip spaces and ampersand
-          while (i<aData.size() && (isblank(aData[i]) || (aData[i]=='&'))) i++;
-          c = aData[i];
-        }
-        // (re-)generate line number
-        string_format_append(res, "N%d%c", lineNo, lineNo==1 ? '&' : ' ');
-      }
-    }
-    res += toupper(c);
-    lastChar = c;
-  }
-  return res;
-}
-
+// MARK: ==== Application
 
 class P44BanditD : public CmdLineApp
 {
   typedef CmdLineApp inherited;
 
+  typedef std::vector<BanditMachinePtr> MachinesVector;
+
   // API Server
   SocketCommPtr apiServer;
+  bool apiKeepAlive; ///< keep API connections open by default
+  EventHubPtr eventHub; ///< pushes events to subscribed API clients
+  MLTicket lagTicket;
+  MLMicroSeconds lagSampleDue; ///< when the current lag sample should fire
 
-  // BANDIT communication
-  BanditCommPtr banditComm;
-  bool rawmode;
-
-  // LED+Button
-  ButtonInputPtr button;
-  IndicatorOutputPtr greenLed;
-  IndicatorOutputPtr redLed;
+  // BANDIT machines
+  BanditMachineSettings settings; ///< settings common to all machines
+  MachinesVector machines; ///< first one is addressed by requests without machine id
+  TransmissionImageCachePtr imageCache;
+  WorkerPoolPtr workers; ///< for CPU heavy file preparation, shared by all machines
 
   MLMicroSeconds starttime;
-  MLTicket autoReceiveTicket;
-  
-
-  // data dir
-  string selectedfile;
 
 public:
 
   P44BanditD() :
-    starttime(MainLoop::now()),
-    rawmode(false)
+    apiKeepAlive(false),
+    eventHub(new EventHub(EVENT_BUFFER_SIZE)),
+    lagSampleDue(Never),
+    starttime(MainLoop::now())
   {
   }
 
@@ -171,13 +85,25 @@ public:
     const CmdLineOptionDescriptor options[] = {
       { 0  , "jsonapiport",    true,  "port;server port number for JSON API (default=none)" },
       { 0  , "jsonapinonlocal",false, "allow JSON API from non-local clients" },
+      { 0  , "jsonapimaxconn", true,  "connections;max number of concurrent JSON API connections (default=3)" },
+      { 0  , "jsonapikeepalive",false,"keep JSON API connections open for further requests unless request has \"keepalive\":false" },
       { 'l', "loglevel",       true,  "level;set max level of log message detail to show on stdout" },
       { 0  , "errlevel",       true,  "level;set max level for log messages to go to stderr as well" },
       { 0  , "dontlogerrors",  false, "don't duplicate error messages (see --errlevel) on stdout" },
       { 0  , "deltatstamps",  false, "show timestamp delta between log lines" },
+      { 0  , "machines",       true,  "file;JSON array of machines, each with \"id\", \"dir\" and settings named like the options for a single machine" },
       { 0  , "serialport",     true,  "serial port device; specify the serial port device" },
       { 0  , "hsoutpin",       true,  "pin specification; serial handshake output line" },
-      { 0  , "hsinpin",        true,  "pin specification; serial handshake input line" },
+      { 0  , "hsinpin",        true,  "pin specification; serial handshake input line, modem.cts|dsr|dcd|ri for the serial port's own lines" },
+      { 0  , "hsdebounce",     true,  "mS;handshake input must be stable this long before a change is accepted (default=0)" },
+      { 0  , "hspoll",         true,  "mS;handshake input poll interval when no edge detection is available (default=100)" },
+      { 0  , "noflowcontrol",  false, "do not pause sending while handshake input line is inactive" },
+      { 0  , "noenddetect",    false, "do not end receiving on DC3 or M2/M30, only by handshake or idle timeout" },
+      { 0  , "txlowwater",     true,  "bytes;read more program data from disk when less than this is left to send (default=" STRINGIFY(DEFAULT_TX_LOW_WATER) ")" },
+      { 0  , "txhighwater",    true,  "bytes;max program data to buffer for sending, must be above txlowwater (default=" STRINGIFY(DEFAULT_TX_HIGH_WATER) ")" },
+      { 0  , "imagecache",     true,  "MB;max size of prebuilt transmission images kept in memory (default=16)" },
+      { 0  , "workers",        true,  "threads;number of worker threads for analyzing and preparing files (default=number of CPUs)" },
+      { 0  , "linkprofile",    true,  "profile;serial link profile name or baud[,bits[,parity[,stopbits[,hs|nohs]]]] (default=bandit, 1200,7,E,2,hs)" },
       { 0  , "button",         true,  "input pinspec; device button" },
       { 0  , "greenled",       true,  "output pinspec; green device LED" },
       { 0  , "redled",         true,  "output pinspec; red device LED" },
@@ -190,7 +116,12 @@ public:
       { 0  , "stoponhs",       false, "stop only on input handshake becoming inactive" },
       { 0  , "hsonstart",      false, "set handshake line active already before sending or receiving" },
       { 0  , "rawmode",        false, "send/receive raw data to/from Bandit" },
+      { 0  , "compact",        false, "send programs in compacted (shortest equivalent) form" },
+      { 0  , "arcfit",         true,  "mm;replace runs of short moves by lines and arcs deviating no more than this from the original path" },
+      { 0  , "compress",       false, "store received and uploaded programs compressed in the data directory" },
       { 0  , "send",           true,  "file; send file to bandit" },
+      { 0  , "dnc",            false, "drip-feed file (DNC mode) to a running machine with --send" },
+      { 0  , "probe",          false, "find link profile by listening to program output from the controller" },
       { 'h', "help",           false, "show this text" },
       { 0, NULL } // list terminator
     };
@@ -215,18 +146,24 @@ public:
       SETERRLEVEL(errlevel, !getOption("dontlogerrors"));
       SETDELTATIME(getOption("deltatstamps"));
 
-      // create button input
-      button = ButtonInputPtr(new ButtonInput(getOption("button","missing")));
-      button->setButtonHandler(boost::bind(&P44BanditD::buttonHandler, this, _1, _2, _3), true, Second);
-      // - create LEDs
-      greenLed = IndicatorOutputPtr(new IndicatorOutput(getOption("greenled","missing")));
-      redLed = IndicatorOutputPtr(new IndicatorOutput(getOption("redled","missing")));
-
-      // - create and start bandit comm
-      banditComm = BanditCommPtr(new BanditComm(MainLoop::currentMainLoop()));
-      string serialport;
-      if (getStringOption("serialport", serialport)) {
-        banditComm->setConnectionSpecification(serialport.c_str(), 2101, getOption("hsoutpin", "missing"), getOption("hsinpin", "missing"));
+      // settings common to all machines
+      settings.rawmode = getOption("rawmode");
+      settings.compactmode = getOption("compact") && !settings.rawmode;
+      string s;
+      if (getStringOption("arcfit", s) && !settings.rawmode) settings.arcfitTolerance = atof(s.c_str());
+      settings.compressStorage = getOption("compress");
+      int imageCacheMB = 16;
+      getIntOption("imagecache", imageCacheMB);
+      imageCache = TransmissionImageCachePtr(new TransmissionImageCache((size_t)imageCacheMB*1024*1024));
+      int numWorkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+      getIntOption("workers", numWorkers);
+      workers = WorkerPoolPtr(new WorkerPool(numWorkers<1 ? 1 : numWorkers));
+
+      // - create the machines
+      ErrorPtr err = createMachines();
+      if (!Error::isOK(err)) {
+        LOG(LOG_ERR, "Invalid machine configuration: %s", err->description().c_str());
+        terminateApp(EXIT_FAILURE);
       }
 
       // - create and start API server and wait for things to happen
@@ -235,7 +172,10 @@ public:
         apiServer = SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
         apiServer->setConnectionParams(NULL, apiport.c_str(), SOCK_STREAM, AF_INET);
         apiServer->setAllowNonlocalConnections(getOption("jsonapinonlocal"));
-        apiServer->startServer(boost::bind(&P44BanditD::apiConnectionHandler, this, _1), 3);
+        apiKeepAlive = getOption("jsonapikeepalive");
+        int maxConnections = 3;
+        getIntOption("jsonapimaxconn", maxConnections);
+        apiServer->startServer(boost::bind(&P44BanditD::apiConnectionHandler, this, _1), maxConnections);
       }
 
 
@@ -245,39 +185,123 @@ public:
   }
 
 
+  /// @return machine configuration from the single machine command line options
+  JsonObjectPtr commandLineMachineConfig()
+  {
+    static const char *stringOptions[] = { "serialport", "hsoutpin", "hsinpin", "linkprofile", "button", "greenled", "redled", NULL };
+    static const char *intOptions[] = { "hsdebounce", "hspoll", "txlowwater", "txhighwater", NULL };
+    JsonObjectPtr cfg = JsonObject::newObj();
+    string s;
+    for (const char **o = stringOptions; *o; o++) {
+      if (getStringOption(*o, s)) cfg->add(*o, JsonObject::newString(s));
+    }
+    int i;
+    for (const char **o = intOptions; *o; o++) {
+      if (getIntOption(*o, i)) cfg->add(*o, JsonObject::newInt32(i));
+    }
+    if (getOption("noflowcontrol")) cfg->add("flowcontrol", JsonObject::newBool(false));
+    if (getOption("noenddetect")) cfg->add("enddetect", JsonObject::newBool(false));
+    return cfg;
+  }
+
+
+  /// create the machines from the --machines file, or a single machine from the command line options
+  ErrorPtr createMachines()
+  {
+    ErrorPtr err;
+    JsonObjectPtr defaults = commandLineMachineConfig();
+    string fn;
+    if (!getStringOption("machines", fn)) {
+      // single machine, using the data directory itself
+      BanditMachinePtr m = BanditMachinePtr(new BanditMachine(SINGLE_MACHINE_ID, "", settings, eventHub, imageCache, workers));
+      err = m->configure(defaults);
+      if (Error::isOK(err)) machines.push_back(m);
+      return err;
+    }
+    JsonObjectPtr cfgs = JsonObject::objFromFile(fn.c_str(), &err, true);
+    if (!Error::isOK(err)) return err;
+    if (!cfgs || !cfgs->isType(json_type_array) || cfgs->arrayLength()==0) {
+      return TextError::err("'%s' must contain a non-empty array of machines", fn.c_str());
+    }
+    // link tuning options given on the command line apply to all machines unless they specify their own
+    static const char *sharedOptions[] = { "linkprofile", "hsdebounce", "hspoll", "txlowwater", "txhighwater", "flowcontrol", "enddetect", NULL };
+    for (int i=0; i<cfgs->arrayLength(); i++) {
+      JsonObjectPtr cfg = cfgs->arrayGet(i);
+      JsonObjectPtr o;
+      if (!cfg->get("id", o) || o->stringValue().empty()) {
+        return TextError::err("machine #%d has no 'id'", i+1);
+      }
+      string id = o->stringValue();
+      if (machineById(id)) return TextError::err("duplicate machine id '%s'", id.c_str());
+      string dir = cfg->get("dir", o) ? o->stringValue() : id;
+      if (dir.find("..")!=string::npos) return TextError::err("invalid 'dir' for machine '%s'", id.c_str());
+      for (const char **so = sharedOptions; *so; so++) {
+        if (!cfg->get(*so) && defaults->get(*so, o)) cfg->add(*so, o);
+      }
+      BanditMachinePtr m = BanditMachinePtr(new BanditMachine(id, dir, settings, eventHub, imageCache, workers));
+      err = m->configure(cfg);
+      if (!Error::isOK(err)) return err;
+      machines.push_back(m);
+    }
+    LOG(LOG_NOTICE, "Driving %zu machines", machines.size());
+    return err;
+  }
+
+
+  /// @param aId machine id
+  /// @return the machine or NULL if none with this id
+  BanditMachinePtr machineById(const string aId)
+  {
+    for (MachinesVector::iterator pos = machines.begin(); pos!=machines.end(); ++pos) {
+      if ((*pos)->getId()==aId) return *pos;
+    }
+    return BanditMachinePtr();
+  }
+
+
   virtual void initialize()
   {
-    banditComm->init(); // idle
+    if (machines.empty()) return;
+    // command line (one shot) operations work on the first machine
+    BanditMachinePtr machine = machines.front();
+    BanditCommPtr banditComm = machine->comm();
+    for (MachinesVector::iterator pos = machines.begin(); pos!=machines.end(); ++pos) {
+      (*pos)->comm()->init(); // idle
+    }
     string fn;
-    rawmode = getOption("rawmode");
-    if (getOption("receive")) {
+    if (getOption("probe")) {
+      banditComm->probe(boost::bind(&P44BanditD::probeResult, this, _1, _2), PROBE_TIMEOUT);
+    }
+    else if (getOption("receive")) {
       banditComm->receive(
         boost::bind(&P44BanditD::receiveResult, this, _1, _2),
         getOption("hsonstart"),
         getOption("startonhs"),
-        getOption("stoponhs")
+        getOption("stoponhs"),
+        BanditCleanerPtr(new BanditCleaner(false, settings.rawmode))
       );
     }
     else if (getStringOption("send", fn)) {
-      string data;
-      FILE *inFile = fopen(fn.c_str(), "r");
-      if (inFile && string_fgetfile(inFile, data)) {
-        string sendData = cleanBanditData(data, true, rawmode);
-        banditComm->send(
-          boost::bind(&P44BanditD::sendComplete, this, _1),
-          sendData,
-          getOption("hsonstart")
-        );
-      }
-      else {
-        LOG(LOG_ERR, "Cannot open input file '%s'", fn.c_str());
+      BanditDataSourcePtr source;
+      ErrorPtr err = machine->programSource(fn, source, settings.compactmode, settings.arcfitTolerance);
+      if (!Error::isOK(err)) {
+        LOG(LOG_ERR, "Cannot open input file: %s", err->description().c_str());
         terminateApp(1);
+        return;
       }
+      banditComm->send(
+        boost::bind(&P44BanditD::sendComplete, this, _1),
+        source,
+        getOption("hsonstart"),
+        getOption("dnc")
+      );
     }
     else {
       // Normal operation:
-      LOG(LOG_NOTICE, "Start receiving automatically when handshake line indicates data");
-      autoReceive();
+      sampleLag();
+      for (MachinesVector::iterator pos = machines.begin(); pos!=machines.end(); ++pos) {
+        (*pos)->start();
+      }
     }
   }
 
@@ -296,136 +320,99 @@ public:
 
 
 
-  void receiveResult(const string &aResponse, ErrorPtr aError)
+  void probeResult(const BanditLinkProfile &aProfile, ErrorPtr aError)
   {
     if (Error::isOK(aError)) {
-      // print data to stdout
-      LOG(LOG_NOTICE, "Successfully received %zd bytes of raw data", aResponse.size());
-      string rcvData = cleanBanditData(aResponse, false, rawmode);
-      fputs(rcvData.c_str(), stdout);
-      fflush(stdout);
+      LOG(LOG_NOTICE, "Controller uses link profile '%s' (%s)", aProfile.name.c_str(), aProfile.commParams().c_str());
+      printf("%s\n", aProfile.name.c_str());
     }
     else {
-      LOG(LOG_ERR, "Error receiving data: %s", aError->description().c_str());
+      LOG(LOG_ERR, "Probing failed: %s", aError->description().c_str());
     }
     terminateAppWith(aError);
   }
 
 
-  // MARK: ==== Normal operation
-  void autoReceive()
-  {
-    LOG(LOG_INFO, "Start waiting for new data...");
-    banditComm->receive(
-      boost::bind(&P44BanditD::autoReceived, this, _1, _2),
-      true, // hsonstart
-      true, // startonhs
-      true // stoponhs
-    );
-  }
-
-
-  void autoReceived(const string &aResponse, ErrorPtr aError)
+  void receiveResult(const string &aResponse, ErrorPtr aError)
   {
     if (Error::isOK(aError)) {
       // print data to stdout
-      size_t receivedBytes = aResponse.size();
-      LOG(LOG_INFO, "Successfully received %zd bytes of data", receivedBytes);
-      redLed->onFor(2*Second);
-      if (aResponse.size()>0) {
-        string ts = string_ftime("%Y-%m-%d_%H.%M.%S", NULL);
-        string fp = Application::sharedApplication()->dataPath(string_format("%s_bandit_download.txt", ts.c_str()));
-        LOG(LOG_NOTICE, "Saving received data (%zd bytes) to '%s'", receivedBytes, fp.c_str());
-        FILE *datafileP = fopen(fp.c_str(), "w");
-        if (datafileP==NULL) {
-          LOG(LOG_ERR, "Error opening file for write: %s", strerror(errno));
-        }
-        else {
-          // clean data
-          string data = cleanBanditData(aResponse, false, rawmode);
-          size_t dataSize = data.size();
-          // save data
-          if (fwrite(data.c_str(), 1, dataSize, datafileP)<dataSize) {
-            LOG(LOG_ERR, "Cannot save received file %s - %s", fp.c_str(), strerror(errno));
-          }
-          // close file
-          fclose(datafileP);
-        }
-      }
+      LOG(LOG_NOTICE, "Successfully received %zd bytes of cleaned data", aResponse.size());
+      fputs(aResponse.c_str(), stdout);
+      fflush(stdout);
     }
     else {
-      LOG(LOG_ERR, "Error auto-receiving data: %s", aError->description().c_str());
+      LOG(LOG_ERR, "Error receiving data: %s", aError->description().c_str());
     }
-    // restart receiving (with a small safety delay)
-    autoReceiveTicket.executeOnce(boost::bind(&P44BanditD::autoReceive, this), 1*Second);
+    terminateAppWith(aError);
   }
 
 
-  ErrorPtr sendFile(const string aFilePath)
+  // MARK: ==== Events
+
+  void subscribeEvents(JsonObjectPtr aData, SocketCommPtr aConnection)
   {
-    ErrorPtr err;
-    string data;
-    FILE *inFile = fopen(aFilePath.c_str(), "r");
-    if (inFile==NULL || !string_fgetfile(inFile, data)) {
-      return SysError::errNo("cannot open file to send: ");
-    }
-    else {
-      // clean data
-      string senddata = "\x11"; // always DC1/XON at beginning
-      senddata.append(100, 0); // 100 null chars padding
-      senddata += "\r"; // single CR in front of first line
-      senddata += cleanBanditData(data, true, rawmode); // data itself, with double LFs
-      // make sure data ends with CR LF
-      if (senddata[senddata.size()-1]!='\n') {
-        senddata += "\r\n";
-      }
-      senddata += "\x13"; // always DC3/XOFF character at the end of file
-      senddata.append(100, 0); // 100 null chars padding
-      LOG(LOG_NOTICE, "Sending data (%lu bytes input data, %lu bytes padded+cleaned) from '%s'", data.size(), senddata.size(), aFilePath.c_str());
-      // send it
-      redLed->steadyOn();
-      banditComm->send(
-        boost::bind(&P44BanditD::sendFileComplete, this, _1),
-        senddata,
-        true // hsonstart
-      );
-    }
-    return err;
+    JsonObjectPtr o;
+    uint64_t since = aData && aData->get("since", o) ? o->int64Value() : 0;
+    eventHub->subscribe(aConnection, since);
   }
 
 
+  // MARK: ==== Metrics
 
-  void sendFileComplete(ErrorPtr aError)
+  /// measure how late a timer fires, which is how long the mainloop was blocked
+  void sampleLag()
   {
-    redLed->steadyOff();
-    if (Error::isOK(aError)) {
-      // print data to stdout
-      LOG(LOG_NOTICE, "Successfully sent data");
-    }
-    else {
-      LOG(LOG_ERR, "Error sending data: %s", aError->description().c_str());
+    static MetricHistogram &lag = Metrics::shared().histogram(
+      "bandit_mainloop_lag_seconds", "delay of timers caused by mainloop being busy",
+      { 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1 }
+    );
+    static MetricCounter &overruns = Metrics::shared().counter(
+      "bandit_mainloop_overruns_total", "timer delays longer than the mainloop cycle time"
+    );
+    MLMicroSeconds now = MainLoop::now();
+    if (lagSampleDue!=Never) {
+      MLMicroSeconds late = now-lagSampleDue;
+      if (late<0) late = 0;
+      lag.observe((double)late/Second);
+      if (late>MAINLOOP_CYCLE_TIME_uS) overruns.inc();
     }
+    lagSampleDue = now+LAG_SAMPLE_INTERVAL;
+    lagTicket.executeOnce(boost::bind(&P44BanditD::sampleLag, this), LAG_SAMPLE_INTERVAL);
   }
 
 
-
-  // MARK: ==== Button
-
-
-  void buttonHandler(bool aState, bool aHasChanged, MLMicroSeconds aTimeSincePreviousChange)
+  string metricsText()
   {
-    LOG(LOG_INFO, "Button state now %d%s", aState, aHasChanged ? " (changed)" : " (same)");
-    if (aHasChanged && !aState && selectedfile.size()>0) {
-      // send the selected file
-      string filepath = Application::sharedApplication()->dataPath(selectedfile.c_str());
-      ErrorPtr err = sendFile(filepath);
-      if (!Error::isOK(err)) {
-        LOG(LOG_ERR, "Cannot send file: %s", err->description().c_str());
-      }
+    Metrics &m = Metrics::shared();
+    // gauges are sampled now
+    for (MachinesVector::iterator pos = machines.begin(); pos!=machines.end(); ++pos) {
+      (*pos)->sampleMetrics();
     }
+    m.gauge("bandit_event_subscribers", "connected event stream clients").set(eventHub->numSubscribers());
+    if (imageCache) m.gauge("bandit_image_cache_bytes", "size of cached transmission images").set(imageCache->size());
+    m.gauge("bandit_workers_busy", "worker threads preparing files").set(workers->numBusy());
+    m.gauge("bandit_workers_pending", "file preparations waiting for a worker thread").set(workers->numPending());
+    m.gauge("bandit_uptime_seconds", "time since daemon start").set((double)(MainLoop::now()-starttime)/Second);
+    return m.prometheusText();
   }
 
 
+  /// forwards API response, recording request latency
+  void apiRequestTimed(const string aUri, MLMicroSeconds aStart, RequestDoneCB aRequestDoneCB, JsonObjectPtr aResponse, ErrorPtr aError)
+  {
+    static const char *knownUris[] = { "files", "jobs", "transfer", "linkprofile", "machines", "log", "events", "metrics", "/", NULL };
+    const char *label = "other"; // do not let arbitrary URIs create new series
+    for (const char **u = knownUris; *u; u++) {
+      if (aUri==*u) { label = *u; break; }
+    }
+    Metrics::shared().histogram(
+      "bandit_api_request_seconds", "API request processing time by URI",
+      { 0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5 },
+      string_format("uri=\"%s\"", label)
+    ).observe((double)(MainLoop::now()-aStart)/Second);
+    aRequestDoneCB(aResponse, aError);
+  }
 
 
   // MARK: ==== API access
@@ -433,110 +420,87 @@ public:
 
   SocketCommPtr apiConnectionHandler(SocketCommPtr aServerSocketComm)
   {
-    JsonCommPtr conn = JsonCommPtr(new JsonComm(MainLoop::currentMainLoop()));
-    conn->setMessageHandler(boost::bind(&P44BanditD::apiRequestHandler, this, conn, _1, _2));
-    conn->setClearHandlersAtClose(); // close must break retain cycles so this object won't cause a mem leak
-    return conn;
+    JsonApiConnectionPtr conn = JsonApiConnectionPtr(new JsonApiConnection(
+      boost::bind(&P44BanditD::apiRequestHandler, this, _1, _2, _3),
+      apiKeepAlive,
+      API_IDLE_TIMEOUT
+    ));
+    return conn->socket();
   }
 
 
-  void apiRequestHandler(JsonCommPtr aConnection, ErrorPtr aError, JsonObjectPtr aRequest)
+  void apiRequestHandler(JsonApiConnectionPtr aConnection, JsonObjectPtr aRequest, RequestDoneCB aRequestDoneCB)
   {
+    ErrorPtr err;
     // Decode mg44-style request (HTTP wrapped in JSON)
-    if (Error::isOK(aError)) {
-      LOG(LOG_INFO,"API request: %s", aRequest->c_strValue());
-      JsonObjectPtr o;
-      o = aRequest->get("method");
-      if (o) {
-        string method = o->stringValue();
-        string uri;
-        o = aRequest->get("uri");
-        if (o) uri = o->stringValue();
-        JsonObjectPtr data;
-        bool upload = false;
-        bool action = (method!="GET");
-        // check for uploads
-        string uploadedfile;
-        if (aRequest->get("uploadedfile", o)) {
-          uploadedfile = o->stringValue();
-          upload = true;
-          action = false; // other params are in the URI, not the POSTed upload
-        }
-        if (action) {
-          // JSON data is in the request
-          data = aRequest->get("data");
-        }
-        else {
-          // URI params is the JSON to process
-          data = aRequest->get("uri_params");
-          if (data) action = true; // GET, but with query_params: treat like PUT/POST with data
-          if (upload) {
-            // move that into the request
-            data->add("uploadedfile", JsonObject::newString(uploadedfile));
-          }
-        }
-        // request elements now: uri and data
-        if (processRequest(uri, data, action, boost::bind(&P44BanditD::requestHandled, this, aConnection, _1, _2))) {
-          // done, callback will send response and close connection
-          return;
-        }
-        // request cannot be processed, return error
-        LOG(LOG_ERR,"Invalid JSON request");
-        aError = WebError::webErr(404, "No handler found for request to %s", uri.c_str());
+    LOG(LOG_INFO,"API request: %s", aRequest->c_strValue());
+    JsonObjectPtr o;
+    o = aRequest->get("method");
+    if (o) {
+      string method = o->stringValue();
+      string uri;
+      o = aRequest->get("uri");
+      if (o) uri = o->stringValue();
+      JsonObjectPtr data;
+      bool upload = false;
+      bool action = (method!="GET");
+      // check for uploads
+      string uploadedfile;
+      if (aRequest->get("uploadedfile", o)) {
+        uploadedfile = o->stringValue();
+        upload = true;
+        action = false; // other params are in the URI, not the POSTed upload
+      }
+      if (action) {
+        // JSON data is in the request
+        data = aRequest->get("data");
       }
       else {
-        LOG(LOG_ERR,"Invalid JSON request");
-        aError = WebError::webErr(415, "Invalid JSON request format");
+        // URI params is the JSON to process
+        data = aRequest->get("uri_params");
+        if (data) action = true; // GET, but with query_params: treat like PUT/POST with data
+        if (upload) {
+          // move that into the request
+          data->add("uploadedfile", JsonObject::newString(uploadedfile));
+        }
       }
+      // request elements now: uri and data
+      aRequestDoneCB = boost::bind(&P44BanditD::apiRequestTimed, this, uri, MainLoop::now(), aRequestDoneCB, _1, _2);
+      if (uri=="events") {
+        // subscribe: after this response, the connection delivers newline-delimited JSON events
+        aConnection->handOver(boost::bind(&P44BanditD::subscribeEvents, this, data, _1));
+        JsonObjectPtr res = JsonObject::newObj();
+        res->add("nextSeq", JsonObject::newInt64(eventHub->nextSeq()));
+        aRequestDoneCB(res, ErrorPtr());
+        return;
+      }
+      if (processRequest(uri, data, action, aRequestDoneCB)) {
+        // done, callback will send response
+        return;
+      }
+      // request cannot be processed, return error
+      LOG(LOG_ERR,"Invalid JSON request");
+      err = WebError::webErr(404, "No handler found for request to %s", uri.c_str());
     }
-    // return error
-    requestHandled(aConnection, JsonObjectPtr(), aError);
-  }
-
-
-  void requestHandled(JsonCommPtr aConnection, JsonObjectPtr aResponse, ErrorPtr aError)
-  {
-    if (!aResponse) {
-      aResponse = JsonObject::newObj(); // empty response
-    }
-    if (!Error::isOK(aError)) {
-      aResponse->add("Error", JsonObject::newString(aError->description()));
+    else {
+      LOG(LOG_ERR,"Invalid JSON request");
+      err = WebError::webErr(415, "Invalid JSON request format");
     }
-    LOG(LOG_INFO,"API answer: %s", aResponse->c_strValue());
-    aConnection->sendMessage(aResponse);
-    aConnection->closeAfterSend();
+    // return error
+    aRequestDoneCB(JsonObjectPtr(), err);
   }
 
 
-  ErrorPtr processUpload(string aUri, JsonObjectPtr aData, const string aUploadedFile)
+  /// @param aData request data, may contain "machine"
+  /// @param aError set to error if the machine does not exist
+  /// @return the machine addressed by the request, the first machine when the request has no machine id
+  BanditMachinePtr requestMachine(JsonObjectPtr aData, ErrorPtr &aError)
   {
-    ErrorPtr err;
-
-    string cmd;
     JsonObjectPtr o;
-    if (aData->get("cmd", o)) {
-      cmd = o->stringValue();
-      if (cmd=="banditfileupload") {
-        // create destination file name
-        // - original name
-        string origname = aUploadedFile;
-        size_t p = aUploadedFile.rfind('/');
-        if (p!=string::npos) {
-          origname = aUploadedFile.substr(p+1);
-        }
-        string filepath = Application::sharedApplication()->dataPath(origname);
-        LOG(LOG_NOTICE, "Saving uploaded file '%s' as '%s'", aUploadedFile.c_str(), filepath.c_str());
-        err = copyfile(aUploadedFile, filepath);
-        if (Error::isOK(err)) {
-          // auto-select the file
-          selectedfile = origname;
-        }
-      }
-      else {
-        err = WebError::webErr(500, "Unknown upload cmd '%s'", cmd.c_str());
-      }
-    }
-    return err;
+    if (!aData || !aData->get("machine", o)) return machines.front();
+    BanditMachinePtr m = machineById(o->stringValue());
+    if (!m) aError = WebError::webErr(404, "Unknown machine '%s'", o->c_strValue());
+    return m;
   }
 
 
@@ -544,99 +508,29 @@ public:
   {
     ErrorPtr err;
     JsonObjectPtr o;
-    if (aUri=="files") {
-      // return a list of files
-      string action;
-      if (!aData->get("action", o)) {
-        aIsAction = false;
-      }
-      else {
-        action = o->stringValue();
-      }
-      if (!aIsAction) {
-        DIR *dirP = opendir(Application::sharedApplication()->dataPath().c_str());
-        struct dirent *direntP;
-        if (dirP==NULL) {
-          err = SysError::errNo("Cannot read data directory: ");
-        }
-        else {
-          JsonObjectPtr files = JsonObject::newArray();
-          bool foundSelected = false;
-          while ((direntP = readdir(dirP))!=NULL) {
-            string fn = direntP->d_name;
-            if (fn=="." || fn=="..") continue;
-            JsonObjectPtr file = JsonObject::newObj();
-            file->add("name", JsonObject::newString(fn));
-            file->add("ino", JsonObject::newInt64(direntP->d_ino));
-            file->add("type", JsonObject::newInt64(direntP->d_type));
-            if (fn==selectedfile) foundSelected = true;
-            file->add("selected", JsonObject::newBool(fn==selectedfile));
-            files->arrayAppend(file);
-          }
-          closedir (dirP);
-          if (!foundSelected) selectedfile.clear(); // remove selection not matching any of the existing files
-          aRequestDoneCB(files, ErrorPtr());
-          return true;
-        }
+    if (aUri=="files" || aUri=="jobs" || aUri=="linkprofile" || aUri=="transfer") {
+      // machine specific
+      BanditMachinePtr machine = requestMachine(aData, err);
+      if (!machine) {
+        actionStatus(aRequestDoneCB, err);
+        return true;
       }
-      else {
-        // a file action
-        if (!aData->get("name", o)) {
-          err = WebError::webErr(400, "Missing 'name'");
-        }
-        else {
-          // addressing a particular file
-          // - try to open to see if it exists
-          string filename = o->c_strValue();
-          string filepath = Application::sharedApplication()->dataPath(filename.c_str());
-          FILE *fileP = fopen(filepath.c_str(),"r");
-          if (fileP==NULL) {
-            err = WebError::webErr(404, "File '%s' not found", filename.c_str());
-          }
-          else {
-            // exists
-            fclose(fileP);
-            if (action=="rename") {
-              // rename file
-              if (!aData->get("newname", o)) {
-                err = WebError::webErr(400, "Missing 'newname'");
-              }
-              else {
-                string newname = o->stringValue();
-                if (newname.size()<3) {
-                  err = WebError::webErr(415, "'newname' is too short (min 3 characters)");
-                }
-                else {
-                  string newpath = Application::sharedApplication()->dataPath(newname.c_str());
-                  if (rename(filepath.c_str(), newpath.c_str())!=0) {
-                    err = SysError::errNo("Cannot rename file: ");
-                  }
-                }
-              }
-            }
-            else if (action=="delete") {
-              if (unlink(filepath.c_str())!=0) {
-                err = SysError::errNo("Cannot delete file: ");
-              }
-            }
-            else if (action=="select") {
-              if (selectedfile==filename) {
-                selectedfile.clear(); // unselect
-              }
-              else {
-                selectedfile = filename; // select
-              }
-            }
-            else if (action=="send") {
-              err = sendFile(filepath);
-            }
-            else {
-              err = WebError::webErr(400, "Unknown files action");
-            }
-          }
-        }
+      return machine->processRequest(aUri, aData, aIsAction, aRequestDoneCB);
+    }
+    else if (aUri=="machines") {
+      JsonObjectPtr res = JsonObject::newArray();
+      for (MachinesVector::iterator pos = machines.begin(); pos!=machines.end(); ++pos) {
+        res->arrayAppend((*pos)->status());
       }
-      actionStatus(aRequestDoneCB, err);
+      aRequestDoneCB(res, ErrorPtr());
+      return true;
+    }
+    else if (aUri=="metrics") {
+      // Prometheus text exposition, wrapped for the JSON API
+      JsonObjectPtr res = JsonObject::newObj();
+      res->add("contentType", JsonObject::newString("text/plain; version=0.0.4"));
+      res->add("text", JsonObject::newString(metricsText()));
+      aRequestDoneCB(res, ErrorPtr());
       return true;
     }
     else if (aIsAction && aUri=="log") {
@@ -650,10 +544,14 @@ public:
     }
     else if (aUri=="/") {
       string uploadedfile;
-      string cmd;
       if (aData->get("uploadedfile", o)) {
         uploadedfile = o->stringValue();
-        actionStatus(aRequestDoneCB, processUpload(aUri, aData, uploadedfile));
+        BanditMachinePtr machine = requestMachine(aData, err);
+        if (!machine) {
+          actionStatus(aRequestDoneCB, err);
+          return true;
+        }
+        machine->processUpload(aData, uploadedfile, boost::bind(&P44BanditD::actionStatus, this, aRequestDoneCB, _1));
         return true;
       }
     }
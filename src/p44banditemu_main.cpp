@@ -0,0 +1,538 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44banditd.
+//
+//  pixelboardd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  pixelboardd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with pixelboardd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "application.hpp"
+#include "socketcomm.hpp"
+
+#include "banditdata.hpp"
+
+#include <math.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <sys/stat.h>
+
+using namespace p44;
+
+#define DEFAULT_LOGLEVEL LOG_NOTICE
+#define DEFAULT_LINK "/tmp/banditemu"
+#define HANDSHAKE_LINK_SUFFIX ".hs" // unix socket for the handshake lines, next to the pty link
+#define DEFAULT_BAUDRATE 1200
+#define DEFAULT_FRAME "7E2"
+#define DEFAULT_BUFFER_SIZE 512 // bytes of program buffer
+#define DEFAULT_CONSUME_RATE 0 // chars/second, 0 = plain memory load, never full
+#define DEFAULT_READY_DELAY 500 // mS until ready after start or reload
+#define DEFAULT_RELOAD_DELAY 2000 // mS until ready again after a complete load
+#define DEFAULT_IDLE_TIME 3000 // mS without data after which a load is considered complete
+#define DEFAULT_SEND_DELAY 1000 // mS from start to punching
+#define EMU_TICK (5*MilliSecond) // wire pacing resolution
+#define HIGH_WATERMARK 90 // percent of buffer, handshake goes inactive above
+#define LOW_WATERMARK 50 // percent of buffer, handshake gets active again below
+#define FRAMING_NULS 100 // NUL padding around punched data, like FramedDataSource does
+
+
+/// Emulates a BANDIT controller on a pseudo terminal.
+/// - the pty slave is symlinked to a fixed path, which p44banditd can use as --serialport
+/// - ptys have no modem lines, so the RTS/DTR and CTS/DSR/DCD handshake is carried over a unix socket,
+///   which p44banditd uses via --hsinpin/--hsoutpin emu:<link>.hs
+/// - bytes are taken from/delivered to the pty at the wire rate of the emulated baud rate and framing
+/// - the program buffer is finite and consumed at a configurable rate, the handshake output follows its fill level
+class P44BanditEmu : public CmdLineApp
+{
+  typedef CmdLineApp inherited;
+
+  // pty
+  string linkPath;
+  int masterFd;
+  int slaveFd; ///< kept open, otherwise the master gets EIO whenever p44banditd closes the port
+  MLMicroSeconds byteTime;
+  MLMicroSeconds lastTick;
+  double credits; ///< bytes the wire could have carried since the last transfer
+  MLTicket tickTicket;
+
+  // handshake
+  SocketCommPtr hsServer;
+  SocketCommPtr hsConn;
+  bool hostReady; ///< p44banditd's RTS/DTR
+  bool ready; ///< our CTS/DSR/DCD
+
+  // program buffer (load mode)
+  size_t bufferSize;
+  double bufferFill;
+  double consumeRate;
+  bool accepting; ///< ready for a load (not waiting for ready delay/reload)
+  MLMicroSeconds readyDelay;
+  MLMicroSeconds reloadDelay;
+  MLMicroSeconds idleTime;
+  MLTicket readyTicket;
+
+  // load statistics
+  bool loading;
+  string loadData;
+  MLMicroSeconds loadStart;
+  MLMicroSeconds lastByte;
+  size_t loadBytes;
+  int loadLines;
+  int loadPauses;
+  MLMicroSeconds pausedTime;
+  MLMicroSeconds pauseStart;
+  size_t overruns;
+  int loadCount;
+
+  // punch mode
+  string punchFile;
+  string punchData;
+  size_t punchPos;
+  bool punching;
+  MLMicroSeconds punchStart;
+  MLMicroSeconds sendEvery;
+  MLTicket punchTicket;
+
+public:
+
+  P44BanditEmu() :
+    masterFd(-1),
+    slaveFd(-1),
+    byteTime(0),
+    lastTick(Never),
+    credits(0),
+    hostReady(false),
+    ready(false),
+    bufferSize(DEFAULT_BUFFER_SIZE),
+    bufferFill(0),
+    consumeRate(DEFAULT_CONSUME_RATE),
+    accepting(false),
+    readyDelay(DEFAULT_READY_DELAY*MilliSecond),
+    reloadDelay(DEFAULT_RELOAD_DELAY*MilliSecond),
+    idleTime(DEFAULT_IDLE_TIME*MilliSecond),
+    loading(false),
+    loadStart(Never),
+    lastByte(Never),
+    loadBytes(0),
+    loadLines(0),
+    loadPauses(0),
+    pausedTime(0),
+    pauseStart(Never),
+    overruns(0),
+    loadCount(0),
+    punchPos(0),
+    punching(false),
+    punchStart(Never),
+    sendEvery(0)
+  {
+  }
+
+  virtual int main(int argc, char **argv)
+  {
+    const char *usageText =
+      "Usage: %1$s [options]\n";
+    const CmdLineOptionDescriptor options[] = {
+      { 0  , "link",           true,  "path;symlink to create for the pty, default=" DEFAULT_LINK },
+      { 0  , "baud",           true,  "baudrate;emulated baud rate (default=1200)" },
+      { 0  , "frame",          true,  "bits,parity,stop;emulated character frame (default=" DEFAULT_FRAME ")" },
+      { 0  , "buffer",         true,  "bytes;size of the program buffer (default=512)" },
+      { 0  , "consume",        true,  "chars/sec;rate at which the program buffer is consumed, 0=immediately (default)" },
+      { 0  , "readydelay",     true,  "milliseconds;delay from start until ready to load (default=500)" },
+      { 0  , "reloaddelay",    true,  "milliseconds;delay after a complete load until ready again (default=2000)" },
+      { 0  , "idletime",       true,  "milliseconds;time without data after which a load is complete (default=3000)" },
+      { 0  , "save",           true,  "file;save loaded programs to this file" },
+      { 0  , "punch",          true,  "file;send this program file instead of loading" },
+      { 0  , "senddelay",      true,  "milliseconds;delay from start until punching (default=1000)" },
+      { 0  , "sendevery",      true,  "seconds;repeat punching in this interval (default=once)" },
+      { 'l', "loglevel",       true,  "level;set max level of log message detail to show on stdout" },
+      { 'h', "help",           false, "show this text" },
+      { 0, NULL } // list terminator
+    };
+
+    // parse the command line, exits when syntax errors occur
+    setCommandDescriptors(usageText, options);
+    parseCommandLine(argc, argv);
+
+    if (getOption("help") || numArguments()>0) {
+      // show usage
+      showUsage();
+      terminateApp(EXIT_SUCCESS);
+    }
+
+    if (!isTerminated()) {
+      int loglevel = DEFAULT_LOGLEVEL;
+      getIntOption("loglevel", loglevel);
+      SETLOGLEVEL(loglevel);
+      linkPath = DEFAULT_LINK;
+      getStringOption("link", linkPath);
+      int baud = DEFAULT_BAUDRATE;
+      getIntOption("baud", baud);
+      string frame = DEFAULT_FRAME;
+      getStringOption("frame", frame);
+      int frameBits = frameLength(frame);
+      if (baud<=0 || frameBits<=0) {
+        fprintf(stderr, "Invalid baud rate or frame '%s'\n", frame.c_str());
+        terminateApp(EXIT_FAILURE);
+      }
+      else {
+        byteTime = (MLMicroSeconds)frameBits*Second/baud;
+        LOG(LOG_NOTICE, "Emulating %d baud %s: %.2f mS per byte, %.1f bytes/sec", baud, frame.c_str(), (double)byteTime/MilliSecond, (double)Second/byteTime);
+      }
+      int i;
+      if (getIntOption("buffer", i) && i>0) bufferSize = i;
+      if (getIntOption("consume", i)) consumeRate = i;
+      if (getIntOption("readydelay", i)) readyDelay = i*MilliSecond;
+      if (getIntOption("reloaddelay", i)) reloadDelay = i*MilliSecond;
+      if (getIntOption("idletime", i)) idleTime = i*MilliSecond;
+      if (getIntOption("sendevery", i)) sendEvery = i*Second;
+      getStringOption("punch", punchFile);
+    }
+    // app now ready to run (or cleanup when already terminated)
+    return run();
+  }
+
+
+  /// @return number of bits per character on the wire for a frame spec like "7E2", or 0 if invalid
+  static int frameLength(const string aFrame)
+  {
+    if (aFrame.size()!=3) return 0;
+    int bits = aFrame[0]-'0';
+    char parity = toupper(aFrame[1]);
+    int stop = aFrame[2]-'0';
+    if (bits<5 || bits>8 || stop<1 || stop>2) return 0;
+    if (parity!='N' && parity!='E' && parity!='O') return 0;
+    return 1+bits+(parity=='N' ? 0 : 1)+stop;
+  }
+
+
+  virtual void initialize()
+  {
+    ErrorPtr err = openPty();
+    if (Error::isOK(err)) err = startHandshakeServer();
+    if (Error::isOK(err) && !punchFile.empty()) {
+      BanditDataSourcePtr source;
+      err = openProgramFile(punchFile, source);
+      if (Error::isOK(err)) {
+        // the controller punches the same framing we use for sending
+        source = BanditDataSourcePtr(new CleaningDataSource(source, BanditCleanerPtr(new BanditCleaner(true, false))));
+        source = BanditDataSourcePtr(new FramedDataSource(source));
+        const char *chunk;
+        size_t n;
+        while ((n = source->nextChunk(chunk, 4096, err))>0) punchData.append(chunk, n);
+      }
+    }
+    if (!Error::isOK(err)) {
+      LOG(LOG_ERR, "Cannot start emulator: %s", err->description().c_str());
+      terminateApp(EXIT_FAILURE);
+      return;
+    }
+    int delay = DEFAULT_SEND_DELAY;
+    if (!punchFile.empty()) {
+      getIntOption("senddelay", delay);
+      LOG(LOG_NOTICE, "Punch mode: will send '%s' (%zu bytes) in %d mS", punchFile.c_str(), punchData.size(), delay);
+      punchTicket.executeOnce(boost::bind(&P44BanditEmu::startPunch, this), delay*MilliSecond);
+    }
+    else {
+      LOG(LOG_NOTICE, "Load mode: %zu bytes program buffer, consuming %.0f chars/sec", bufferSize, consumeRate);
+      readyTicket.executeOnce(boost::bind(&P44BanditEmu::becomeReady, this), readyDelay);
+    }
+    lastTick = MainLoop::now();
+    tickTicket.executeOnce(boost::bind(&P44BanditEmu::tick, this), EMU_TICK);
+  }
+
+
+  virtual void cleanup(int aExitCode)
+  {
+    unlink(linkPath.c_str());
+    unlink((linkPath+HANDSHAKE_LINK_SUFFIX).c_str());
+    if (slaveFd>=0) close(slaveFd);
+    if (masterFd>=0) close(masterFd);
+    inherited::cleanup(aExitCode);
+  }
+
+
+  // MARK: ==== pty and handshake link
+
+  ErrorPtr openPty()
+  {
+    masterFd = posix_openpt(O_RDWR|O_NOCTTY);
+    if (masterFd<0 || grantpt(masterFd)<0 || unlockpt(masterFd)<0) {
+      return SysError::errNo("Cannot create pty: ");
+    }
+    string slaveName = ptsname(masterFd);
+    slaveFd = open(slaveName.c_str(), O_RDWR|O_NOCTTY);
+    if (slaveFd<0) return SysError::errNo("Cannot open pty slave: ");
+    // raw until p44banditd configures the port itself
+    struct termios tio;
+    if (tcgetattr(slaveFd, &tio)==0) {
+      cfmakeraw(&tio);
+      tcsetattr(slaveFd, TCSANOW, &tio);
+    }
+    fcntl(masterFd, F_SETFL, fcntl(masterFd, F_GETFL) | O_NONBLOCK);
+    struct stat st;
+    if (lstat(linkPath.c_str(), &st)==0) {
+      if (!S_ISLNK(st.st_mode)) return TextError::err("'%s' exists and is not a symlink", linkPath.c_str());
+      unlink(linkPath.c_str());
+    }
+    if (symlink(slaveName.c_str(), linkPath.c_str())<0) return SysError::errNo("Cannot create pty link: ");
+    LOG(LOG_NOTICE, "Controller emulator on '%s' (-> %s)", linkPath.c_str(), slaveName.c_str());
+    return ErrorPtr();
+  }
+
+
+  ErrorPtr startHandshakeServer()
+  {
+    string hsPath = linkPath+HANDSHAKE_LINK_SUFFIX;
+    unlink(hsPath.c_str()); // stale socket from previous run
+    hsServer = SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
+    hsServer->setConnectionParams(NULL, hsPath.c_str(), SOCK_STREAM, PF_LOCAL);
+    ErrorPtr err = hsServer->startServer(boost::bind(&P44BanditEmu::hsConnectionHandler, this, _1), 1);
+    if (Error::isOK(err)) {
+      LOG(LOG_NOTICE, "Handshake lines at '%s' (use --hsinpin emu:%s --hsoutpin emu:%s)", hsPath.c_str(), hsPath.c_str(), hsPath.c_str());
+    }
+    return err;
+  }
+
+
+  SocketCommPtr hsConnectionHandler(SocketCommPtr aServerSocketComm)
+  {
+    if (hsConn) hsConn->closeConnection(); // only one host at a time
+    hsConn = SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
+    hsConn->setReceiveHandler(boost::bind(&P44BanditEmu::hsReceive, this, _1));
+    hsConn->setConnectionStatusHandler(boost::bind(&P44BanditEmu::hsConnectionStatus, this, _1, _2));
+    LOG(LOG_NOTICE, "Host connected to handshake lines");
+    return hsConn;
+  }
+
+
+  void hsConnectionStatus(SocketCommPtr aSocketComm, ErrorPtr aError)
+  {
+    if (Error::isOK(aError) || aSocketComm!=hsConn) return;
+    LOG(LOG_NOTICE, "Host disconnected from handshake lines");
+    hsConn.reset();
+    setHostReady(false);
+  }
+
+
+  void hsReceive(ErrorPtr aError)
+  {
+    string d;
+    if (!hsConn || !Error::isOK(hsConn->receiveString(d)) || d.empty()) return;
+    // host tells its state on connect, so always answer with ours
+    hsConn->transmitString(ready ? "1" : "0");
+    setHostReady(d[d.size()-1]=='1');
+  }
+
+
+  void setHostReady(bool aReady)
+  {
+    if (aReady==hostReady) return;
+    hostReady = aReady;
+    LOG(LOG_INFO, "Host RTS/DTR -> %d", hostReady);
+  }
+
+
+  void setReady(bool aReady)
+  {
+    if (aReady==ready) return;
+    ready = aReady;
+    LOG(LOG_INFO, "Controller CTS/DSR/DCD -> %d", ready);
+    if (hsConn) hsConn->transmitString(ready ? "1" : "0");
+  }
+
+
+  // MARK: ==== wire pacing
+
+  void tick()
+  {
+    MLMicroSeconds now = MainLoop::now();
+    MLMicroSeconds elapsed = now-lastTick;
+    credits += (double)elapsed/byteTime;
+    lastTick = now;
+    if (punching) {
+      punchNext();
+    }
+    else {
+      loadNext(now, elapsed);
+    }
+    tickTicket.executeOnce(boost::bind(&P44BanditEmu::tick, this), EMU_TICK);
+  }
+
+
+  // MARK: ==== load mode (host sends, controller receives into its program buffer)
+
+  void becomeReady()
+  {
+    accepting = true;
+    bufferFill = 0;
+    LOG(LOG_NOTICE, "Ready to load");
+  }
+
+
+  void loadNext(MLMicroSeconds aNow, MLMicroSeconds aElapsed)
+  {
+    // consume program buffer
+    if (consumeRate<=0) bufferFill = 0;
+    else if (loading) bufferFill = std::max(0.0, bufferFill-consumeRate*aElapsed/Second);
+    // take what the wire could have carried
+    uint8_t buf[256];
+    size_t n = (size_t)credits;
+    if (n>sizeof(buf)) n = sizeof(buf);
+    ssize_t got = n>0 ? read(masterFd, buf, n) : 0;
+    if (got>0) {
+      credits -= got;
+      for (ssize_t i=0; i<got; i++) loadByte(buf[i]&0x7F, aNow);
+    }
+    else {
+      credits = std::min(credits, 1.0); // idle wire does not save up
+    }
+    if (loading && aNow-lastByte>idleTime) {
+      LOG(LOG_INFO, "No data for %.1f sec -> load complete", (double)idleTime/Second);
+      loadEnd(aNow);
+    }
+    // handshake follows the buffer fill level
+    bool r = ready;
+    if (!accepting) r = false;
+    else if (bufferFill>=bufferSize*HIGH_WATERMARK/100) r = false;
+    else if (bufferFill<=bufferSize*LOW_WATERMARK/100) r = true;
+    if (loading && r!=ready) {
+      if (!r) {
+        loadPauses++;
+        pauseStart = aNow;
+      }
+      else if (pauseStart!=Never) {
+        pausedTime += aNow-pauseStart;
+        pauseStart = Never;
+      }
+    }
+    setReady(r);
+  }
+
+
+  void loadByte(uint8_t aByte, MLMicroSeconds aNow)
+  {
+    if (!accepting) return; // not listening
+    if (aByte==0x13) {
+      // DC3 ends the transmission
+      if (loading) {
+        LOG(LOG_INFO, "DC3 received -> load complete");
+        loadEnd(aNow);
+      }
+      return;
+    }
+    if (!loading) {
+      if (aByte==0 || aByte==0x11 || aByte=='\r' || aByte=='\n') return; // leader
+      loading = true;
+      loadStart = aNow;
+      loadData.clear();
+      loadBytes = 0;
+      loadLines = 0;
+      loadPauses = 0;
+      pausedTime = 0;
+      pauseStart = Never;
+      overruns = 0;
+      LOG(LOG_NOTICE, "Load started");
+    }
+    lastByte = aNow;
+    loadBytes++;
+    if (bufferFill>=bufferSize) {
+      // host ignored our handshake
+      overruns++;
+      return;
+    }
+    bufferFill++;
+    if (aByte==0 || aByte==0x11 || aByte=='\r') return;
+    loadData += (char)aByte;
+    if (aByte=='\n') loadLines++;
+  }
+
+
+  void loadEnd(MLMicroSeconds aNow)
+  {
+    loading = false;
+    accepting = false;
+    loadCount++;
+    if (pauseStart!=Never) pausedTime += aNow-pauseStart;
+    MLMicroSeconds duration = lastByte-loadStart;
+    double cps = duration>0 ? (double)loadBytes*Second/duration : 0;
+    LOG(LOG_NOTICE,
+      "Load #%d complete: %zu bytes, %d lines in %.2f sec = %.1f chars/sec (%.0f%% of wire speed), %d pauses (%.2f sec), %zu bytes overrun",
+      loadCount, loadBytes, loadLines, (double)duration/Second, cps, cps*byteTime/Second*100,
+      loadPauses, (double)pausedTime/Second, overruns
+    );
+    string fn;
+    if (getStringOption("save", fn)) {
+      FILE *f = fopen(fn.c_str(), "w");
+      if (!f || fwrite(loadData.c_str(), 1, loadData.size(), f)!=loadData.size()) {
+        LOG(LOG_ERR, "Cannot save loaded program to '%s'", fn.c_str());
+      }
+      if (f) fclose(f);
+    }
+    readyTicket.executeOnce(boost::bind(&P44BanditEmu::becomeReady, this), reloadDelay);
+  }
+
+
+  // MARK: ==== punch mode (controller sends, host receives)
+
+  void startPunch()
+  {
+    LOG(LOG_NOTICE, "Punching %zu bytes", punchData.size());
+    punchPos = 0;
+    punching = true;
+    punchStart = MainLoop::now();
+    credits = 0;
+    setReady(true); // host starts receiving on this
+  }
+
+
+  void punchNext()
+  {
+    if (!hostReady) {
+      credits = std::min(credits, 1.0);
+      return; // host not ready, wait
+    }
+    size_t n = (size_t)credits;
+    if (n>punchData.size()-punchPos) n = punchData.size()-punchPos;
+    if (n>0) {
+      ssize_t written = write(masterFd, punchData.c_str()+punchPos, n);
+      if (written>0) {
+        punchPos += written;
+        credits -= written;
+      }
+    }
+    if (punchPos>=punchData.size()) {
+      punching = false;
+      MLMicroSeconds duration = MainLoop::now()-punchStart;
+      LOG(LOG_NOTICE, "Punch complete: %zu bytes in %.2f sec", punchData.size(), (double)duration/Second);
+      setReady(false);
+      if (sendEvery>0) {
+        punchTicket.executeOnce(boost::bind(&P44BanditEmu::startPunch, this), sendEvery);
+      }
+    }
+  }
+
+};
+
+
+int main(int argc, char **argv)
+{
+  // prevent debug output before application.main scans command line
+  SETLOGLEVEL(LOG_EMERG);
+  SETERRLEVEL(LOG_EMERG, false); // messages, if any, go to stderr
+  // create app with current mainloop
+  static P44BanditEmu application;
+  // pass control
+  return application.main(argc, argv);
+}
@@ -0,0 +1,411 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44banditd.
+//
+//  pixelboardd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  pixelboardd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with pixelboardd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "banditoptimizer.hpp"
+#include "banditcompress.hpp"
+
+#include <math.h>
+#include <algorithm>
+
+using namespace p44;
+
+
+static int failures = 0;
+
+#define BINARY_STRING(s) string(s, sizeof(s)-1)
+
+
+static string compacted(const string aProgram)
+{
+  BanditCompactorPtr compactor = BanditCompactorPtr(new BanditCompactor);
+  string out;
+  compactor->process(aProgram.c_str(), aProgram.size(), out);
+  compactor->finish(out);
+  return out;
+}
+
+
+static string arcFitted(const string aProgram, double aTolerance)
+{
+  BanditArcFitterPtr fitter = BanditArcFitterPtr(new BanditArcFitter(aTolerance));
+  string out;
+  fitter->process(aProgram.c_str(), aProgram.size(), out);
+  fitter->finish(out);
+  return out;
+}
+
+
+/// @return program with absolute XY moves along a circle around 0,0, clockwise from aFromDeg to aToDeg
+static string circleProgram(double aRadius, double aFromDeg, double aToDeg, int aSteps)
+{
+  string prog = "G90\n";
+  for (int i=0; i<=aSteps; i++) {
+    double a = (aFromDeg+(aToDeg-aFromDeg)*i/aSteps)*M_PI/180;
+    string_format_append(prog, "X%.3fY%.3f\n", aRadius*cos(a), aRadius*sin(a));
+  }
+  return prog;
+}
+
+
+/// @return description of the first arc in aProgram with end points on different sides of an axis through its center, empty if none
+static string arcCrossingAxis(const string &aProgram)
+{
+  double x = 0, y = 0;
+  size_t i = 0;
+  while (i<aProgram.size()) {
+    size_t e = aProgram.find('\n', i);
+    if (e==string::npos) e = aProgram.size();
+    string line = aProgram.substr(i, e-i);
+    i = e+1;
+    BanditWordsVector words;
+    if (!parseBanditLine(line, words)) continue;
+    double nx = x, ny = y, cx = 0, cy = 0;
+    bool arc = false;
+    for (BanditWordsVector::iterator w=words.begin(); w!=words.end(); ++w) {
+      double v = atof(w->number.c_str());
+      if (w->letter=='X') nx = v;
+      else if (w->letter=='Y') ny = v;
+      else if (w->letter=='I') { cx = v; arc = true; }
+      else if (w->letter=='J') { cy = v; arc = true; }
+    }
+    if (arc && (((x-cx)*(nx-cx)<0) || ((y-cy)*(ny-cy)<0))) return line;
+    x = nx; y = ny;
+  }
+  return "";
+}
+
+
+static size_t numLines(const string &aProgram)
+{
+  return std::count(aProgram.begin(), aProgram.end(), '\n');
+}
+
+
+/// @return aData cleaned by a BanditCleaner, fed in chunks of aChunkSize bytes
+static string cleaned(const string &aData, bool aForSend, bool aRawMode, size_t aChunkSize)
+{
+  BanditCleanerPtr cleaner = BanditCleanerPtr(new BanditCleaner(aForSend, aRawMode));
+  string out;
+  for (size_t pos=0; pos<aData.size(); pos += aChunkSize) {
+    cleaner->clean(aData.c_str()+pos, std::min(aChunkSize, aData.size()-pos), out);
+  }
+  cleaner->finish(out);
+  return out;
+}
+
+
+/// data source delivering a string in chunks of at most aChunkSize bytes, each in its own exactly sized
+/// buffer, so reading beyond the end of a chunk is caught by memory checkers
+class ChoppedDataSource : public BanditDataSource
+{
+  string data;
+  size_t pos;
+  size_t chunkSize;
+  char *chunk;
+
+public:
+
+  ChoppedDataSource(const string &aData, size_t aChunkSize) : data(aData), pos(0), chunkSize(aChunkSize), chunk(NULL) {};
+  virtual ~ChoppedDataSource() { delete[] chunk; };
+
+  virtual size_t nextChunk(const char *&aChunkP, size_t aMaxBytes, ErrorPtr &aError)
+  {
+    size_t n = std::min(std::min(data.size()-pos, aMaxBytes), chunkSize);
+    delete[] chunk;
+    chunk = new char[n];
+    memcpy(chunk, data.c_str()+pos, n);
+    pos += n;
+    aChunkP = chunk;
+    return n;
+  }
+
+};
+
+
+/// @return aData compressed with aBlockSize blocks, fed to the compressor in chunks of aChunkSize bytes
+static string compressedData(const string &aData, size_t aBlockSize, size_t aChunkSize)
+{
+  ProgramCompressorPtr compressor = ProgramCompressorPtr(new ProgramCompressor(aBlockSize));
+  string out;
+  for (size_t pos=0; pos<aData.size(); pos += aChunkSize) {
+    compressor->compress(aData.c_str()+pos, std::min(aChunkSize, aData.size()-pos), out);
+  }
+  compressor->finish(out);
+  return out;
+}
+
+
+/// @return aCompressed expanded by a DecompressingDataSource, read in chunks of aReadSize bytes from
+///   a source delivering aSourceChunkSize bytes at a time, or "ERROR" if decompression fails
+static string expandedData(const string &aCompressed, size_t aSourceChunkSize, size_t aReadSize)
+{
+  BanditDataSourcePtr source = BanditDataSourcePtr(new DecompressingDataSource(BanditDataSourcePtr(new ChoppedDataSource(aCompressed, aSourceChunkSize))));
+  string out;
+  ErrorPtr err;
+  const char *p;
+  size_t n;
+  while ((n = source->nextChunk(p, aReadSize, err))>0) {
+    if (n>aReadSize) return "ERROR: chunk too large";
+    out.append(p, n);
+  }
+  if (!Error::isOK(err)) return "ERROR";
+  return out;
+}
+
+
+/// @return compressed program data consisting of the magic followed by aBytes
+static string blzStream(std::initializer_list<uint8_t> aBytes)
+{
+  string s(BLZ_MAGIC);
+  for (std::initializer_list<uint8_t>::iterator b=aBytes.begin(); b!=aBytes.end(); ++b) s += (char)*b;
+  return s;
+}
+
+
+/// @return aSize bytes of program-like text, varied enough not to compress into nothing
+static string sampleProgram(size_t aSize)
+{
+  string prog;
+  uint32_t r = 4711;
+  int line = 1;
+  while (prog.size()<aSize) {
+    r = r*1103515245+12345;
+    string_format_append(prog, "N%d X%u.%03u Y%u.%03u\n", line++, (r>>8)%200, (r>>4)%1000, (r>>16)%200, r%1000);
+  }
+  prog.resize(aSize);
+  return prog;
+}
+
+
+/// @return aSize pseudo random bytes
+static string randomBytes(size_t aSize)
+{
+  string data;
+  uint32_t r = 42;
+  while (data.size()<aSize) {
+    r = r*1103515245+12345;
+    data += (char)(r>>24);
+  }
+  return data;
+}
+
+
+static string hexed(const string &aData)
+{
+  return binaryToHexString(aData, ' ')+"\n";
+}
+
+
+static void expect(const char *aName, const string &aResult, const string &aExpected)
+{
+  if (aResult==aExpected) {
+    printf("ok   %s\n", aName);
+    return;
+  }
+  failures++;
+  printf("FAIL %s\n--- expected:\n%s--- got:\n%s---\n", aName, aExpected.c_str(), aResult.c_str());
+}
+
+
+/// known-answer tests, run by "make check"
+/// @return EXIT_SUCCESS if all tests pass
+int main(int argc, char **argv)
+{
+  // MARK: ==== compactor
+  expect("compact: repeated position omitted",
+    compacted("G90\nX10.Y20.\nX10.Y30.\n"),
+    "G90\nX10.Y20.\nY30.\n"
+  );
+  // G99 goes to machine zero, so moving back to the position before it is a real move
+  expect("compact: move to previous position after G99",
+    compacted("G90\nX10.Y20.Z5.\nG99\nX10.Y20.Z5.\n"),
+    "G90\nX10.Y20.Z5.\nG99\nX10.Y20.Z5.\n"
+  );
+  // without G90/G91, words might be relative distances, nothing can be omitted
+  expect("compact: nothing dropped before mode is known",
+    compacted("X10.\nX10.\nI5.J5.\nI5.J5.\nG90\nX10.\nX10.\n"),
+    "X10.\nX10.\nI5.J5.\nI5.J5.\nG90\nX10.\n"
+  );
+  // MARK: ==== arc fitter
+  // start point is within tolerance of the Y axis, but on its negative side
+  string fitted = arcFitted("G90\nX-0.009Y5.\n" + circleProgram(5, 89, 0, 89), 0.01);
+  expect("arcfit: arc end points in same quadrant", arcCrossingAxis(fitted), "");
+  // runs much longer than a single fit are fitted in bounded pieces
+  fitted = arcFitted(circleProgram(50, 359.99, 0.01, 20000), 0.01);
+  expect("arcfit: long run", arcCrossingAxis(fitted), "");
+  expect("arcfit: long run reduced", numLines(fitted)<=200 ? "yes" : string_format("no, %zd lines", numLines(fitted)), "yes");
+  // MARK: ==== cleaner
+  // expected results are those of the original implementation, which cleaned all data at once
+  struct {
+    const char *name;
+    string input;
+    string sent;
+    string received;
+  } cleanerCases[] = {
+    { "lowercase",
+      "g90\nx10.5y-3.25\ni5.j-7. m2\n",
+      "N1&G90\r\nN2 X10.5Y-3.25\r\nN3 I5.J-7. M2\r\n",
+      "G90\nX10.5Y-3.25\nI5.J-7. M2\n"
+    },
+    { "comments",
+      "# header\n#second line\r\n\nN10 G90\n#mid\r\nx1.\n\n\n#trailing",
+      "N1&G90\r\nN2 X1.\r\n",
+      "N10 G90\nX1.\n"
+    },
+    { "padding",
+      BINARY_STRING("\021\0\0\0\0\0\rN1&G90\r\nX1.Y2.\r\n\023\0\0\0\0\0"),
+      "N1&G90\r\nN2 X1.Y2.\r\n",
+      "N1&G90\nX1.Y2.\n"
+    },
+    // a line number cut off by the end of the data leaves a NUL where the line's first word would be
+    { "line number cut off",
+      "G90\nN12",
+      BINARY_STRING("N1&G90\r\nN2 \0"),
+      "G90\nN12"
+    },
+    { "line numbers",
+      "N5 G90\r\n7&X1.\r\nN Y2.\r\n N8 & Z3.\n",
+      "N1&G90\r\nN2 X1.\r\nN3 Y2.\r\nN4  N8 & Z3.\r\n",
+      "N5 G90\n7&X1.\nN Y2.\n N8 & Z3.\n"
+    },
+    // long enough for the vector paths, with padding runs, high bytes and all kinds of line ends
+    { "mixed",
+      BINARY_STRING(
+        "\021\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\r\n"
+        "# this comment line is long enough to cover several vector blocks\r\n"
+        "n10 g90 x123.456y-78.900i12.000j13.000 and some more lowercase text\r\n"
+        "\r\r\n\n"
+        "N20&X1.\377\340Y2.\177\r\n"
+        "#\n"
+        "30 z-5.\n"
+        "\023\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
+        "N4"
+      ),
+      BINARY_STRING(
+        "N1&N10 G90 X123.456Y-78.900I12.000J13.000 AND SOME MORE LOWERCASE TEXT\r\n"
+        "N2 X1.Y2.\r\n"
+        "N3 Z-5.\r\n"
+        "N4 \0"
+      ),
+      "N10 G90 X123.456Y-78.900I12.000J13.000 AND SOME MORE LOWERCASE TEXT\n"
+      "N20&X1.Y2.\n"
+      "30 Z-5.\n"
+      "N4"
+    }
+  };
+  for (size_t k=0; k<sizeof(cleanerCases)/sizeof(cleanerCases[0]); k++) {
+    const string &input = cleanerCases[k].input;
+    string name = cleanerCases[k].name;
+    expect(("clean: send "+name).c_str(), cleanBanditData(input, true, false), cleanerCases[k].sent);
+    expect(("clean: receive "+name).c_str(), cleanBanditData(input, false, false), cleanerCases[k].received);
+    expect(("clean: raw "+name).c_str(), cleanBanditData(input, false, true), input);
+    // every split position, and chunks both shorter and longer than the vector width
+    string bad;
+    for (size_t chunkSize=1; chunkSize<input.size(); chunkSize++) {
+      if (
+        cleaned(input, true, false, chunkSize)!=cleanerCases[k].sent ||
+        cleaned(input, false, false, chunkSize)!=cleanerCases[k].received ||
+        cleaned(input, false, true, chunkSize)!=input
+      ) {
+        string_format_append(bad, " %zu", chunkSize);
+      }
+    }
+    expect(("clean: chunked "+name).c_str(), bad, "");
+  }
+  // MARK: ==== compression
+  expect("compress: empty input", hexed(compressedData("", BLZ_MAX_BLOCK_SIZE, 1)), hexed(BLZ_MAGIC));
+  expect("expand: empty input", expandedData(BLZ_MAGIC, 100, 100), "");
+  expect("expand: empty block", expandedData(blzStream({ 0,0,0,0, 0,0,0,0, 3,0,0,0, 3,0,0,0, 'a','b','c' }), 100, 100), "abc");
+  // too short to compress, stored as-is with storedLen==rawLen
+  expect("compress: incompressible block stored raw",
+    hexed(compressedData("abcdefgh", BLZ_MAX_BLOCK_SIZE, 3)),
+    hexed(blzStream({ 8,0,0,0, 8,0,0,0, 'a','b','c','d','e','f','g','h' }))
+  );
+  string noise = randomBytes(1000);
+  string compressed = compressedData(noise, 1000, 1000);
+  expect("compress: random block stored raw", compressed.substr(BLZ_MAGIC_SIZE, BLZ_BLOCK_HEADER_SIZE), string("\xE8\x03\0\0\xE8\x03\0\0", 8));
+  expect("expand: raw block", expandedData(compressed, 1000, 1000)==noise ? "same" : "different", "same");
+  // "abc" literals, then a 15 byte match at offset 3, overlapping the bytes it produces
+  expect("compress: overlapping match",
+    hexed(compressedData("abcabcabcabcabcabc", BLZ_MAX_BLOCK_SIZE, 18)),
+    hexed(blzStream({ 18,0,0,0, 6,0,0,0, 0x3B,'a','b','c', 3,0 }))
+  );
+  expect("expand: overlapping match", expandedData(blzStream({ 10,0,0,0, 4,0,0,0, 0x15,'x', 1,0 }), 1, 3), "xxxxxxxxxx");
+  // long literal run and long match, both with extension bytes
+  string longRun = randomBytes(300)+string(600, '-');
+  compressed = compressedData(longRun, BLZ_MAX_BLOCK_SIZE, 7);
+  expect("compress: long runs compressed", compressed.size()<longRun.size() ? "yes" : "no", "yes");
+  expect("expand: long runs", expandedData(compressed, 5, 77)==longRun ? "same" : "different", "same");
+  // block boundaries: result must not depend on how the data is fed or read
+  string prog = sampleProgram(50000);
+  compressed = compressedData(prog, 1000, prog.size());
+  expect("compress: multiple blocks compressed", compressed.size()<prog.size() ? "yes" : "no", "yes");
+  expect("compress: byte by byte", compressedData(prog, 1000, 1)==compressed ? "same" : "different", "same");
+  expect("compress: chunks across blocks", compressedData(prog, 1000, 777)==compressed ? "same" : "different", "same");
+  uint64_t logicalSize;
+  expect("compress: logical size",
+    compressedProgramSize(compressed.c_str(), compressed.size(), logicalSize) ? string_format("%llu", (unsigned long long)logicalSize) : "invalid",
+    string_format("%zu", prog.size())
+  );
+  expect("expand: whole stream", expandedData(compressed, compressed.size(), prog.size())==prog ? "same" : "different", "same");
+  expect("expand: source byte by byte", expandedData(compressed, 1, 4096)==prog ? "same" : "different", "same");
+  expect("expand: small reads", expandedData(compressed, 333, 7)==prog ? "same" : "different", "same");
+  // truncated streams: an error, unless cut exactly between two blocks
+  compressed = compressedData(prog.substr(0, 300)+noise.substr(0, 100), 100, 400);
+  size_t pos = BLZ_MAGIC_SIZE;
+  string blockEnds = string_format(" %zu ", pos);
+  while (pos<compressed.size()) {
+    pos += BLZ_BLOCK_HEADER_SIZE+(uint8_t)compressed[pos+4]+((uint8_t)compressed[pos+5]<<8);
+    string_format_append(blockEnds, "%zu ", pos);
+  }
+  string bad;
+  for (size_t cut=0; cut<compressed.size(); cut++) {
+    string res = expandedData(compressed.substr(0, cut), 3, 100);
+    bool atBlockEnd = blockEnds.find(string_format(" %zu ", cut))!=string::npos;
+    if (atBlockEnd ? res=="ERROR" : res!="ERROR") string_format_append(bad, " %zu", cut);
+  }
+  expect("expand: truncated", bad, "");
+  // corrupted streams: an error or as many bytes as the block headers announce, but never reading out of bounds
+  bad.clear();
+  for (size_t i=BLZ_MAGIC_SIZE; i<compressed.size(); i++) {
+    for (int v=0; v<256; v += 17) {
+      string corrupt = compressed;
+      corrupt[i] = (char)v;
+      string res = expandedData(corrupt, 1000, 1000);
+      if (res=="ERROR") continue;
+      if (!compressedProgramSize(corrupt.c_str(), corrupt.size(), logicalSize) || res.size()!=logicalSize) {
+        string_format_append(bad, " %zu:%d", i, v);
+      }
+    }
+  }
+  expect("expand: corrupted", bad, "");
+  expect("expand: bad magic", expandedData("BLZ2", 100, 100), "ERROR");
+  expect("expand: block too large", expandedData(blzStream({ 1,0,1,0, 1,0,1,0 }), 100, 100), "ERROR");
+  expect("expand: stored size too large", expandedData(blzStream({ 4,0,0,0, 5,0,0,0, 0x40,'a','b','c','d' }), 100, 100), "ERROR");
+  expect("expand: match offset zero", expandedData(blzStream({ 10,0,0,0, 4,0,0,0, 0x15,'x', 0,0 }), 100, 100), "ERROR");
+  expect("expand: match before block start", expandedData(blzStream({ 10,0,0,0, 4,0,0,0, 0x15,'x', 2,0 }), 100, 100), "ERROR");
+  expect("expand: match beyond block end", expandedData(blzStream({ 5,0,0,0, 4,0,0,0, 0x15,'x', 1,0 }), 100, 100), "ERROR");
+  expect("expand: literals beyond block end", expandedData(blzStream({ 2,0,0,0, 1,0,0,0, 0x30 }), 100, 100), "ERROR");
+  expect("expand: truncated back reference", expandedData(blzStream({ 5,0,0,0, 4,0,0,0, 0x20,'x','y', 1 }), 100, 100), "ERROR");
+  expect("expand: garbage after last token", expandedData(blzStream({ 6,0,0,0, 5,0,0,0, 0x11,'x', 1,0, 0 }), 100, 100), "ERROR");
+  printf("%d failure(s)\n", failures);
+  return failures>0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,170 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44bandit.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "workerpool.hpp"
+
+#include <unistd.h>
+#include <fcntl.h>
+
+using namespace p44;
+
+
+#pragma mark - WorkerPool
+
+WorkerPool::WorkerPool(int aNumThreads) :
+  busy(0),
+  stopping(false),
+  mainLoop(MainLoop::currentMainLoop())
+{
+  pthread_mutex_init(&queueMutex, NULL);
+  pthread_cond_init(&workAvailable, NULL);
+  wakePipe[0] = -1;
+  wakePipe[1] = -1;
+  if (pipe(wakePipe)<0) {
+    LOG(LOG_ERR, "Cannot create worker pool completion pipe, file preparation runs on the mainloop");
+    return;
+  }
+  fcntl(wakePipe[0], F_SETFL, fcntl(wakePipe[0], F_GETFL) | O_NONBLOCK);
+  fcntl(wakePipe[1], F_SETFL, fcntl(wakePipe[1], F_GETFL) | O_NONBLOCK); // workers must never block on it
+  mainLoop.registerPollHandler(wakePipe[0], POLLIN, boost::bind(&WorkerPool::completionHandler, this, _1, _2));
+  for (int i=0; i<aNumThreads; i++) {
+    pthread_t t;
+    if (pthread_create(&t, NULL, workerThread, this)!=0) {
+      LOG(LOG_WARNING, "Could only start %d of %d worker threads", i, aNumThreads);
+      break;
+    }
+    threads.push_back(t);
+  }
+  LOG(LOG_INFO, "Worker pool with %zu threads started", threads.size());
+}
+
+
+WorkerPool::~WorkerPool()
+{
+  pthread_mutex_lock(&queueMutex);
+  stopping = true;
+  pthread_cond_broadcast(&workAvailable);
+  pthread_mutex_unlock(&queueMutex);
+  for (size_t i=0; i<threads.size(); i++) {
+    pthread_join(threads[i], NULL);
+  }
+  // undelivered work is dropped without calling back
+  for (WorkQueue::iterator pos = pending.begin(); pos!=pending.end(); ++pos) delete *pos;
+  for (WorkQueue::iterator pos = completed.begin(); pos!=completed.end(); ++pos) delete *pos;
+  if (wakePipe[0]>=0) {
+    mainLoop.unregisterPollHandler(wakePipe[0]);
+    close(wakePipe[0]);
+    close(wakePipe[1]);
+  }
+  pthread_cond_destroy(&workAvailable);
+  pthread_mutex_destroy(&queueMutex);
+}
+
+
+void WorkerPool::submit(WorkRoutine aRoutine, StatusCB aDoneCB)
+{
+  if (threads.empty()) {
+    // no workers, do it now
+    ErrorPtr err = aRoutine();
+    if (aDoneCB) aDoneCB(err);
+    return;
+  }
+  WorkItem *item = new WorkItem;
+  item->routine = aRoutine;
+  item->doneCB = aDoneCB;
+  pthread_mutex_lock(&queueMutex);
+  pending.push_back(item);
+  pthread_cond_signal(&workAvailable);
+  pthread_mutex_unlock(&queueMutex);
+}
+
+
+size_t WorkerPool::numPending()
+{
+  pthread_mutex_lock(&queueMutex);
+  size_t n = pending.size();
+  pthread_mutex_unlock(&queueMutex);
+  return n;
+}
+
+
+size_t WorkerPool::numBusy()
+{
+  pthread_mutex_lock(&queueMutex);
+  size_t n = busy;
+  pthread_mutex_unlock(&queueMutex);
+  return n;
+}
+
+
+void *WorkerPool::workerThread(void *aArg)
+{
+  static_cast<WorkerPool *>(aArg)->work();
+  return NULL;
+}
+
+
+void WorkerPool::work()
+{
+  pthread_mutex_lock(&queueMutex);
+  while (true) {
+    while (!stopping && pending.empty()) pthread_cond_wait(&workAvailable, &queueMutex);
+    if (stopping) break;
+    WorkItem *item = pending.front();
+    pending.pop_front();
+    busy++;
+    pthread_mutex_unlock(&queueMutex);
+    item->result = item->routine();
+    item->routine = NULL; // release what the routine holds while still owning it
+    pthread_mutex_lock(&queueMutex);
+    busy--;
+    completed.push_back(item);
+    // wake the mainloop (pipe full just means it is already woken)
+    char c = 0;
+    ssize_t r = write(wakePipe[1], &c, 1);
+    (void)r;
+  }
+  pthread_mutex_unlock(&queueMutex);
+}
+
+
+bool WorkerPool::completionHandler(int aFD, int aPollFlags)
+{
+  if (aPollFlags & POLLIN) {
+    char buf[64];
+    while (read(aFD, buf, sizeof(buf))>0);
+    // deliver all completed work, callbacks may submit more
+    while (true) {
+      pthread_mutex_lock(&queueMutex);
+      if (completed.empty()) {
+        pthread_mutex_unlock(&queueMutex);
+        break;
+      }
+      WorkItem *item = completed.front();
+      completed.pop_front();
+      pthread_mutex_unlock(&queueMutex);
+      if (item->doneCB) item->doneCB(item->result);
+      delete item;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,102 @@
+//
+//  Copyright (c) 2017 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44bandit.
+//
+//  p44ayabd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44ayabd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44ayabd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef __p44bandit__workerpool__
+#define __p44bandit__workerpool__
+
+#include "p44utils_common.hpp"
+
+#include <pthread.h>
+#include <deque>
+#include <vector>
+
+using namespace std;
+
+namespace p44 {
+
+
+  /// work to be done in a worker thread
+  /// @return error, if any
+  /// @note the routine must not access objects the mainloop uses at the same time. Objects passed to it
+  ///   (including reference counted ones) belong to the worker until the completion callback runs.
+  typedef boost::function<ErrorPtr ()> WorkRoutine;
+
+
+  class WorkerPool;
+  typedef boost::intrusive_ptr<WorkerPool> WorkerPoolPtr;
+
+  /// pool of worker threads for CPU heavy file preparation (cleaning, framing, analyzing, copying).
+  /// Completions are posted back through a queue, which wakes the mainloop via a pipe, so completion
+  /// callbacks always run on the mainloop thread.
+  class WorkerPool : public P44Obj
+  {
+    typedef struct {
+      WorkRoutine routine;
+      StatusCB doneCB;
+      ErrorPtr result;
+    } WorkItem;
+    typedef std::deque<WorkItem *> WorkQueue;
+
+    std::vector<pthread_t> threads;
+    pthread_mutex_t queueMutex; ///< protects queues and counters
+    pthread_cond_t workAvailable;
+    WorkQueue pending; ///< waiting for a worker
+    WorkQueue completed; ///< done, waiting for the mainloop to deliver
+    size_t busy; ///< number of workers running a routine
+    bool stopping;
+    int wakePipe[2]; ///< workers write a byte for each completion, mainloop reads
+    MainLoop &mainLoop;
+
+  public:
+
+    /// create pool and start the worker threads
+    /// @param aNumThreads number of worker threads
+    /// @note if no threads can be started, work is done in the mainloop when submitted
+    WorkerPool(int aNumThreads);
+    virtual ~WorkerPool();
+
+    /// run a routine in a worker thread
+    /// @param aRoutine the work to do
+    /// @param aDoneCB called on the mainloop thread with the routine's result when done
+    void submit(WorkRoutine aRoutine, StatusCB aDoneCB);
+
+    /// @return number of routines waiting for a worker
+    size_t numPending();
+
+    /// @return number of routines currently running
+    size_t numBusy();
+
+    /// @return number of worker threads
+    size_t numThreads() { return threads.size(); };
+
+  private:
+
+    static void *workerThread(void *aArg);
+    void work();
+    bool completionHandler(int aFD, int aPollFlags);
+
+  };
+
+
+} // namespace p44
+
+#endif /* defined(__p44bandit__workerpool__) */